@@ -0,0 +1,793 @@
+/* nbd.c - disks exported by a Network Block Device server.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/dl.h>
+#include <grub/misc.h>
+#include <grub/disk.h>
+#include <grub/mm.h>
+#include <grub/extcmd.h>
+#include <grub/i18n.h>
+#include <grub/net.h>
+#include <grub/net/tcp.h>
+#include <grub/net/netbuff.h>
+
+GRUB_MOD_LICENSE ("GPLv3+");
+
+#define NBD_DEFAULT_PORT 10809
+
+/* "NBDMAGIC", then "IHAVEOPT" for the newstyle handshake or the
+   oldstyle magic.  */
+#define NBD_INIT_MAGIC 0x4e42444d41474943ULL
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL
+#define NBD_CLISERV_MAGIC 0x0000420281861253ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_CMD_READ 0
+#define NBD_CMD_DISC 2
+
+/* Data is requested and cached in blocks of this size.  */
+#define NBD_BLOCK_SHIFT 16
+#define NBD_BLOCK_SIZE (1 << NBD_BLOCK_SHIFT)
+/* Read requests outstanding at once.  */
+#define NBD_MAX_INFLIGHT 8
+/* Blocks requested ahead once reading turns out to be sequential.  */
+#define NBD_MAX_READAHEAD 8
+/* Cache size in KiB.  */
+#define NBD_DEFAULT_CACHE 8192
+/* Room for the largest read, the read-ahead and some reuse.  */
+#define NBD_MIN_SLOTS (4 * NBD_MAX_INFLIGHT)
+
+struct nbd_request
+{
+  grub_uint32_t magic;
+  grub_uint16_t flags;
+  grub_uint16_t type;
+  grub_uint64_t handle;
+  grub_uint64_t offset;
+  grub_uint32_t length;
+} GRUB_PACKED;
+
+struct nbd_reply
+{
+  grub_uint32_t magic;
+  grub_uint32_t error;
+  grub_uint64_t handle;
+} GRUB_PACKED;
+
+struct nbd_option
+{
+  grub_uint32_t client_flags;
+  grub_uint64_t magic;
+  grub_uint32_t option;
+  grub_uint32_t length;
+} GRUB_PACKED;
+
+enum
+  {
+    NBD_SLOT_EMPTY,
+    NBD_SLOT_PENDING,
+    NBD_SLOT_VALID
+  };
+
+/* A cached block, or one requested from the server.  */
+struct nbd_slot
+{
+  grub_uint64_t index;
+  grub_uint64_t last_use;
+  int state;
+  grub_uint32_t len;
+  grub_uint32_t got;
+  grub_uint32_t error;
+  char *data;
+};
+
+enum
+  {
+    NBD_STATE_GREETING,
+    NBD_STATE_FLAGS,
+    /* Waiting for us to send the export name.  */
+    NBD_STATE_SEND_OPTS,
+    NBD_STATE_EXPORT,
+    NBD_STATE_OLDSTYLE,
+    NBD_STATE_REPLY,
+    NBD_STATE_DATA,
+    NBD_STATE_DEAD
+  };
+
+struct grub_nbd
+{
+  struct grub_nbd *next;
+  char *devname;
+  unsigned long id;
+  char *server;
+  char *export_name;
+  int port;
+  grub_net_tcp_socket_t sock;
+  int state;
+  int no_zeroes;
+  grub_uint64_t size;
+
+  /* Handshake or reply header being received.  */
+  grub_uint8_t hdr[8 + 4 + 124];
+  grub_size_t have;
+  grub_size_t need;
+  /* The block whose data is being received.  */
+  struct nbd_slot *cur;
+  int progress;
+
+  struct nbd_slot *slots;
+  unsigned nslots;
+  grub_uint64_t tick;
+  unsigned inflight;
+  grub_uint64_t next_block;
+  unsigned readahead;
+};
+
+static struct grub_nbd *nbd_list;
+static unsigned long last_id = 0;
+
+static const struct grub_arg_option options[] =
+  {
+    {"delete", 'd', 0, N_("Delete the specified NBD drive."), 0, 0},
+    {"export", 'e', 0, N_("Use the export named NAME."), N_("NAME"),
+     ARG_TYPE_STRING},
+    {"port", 'p', 0, N_("Connect to PORT instead of 10809."), N_("PORT"),
+     ARG_TYPE_INT},
+    {"cache", 'c', 0, N_("Cache up to SIZE KiB of data."), N_("SIZE"),
+     ARG_TYPE_INT},
+    {0, 0, 0, 0, 0, 0}
+  };
+
+static void
+nbd_expect (struct grub_nbd *dev, int state, grub_size_t need)
+{
+  dev->state = state;
+  dev->have = 0;
+  dev->need = need;
+}
+
+/* The connection is unusable.  Requests in flight are forgotten; the
+   next read connects again.  */
+static void
+nbd_fail (struct grub_nbd *dev)
+{
+  unsigned i;
+
+  if (dev->state == NBD_STATE_DEAD)
+    return;
+  grub_net_tcp_close (dev->sock, GRUB_NET_TCP_ABORT);
+  dev->state = NBD_STATE_DEAD;
+  dev->cur = NULL;
+  dev->inflight = 0;
+  dev->progress = 1;
+  for (i = 0; i < dev->nslots; i++)
+    if (dev->slots[i].state == NBD_SLOT_PENDING)
+      dev->slots[i].state = NBD_SLOT_EMPTY;
+}
+
+/* A header in DEV->hdr is complete.  */
+static void
+nbd_parse (struct grub_nbd *dev)
+{
+  switch (dev->state)
+    {
+    case NBD_STATE_GREETING:
+      {
+	grub_uint64_t magic = grub_be_to_cpu64 (grub_get_unaligned64 (dev->hdr
+								      + 8));
+
+	if (grub_be_to_cpu64 (grub_get_unaligned64 (dev->hdr))
+	    != NBD_INIT_MAGIC)
+	  break;
+	if (magic == NBD_OPTS_MAGIC)
+	  nbd_expect (dev, NBD_STATE_FLAGS, 2);
+	else if (magic == NBD_CLISERV_MAGIC)
+	  nbd_expect (dev, NBD_STATE_OLDSTYLE, 8 + 4 + 124);
+	else
+	  break;
+	return;
+      }
+
+    case NBD_STATE_FLAGS:
+      dev->no_zeroes = !!(grub_be_to_cpu16 (grub_get_unaligned16 (dev->hdr))
+			  & NBD_FLAG_NO_ZEROES);
+      nbd_expect (dev, NBD_STATE_SEND_OPTS, 0);
+      dev->progress = 1;
+      return;
+
+    case NBD_STATE_EXPORT:
+    case NBD_STATE_OLDSTYLE:
+      dev->size = grub_be_to_cpu64 (grub_get_unaligned64 (dev->hdr));
+      nbd_expect (dev, NBD_STATE_REPLY, sizeof (struct nbd_reply));
+      dev->progress = 1;
+      return;
+
+    case NBD_STATE_REPLY:
+      {
+	struct nbd_reply *reply = (struct nbd_reply *) dev->hdr;
+	grub_uint64_t handle = grub_be_to_cpu64 (reply->handle);
+	struct nbd_slot *slot;
+
+	if (grub_be_to_cpu32 (reply->magic) != NBD_REPLY_MAGIC
+	    || handle >= dev->nslots
+	    || dev->slots[handle].state != NBD_SLOT_PENDING)
+	  break;
+	slot = &dev->slots[handle];
+	slot->error = grub_be_to_cpu32 (reply->error);
+	if (slot->error)
+	  {
+	    /* No data follows an error.  */
+	    slot->state = NBD_SLOT_VALID;
+	    dev->inflight--;
+	    dev->progress = 1;
+	    nbd_expect (dev, NBD_STATE_REPLY, sizeof (struct nbd_reply));
+	    return;
+	  }
+	dev->cur = slot;
+	slot->got = 0;
+	dev->state = NBD_STATE_DATA;
+	return;
+      }
+    }
+
+  grub_dprintf ("nbd", "%s: protocol error in state %d\n", dev->devname,
+		dev->state);
+  nbd_fail (dev);
+}
+
+static grub_err_t
+nbd_receive (grub_net_tcp_socket_t sock __attribute__ ((unused)),
+	     struct grub_net_buff *nb, void *data)
+{
+  struct grub_nbd *dev = data;
+
+  while (nb->data < nb->tail && dev->state != NBD_STATE_DEAD)
+    {
+      grub_size_t avail = nb->tail - nb->data;
+      grub_size_t amount;
+
+      /* Read data goes straight into its cache block.  */
+      if (dev->state == NBD_STATE_DATA)
+	{
+	  struct nbd_slot *slot = dev->cur;
+
+	  amount = slot->len - slot->got;
+	  if (amount > avail)
+	    amount = avail;
+	  grub_memcpy (slot->data + slot->got, nb->data, amount);
+	  slot->got += amount;
+	  nb->data += amount;
+	  if (slot->got == slot->len)
+	    {
+	      slot->state = NBD_SLOT_VALID;
+	      dev->cur = NULL;
+	      dev->inflight--;
+	      dev->progress = 1;
+	      nbd_expect (dev, NBD_STATE_REPLY, sizeof (struct nbd_reply));
+	    }
+	  continue;
+	}
+
+      /* The server isn't supposed to say anything here.  */
+      if (dev->state == NBD_STATE_SEND_OPTS)
+	{
+	  nbd_fail (dev);
+	  break;
+	}
+
+      amount = dev->need - dev->have;
+      if (amount > avail)
+	amount = avail;
+      grub_memcpy (dev->hdr + dev->have, nb->data, amount);
+      dev->have += amount;
+      nb->data += amount;
+      if (dev->have == dev->need)
+	nbd_parse (dev);
+    }
+
+  grub_netbuff_free (nb);
+  return GRUB_ERR_NONE;
+}
+
+static void
+nbd_error (grub_net_tcp_socket_t sock __attribute__ ((unused)),
+	   void *data)
+{
+  nbd_fail (data);
+}
+
+static grub_err_t
+nbd_send (struct grub_nbd *dev, const void *buf, grub_size_t len)
+{
+  struct grub_net_buff *nb;
+  grub_err_t err;
+
+  nb = grub_netbuff_alloc (len + GRUB_NET_TCP_RESERVE_SIZE);
+  if (!nb)
+    return grub_errno;
+  err = grub_netbuff_reserve (nb, GRUB_NET_TCP_RESERVE_SIZE);
+  if (!err)
+    err = grub_netbuff_put (nb, len);
+  if (err)
+    {
+      grub_netbuff_free (nb);
+      return err;
+    }
+  grub_memcpy (nb->data, buf, len);
+  err = grub_net_send_tcp_packet (dev->sock, nb, 1);
+  if (err)
+    nbd_fail (dev);
+  return err;
+}
+
+/* Wait for something to happen on DEV.  Returns 0 on timeout.  */
+static int
+nbd_wait (struct grub_nbd *dev, int *try)
+{
+  dev->progress = 0;
+  grub_net_poll_cards (GRUB_NET_INTERVAL
+		       + (*try * GRUB_NET_INTERVAL_ADDITION),
+		       &dev->progress);
+  if (dev->progress)
+    *try = 0;
+  else if (++*try > GRUB_NET_TRIES)
+    return 0;
+  return 1;
+}
+
+static grub_err_t
+nbd_connect (struct grub_nbd *dev)
+{
+  int try = 0;
+
+  dev->cur = NULL;
+  dev->inflight = 0;
+  nbd_expect (dev, NBD_STATE_GREETING, 16);
+  dev->sock = grub_net_tcp_open (dev->server, dev->port, nbd_receive,
+				 nbd_error, nbd_error, dev);
+  if (!dev->sock)
+    {
+      dev->state = NBD_STATE_DEAD;
+      return grub_errno;
+    }
+
+  while (dev->state != NBD_STATE_REPLY)
+    {
+      if (dev->state == NBD_STATE_SEND_OPTS)
+	{
+	  struct nbd_option *opt;
+	  grub_size_t len = grub_strlen (dev->export_name);
+	  grub_err_t err;
+
+	  opt = grub_malloc (sizeof (*opt) + len);
+	  if (!opt)
+	    {
+	      nbd_fail (dev);
+	      return grub_errno;
+	    }
+	  opt->client_flags = grub_cpu_to_be32 (NBD_FLAG_FIXED_NEWSTYLE
+						| (dev->no_zeroes
+						   ? NBD_FLAG_NO_ZEROES : 0));
+	  opt->magic = grub_cpu_to_be64_compile_time (NBD_OPTS_MAGIC);
+	  opt->option = grub_cpu_to_be32_compile_time (NBD_OPT_EXPORT_NAME);
+	  opt->length = grub_cpu_to_be32 (len);
+	  grub_memcpy (opt + 1, dev->export_name, len);
+	  nbd_expect (dev, NBD_STATE_EXPORT,
+		      8 + 2 + (dev->no_zeroes ? 0 : 124));
+	  err = nbd_send (dev, opt, sizeof (*opt) + len);
+	  grub_free (opt);
+	  if (err)
+	    return err;
+	  continue;
+	}
+      /* A server without the export just hangs up.  */
+      if (dev->state == NBD_STATE_DEAD)
+	return grub_error (GRUB_ERR_NET_UNKNOWN_ERROR,
+			   N_("NBD server `%s' refused export `%s'"),
+			   dev->server, dev->export_name);
+      if (!nbd_wait (dev, &try))
+	{
+	  nbd_fail (dev);
+	  return grub_error (GRUB_ERR_TIMEOUT,
+			     N_("time out opening `%s'"), dev->devname);
+	}
+    }
+
+  grub_dprintf ("nbd", "%s: %" PRIuGRUB_UINT64_T " bytes\n",
+		dev->devname, dev->size);
+  return GRUB_ERR_NONE;
+}
+
+static struct nbd_slot *
+nbd_find (struct grub_nbd *dev, grub_uint64_t index)
+{
+  unsigned i;
+
+  for (i = 0; i < dev->nslots; i++)
+    if (dev->slots[i].state != NBD_SLOT_EMPTY && dev->slots[i].index == index)
+      return &dev->slots[i];
+  return NULL;
+}
+
+/* An empty slot, or else the least recently used cached block.  */
+static struct nbd_slot *
+nbd_victim (struct grub_nbd *dev)
+{
+  struct nbd_slot *best = NULL;
+  unsigned i;
+
+  for (i = 0; i < dev->nslots; i++)
+    {
+      struct nbd_slot *slot = &dev->slots[i];
+
+      if (slot->state == NBD_SLOT_EMPTY)
+	return slot;
+      if (slot->state == NBD_SLOT_VALID
+	  && (!best || slot->last_use < best->last_use))
+	best = slot;
+    }
+  return best;
+}
+
+/* Request the blocks from FIRST to LAST which are neither cached nor on
+   their way, as far as the pipeline allows, in a single packet.  */
+static grub_err_t
+nbd_submit (struct grub_nbd *dev, grub_uint64_t first, grub_uint64_t last)
+{
+  struct nbd_request reqs[NBD_MAX_INFLIGHT];
+  grub_uint64_t nblocks, index;
+  unsigned n = 0;
+
+  nblocks = (dev->size + NBD_BLOCK_SIZE - 1) >> NBD_BLOCK_SHIFT;
+  if (last >= nblocks)
+    last = nblocks - 1;
+
+  for (index = first; index <= last; index++)
+    {
+      struct nbd_slot *slot = nbd_find (dev, index);
+      grub_uint64_t start = index << NBD_BLOCK_SHIFT;
+
+      if (slot)
+	{
+	  slot->last_use = ++dev->tick;
+	  continue;
+	}
+      if (dev->inflight >= NBD_MAX_INFLIGHT)
+	break;
+      slot = nbd_victim (dev);
+      if (!slot)
+	break;
+      if (!slot->data)
+	{
+	  slot->data = grub_malloc (NBD_BLOCK_SIZE);
+	  if (!slot->data)
+	    {
+	      if (!n)
+		return grub_errno;
+	      grub_errno = GRUB_ERR_NONE;
+	      break;
+	    }
+	}
+
+      slot->index = index;
+      slot->state = NBD_SLOT_PENDING;
+      slot->last_use = ++dev->tick;
+      slot->len = NBD_BLOCK_SIZE;
+      if (dev->size - start < slot->len)
+	slot->len = dev->size - start;
+
+      reqs[n].magic = grub_cpu_to_be32_compile_time (NBD_REQUEST_MAGIC);
+      reqs[n].flags = 0;
+      reqs[n].type = grub_cpu_to_be16_compile_time (NBD_CMD_READ);
+      reqs[n].handle = grub_cpu_to_be64 (slot - dev->slots);
+      reqs[n].offset = grub_cpu_to_be64 (start);
+      reqs[n].length = grub_cpu_to_be32 (slot->len);
+      n++;
+      dev->inflight++;
+    }
+
+  if (!n)
+    return GRUB_ERR_NONE;
+  return nbd_send (dev, reqs, n * sizeof (reqs[0]));
+}
+
+static grub_err_t
+nbd_read (struct grub_nbd *dev, grub_uint64_t offset, grub_size_t len,
+	  char *buf)
+{
+  grub_uint64_t first, last, index;
+  grub_err_t err;
+
+  if (!len)
+    return GRUB_ERR_NONE;
+
+  if (dev->state == NBD_STATE_DEAD)
+    {
+      err = nbd_connect (dev);
+      if (err)
+	return err;
+    }
+
+  first = offset >> NBD_BLOCK_SHIFT;
+  last = (offset + len - 1) >> NBD_BLOCK_SHIFT;
+
+  /* Reading on from where the last read stopped is sequential.  */
+  if (first <= dev->next_block && first + 1 >= dev->next_block)
+    {
+      if (dev->readahead < NBD_MAX_READAHEAD)
+	dev->readahead = dev->readahead ? dev->readahead * 2 : 1;
+    }
+  else
+    dev->readahead = 0;
+  dev->next_block = last + 1;
+
+  for (index = first; index <= last; index++)
+    {
+      struct nbd_slot *slot;
+      grub_size_t boff, amount;
+      int try = 0;
+
+      while (1)
+	{
+	  if (dev->state == NBD_STATE_DEAD)
+	    return grub_error (GRUB_ERR_READ_ERROR,
+			       N_("connection to NBD server `%s' lost"),
+			       dev->server);
+	  err = nbd_submit (dev, index, last + dev->readahead);
+	  if (err)
+	    return err;
+	  slot = nbd_find (dev, index);
+	  if (slot && slot->state == NBD_SLOT_VALID)
+	    break;
+	  if (!nbd_wait (dev, &try))
+	    {
+	      nbd_fail (dev);
+	      return grub_error (GRUB_ERR_TIMEOUT,
+				 N_("timeout reading `%s'"), dev->devname);
+	    }
+	}
+
+      if (slot->error)
+	{
+	  slot->state = NBD_SLOT_EMPTY;
+	  return grub_error (GRUB_ERR_READ_ERROR,
+			     N_("NBD server error %u reading `%s'"),
+			     slot->error, dev->devname);
+	}
+
+      boff = (index == first) ? (offset & (NBD_BLOCK_SIZE - 1)) : 0;
+      amount = slot->len - boff;
+      if (amount > len)
+	amount = len;
+      grub_memcpy (buf, slot->data + boff, amount);
+      buf += amount;
+      len -= amount;
+
+      /* The last sector of the export may be partial.  */
+      if (slot->len < NBD_BLOCK_SIZE)
+	{
+	  grub_memset (buf, 0, len);
+	  break;
+	}
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static void
+nbd_free (struct grub_nbd *dev)
+{
+  unsigned i;
+
+  if (dev->state != NBD_STATE_DEAD)
+    {
+      struct nbd_request req;
+
+      grub_memset (&req, 0, sizeof (req));
+      req.magic = grub_cpu_to_be32_compile_time (NBD_REQUEST_MAGIC);
+      req.type = grub_cpu_to_be16_compile_time (NBD_CMD_DISC);
+      if (nbd_send (dev, &req, sizeof (req)) == GRUB_ERR_NONE)
+	grub_net_tcp_close (dev->sock, GRUB_NET_TCP_DISCARD);
+      grub_errno = GRUB_ERR_NONE;
+    }
+  for (i = 0; i < dev->nslots; i++)
+    grub_free (dev->slots[i].data);
+  grub_free (dev->slots);
+  grub_free (dev->devname);
+  grub_free (dev->server);
+  grub_free (dev->export_name);
+  grub_free (dev);
+}
+
+/* Delete the NBD device NAME.  */
+static grub_err_t
+delete_nbd (const char *name)
+{
+  struct grub_nbd *dev;
+  struct grub_nbd **prev;
+
+  for (dev = nbd_list, prev = &nbd_list;
+       dev;
+       prev = &dev->next, dev = dev->next)
+    if (grub_strcmp (dev->devname, name) == 0)
+      break;
+
+  if (! dev)
+    return grub_error (GRUB_ERR_BAD_DEVICE, "device not found");
+
+  *prev = dev->next;
+  nbd_free (dev);
+  return GRUB_ERR_NONE;
+}
+
+/* The command to connect to NBD servers and to delete the drives.  */
+static grub_err_t
+grub_cmd_nbd (grub_extcmd_context_t ctxt, int argc, char **args)
+{
+  struct grub_arg_list *state = ctxt->state;
+  struct grub_nbd *dev, **last;
+  unsigned long cache = NBD_DEFAULT_CACHE;
+  grub_err_t err;
+
+  if (state[0].set)
+    {
+      if (argc < 1)
+	return grub_error (GRUB_ERR_BAD_ARGUMENT, "device name required");
+      return delete_nbd (args[0]);
+    }
+
+  if (argc < 1)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("server name expected"));
+
+  dev = grub_zalloc (sizeof (*dev));
+  if (!dev)
+    return grub_errno;
+  dev->state = NBD_STATE_DEAD;
+  dev->port = NBD_DEFAULT_PORT;
+  if (state[2].set)
+    dev->port = grub_strtoul (state[2].arg, 0, 0);
+  if (state[3].set)
+    cache = grub_strtoul (state[3].arg, 0, 0);
+  if (grub_errno)
+    {
+      grub_free (dev);
+      return grub_errno;
+    }
+  dev->nslots = cache / (NBD_BLOCK_SIZE / 1024);
+  if (dev->nslots < NBD_MIN_SLOTS)
+    dev->nslots = NBD_MIN_SLOTS;
+
+  dev->id = last_id++;
+  dev->devname = grub_xasprintf ("nbd%lu", dev->id);
+  dev->server = grub_strdup (args[0]);
+  dev->export_name = grub_strdup (state[1].set ? state[1].arg : "");
+  dev->slots = grub_zalloc (dev->nslots * sizeof (dev->slots[0]));
+  if (!dev->devname || !dev->server || !dev->export_name || !dev->slots)
+    {
+      nbd_free (dev);
+      return grub_errno;
+    }
+
+  err = nbd_connect (dev);
+  if (err)
+    {
+      nbd_free (dev);
+      return err;
+    }
+
+  /* Keep the drives in order of creation.  */
+  for (last = &nbd_list; *last; last = &(*last)->next);
+  *last = dev;
+  return GRUB_ERR_NONE;
+}
+
+
+static int
+grub_nbd_iterate (grub_disk_dev_iterate_hook_t hook, void *hook_data,
+		  grub_disk_pull_t pull)
+{
+  struct grub_nbd *d;
+  if (pull != GRUB_DISK_PULL_NONE)
+    return 0;
+  for (d = nbd_list; d; d = d->next)
+    {
+      if (hook (d->devname, hook_data))
+	return 1;
+    }
+  return 0;
+}
+
+static grub_err_t
+grub_nbd_open (const char *name, grub_disk_t disk)
+{
+  struct grub_nbd *dev;
+
+  for (dev = nbd_list; dev; dev = dev->next)
+    if (grub_strcmp (dev->devname, name) == 0)
+      break;
+
+  if (! dev)
+    return grub_error (GRUB_ERR_UNKNOWN_DEVICE, "can't open device");
+
+  disk->total_sectors = ((dev->size + GRUB_DISK_SECTOR_SIZE - 1)
+			 >> GRUB_DISK_SECTOR_BITS);
+  /* A read spans at most what can be in flight at once.  */
+  disk->max_agglomerate = ((NBD_MAX_INFLIGHT * NBD_BLOCK_SIZE)
+			   >> (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS));
+  disk->id = dev->id;
+  disk->data = dev;
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_nbd_read (grub_disk_t disk, grub_disk_addr_t sector,
+	       grub_size_t size, char *buf)
+{
+  return nbd_read (disk->data, sector << GRUB_DISK_SECTOR_BITS,
+		   size << GRUB_DISK_SECTOR_BITS, buf);
+}
+
+static grub_err_t
+grub_nbd_write (grub_disk_t disk __attribute ((unused)),
+		grub_disk_addr_t sector __attribute ((unused)),
+		grub_size_t size __attribute ((unused)),
+		const char *buf __attribute ((unused)))
+{
+  return grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET,
+		     "NBD write is not supported");
+}
+
+static struct grub_disk_dev grub_nbd_dev =
+{
+  .name = "nbd",
+  .id = GRUB_DISK_DEVICE_NBD_ID,
+  .disk_iterate = grub_nbd_iterate,
+  .disk_open = grub_nbd_open,
+  .disk_read = grub_nbd_read,
+  .disk_write = grub_nbd_write,
+  .next = 0
+};
+
+static grub_extcmd_t cmd;
+
+GRUB_MOD_INIT(nbd)
+{
+  cmd = grub_register_extcmd ("nbd", grub_cmd_nbd, 0,
+			      N_("[-e NAME] [-p PORT] [-c SIZE] SERVER | -d DEVICENAME"),
+			      N_("Make a drive from an export of an NBD server."),
+			      options);
+  grub_disk_dev_register (&grub_nbd_dev);
+}
+
+GRUB_MOD_FINI(nbd)
+{
+  grub_unregister_extcmd (cmd);
+  grub_disk_dev_unregister (&grub_nbd_dev);
+  while (nbd_list)
+    {
+      struct grub_nbd *dev = nbd_list;
+      nbd_list = dev->next;
+      nbd_free (dev);
+    }
+}
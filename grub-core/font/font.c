@@ -58,6 +58,24 @@ struct char_index_entry
 /* Definition of font registry.  */
 struct grub_font_node *grub_font_list;
 
+/* Fonts normally cover whole Unicode blocks, so the font that supplied a
+   missing glyph is remembered for the block of 128 code points around it
+   and tried first for the other characters of the block.  The cache is
+   cleared whenever the font list changes.  */
+#define FALLBACK_BLOCK_SHIFT 7
+#define FALLBACK_CACHE_SIZE 64
+
+struct fallback_cache_entry
+{
+  /* The requested font, or 0 for any font.  */
+  grub_font_t font;
+  grub_uint32_t block;
+  /* The font the glyphs of BLOCK came from, or 0 if the entry is unused.  */
+  grub_font_t supplier;
+};
+
+static struct fallback_cache_entry fallback_cache[FALLBACK_CACHE_SIZE];
+
 static int register_font (grub_font_t font);
 static void font_init (grub_font_t font);
 static void free_font (grub_font_t font);
@@ -206,6 +224,7 @@ font_init (grub_font_t font)
   font->num_chars = 0;
   font->char_index = 0;
   font->bmp_idx = 0;
+  font->glyph_data = 0;
 }
 
 /* Open the next section in the file.
@@ -355,6 +374,125 @@ load_font_index (grub_file_t file, grub_uint32_t sect_length, struct
   return 0;
 }
 
+/* Read the contents of the DATA section, which FILE is positioned at, and
+   make glyphs of all characters of FONT from it at once.  Fonts made by
+   grub-mkfont --aligned leave room before each character definition for
+   the rest of struct grub_font_glyph, so their glyphs are made where they
+   are.  Other fonts have their glyphs copied into one block.
+   Returns 0 upon success, nonzero for failure.  */
+static int
+load_font_data (grub_file_t file, grub_font_t font)
+{
+  grub_off_t start;
+  grub_size_t size;
+  grub_size_t pos, len, end = 0, total = 0;
+  grub_uint8_t *data, *ptr;
+  struct grub_font_glyph *glyph;
+  int in_place;
+  unsigned i;
+
+  start = grub_file_tell (file);
+  if (grub_file_size (file) == GRUB_FILE_SIZE_UNKNOWN
+      || grub_file_size (file) <= start)
+    {
+      grub_error (GRUB_ERR_BAD_FONT, "font file has no glyph data");
+      return 1;
+    }
+  size = grub_file_size (file) - start;
+
+  data = grub_malloc (size);
+  if (!data)
+    return 1;
+  if (grub_file_read (file, data, size) != (grub_ssize_t) size)
+    {
+      if (!grub_errno)
+	grub_error (GRUB_ERR_BAD_FONT, "premature end of font file");
+      goto fail;
+    }
+
+  /* The fields of the glyph must be laid out like the character
+     definition for it to be used in place.  */
+  in_place = (__builtin_offsetof (struct grub_font_glyph, width)
+	      <= FONT_FORMAT_GLYPH_ALIGN
+	      && __builtin_offsetof (struct grub_font_glyph, bitmap)
+	      - __builtin_offsetof (struct grub_font_glyph, width)
+	      == FONT_FORMAT_GLYPH_HEADER_SIZE);
+
+  for (i = 0; i < font->num_chars; i++)
+    {
+      pos = font->char_index[i].offset - start;
+      if (font->char_index[i].offset < start
+	  || pos + FONT_FORMAT_GLYPH_HEADER_SIZE > size)
+	goto bad;
+      len = ((grub_size_t) grub_be_to_cpu16 (grub_get_unaligned16 (data + pos))
+	     * grub_be_to_cpu16 (grub_get_unaligned16 (data + pos + 2))
+	     + 7) / 8;
+      if (len > size - pos - FONT_FORMAT_GLYPH_HEADER_SIZE)
+	goto bad;
+
+      if (pos % FONT_FORMAT_GLYPH_ALIGN != 0
+	  || pos < end + FONT_FORMAT_GLYPH_ALIGN)
+	in_place = 0;
+      end = pos + FONT_FORMAT_GLYPH_HEADER_SIZE + len;
+      total += ALIGN_UP (sizeof (*glyph) + len, FONT_FORMAT_GLYPH_ALIGN);
+    }
+
+  if (in_place)
+    font->glyph_data = data;
+  else
+    {
+      font->glyph_data = grub_malloc (total);
+      if (!font->glyph_data)
+	goto fail;
+    }
+
+  ptr = font->glyph_data;
+  for (i = 0; i < font->num_chars; i++)
+    {
+      grub_uint16_t width, height, dwidth;
+      grub_int16_t xoff, yoff;
+      grub_uint8_t *src;
+
+      src = data + font->char_index[i].offset - start;
+      width = grub_be_to_cpu16 (grub_get_unaligned16 (src));
+      height = grub_be_to_cpu16 (grub_get_unaligned16 (src + 2));
+      xoff = grub_be_to_cpu16 (grub_get_unaligned16 (src + 4));
+      yoff = grub_be_to_cpu16 (grub_get_unaligned16 (src + 6));
+      dwidth = grub_be_to_cpu16 (grub_get_unaligned16 (src + 8));
+      len = ((grub_size_t) width * height + 7) / 8;
+
+      if (in_place)
+	glyph = (struct grub_font_glyph *)
+	  (src - __builtin_offsetof (struct grub_font_glyph, width));
+      else
+	{
+	  glyph = (struct grub_font_glyph *) ptr;
+	  grub_memcpy (glyph->bitmap, src + FONT_FORMAT_GLYPH_HEADER_SIZE, len);
+	  ptr += ALIGN_UP (sizeof (*glyph) + len, FONT_FORMAT_GLYPH_ALIGN);
+	}
+
+      glyph->font = font;
+      glyph->width = width;
+      glyph->height = height;
+      glyph->offset_x = xoff;
+      glyph->offset_y = yoff;
+      glyph->device_width = dwidth;
+      font->char_index[i].glyph = glyph;
+    }
+
+  if (!in_place)
+    grub_free (data);
+
+  return 0;
+
+ bad:
+  grub_error (GRUB_ERR_BAD_FONT,
+	      "font file format error: invalid character definition");
+ fail:
+  grub_free (data);
+  return 1;
+}
+
 /* Read the contents of the specified section as a string, which is
    allocated on the heap.  Returns 0 if there is an error.  */
 static char *
@@ -403,15 +541,17 @@ read_section_as_short (struct font_file_section *section,
   return 0;
 }
 
-/* Load a font and add it to the beginning of the global font list.
+/* Load a font and add it to the beginning of the global font list.  If
+   RESIDENT is set, all glyphs are read at once and the file is closed.
    Returns 0 upon success, nonzero upon failure.  */
-grub_font_t
-grub_font_load (const char *filename)
+static grub_font_t
+load_font (const char *filename, int resident)
 {
   grub_file_t file = 0;
   struct font_file_section section;
   char magic[4];
   grub_font_t font = 0;
+  int have_data = 0;
 
 #if FONT_DEBUG >= 1
   grub_dprintf ("font", "add_font(%s)\n", filename);
@@ -598,6 +738,7 @@ grub_font_load (const char *filename)
 			    sizeof (FONT_FORMAT_SECTION_NAMES_DATA) - 1) == 0)
 	{
 	  /* When the DATA section marker is reached, we stop reading.  */
+	  have_data = 1;
 	  break;
 	}
       else
@@ -636,6 +777,22 @@ grub_font_load (const char *filename)
       goto fail;
     }
 
+  if (resident)
+    {
+      if (!have_data)
+	{
+	  grub_error (GRUB_ERR_BAD_FONT, "font file has no glyph data");
+	  goto fail;
+	}
+      if (load_font_data (file, font) != 0)
+	goto fail;
+
+      /* Every glyph is loaded, so the file isn't needed any more.  */
+      grub_file_close (file);
+      file = 0;
+      font->file = 0;
+    }
+
   /* Add the font to the global font registry.  */
   if (register_font (font) != 0)
     goto fail;
@@ -652,6 +809,18 @@ fail:
   return 0;
 }
 
+grub_font_t
+grub_font_load (const char *filename)
+{
+  return load_font (filename, 0);
+}
+
+grub_font_t
+grub_font_load_resident (const char *filename)
+{
+  return load_font (filename, 1);
+}
+
 /* Read a 16-bit big-endian integer from FILE, convert it to native byte
    order, and store it in *VALUE.
    Returns 0 on success, 1 on failure.  */
@@ -809,10 +978,17 @@ free_font (grub_font_t font)
       grub_free (font->family);
       grub_free (font->char_index);
       grub_free (font->bmp_idx);
+      grub_free (font->glyph_data);
       grub_free (font);
     }
 }
 
+static void
+fallback_cache_clear (void)
+{
+  grub_memset (fallback_cache, 0, sizeof (fallback_cache));
+}
+
 /* Add FONT to the global font registry.
    Returns 0 upon success, nonzero on failure
    (the font was not registered).  */
@@ -828,6 +1004,7 @@ register_font (grub_font_t font)
   node->value = font;
   node->next = grub_font_list;
   grub_font_list = node;
+  fallback_cache_clear ();
 
   return 0;
 }
@@ -848,6 +1025,7 @@ remove_font (grub_font_t font)
 
 	  /* Free the node, but not the font itself.  */
 	  grub_free (cur);
+	  fallback_cache_clear ();
 
 	  return;
 	}
@@ -994,6 +1172,8 @@ grub_font_get_glyph_with_fallback (grub_font_t font, grub_uint32_t code)
      the best matching to the requested one.  */
   int best_diversity;
   struct grub_font_glyph *best_glyph;
+  struct fallback_cache_entry *entry;
+  grub_uint32_t block = code >> FALLBACK_BLOCK_SHIFT;
 
   if (font)
     {
@@ -1003,6 +1183,16 @@ grub_font_get_glyph_with_fallback (grub_font_t font, grub_uint32_t code)
 	return glyph;
     }
 
+  /* Then the font that supplied the rest of the block.  */
+  entry = &fallback_cache[(((grub_addr_t) font >> 4) ^ block)
+			  % FALLBACK_CACHE_SIZE];
+  if (entry->supplier && entry->font == font && entry->block == block)
+    {
+      glyph = grub_font_get_glyph_internal (entry->supplier, code);
+      if (glyph)
+	return glyph;
+    }
+
   /* Otherwise, search all loaded fonts for the glyph and use the one from
      the font that best matches the requested font.  */
   best_diversity = 10000;
@@ -1017,7 +1207,10 @@ grub_font_get_glyph_with_fallback (grub_font_t font, grub_uint32_t code)
 
       glyph = grub_font_get_glyph_internal (curfont, code);
       if (glyph && !font)
-	return glyph;
+	{
+	  best_glyph = glyph;
+	  break;
+	}
       if (glyph)
 	{
 	  int d;
@@ -1031,6 +1224,15 @@ grub_font_get_glyph_with_fallback (grub_font_t font, grub_uint32_t code)
 	}
     }
 
+  /* Reading a glyph may have failed and removed a font, clearing the
+     cache, so ENTRY is only filled in now.  */
+  if (best_glyph)
+    {
+      entry->font = font;
+      entry->block = block;
+      entry->supplier = best_glyph->font;
+    }
+
   return best_glyph;
 }
 
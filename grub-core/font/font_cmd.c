@@ -28,11 +28,21 @@ loadfont_command (grub_command_t cmd __attribute__ ((unused)),
 		  int argc,
 		  char **args)
 {
+  int resident = 0;
+
+  if (argc > 0 && grub_strcmp (args[0], "--resident") == 0)
+    {
+      resident = 1;
+      argc--;
+      args++;
+    }
+
   if (argc == 0)
     return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("filename expected"));
 
   while (argc--)
-    if (grub_font_load (*args++) == 0)
+    if ((resident ? grub_font_load_resident (*args++)
+	 : grub_font_load (*args++)) == 0)
       {
 	if (!grub_errno)
 	  return grub_error (GRUB_ERR_BAD_FONT, "invalid font");
@@ -71,7 +81,7 @@ GRUB_MOD_INIT(font)
 
   cmd_loadfont =
     grub_register_command ("loadfont", loadfont_command,
-			   N_("FILE..."),
+			   N_("[--resident] FILE..."),
 			   N_("Specify one or more font files to load."));
   cmd_lsfonts =
     grub_register_command ("lsfonts", lsfonts_command,
@@ -21,6 +21,11 @@
 #include <grub/fs.h>
 #include <grub/disk.h>
 #include <grub/dl.h>
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/partition.h>
+#include <grub/time.h>
+#include <grub/i18n.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
@@ -54,11 +59,11 @@ canonicalize (char *name)
   *optr = 0;
 }
 
+/* Redirect NAME through the symlink FN pointing to LINKTARGET, if FN is
+   NAME itself or one of its leading directories.  Takes ownership of
+   LINKTARGET.  */
 static grub_err_t
-handle_symlink (struct grub_archelp_data *data,
-		struct grub_archelp_ops *arcops,
-		const char *fn, char **name,
-		grub_uint32_t mode, int *restart)
+apply_symlink (const char *fn, char **name, char *linktarget, int *restart)
 {
   grub_size_t flen;
   char *target;
@@ -66,18 +71,17 @@ handle_symlink (struct grub_archelp_data *data,
   char *lastslash;
   grub_size_t prefixlen;
   char *rest;
-  char *linktarget;
   grub_size_t linktarget_len;
 
   *restart = 0;
 
-  if ((mode & GRUB_ARCHELP_ATTR_TYPE) != GRUB_ARCHELP_ATTR_LNK
-      || !arcops->get_link_target)
-    return GRUB_ERR_NONE;
   flen = grub_strlen (fn);
   if (grub_memcmp (*name, fn, flen) != 0 
       || ((*name)[flen] != 0 && (*name)[flen] != '/'))
-    return GRUB_ERR_NONE;
+    {
+      grub_free (linktarget);
+      return GRUB_ERR_NONE;
+    }
   rest = *name + flen;
   lastslash = rest;
   if (*rest)
@@ -92,15 +96,18 @@ handle_symlink (struct grub_archelp_data *data,
   if (prefixlen)
     prefixlen++;
 
-  linktarget = arcops->get_link_target (data);
-  if (!linktarget)
-    return grub_errno;
   if (linktarget[0] == '\0')
-    return GRUB_ERR_NONE;
+    {
+      grub_free (linktarget);
+      return GRUB_ERR_NONE;
+    }
   linktarget_len = grub_strlen (linktarget);
   target = grub_malloc (linktarget_len + grub_strlen (*name) + 2);
   if (!target)
-    return grub_errno;
+    {
+      grub_free (linktarget);
+      return grub_errno;
+    }
 
   grub_strcpy (target + prefixlen, linktarget);
   grub_free (linktarget);
@@ -133,6 +140,488 @@ handle_symlink (struct grub_archelp_data *data,
   return GRUB_ERR_NONE;
 }
 
+static grub_err_t
+handle_symlink (struct grub_archelp_data *data,
+		struct grub_archelp_ops *arcops,
+		const char *fn, char **name,
+		grub_uint32_t mode, int *restart)
+{
+  grub_size_t flen;
+  char *linktarget;
+
+  *restart = 0;
+
+  if ((mode & GRUB_ARCHELP_ATTR_TYPE) != GRUB_ARCHELP_ATTR_LNK
+      || !arcops->get_link_target)
+    return GRUB_ERR_NONE;
+  flen = grub_strlen (fn);
+  if (grub_memcmp (*name, fn, flen) != 0 
+      || ((*name)[flen] != 0 && (*name)[flen] != '/'))
+    return GRUB_ERR_NONE;
+
+  linktarget = arcops->get_link_target (data);
+  if (!linktarget)
+    return grub_errno;
+
+  return apply_symlink (fn, name, linktarget, restart);
+}
+
+/* Name index.  Every header of the archive is read once; entries are then
+   found through a hash table on the full path, and directories are listed
+   from a copy of the entries sorted so that each directory's contents are
+   contiguous.  */
+
+#define GRUB_ARCHELP_INDEX_TIMEOUT	2
+#define GRUB_ARCHELP_MAX_INDICES	4
+
+struct grub_archelp_entry
+{
+  char *name;
+  /* Symlink target, NULL for other entries.  */
+  char *link;
+  grub_off_t hofs;
+  grub_int32_t mtime;
+  grub_uint32_t mode;
+  struct grub_archelp_entry *hash_next;
+};
+
+struct grub_archelp_index
+{
+  struct grub_archelp_index *next;
+
+  /* What the index was built from.  */
+  struct grub_archelp_ops *arcops;
+  unsigned long dev_id;
+  unsigned long disk_id;
+  grub_disk_addr_t part_start;
+  grub_uint64_t total_sectors;
+
+  grub_uint64_t last_used;
+  int refcnt;
+
+  struct grub_archelp_entry *entries;
+  grub_size_t nentries;
+  struct grub_archelp_entry **sorted;
+  grub_size_t nsorted;
+  struct grub_archelp_entry **hash;
+  grub_size_t hash_size;
+};
+
+static struct grub_archelp_index *indices;
+
+static grub_uint32_t
+name_hash (const char *name, grub_size_t len)
+{
+  grub_uint32_t h = 2166136261U;
+
+  while (len--)
+    h = (h ^ (grub_uint8_t) *name++) * 16777619U;
+  return h;
+}
+
+/* Compare paths so that '/' sorts before any other character, which keeps
+   "dir", "dir/..." and "dir-x" in this order.  */
+static int
+path_cmp (const char *a, const char *b)
+{
+  for (; *a && *a == *b; a++, b++);
+  if (*a == *b)
+    return 0;
+  if (*a == '/' && *b)
+    return -1;
+  if (*b == '/' && *a)
+    return 1;
+  return (grub_uint8_t) *a < (grub_uint8_t) *b ? -1 : 1;
+}
+
+static void
+free_index (struct grub_archelp_index *index)
+{
+  grub_size_t i;
+
+  for (i = 0; i < index->nentries; i++)
+    {
+      grub_free (index->entries[i].name);
+      grub_free (index->entries[i].link);
+    }
+  grub_free (index->entries);
+  grub_free (index->sorted);
+  grub_free (index->hash);
+  grub_free (index);
+}
+
+static struct grub_archelp_entry *
+index_lookup (struct grub_archelp_index *index, const char *name,
+	      grub_size_t len)
+{
+  struct grub_archelp_entry *e;
+
+  for (e = index->hash[name_hash (name, len) & (index->hash_size - 1)];
+       e; e = e->hash_next)
+    if (grub_memcmp (e->name, name, len) == 0 && e->name[len] == 0)
+      return e;
+  return NULL;
+}
+
+static void
+sort_entries (struct grub_archelp_entry **a, grub_size_t n)
+{
+  grub_size_t i, j;
+  struct grub_archelp_entry *t;
+
+  /* Shell sort.  Names are unique here, so stability does not matter.  */
+  for (i = n / 2; i > 0; i /= 2)
+    for (j = i; j < n; j++)
+      {
+	grub_size_t k;
+	t = a[j];
+	for (k = j; k >= i && path_cmp (a[k - i]->name, t->name) > 0; k -= i)
+	  a[k] = a[k - i];
+	a[k] = t;
+      }
+}
+
+static struct grub_archelp_index *
+build_index (struct grub_archelp_data *data,
+	     struct grub_archelp_ops *arcops)
+{
+  struct grub_archelp_index *index;
+  grub_size_t alloc = 0, i;
+
+  index = grub_zalloc (sizeof (*index));
+  if (!index)
+    return NULL;
+
+  arcops->rewind (data);
+  while (1)
+    {
+      struct grub_archelp_entry *e;
+      grub_off_t hofs;
+      grub_int32_t mtime = 0;
+      grub_uint32_t mode;
+      char *name;
+
+      hofs = arcops->tell (data);
+      if (arcops->find_file (data, &name, &mtime, &mode))
+	goto fail;
+      if (mode == GRUB_ARCHELP_ATTR_END)
+	break;
+
+      canonicalize (name);
+
+      if (index->nentries == alloc)
+	{
+	  struct grub_archelp_entry *n;
+
+	  alloc = alloc ? 2 * alloc : 64;
+	  n = grub_realloc (index->entries, alloc * sizeof (*n));
+	  if (!n)
+	    {
+	      grub_free (name);
+	      goto fail;
+	    }
+	  index->entries = n;
+	}
+      e = &index->entries[index->nentries++];
+      e->name = name;
+      e->link = NULL;
+      e->hofs = hofs;
+      e->mtime = mtime;
+      e->mode = mode;
+      e->hash_next = NULL;
+
+      if ((mode & GRUB_ARCHELP_ATTR_TYPE) == GRUB_ARCHELP_ATTR_LNK
+	  && arcops->get_link_target)
+	{
+	  e->link = arcops->get_link_target (data);
+	  if (!e->link)
+	    goto fail;
+	}
+    }
+
+  for (index->hash_size = 16; index->hash_size < index->nentries;
+       index->hash_size *= 2);
+  index->hash = grub_zalloc (index->hash_size * sizeof (index->hash[0]));
+  index->sorted = grub_malloc ((index->nentries + 1)
+			       * sizeof (index->sorted[0]));
+  if (!index->hash || !index->sorted)
+    goto fail;
+
+  /* The first occurrence of a name wins, as with a linear scan.  Later
+     duplicates are kept out of both the hash and the sorted list.  */
+  for (i = 0; i < index->nentries; i++)
+    {
+      struct grub_archelp_entry *e = &index->entries[i];
+      grub_size_t len = grub_strlen (e->name);
+      grub_uint32_t h;
+
+      if (index_lookup (index, e->name, len))
+	continue;
+      h = name_hash (e->name, len) & (index->hash_size - 1);
+      e->hash_next = index->hash[h];
+      index->hash[h] = e;
+    }
+
+  {
+    grub_size_t n = 0;
+    for (i = 0; i < index->nentries; i++)
+      if (index_lookup (index, index->entries[i].name,
+			grub_strlen (index->entries[i].name))
+	  == &index->entries[i])
+	index->sorted[n++] = &index->entries[i];
+    sort_entries (index->sorted, n);
+    index->sorted[n] = NULL;
+    index->nsorted = n;
+  }
+
+  grub_dprintf ("archelp", "indexed %" PRIuGRUB_SIZE " entries\n",
+		index->nentries);
+
+  return index;
+
+ fail:
+  free_index (index);
+  return NULL;
+}
+
+static struct grub_archelp_index *
+get_index (struct grub_archelp_data *data, struct grub_archelp_ops *arcops)
+{
+  struct grub_archelp_index *index, **prev, *oldest = NULL;
+  grub_disk_t disk;
+  grub_disk_addr_t part_start;
+  grub_uint64_t now;
+  int count = 0;
+
+  if (!arcops->tell || !arcops->seek || !arcops->get_disk)
+    return NULL;
+
+  disk = arcops->get_disk (data);
+  part_start = disk->partition ? grub_partition_get_start (disk->partition) : 0;
+  now = grub_get_time_ms ();
+
+  /* Drop indices which have not been used for a while, like the disk
+     cache does after a device is closed.  */
+  for (prev = &indices; *prev; )
+    {
+      index = *prev;
+      if (!index->refcnt
+	  && now > index->last_used + GRUB_ARCHELP_INDEX_TIMEOUT * 1000)
+	{
+	  *prev = index->next;
+	  free_index (index);
+	  continue;
+	}
+      if (index->arcops == arcops
+	  && index->dev_id == disk->dev->id
+	  && index->disk_id == disk->id
+	  && index->part_start == part_start
+	  && index->total_sectors == disk->total_sectors)
+	{
+	  index->refcnt++;
+	  return index;
+	}
+      if (!index->refcnt && (!oldest || index->last_used < oldest->last_used))
+	oldest = index;
+      count++;
+      prev = &index->next;
+    }
+
+  if (count >= GRUB_ARCHELP_MAX_INDICES && oldest)
+    {
+      for (prev = &indices; *prev != oldest; prev = &(*prev)->next);
+      *prev = oldest->next;
+      free_index (oldest);
+    }
+
+  index = build_index (data, arcops);
+  if (!index)
+    {
+      /* Fall back to scanning, which reports errors only for the headers
+	 it actually reaches.  Indexing may have stopped anywhere, so the
+	 scan has to start over.  */
+      grub_errno = GRUB_ERR_NONE;
+      arcops->rewind (data);
+      return NULL;
+    }
+
+  index->arcops = arcops;
+  index->dev_id = disk->dev->id;
+  index->disk_id = disk->id;
+  index->part_start = part_start;
+  index->total_sectors = disk->total_sectors;
+  index->refcnt = 1;
+  index->next = indices;
+  indices = index;
+
+  return index;
+}
+
+static void
+put_index (struct grub_archelp_index *index)
+{
+  index->refcnt--;
+  index->last_used = grub_get_time_ms ();
+}
+
+/* Follow symlinks in NAME and its leading directories.  */
+static grub_err_t
+index_resolve (struct grub_archelp_index *index, char **name)
+{
+  int symlinknest = 0;
+  grub_size_t len;
+
+ again:
+  for (len = 0; ; len++)
+    {
+      struct grub_archelp_entry *e;
+      char *fn;
+      int restart;
+
+      if ((*name)[len] != '/' && (*name)[len] != 0)
+	continue;
+
+      if (len)
+	{
+	  e = index_lookup (index, *name, len);
+	  if (e && e->link)
+	    {
+	      char *linktarget = grub_strdup (e->link);
+
+	      fn = grub_strdup (e->name);
+	      if (!linktarget || !fn)
+		{
+		  grub_free (linktarget);
+		  grub_free (fn);
+		  return grub_errno;
+		}
+	      if (apply_symlink (fn, name, linktarget, &restart))
+		{
+		  grub_free (fn);
+		  return grub_errno;
+		}
+	      grub_free (fn);
+	      if (restart)
+		{
+		  if (++symlinknest == 8)
+		    return grub_error (GRUB_ERR_SYMLINK_LOOP,
+				       N_("too deep nesting of symlinks"));
+		  goto again;
+		}
+	    }
+	}
+
+      if ((*name)[len] == 0)
+	break;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+index_dir (struct grub_archelp_index *index, char **path,
+	   grub_fs_dir_hook_t hook, void *hook_data)
+{
+  struct grub_archelp_entry **cur;
+  grub_size_t len, lo, hi, prevlen = 0;
+  const char *prev = NULL;
+
+  if (index_resolve (index, path))
+    return grub_errno;
+
+  len = grub_strlen (*path);
+
+  /* Find the first entry not sorting before PATH.  */
+  lo = 0;
+  hi = index->nsorted;
+  while (lo < hi)
+    {
+      grub_size_t mid = lo + (hi - lo) / 2;
+      if (path_cmp (index->sorted[mid]->name, *path) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  for (cur = &index->sorted[lo]; *cur; cur++)
+    {
+      const char *n = (*cur)->name, *p;
+      grub_size_t nlen;
+      struct grub_dirhook_info info;
+
+      if (grub_memcmp (*path, n, len) != 0)
+	break;
+      if (len != 0 && n[len] != 0 && n[len] != '/')
+	break;
+
+      n += len;
+      while (*n == '/')
+	n++;
+      if (*n == 0)
+	continue;
+
+      p = grub_strchr (n, '/');
+      nlen = p ? (grub_size_t) (p - n) : grub_strlen (n);
+
+      if (prev && prevlen == nlen && grub_memcmp (prev, n, nlen) == 0)
+	continue;
+      prev = n;
+      prevlen = nlen;
+
+      grub_memset (&info, 0, sizeof (info));
+      info.dir = (p != NULL) || (((*cur)->mode & GRUB_ARCHELP_ATTR_TYPE)
+				 == GRUB_ARCHELP_ATTR_DIR);
+      if (!((*cur)->mode & GRUB_ARCHELP_ATTR_NOTIME))
+	{
+	  info.mtime = (*cur)->mtime;
+	  info.mtimeset = 1;
+	}
+
+      {
+	char *c = grub_strndup (n, nlen);
+	int stop;
+
+	if (!c)
+	  return grub_errno;
+	stop = hook (c, &info, hook_data);
+	grub_free (c);
+	if (stop)
+	  break;
+      }
+    }
+
+  return grub_errno;
+}
+
+static grub_err_t
+index_open (struct grub_archelp_index *index,
+	    struct grub_archelp_data *data,
+	    struct grub_archelp_ops *arcops,
+	    char **name, const char *name_in)
+{
+  struct grub_archelp_entry *e;
+  grub_int32_t mtime;
+  grub_uint32_t mode;
+  char *fn;
+
+  if (index_resolve (index, name))
+    return grub_errno;
+
+  e = index_lookup (index, *name, grub_strlen (*name));
+  if (!e)
+    return grub_error (GRUB_ERR_FILE_NOT_FOUND, N_("file `%s' not found"),
+		       name_in);
+
+  /* Re-read just this header so that the driver's state describes it.  */
+  arcops->seek (data, e->hofs);
+  if (arcops->find_file (data, &fn, &mtime, &mode))
+    return grub_errno;
+  if (mode != GRUB_ARCHELP_ATTR_END)
+    grub_free (fn);
+
+  return GRUB_ERR_NONE;
+}
+
 grub_err_t
 grub_archelp_dir (struct grub_archelp_data *data,
 		  struct grub_archelp_ops *arcops,
@@ -142,6 +631,7 @@ grub_archelp_dir (struct grub_archelp_data *data,
   char *prev, *name, *path, *ptr;
   grub_size_t len;
   int symlinknest = 0;
+  struct grub_archelp_index *index;
 
   path = grub_strdup (path_in + 1);
   if (!path)
@@ -152,6 +642,14 @@ grub_archelp_dir (struct grub_archelp_data *data,
 
   prev = 0;
 
+  index = get_index (data, arcops);
+  if (index)
+    {
+      index_dir (index, &path, hook, hook_data);
+      put_index (index);
+      goto fail;
+    }
+
   len = grub_strlen (path);
   while (1)
     {
@@ -240,12 +738,21 @@ grub_archelp_open (struct grub_archelp_data *data,
   char *fn;
   char *name = grub_strdup (name_in + 1);
   int symlinknest = 0;
+  struct grub_archelp_index *index;
 
   if (!name)
     return grub_errno;
 
   canonicalize (name);
 
+  index = get_index (data, arcops);
+  if (index)
+    {
+      index_open (index, data, arcops, &name, name_in);
+      put_index (index);
+      goto fail;
+    }
+
   while (1)
     {
       grub_uint32_t mode;
@@ -299,3 +806,17 @@ fail:
 
   return grub_errno;
 }
+
+GRUB_MOD_INIT (archelp)
+{
+}
+
+GRUB_MOD_FINI (archelp)
+{
+  while (indices)
+    {
+      struct grub_archelp_index *next = indices->next;
+      free_index (indices);
+      indices = next;
+    }
+}
@@ -109,6 +109,32 @@ struct grub_btrfs_device_desc
   grub_uint64_t id;
 };
 
+/* Cached extent data.  */
+struct grub_btrfs_extent_cache
+{
+  grub_uint64_t extstart;
+  grub_uint64_t extend;
+  grub_uint64_t extino;
+  grub_uint64_t exttree;
+  grub_size_t extsize;
+  struct grub_btrfs_extent_data *extent;
+  grub_uint64_t last_used;
+};
+
+#define GRUB_BTRFS_EXTENT_CACHE_SIZE 16
+/* Number of following extents of the same inode loaded from the leaf
+   together with the one being looked up.  */
+#define GRUB_BTRFS_EXTENT_PREFETCH 8
+
+/* Chunk item found in the chunk tree, kept sorted by logical address.  */
+struct grub_btrfs_chunk_cache
+{
+  struct grub_btrfs_key key;
+  grub_uint64_t start;
+  grub_uint64_t size;
+  struct grub_btrfs_chunk_item *chunk;
+};
+
 struct grub_btrfs_data
 {
   struct grub_btrfs_superblock sblock;
@@ -119,13 +145,13 @@ struct grub_btrfs_data
   unsigned n_devices_attached;
   unsigned n_devices_allocated;
 
-  /* Cached extent data.  */
-  grub_uint64_t extstart;
-  grub_uint64_t extend;
-  grub_uint64_t extino;
-  grub_uint64_t exttree;
-  grub_size_t extsize;
-  struct grub_btrfs_extent_data *extent;
+  struct grub_btrfs_extent_cache extents[GRUB_BTRFS_EXTENT_CACHE_SIZE];
+  grub_uint64_t extent_tick;
+
+  struct grub_btrfs_chunk_cache *chunks;
+  unsigned n_chunks;
+  unsigned n_chunks_allocated;
+
   grub_uint64_t fs_tree;
 };
 
@@ -876,6 +902,65 @@ raid56_read_retry (struct grub_btrfs_data *data,
   return ret;
 }
 
+static struct grub_btrfs_chunk_cache *
+find_cached_chunk (struct grub_btrfs_data *data, grub_disk_addr_t addr)
+{
+  unsigned lo = 0, hi = data->n_chunks;
+
+  while (lo < hi)
+    {
+      unsigned mid = lo + (hi - lo) / 2;
+      struct grub_btrfs_chunk_cache *c = &data->chunks[mid];
+
+      if (addr < c->start)
+	hi = mid;
+      else if (addr - c->start >= c->size)
+	lo = mid + 1;
+      else
+	return c;
+    }
+  return NULL;
+}
+
+/* Remember CHUNK.  Returns 1 if the cache took ownership of it, or 0 if
+   it stays with the caller.  Failure to cache is not an error; the chunk
+   is simply looked up again next time.  */
+static int
+cache_chunk (struct grub_btrfs_data *data, const struct grub_btrfs_key *key,
+	     struct grub_btrfs_chunk_item *chunk)
+{
+  grub_uint64_t start = grub_le_to_cpu64 (key->offset);
+  unsigned pos;
+
+  if (find_cached_chunk (data, start))
+    return 0;
+
+  if (data->n_chunks == data->n_chunks_allocated)
+    {
+      struct grub_btrfs_chunk_cache *n;
+      unsigned alloc = data->n_chunks_allocated ? : 8;
+
+      n = grub_realloc (data->chunks, 2 * alloc * sizeof (n[0]));
+      if (!n)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  return 0;
+	}
+      data->chunks = n;
+      data->n_chunks_allocated = 2 * alloc;
+    }
+
+  for (pos = data->n_chunks; pos > 0 && data->chunks[pos - 1].start > start;
+       pos--)
+    data->chunks[pos] = data->chunks[pos - 1];
+  data->chunks[pos].key = *key;
+  data->chunks[pos].start = start;
+  data->chunks[pos].size = grub_le_to_cpu64 (chunk->size);
+  data->chunks[pos].chunk = chunk;
+  data->n_chunks++;
+  return 1;
+}
+
 static grub_err_t
 grub_btrfs_read_logical (struct grub_btrfs_data *data, grub_disk_addr_t addr,
 			 void *buf, grub_size_t size, int recursion_depth)
@@ -895,6 +980,18 @@ grub_btrfs_read_logical (struct grub_btrfs_data *data, grub_disk_addr_t addr,
 
       grub_dprintf ("btrfs", "searching for laddr %" PRIxGRUB_UINT64_T "\n",
 		    addr);
+
+      {
+	struct grub_btrfs_chunk_cache *c = find_cached_chunk (data, addr);
+	if (c)
+	  {
+	    key_out = c->key;
+	    key = &key_out;
+	    chunk = c->chunk;
+	    goto chunk_found;
+	  }
+      }
+
       for (ptr = data->sblock.bootstrap_mapping;
 	   ptr < data->sblock.bootstrap_mapping
 	   + sizeof (data->sblock.bootstrap_mapping)
@@ -944,6 +1041,16 @@ grub_btrfs_read_logical (struct grub_btrfs_data *data, grub_disk_addr_t addr,
 	  return err;
 	}
 
+      if (chsize >= sizeof (*chunk)
+	  && grub_le_to_cpu64 (chunk->size) > addr - grub_le_to_cpu64 (key->offset)
+	  && chsize >= sizeof (*chunk) + sizeof (struct grub_btrfs_chunk_stripe)
+	     * grub_le_to_cpu16 (chunk->nstripes))
+	{
+	  /* If cached, the cache owns the chunk from now on.  */
+	  if (cache_chunk (data, key, chunk))
+	    challoc = 0;
+	}
+
     chunk_found:
       {
 	grub_uint64_t stripen;
@@ -1350,7 +1457,11 @@ grub_btrfs_unmount (struct grub_btrfs_data *data)
     if (data->devices_attached[i].dev)
         grub_device_close (data->devices_attached[i].dev);
   grub_free (data->devices_attached);
-  grub_free (data->extent);
+  for (i = 0; i < GRUB_BTRFS_EXTENT_CACHE_SIZE; i++)
+    grub_free (data->extents[i].extent);
+  for (i = 0; i < data->n_chunks; i++)
+    grub_free (data->chunks[i].chunk);
+  grub_free (data->chunks);
   grub_free (data);
 }
 
@@ -1562,6 +1673,92 @@ grub_btrfs_lzo_decompress(char *ibuf, grub_size_t isize, grub_off_t off,
   return ret;
 }
 
+/* Load the EXTENT_DATA item at ELEMADDR into the cache slot EXT.  */
+static grub_err_t
+load_extent (struct grub_btrfs_data *data,
+	     struct grub_btrfs_extent_cache *ext,
+	     grub_uint64_t ino, grub_uint64_t tree,
+	     const struct grub_btrfs_key *key,
+	     grub_disk_addr_t elemaddr, grub_size_t elemsize)
+{
+  grub_err_t err;
+
+  grub_free (ext->extent);
+  ext->extent = NULL;
+
+  if ((grub_ssize_t) elemsize < ((char *) &ext->extent->inl
+				 - (char *) ext->extent))
+    return grub_error (GRUB_ERR_BAD_FS, "extent descriptor is too short");
+
+  ext->extent = grub_malloc (elemsize);
+  if (!ext->extent)
+    return grub_errno;
+
+  err = grub_btrfs_read_logical (data, elemaddr, ext->extent, elemsize, 0);
+  if (err)
+    {
+      grub_free (ext->extent);
+      ext->extent = NULL;
+      return err;
+    }
+
+  ext->extstart = grub_le_to_cpu64 (key->offset);
+  ext->extsize = elemsize;
+  ext->extino = ino;
+  ext->exttree = tree;
+  ext->last_used = ++data->extent_tick;
+
+  ext->extend = ext->extstart + grub_le_to_cpu64 (ext->extent->size);
+  if (ext->extent->type == GRUB_BTRFS_EXTENT_REGULAR
+      && (char *) ext->extent + elemsize
+      >= (char *) &ext->extent->filled + sizeof (ext->extent->filled))
+    ext->extend =
+      ext->extstart + grub_le_to_cpu64 (ext->extent->filled);
+
+  grub_dprintf ("btrfs", "regular extent 0x%" PRIxGRUB_UINT64_T "+0x%"
+		PRIxGRUB_UINT64_T "\n",
+		grub_le_to_cpu64 (key->offset),
+		grub_le_to_cpu64 (ext->extent->size));
+  return GRUB_ERR_NONE;
+}
+
+static struct grub_btrfs_extent_cache *
+find_cached_extent (struct grub_btrfs_data *data, grub_uint64_t ino,
+		    grub_uint64_t tree, grub_off_t pos)
+{
+  unsigned i;
+
+  for (i = 0; i < GRUB_BTRFS_EXTENT_CACHE_SIZE; i++)
+    {
+      struct grub_btrfs_extent_cache *ext = &data->extents[i];
+      if (ext->extent && ext->extino == ino && ext->exttree == tree
+	  && ext->extstart <= pos && pos < ext->extend)
+	return ext;
+    }
+  return NULL;
+}
+
+/* Pick the least recently used slot, never EXCEPT.  */
+static struct grub_btrfs_extent_cache *
+get_extent_slot (struct grub_btrfs_data *data,
+		 struct grub_btrfs_extent_cache *except)
+{
+  struct grub_btrfs_extent_cache *victim = NULL;
+  unsigned i;
+
+  for (i = 0; i < GRUB_BTRFS_EXTENT_CACHE_SIZE; i++)
+    {
+      struct grub_btrfs_extent_cache *ext = &data->extents[i];
+      if (ext == except)
+	continue;
+      if (!ext->extent)
+	return ext;
+      if (!victim || ext->last_used < victim->last_used)
+	victim = ext;
+    }
+  return victim;
+}
+
 static grub_ssize_t
 grub_btrfs_extent_read (struct grub_btrfs_data *data,
 			grub_uint64_t ino, grub_uint64_t tree,
@@ -1573,100 +1770,117 @@ grub_btrfs_extent_read (struct grub_btrfs_data *data,
       grub_size_t csize;
       grub_err_t err;
       grub_off_t extoff;
-      if (!data->extent || data->extstart > pos || data->extino != ino
-	  || data->exttree != tree || data->extend <= pos)
+      struct grub_btrfs_extent_cache *ext;
+
+      ext = find_cached_extent (data, ino, tree, pos);
+      if (ext)
+	ext->last_used = ++data->extent_tick;
+      else
 	{
 	  struct grub_btrfs_key key_in, key_out;
 	  grub_disk_addr_t elemaddr;
 	  grub_size_t elemsize;
+	  struct grub_btrfs_leaf_descriptor desc;
+	  unsigned i;
 
-	  grub_free (data->extent);
 	  key_in.object_id = ino;
 	  key_in.type = GRUB_BTRFS_ITEM_TYPE_EXTENT_ITEM;
 	  key_in.offset = grub_cpu_to_le64 (pos);
 	  err = lower_bound (data, &key_in, &key_out, tree,
-			     &elemaddr, &elemsize, NULL, 0);
+			     &elemaddr, &elemsize, &desc, 0);
 	  if (err)
-	    return -1;
+	    {
+	      free_iterator (&desc);
+	      return -1;
+	    }
 	  if (key_out.object_id != ino
 	      || key_out.type != GRUB_BTRFS_ITEM_TYPE_EXTENT_ITEM)
 	    {
+	      free_iterator (&desc);
 	      grub_error (GRUB_ERR_BAD_FS, "extent not found");
 	      return -1;
 	    }
-	  if ((grub_ssize_t) elemsize < ((char *) &data->extent->inl
-					 - (char *) data->extent))
+	  ext = get_extent_slot (data, NULL);
+	  err = load_extent (data, ext, ino, tree, &key_out, elemaddr, elemsize);
+	  if (err)
 	    {
-	      grub_error (GRUB_ERR_BAD_FS, "extent descriptor is too short");
+	      free_iterator (&desc);
 	      return -1;
 	    }
-	  data->extstart = grub_le_to_cpu64 (key_out.offset);
-	  data->extsize = elemsize;
-	  data->extent = grub_malloc (elemsize);
-	  data->extino = ino;
-	  data->exttree = tree;
-	  if (!data->extent)
-	    return grub_errno;
-
-	  err = grub_btrfs_read_logical (data, elemaddr, data->extent,
-					 elemsize, 0);
-	  if (err)
-	    return err;
-
-	  data->extend = data->extstart + grub_le_to_cpu64 (data->extent->size);
-	  if (data->extent->type == GRUB_BTRFS_EXTENT_REGULAR
-	      && (char *) data->extent + elemsize
-	      >= (char *) &data->extent->filled + sizeof (data->extent->filled))
-	    data->extend =
-	      data->extstart + grub_le_to_cpu64 (data->extent->filled);
-
-	  grub_dprintf ("btrfs", "regular extent 0x%" PRIxGRUB_UINT64_T "+0x%"
-			PRIxGRUB_UINT64_T "\n",
-			grub_le_to_cpu64 (key_out.offset),
-			grub_le_to_cpu64 (data->extent->size));
-	  if (data->extend <= pos)
+	  if (ext->extend <= pos)
 	    {
+	      free_iterator (&desc);
 	      grub_error (GRUB_ERR_BAD_FS, "extent not found");
 	      return -1;
 	    }
+
+	  /* Sequential reads will want the next extents of this file too;
+	     take them while the leaf is at hand.  */
+	  for (i = 0; i < GRUB_BTRFS_EXTENT_PREFETCH && desc.depth > 0; i++)
+	    {
+	      struct grub_btrfs_extent_cache *slot;
+	      int r;
+
+	      if (!desc.data[desc.depth - 1].leaf
+		  || desc.data[desc.depth - 1].iter + 1
+		  >= desc.data[desc.depth - 1].maxiter)
+		break;
+	      r = next (data, &desc, &elemaddr, &elemsize, &key_out);
+	      if (r <= 0)
+		break;
+	      if (key_out.object_id != ino
+		  || key_out.type != GRUB_BTRFS_ITEM_TYPE_EXTENT_ITEM)
+		break;
+	      if (find_cached_extent (data, ino, tree,
+				      grub_le_to_cpu64 (key_out.offset)))
+		continue;
+	      slot = get_extent_slot (data, ext);
+	      if (load_extent (data, slot, ino, tree, &key_out,
+			       elemaddr, elemsize))
+		break;
+	    }
+	  free_iterator (&desc);
+	  grub_errno = GRUB_ERR_NONE;
+	  /* Keep the extent we need the most recent one.  */
+	  ext->last_used = ++data->extent_tick;
 	}
-      csize = data->extend - pos;
-      extoff = pos - data->extstart;
+      csize = ext->extend - pos;
+      extoff = pos - ext->extstart;
       if (csize > len)
 	csize = len;
 
-      if (data->extent->encryption)
+      if (ext->extent->encryption)
 	{
 	  grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET,
 		      "encryption not supported");
 	  return -1;
 	}
 
-      if (data->extent->compression != GRUB_BTRFS_COMPRESSION_NONE
-	  && data->extent->compression != GRUB_BTRFS_COMPRESSION_ZLIB
-	  && data->extent->compression != GRUB_BTRFS_COMPRESSION_LZO
-	  && data->extent->compression != GRUB_BTRFS_COMPRESSION_ZSTD)
+      if (ext->extent->compression != GRUB_BTRFS_COMPRESSION_NONE
+	  && ext->extent->compression != GRUB_BTRFS_COMPRESSION_ZLIB
+	  && ext->extent->compression != GRUB_BTRFS_COMPRESSION_LZO
+	  && ext->extent->compression != GRUB_BTRFS_COMPRESSION_ZSTD)
 	{
 	  grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET,
 		      "compression type 0x%x not supported",
-		      data->extent->compression);
+		      ext->extent->compression);
 	  return -1;
 	}
 
-      if (data->extent->encoding)
+      if (ext->extent->encoding)
 	{
 	  grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET, "encoding not supported");
 	  return -1;
 	}
 
-      switch (data->extent->type)
+      switch (ext->extent->type)
 	{
 	case GRUB_BTRFS_EXTENT_INLINE:
-	  if (data->extent->compression == GRUB_BTRFS_COMPRESSION_ZLIB)
+	  if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_ZLIB)
 	    {
-	      if (grub_zlib_decompress (data->extent->inl, data->extsize -
-					((grub_uint8_t *) data->extent->inl
-					 - (grub_uint8_t *) data->extent),
+	      if (grub_zlib_decompress (ext->extent->inl, ext->extsize -
+					((grub_uint8_t *) ext->extent->inl
+					 - (grub_uint8_t *) ext->extent),
 					extoff, buf, csize)
 		  != (grub_ssize_t) csize)
 		{
@@ -1676,46 +1890,46 @@ grub_btrfs_extent_read (struct grub_btrfs_data *data,
 		  return -1;
 		}
 	    }
-	  else if (data->extent->compression == GRUB_BTRFS_COMPRESSION_LZO)
+	  else if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_LZO)
 	    {
-	      if (grub_btrfs_lzo_decompress(data->extent->inl, data->extsize -
-					   ((grub_uint8_t *) data->extent->inl
-					    - (grub_uint8_t *) data->extent),
+	      if (grub_btrfs_lzo_decompress(ext->extent->inl, ext->extsize -
+					   ((grub_uint8_t *) ext->extent->inl
+					    - (grub_uint8_t *) ext->extent),
 					   extoff, buf, csize)
 		  != (grub_ssize_t) csize)
 		return -1;
 	    }
-	  else if (data->extent->compression == GRUB_BTRFS_COMPRESSION_ZSTD)
+	  else if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_ZSTD)
 	    {
-	      if (grub_btrfs_zstd_decompress (data->extent->inl, data->extsize -
-					      ((grub_uint8_t *) data->extent->inl
-					       - (grub_uint8_t *) data->extent),
+	      if (grub_btrfs_zstd_decompress (ext->extent->inl, ext->extsize -
+					      ((grub_uint8_t *) ext->extent->inl
+					       - (grub_uint8_t *) ext->extent),
 					      extoff, buf, csize)
 		  != (grub_ssize_t) csize)
 		return -1;
 	    }
 	  else
-	    grub_memcpy (buf, data->extent->inl + extoff, csize);
+	    grub_memcpy (buf, ext->extent->inl + extoff, csize);
 	  break;
 	case GRUB_BTRFS_EXTENT_REGULAR:
-	  if (!data->extent->laddr)
+	  if (!ext->extent->laddr)
 	    {
 	      grub_memset (buf, 0, csize);
 	      break;
 	    }
 
-	  if (data->extent->compression != GRUB_BTRFS_COMPRESSION_NONE)
+	  if (ext->extent->compression != GRUB_BTRFS_COMPRESSION_NONE)
 	    {
 	      char *tmp;
 	      grub_uint64_t zsize;
 	      grub_ssize_t ret;
 
-	      zsize = grub_le_to_cpu64 (data->extent->compressed_size);
+	      zsize = grub_le_to_cpu64 (ext->extent->compressed_size);
 	      tmp = grub_malloc (zsize);
 	      if (!tmp)
 		return -1;
 	      err = grub_btrfs_read_logical (data,
-					     grub_le_to_cpu64 (data->extent->laddr),
+					     grub_le_to_cpu64 (ext->extent->laddr),
 					     tmp, zsize, 0);
 	      if (err)
 		{
@@ -1723,17 +1937,17 @@ grub_btrfs_extent_read (struct grub_btrfs_data *data,
 		  return -1;
 		}
 
-	      if (data->extent->compression == GRUB_BTRFS_COMPRESSION_ZLIB)
+	      if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_ZLIB)
 		ret = grub_zlib_decompress (tmp, zsize, extoff
-				    + grub_le_to_cpu64 (data->extent->offset),
+				    + grub_le_to_cpu64 (ext->extent->offset),
 				    buf, csize);
-	      else if (data->extent->compression == GRUB_BTRFS_COMPRESSION_LZO)
+	      else if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_LZO)
 		ret = grub_btrfs_lzo_decompress (tmp, zsize, extoff
-				    + grub_le_to_cpu64 (data->extent->offset),
+				    + grub_le_to_cpu64 (ext->extent->offset),
 				    buf, csize);
-	      else if (data->extent->compression == GRUB_BTRFS_COMPRESSION_ZSTD)
+	      else if (ext->extent->compression == GRUB_BTRFS_COMPRESSION_ZSTD)
 		ret = grub_btrfs_zstd_decompress (tmp, zsize, extoff
-				    + grub_le_to_cpu64 (data->extent->offset),
+				    + grub_le_to_cpu64 (ext->extent->offset),
 				    buf, csize);
 	      else
 		ret = -1;
@@ -1751,15 +1965,15 @@ grub_btrfs_extent_read (struct grub_btrfs_data *data,
 	      break;
 	    }
 	  err = grub_btrfs_read_logical (data,
-					 grub_le_to_cpu64 (data->extent->laddr)
-					 + grub_le_to_cpu64 (data->extent->offset)
+					 grub_le_to_cpu64 (ext->extent->laddr)
+					 + grub_le_to_cpu64 (ext->extent->offset)
 					 + extoff, buf, csize, 0);
 	  if (err)
 	    return -1;
 	  break;
 	default:
 	  grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET,
-		      "unsupported extent type 0x%x", data->extent->type);
+		      "unsupported extent type 0x%x", ext->extent->type);
 	  return -1;
 	}
       buf += csize;
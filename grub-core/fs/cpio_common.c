@@ -134,11 +134,32 @@ grub_cpio_rewind (struct grub_archelp_data *data)
   data->next_hofs = 0;
 }
 
+static grub_off_t
+grub_cpio_tell (struct grub_archelp_data *data)
+{
+  return data->next_hofs;
+}
+
+static void
+grub_cpio_seek (struct grub_archelp_data *data, grub_off_t hofs)
+{
+  data->next_hofs = hofs;
+}
+
+static grub_disk_t
+grub_cpio_get_disk (struct grub_archelp_data *data)
+{
+  return data->disk;
+}
+
 static struct grub_archelp_ops arcops =
   {
     .find_file = grub_cpio_find_file,
     .get_link_target = grub_cpio_get_link_target,
-    .rewind = grub_cpio_rewind
+    .rewind = grub_cpio_rewind,
+    .tell = grub_cpio_tell,
+    .seek = grub_cpio_seek,
+    .get_disk = grub_cpio_get_disk
   };
 
 static struct grub_archelp_data *
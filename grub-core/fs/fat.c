@@ -183,6 +183,19 @@ struct grub_fat_data
   grub_uint32_t num_clusters;
 
   grub_uint32_t uuid;
+
+  /* In-memory window of the FAT used to follow cluster chains.  */
+  grub_uint8_t *fat_cache;
+  grub_uint32_t fat_cache_start;
+  grub_uint32_t fat_cache_len;
+};
+
+/* A run of physically contiguous clusters of a file.  */
+struct grub_fat_run
+{
+  grub_uint32_t logical;
+  grub_uint32_t physical;
+  grub_uint32_t length;
 };
 
 struct grub_fshelp_node {
@@ -202,8 +215,18 @@ struct grub_fshelp_node {
 #ifdef MODE_EXFAT
   int is_contiguous;
 #endif
+
+  /* Run-length cluster map, only present for files opened with
+     grub_fat_open.  It is extended lazily as the file is read.  */
+  struct grub_fat_run *runs;
+  grub_uint32_t num_runs;
+  grub_uint32_t alloc_runs;
+  int runs_complete;
 };
 
+#define GRUB_FAT_CACHE_SIZE	65536
+#define GRUB_FAT_INITIAL_RUNS	16
+
 static grub_dl_t my_mod;
 
 #ifndef MODE_EXFAT
@@ -235,7 +258,7 @@ grub_fat_mount (grub_disk_t disk)
   if (! disk)
     goto fail;
 
-  data = (struct grub_fat_data *) grub_malloc (sizeof (*data));
+  data = (struct grub_fat_data *) grub_zalloc (sizeof (*data));
   if (! data)
     goto fail;
 
@@ -440,6 +463,18 @@ grub_fat_mount (grub_disk_t disk)
   (void) magic;
 #endif
 
+  data->fat_cache_len = GRUB_FAT_CACHE_SIZE;
+  if (data->fat_cache_len > (data->sectors_per_fat << GRUB_DISK_SECTOR_BITS))
+    data->fat_cache_len = data->sectors_per_fat << GRUB_DISK_SECTOR_BITS;
+  data->fat_cache = grub_malloc (data->fat_cache_len);
+  if (! data->fat_cache)
+    {
+      grub_free (data);
+      return 0;
+    }
+  /* Nothing is loaded yet.  */
+  data->fat_cache_start = ~0U;
+
   return data;
 
  fail:
@@ -449,6 +484,183 @@ grub_fat_mount (grub_disk_t disk)
   return 0;
 }
 
+static void
+grub_fat_unmount (struct grub_fat_data *data)
+{
+  if (! data)
+    return;
+  grub_free (data->fat_cache);
+  grub_free (data);
+}
+
+/* Get the FAT entry for CLUSTER, reading the FAT a window at a time.  */
+static grub_err_t
+grub_fat_get_next_cluster (grub_disk_t disk, struct grub_fat_data *data,
+			   grub_uint32_t cluster, grub_uint32_t *next)
+{
+  grub_uint32_t fat_offset, fat_bytes, entry_bytes, pos;
+  grub_uint32_t next_cluster = 0;
+
+  switch (data->fat_size)
+    {
+    case 32:
+      fat_offset = cluster << 2;
+      break;
+    case 16:
+      fat_offset = cluster << 1;
+      break;
+    default:
+      /* case 12: */
+      fat_offset = cluster + (cluster >> 1);
+      break;
+    }
+  entry_bytes = (data->fat_size + 7) >> 3;
+  fat_bytes = data->sectors_per_fat << GRUB_DISK_SECTOR_BITS;
+
+  if (fat_offset + entry_bytes > fat_bytes)
+    return grub_error (GRUB_ERR_BAD_FS, "invalid cluster %u", cluster);
+
+  if (data->fat_cache_start == ~0U
+      || fat_offset < data->fat_cache_start
+      || fat_offset + entry_bytes > data->fat_cache_start + data->fat_cache_len)
+    {
+      /* Load a new window starting at the sector holding the entry, so that
+	 following a chain forward stays inside the window.  */
+      grub_uint32_t start;
+
+      start = fat_offset & ~(GRUB_DISK_SECTOR_SIZE - 1);
+      if (start + data->fat_cache_len > fat_bytes)
+	start = fat_bytes - data->fat_cache_len;
+
+      data->fat_cache_start = ~0U;
+      if (grub_disk_read (disk, data->fat_sector, start, data->fat_cache_len,
+			  data->fat_cache))
+	return grub_errno;
+      data->fat_cache_start = start;
+    }
+
+  pos = fat_offset - data->fat_cache_start;
+  grub_memcpy (&next_cluster, data->fat_cache + pos, entry_bytes);
+
+  next_cluster = grub_le_to_cpu32 (next_cluster);
+  switch (data->fat_size)
+    {
+    case 16:
+      next_cluster &= 0xFFFF;
+      break;
+    case 12:
+      if (cluster & 1)
+	next_cluster >>= 4;
+
+      next_cluster &= 0x0FFF;
+      break;
+    }
+
+  grub_dprintf ("fat", "fat_size=%d, next_cluster=%u\n",
+		data->fat_size, next_cluster);
+
+  *next = next_cluster;
+  return GRUB_ERR_NONE;
+}
+
+/* Follow the cluster chain until the run map covers LOGICAL_CLUSTER or the
+   end of the chain is reached.  */
+static grub_err_t
+grub_fat_extend_runs (grub_disk_t disk, grub_fshelp_node_t node,
+		      grub_uint32_t logical_cluster)
+{
+  struct grub_fat_run *last = &node->runs[node->num_runs - 1];
+
+  while (! node->runs_complete
+	 && logical_cluster >= last->logical + last->length)
+    {
+      grub_uint32_t next_cluster;
+
+      if (grub_fat_get_next_cluster (disk, node->data,
+				     last->physical + last->length - 1,
+				     &next_cluster))
+	return grub_errno;
+
+      /* Check the end.  */
+      if (next_cluster >= node->data->cluster_eof_mark)
+	{
+	  node->runs_complete = 1;
+	  break;
+	}
+
+      if (next_cluster < 2 || next_cluster >= node->data->num_clusters)
+	return grub_error (GRUB_ERR_BAD_FS, "invalid cluster %u",
+			   next_cluster);
+
+      if (next_cluster == last->physical + last->length)
+	{
+	  last->length++;
+	  continue;
+	}
+
+      if (node->num_runs == node->alloc_runs)
+	{
+	  struct grub_fat_run *runs;
+
+	  runs = grub_realloc (node->runs, 2 * node->alloc_runs
+			       * sizeof (node->runs[0]));
+	  if (! runs)
+	    return grub_errno;
+	  node->runs = runs;
+	  node->alloc_runs *= 2;
+	}
+
+      node->runs[node->num_runs].logical = last->logical + last->length;
+      node->runs[node->num_runs].physical = next_cluster;
+      node->runs[node->num_runs].length = 1;
+      last = &node->runs[node->num_runs++];
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Find the run holding LOGICAL_CLUSTER, or NULL past the end of the file.  */
+static struct grub_fat_run *
+grub_fat_find_run (grub_disk_t disk, grub_fshelp_node_t node,
+		   grub_uint32_t logical_cluster)
+{
+  grub_uint32_t lo = 0, hi;
+
+  if (grub_fat_extend_runs (disk, node, logical_cluster))
+    return NULL;
+
+  hi = node->num_runs;
+  while (lo < hi)
+    {
+      grub_uint32_t mid = lo + (hi - lo) / 2;
+      struct grub_fat_run *run = &node->runs[mid];
+
+      if (logical_cluster < run->logical)
+	hi = mid;
+      else if (logical_cluster >= run->logical + run->length)
+	lo = mid + 1;
+      else
+	return run;
+    }
+
+  return NULL;
+}
+
+static grub_err_t
+grub_fat_init_runs (grub_fshelp_node_t node)
+{
+  node->runs = grub_malloc (GRUB_FAT_INITIAL_RUNS * sizeof (node->runs[0]));
+  if (! node->runs)
+    return grub_errno;
+  node->alloc_runs = GRUB_FAT_INITIAL_RUNS;
+  node->num_runs = 1;
+  node->runs[0].logical = 0;
+  node->runs[0].physical = node->file_cluster;
+  node->runs[0].length = 1;
+  node->runs_complete = 0;
+  return GRUB_ERR_NONE;
+}
+
 static grub_ssize_t
 grub_fat_read_data (grub_disk_t disk, grub_fshelp_node_t node,
 		    grub_disk_read_hook_t read_hook, void *read_hook_data, int blocklist,
@@ -503,6 +715,48 @@ grub_fat_read_data (grub_disk_t disk, grub_fshelp_node_t node,
   logical_cluster = offset >> logical_cluster_bits;
   offset &= (1ULL << logical_cluster_bits) - 1;
 
+  if (node->runs)
+    {
+      /* Read whole runs of contiguous clusters at once.  */
+      while (len)
+	{
+	  struct grub_fat_run *run;
+	  grub_uint64_t run_bytes;
+
+	  run = grub_fat_find_run (disk, node, logical_cluster);
+	  if (! run)
+	    return grub_errno ? -1 : ret;
+
+	  sector = (node->data->cluster_sector
+		    + ((grub_disk_addr_t) (run->physical - 2
+					   + logical_cluster - run->logical)
+		       << node->data->cluster_bits));
+	  run_bytes = (((grub_uint64_t) (run->logical + run->length
+					 - logical_cluster)
+			<< logical_cluster_bits) - offset);
+	  size = len;
+	  if (size > run_bytes)
+	    size = run_bytes;
+
+	  disk->read_hook = read_hook;
+	  disk->read_hook_data = read_hook_data;
+	  grub_disk_read_ex (disk, sector, offset, size, buf, blocklist);
+	  disk->read_hook = 0;
+	  if (grub_errno)
+	    return -1;
+
+	  len -= size;
+	  if (buf)
+	    buf += size;
+	  ret += size;
+	  offset += size;
+	  logical_cluster += offset >> logical_cluster_bits;
+	  offset &= (1ULL << logical_cluster_bits) - 1;
+	}
+
+      return ret;
+    }
+
   if (logical_cluster < node->cur_cluster_num)
     {
       node->cur_cluster_num = 0;
@@ -515,45 +769,11 @@ grub_fat_read_data (grub_disk_t disk, grub_fshelp_node_t node,
 	{
 	  /* Find next cluster.  */
 	  grub_uint32_t next_cluster;
-	  grub_uint32_t fat_offset;
 
-	  switch (node->data->fat_size)
-	    {
-	    case 32:
-	      fat_offset = node->cur_cluster << 2;
-	      break;
-	    case 16:
-	      fat_offset = node->cur_cluster << 1;
-	      break;
-	    default:
-	      /* case 12: */
-	      fat_offset = node->cur_cluster + (node->cur_cluster >> 1);
-	      break;
-	    }
-
-	  /* Read the FAT.  */
-	  if (grub_disk_read (disk, node->data->fat_sector, fat_offset,
-			      (node->data->fat_size + 7) >> 3,
-			      (char *) &next_cluster))
+	  if (grub_fat_get_next_cluster (disk, node->data, node->cur_cluster,
+					 &next_cluster))
 	    return -1;
 
-	  next_cluster = grub_le_to_cpu32 (next_cluster);
-	  switch (node->data->fat_size)
-	    {
-	    case 16:
-	      next_cluster &= 0xFFFF;
-	      break;
-	    case 12:
-	      if (node->cur_cluster & 1)
-		next_cluster >>= 4;
-
-	      next_cluster &= 0x0FFF;
-	      break;
-	    }
-
-	  grub_dprintf ("fat", "fat_size=%d, next_cluster=%u\n",
-			node->data->fat_size, next_cluster);
-
 	  /* Check the end.  */
 	  if (next_cluster >= node->data->cluster_eof_mark)
 	    return ret;
@@ -954,6 +1174,7 @@ static grub_err_t lookup_file (grub_fshelp_node_t node,
 	    (*foundnode)->file_cluster = node->data->root_cluster;
 #endif
 	  (*foundnode)->cur_cluster_num = ~0U;
+	  (*foundnode)->runs = NULL;
 	  (*foundnode)->data = node->data;
 	  (*foundnode)->disk = node->disk;
 
@@ -1044,7 +1265,7 @@ grub_fat_dir (grub_device_t device, const char *path, grub_fs_dir_hook_t hook,
   if (found != &root)
     grub_free (found);
 
-  grub_free (data);
+  grub_fat_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -1082,6 +1303,9 @@ grub_fat_open (grub_file_t file, const char *name)
   if (err)
     goto fail;
 
+  if (grub_fat_init_runs (found))
+    goto fail;
+
   file->data = found;
   file->size = found->file_size;
 
@@ -1092,7 +1316,7 @@ grub_fat_open (grub_file_t file, const char *name)
   if (found != &root)
     grub_free (found);
 
-  grub_free (data);
+  grub_fat_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -1112,7 +1336,8 @@ grub_fat_close (grub_file_t file)
 {
   grub_fshelp_node_t node = file->data;
 
-  grub_free (node->data);
+  grub_fat_unmount (node->data);
+  grub_free (node->runs);
   grub_free (node);
 
   grub_dl_unref (my_mod);
@@ -1168,7 +1393,7 @@ grub_fat_label (grub_device_t device, char **label)
 				* GRUB_MAX_UTF8_PER_UTF16 + 1);
 	  if (!*label)
 	    {
-	      grub_free (root.data);
+	      grub_fat_unmount (root.data);
 	      return grub_errno;
 	    }
 	  chc = dir.type_specific.volume_label.character_count;
@@ -1180,7 +1405,7 @@ grub_fat_label (grub_device_t device, char **label)
 	}
     }
 
-  grub_free (root.data);
+  grub_fat_unmount (root.data);
   return grub_errno;
 }
 
@@ -1227,7 +1452,7 @@ grub_fat_label (grub_device_t device, char **label)
 
   grub_dl_unref (my_mod);
 
-  grub_free (root.data);
+  grub_fat_unmount (root.data);
 
   return grub_errno;
 }
@@ -1257,7 +1482,7 @@ grub_fat_uuid (grub_device_t device, char **uuid)
 
   grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_fat_unmount (data);
 
   return grub_errno;
 }
@@ -1280,7 +1505,7 @@ grub_disk_addr_t
 
   *sec_per_lcn = 1ULL << data->cluster_bits;
 
-  grub_free (data);
+  grub_fat_unmount (data);
   return ret;
 }
 #endif
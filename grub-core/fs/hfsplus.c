@@ -148,6 +148,24 @@ grub_hfsplus_read_block (grub_fshelp_node_t node, grub_disk_addr_t fileblock)
   struct grub_hfsplus_extent *extents = node->compressed 
     ? &node->resource_extents[0] : &node->extents[0];
 
+  if (node->extmap)
+    {
+      grub_uint32_t lo = 0, hi = node->extmap_count;
+
+      while (lo < hi)
+	{
+	  grub_uint32_t mid = lo + (hi - lo) / 2;
+	  struct grub_hfsplus_extent_map *e = &node->extmap[mid];
+
+	  if (fileblock < e->fileblock)
+	    hi = mid;
+	  else if (fileblock - e->fileblock >= e->count)
+	    lo = mid + 1;
+	  else
+	    return e->start + (fileblock - e->fileblock);
+	}
+    }
+
   while (1)
     {
       struct grub_hfsplus_extkey *key;
@@ -223,6 +241,70 @@ grub_hfsplus_read_file (grub_fshelp_node_t node,
 				node->data->embedded_offset);
 }
 
+static void
+grub_hfsplus_unmount (struct grub_hfsplus_data *data)
+{
+  unsigned i;
+
+  if (!data)
+    return;
+  for (i = 0; i < GRUB_HFSPLUS_NODE_CACHE_SIZE; i++)
+    grub_free (data->node_cache[i].buf);
+  grub_free (data);
+}
+
+/* Read node NODENUM of BTREE into BUF, going through the per-mount node
+   cache.  */
+static grub_err_t
+grub_hfsplus_read_node (struct grub_hfsplus_btree *btree,
+			grub_uint64_t nodenum, char *buf)
+{
+  struct grub_hfsplus_data *data = btree->file.data;
+  struct grub_hfsplus_node_cache *slot = NULL;
+  unsigned i;
+
+  for (i = 0; i < GRUB_HFSPLUS_NODE_CACHE_SIZE; i++)
+    {
+      struct grub_hfsplus_node_cache *c = &data->node_cache[i];
+
+      if (c->buf && c->btree == btree && c->node == nodenum
+	  && c->size == btree->nodesize)
+	{
+	  c->last_used = ++data->node_cache_tick;
+	  grub_memcpy (buf, c->buf, btree->nodesize);
+	  return GRUB_ERR_NONE;
+	}
+      if (!slot || !c->buf
+	  || (slot->buf && c->last_used < slot->last_used))
+	slot = c;
+    }
+
+  if (grub_hfsplus_read_file (&btree->file, 0, 0,
+			      nodenum * (grub_disk_addr_t) btree->nodesize,
+			      btree->nodesize, buf) <= 0)
+    return grub_errno ? : grub_error (GRUB_ERR_BAD_FS,
+				      "couldn't read i-node");
+
+  if (slot->size != btree->nodesize)
+    {
+      grub_free (slot->buf);
+      slot->size = 0;
+      slot->buf = grub_malloc (btree->nodesize);
+      if (!slot->buf)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  return GRUB_ERR_NONE;
+	}
+      slot->size = btree->nodesize;
+    }
+  grub_memcpy (slot->buf, buf, btree->nodesize);
+  slot->btree = btree;
+  slot->node = nodenum;
+  slot->last_used = ++data->node_cache_tick;
+
+  return GRUB_ERR_NONE;
+}
+
 static struct grub_hfsplus_data *
 grub_hfsplus_mount (grub_disk_t disk)
 {
@@ -235,7 +317,7 @@ grub_hfsplus_mount (grub_disk_t disk)
     struct grub_hfsplus_volheader hfsplus;
   } volheader;
 
-  data = grub_malloc (sizeof (*data));
+  data = grub_zalloc (sizeof (*data));
   if (!data)
     return 0;
 
@@ -380,7 +462,7 @@ grub_hfsplus_mount (grub_disk_t disk)
   if (grub_errno == GRUB_ERR_OUT_OF_RANGE)
     grub_error (GRUB_ERR_BAD_FS, "not a HFS+ filesystem");
 
-  grub_free (data);
+  grub_hfsplus_unmount (data);
   return 0;
 }
 
@@ -525,11 +607,8 @@ grub_hfsplus_btree_iterate_node (struct grub_hfsplus_btree *btree,
 	saved_node = first_node->next;
       node_count++;
 
-      if (grub_hfsplus_read_file (&btree->file, 0, 0,
-				  (((grub_disk_addr_t)
-				    grub_be_to_cpu32 (first_node->next))
-				   * btree->nodesize),
-				  btree->nodesize, cnode) <= 0)
+      if (grub_hfsplus_read_node (btree, grub_be_to_cpu32 (first_node->next),
+				  cnode))
 	return 1;
 
       /* Don't skip any record in the next iteration.  */
@@ -584,10 +663,7 @@ grub_hfsplus_btree_search (struct grub_hfsplus_btree *btree,
       node_count++;
 
       /* Read a node.  */
-      if (grub_hfsplus_read_file (&btree->file, 0, 0,
-				  (grub_disk_addr_t) currnode
-				  * (grub_disk_addr_t) btree->nodesize,
-				  btree->nodesize, (char *) node) <= 0)
+      if (grub_hfsplus_read_node (btree, currnode, node))
 	{
 	  grub_free (node);
 	  return grub_error (GRUB_ERR_BAD_FS, "couldn't read i-node");
@@ -706,6 +782,7 @@ list_nodes (void *record, void *hook_arg)
       node->data = ctx->dir->data;
       node->mtime = 0;
       node->size = 0;
+      node->extmap = 0;
       node->fileid = grub_be_to_cpu32 (fileinfo->parentid);
 
       ctx->ret = ctx->hook ("..", GRUB_FSHELP_DIR, node, ctx->hook_data);
@@ -765,6 +842,7 @@ list_nodes (void *record, void *hook_arg)
   node->compressed = 0;
   node->cbuf = 0;
   node->compress_index = 0;
+  node->extmap = 0;
 
   grub_memcpy (node->extents, fileinfo->data.extents,
 	       sizeof (node->extents));
@@ -828,6 +906,89 @@ grub_hfsplus_iterate_dir (grub_fshelp_node_t dir,
   return ctx.ret;
 }
 
+/* Collect every extent of the fork of NODE which is read, walking the
+   extent overflow tree once, so that later block lookups are a binary
+   search.  Failing to build the map is not fatal.  */
+static void
+grub_hfsplus_build_extmap (struct grub_hfsplus_file *node)
+{
+  struct grub_hfsplus_extent *extents = node->compressed
+    ? &node->resource_extents[0] : &node->extents[0];
+  struct grub_hfsplus_extent_map *map = NULL;
+  grub_uint32_t count = 0, alloc = 0;
+  grub_uint64_t fileblock = 0;
+  struct grub_hfsplus_btnode *nnode = NULL;
+
+  if (node->fileid == GRUB_HFSPLUS_FILEID_OVERFLOW)
+    return;
+
+  while (1)
+    {
+      struct grub_hfsplus_key_internal extoverflow;
+      struct grub_hfsplus_extkey *key;
+      grub_off_t ptr;
+      grub_uint64_t before = fileblock;
+      int i;
+
+      for (i = 0; i < 8; i++)
+	{
+	  grub_uint32_t n = grub_be_to_cpu32 (extents[i].count);
+
+	  if (!n)
+	    continue;
+	  if (count == alloc)
+	    {
+	      struct grub_hfsplus_extent_map *t;
+
+	      alloc = alloc ? 2 * alloc : 16;
+	      t = grub_realloc (map, alloc * sizeof (map[0]));
+	      if (!t)
+		goto fail;
+	      map = t;
+	    }
+	  map[count].fileblock = fileblock;
+	  map[count].start = grub_be_to_cpu32 (extents[i].start);
+	  map[count].count = n;
+	  count++;
+	  fileblock += n;
+	}
+
+      grub_free (nnode);
+      nnode = NULL;
+
+      /* A record full of empty extents means we are done.  */
+      if (fileblock == before)
+	break;
+      if ((fileblock << node->data->log2blksize)
+	  >= (node->compressed ? node->resource_size : node->size))
+	break;
+
+      extoverflow.extkey.fileid = node->fileid;
+      extoverflow.extkey.start = fileblock;
+      extoverflow.extkey.type = node->compressed ? 0xff : 0;
+      if (grub_hfsplus_btree_search (&node->data->extoverflow_tree,
+				     &extoverflow,
+				     grub_hfsplus_cmp_extkey, &nnode, &ptr))
+	goto fail;
+      if (!nnode)
+	break;
+
+      key = (struct grub_hfsplus_extkey *)
+	grub_hfsplus_btree_recptr (&node->data->extoverflow_tree, nnode, ptr);
+      extents = (struct grub_hfsplus_extent *) (key + 1);
+    }
+
+  grub_free (nnode);
+  node->extmap = map;
+  node->extmap_count = count;
+  return;
+
+ fail:
+  grub_free (nnode);
+  grub_free (map);
+  grub_errno = GRUB_ERR_NONE;
+}
+
 /* Open a file named NAME and initialize FILE.  */
 static grub_err_t
 grub_hfsplus_open (struct grub_file *file, const char *name)
@@ -859,6 +1020,8 @@ grub_hfsplus_open (struct grub_file *file, const char *name)
   data->opened_file = *fdiro;
   grub_free (fdiro);
 
+  grub_hfsplus_build_extmap (&data->opened_file);
+
   file->data = data;
   file->offset = 0;
 
@@ -867,7 +1030,7 @@ grub_hfsplus_open (struct grub_file *file, const char *name)
  fail:
   if (data && fdiro != &data->dirroot)
     grub_free (fdiro);
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -883,8 +1046,9 @@ grub_hfsplus_close (grub_file_t file)
 
   grub_free (data->opened_file.cbuf);
   grub_free (data->opened_file.compress_index);
+  grub_free (data->opened_file.extmap);
 
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -963,7 +1127,7 @@ grub_hfsplus_dir (grub_device_t device, const char *path,
  fail:
   if (data && fdiro != &data->dirroot)
     grub_free (fdiro);
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -999,7 +1163,7 @@ grub_hfsplus_label (grub_device_t device, char **label)
 				 grub_hfsplus_cmp_catkey_id, &node, &ptr)
       || !node)
     {
-      grub_free (data);
+      grub_hfsplus_unmount (data);
       return 0;
     }
 
@@ -1011,7 +1175,7 @@ grub_hfsplus_label (grub_device_t device, char **label)
   if (!label_name)
     {
       grub_free (node);
-      grub_free (data);
+      grub_hfsplus_unmount (data);
       return grub_errno;
     }
 
@@ -1024,7 +1188,7 @@ grub_hfsplus_label (grub_device_t device, char **label)
 	{
 	  grub_free (label_name);
 	  grub_free (node);
-	  grub_free (data);
+	  grub_hfsplus_unmount (data);
 	  return 0;
 	}
     }
@@ -1034,7 +1198,7 @@ grub_hfsplus_label (grub_device_t device, char **label)
     {
       grub_free (label_name);
       grub_free (node);
-      grub_free (data);
+      grub_hfsplus_unmount (data);
       return grub_errno;
     }
 
@@ -1043,7 +1207,7 @@ grub_hfsplus_label (grub_device_t device, char **label)
 
   grub_free (label_name);
   grub_free (node);
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   return GRUB_ERR_NONE;
 }
@@ -1065,7 +1229,7 @@ grub_hfsplus_mtime (grub_device_t device, grub_int32_t *tm)
 
   grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   return grub_errno;
 
@@ -1091,7 +1255,7 @@ grub_hfsplus_uuid (grub_device_t device, char **uuid)
 
   grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_hfsplus_unmount (data);
 
   return grub_errno;
 }
@@ -48,6 +48,13 @@ GRUB_MOD_LICENSE ("GPLv3+");
 #define GRUB_ISO9660_VOLDESC_PART	3
 #define GRUB_ISO9660_VOLDESC_END	255
 
+/* Number of directories whose contents are kept per mount.  */
+#define GRUB_ISO9660_DIR_CACHE_SLOTS	8
+/* Directories bigger than this are parsed record by record.  */
+#define GRUB_ISO9660_DIR_CACHE_MAX	(4 << 20)
+/* Path tables bigger than this are not used for lookups.  */
+#define GRUB_ISO9660_PATH_TABLE_MAX	(4 << 20)
+
 /* The head of a volume descriptor.  */
 struct grub_iso9660_voldesc
 {
@@ -146,6 +153,15 @@ struct grub_iso9660_susp_ce
   grub_uint32_t len_be;
 } GRUB_PACKED;
 
+/* The contents of a directory, read in one go.  */
+struct grub_iso9660_dir_cache
+{
+  grub_uint32_t first_sector;
+  grub_size_t size;
+  char *buf;
+  unsigned long last_use;
+};
+
 struct grub_iso9660_data
 {
   struct grub_iso9660_primary_voldesc voldesc;
@@ -154,6 +170,10 @@ struct grub_iso9660_data
   int susp_skip;
   int joliet;
   struct grub_fshelp_node *node;
+  struct grub_iso9660_dir_cache dir_cache[GRUB_ISO9660_DIR_CACHE_SLOTS];
+  unsigned long dir_cache_tick;
+  grub_uint8_t *path_table;
+  grub_size_t path_table_size;
 };
 
 struct grub_fshelp_node
@@ -256,12 +276,29 @@ read_node (grub_fshelp_node_t node, grub_off_t off, grub_size_t len, char *buf,
   return GRUB_ERR_NONE;
 }
 
+/* Read a part of directory NODE, from DIRBUF if its contents are
+   cached.  */
+static grub_err_t
+read_dir (grub_fshelp_node_t node, const struct grub_iso9660_dir_cache *dirbuf,
+	  grub_off_t off, grub_size_t len, char *buf)
+{
+  if (!dirbuf)
+    return read_node (node, off, len, buf, 0);
+
+  if (off > dirbuf->size || len > dirbuf->size - off)
+    return grub_error (GRUB_ERR_OUT_OF_RANGE, "read out of range");
+
+  grub_memcpy (buf, dirbuf->buf + off, len);
+  return GRUB_ERR_NONE;
+}
+
 /* Iterate over the susp entries, starting with block SUA_BLOCK on the
    offset SUA_POS with a size of SUA_SIZE bytes.  Hook is called for
    every entry.  */
 static grub_err_t
-grub_iso9660_susp_iterate (grub_fshelp_node_t node, grub_off_t off,
-			   grub_ssize_t sua_size,
+grub_iso9660_susp_iterate (grub_fshelp_node_t node,
+			   const struct grub_iso9660_dir_cache *dirbuf,
+			   grub_off_t off, grub_ssize_t sua_size,
 			   grub_err_t (*hook)
 			   (struct grub_iso9660_susp_entry *entry, void *hook_arg),
 			   void *hook_arg)
@@ -278,9 +315,12 @@ grub_iso9660_susp_iterate (grub_fshelp_node_t node, grub_off_t off,
     return grub_errno;
 
   /* Load a part of the System Usage Area.  */
-  err = read_node (node, off, sua_size, sua, 0);
+  err = read_dir (node, dirbuf, off, sua_size, sua);
   if (err)
-    return err;
+    {
+      grub_free (sua);
+      return err;
+    }
 
   for (entry = (struct grub_iso9660_susp_entry *) sua; (char *) entry < (char *) sua + sua_size - 1 && entry->len > 0;
        entry = (struct grub_iso9660_susp_entry *)
@@ -419,7 +459,7 @@ set_rockridge (struct grub_iso9660_data *data)
 
       /* Iterate over the entries in the SUA area to detect
 	 extensions.  */
-      if (grub_iso9660_susp_iterate (&rootnode,
+      if (grub_iso9660_susp_iterate (&rootnode, 0,
 				     sua_pos, sua_size, susp_iterate_set_rockridge,
 				     data))
 	{
@@ -517,6 +557,76 @@ get_node_size (grub_fshelp_node_t node)
   return ret;
 }
 
+static void
+grub_iso9660_unmount (struct grub_iso9660_data *data)
+{
+  unsigned i;
+
+  if (!data)
+    return;
+
+  for (i = 0; i < ARRAY_SIZE (data->dir_cache); i++)
+    grub_free (data->dir_cache[i].buf);
+  grub_free (data->path_table);
+  grub_free (data);
+}
+
+/* Read all extents of directory DIR into the per-mount cache, one disk
+   request per extent, and return the cached copy in *DIRBUF.  If the
+   directory is too big or memory is short *DIRBUF is set to NULL and
+   the caller falls back to reading record by record.  */
+static grub_err_t
+grub_iso9660_load_dir (grub_fshelp_node_t dir,
+		       struct grub_iso9660_dir_cache **dirbuf)
+{
+  struct grub_iso9660_data *data = dir->data;
+  struct grub_iso9660_dir_cache *slot = &data->dir_cache[0];
+  grub_uint32_t first_sector = grub_le_to_cpu32 (dir->dirents[0].first_sector);
+  grub_off_t size = get_node_size (dir);
+  char *buf;
+  unsigned i;
+
+  *dirbuf = 0;
+
+  for (i = 0; i < ARRAY_SIZE (data->dir_cache); i++)
+    {
+      struct grub_iso9660_dir_cache *c = &data->dir_cache[i];
+
+      if (c->buf && c->first_sector == first_sector && c->size == size)
+	{
+	  c->last_use = ++data->dir_cache_tick;
+	  *dirbuf = c;
+	  return GRUB_ERR_NONE;
+	}
+      if (c->last_use < slot->last_use)
+	slot = c;
+    }
+
+  if (size == 0 || size > GRUB_ISO9660_DIR_CACHE_MAX)
+    return GRUB_ERR_NONE;
+
+  buf = grub_malloc (size);
+  if (!buf)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return GRUB_ERR_NONE;
+    }
+
+  if (read_node (dir, 0, size, buf, 0))
+    {
+      grub_free (buf);
+      return grub_errno;
+    }
+
+  grub_free (slot->buf);
+  slot->first_sector = first_sector;
+  slot->size = size;
+  slot->buf = buf;
+  slot->last_use = ++data->dir_cache_tick;
+  *dirbuf = slot;
+  return GRUB_ERR_NONE;
+}
+
 struct iterate_dir_ctx
 {
   char *filename;
@@ -663,15 +773,19 @@ grub_iso9660_iterate_dir (grub_fshelp_node_t dir,
   grub_off_t offset = 0;
   grub_off_t len;
   struct iterate_dir_ctx ctx;
+  struct grub_iso9660_dir_cache *dirbuf;
 
   len = get_node_size (dir);
 
+  if (grub_iso9660_load_dir (dir, &dirbuf))
+    return 0;
+
   for (; offset < len; offset += dirent.len)
     {
       ctx.symlink = 0;
       ctx.was_continue = 0;
 
-      if (read_node (dir, offset, sizeof (dirent), (char *) &dirent, 0))
+      if (read_dir (dir, dirbuf, offset, sizeof (dirent), (char *) &dirent))
 	return 0;
 
       /* The end of the block, skip to the next one.  */
@@ -696,12 +810,12 @@ grub_iso9660_iterate_dir (grub_fshelp_node_t dir,
 	ctx.type = GRUB_FSHELP_UNKNOWN;
 
 	if (dir->data->rockridge
-	    && grub_iso9660_susp_iterate (dir, sua_off, sua_size,
+	    && grub_iso9660_susp_iterate (dir, dirbuf, sua_off, sua_size,
 					  susp_iterate_dir, &ctx))
 	  return 0;
 
 	/* Read the name.  */
-	if (read_node (dir, nameoffset, dirent.namelen, (char *) name, 0))
+	if (read_dir (dir, dirbuf, nameoffset, dirent.namelen, (char *) name))
 	  return 0;
 
 	node = grub_malloc (sizeof (struct grub_fshelp_node));
@@ -768,7 +882,8 @@ grub_iso9660_iterate_dir (grub_fshelp_node_t dir,
 	while (dirent.flags & FLAG_MORE_EXTENTS)
 	  {
 	    offset += dirent.len;
-	    if (read_node (dir, offset, sizeof (dirent), (char *) &dirent, 0))
+	    if (read_dir (dir, dirbuf, offset, sizeof (dirent),
+			  (char *) &dirent))
 	      {
 		if (ctx.filename_alloc)
 		  grub_free (ctx.filename);
@@ -839,6 +954,156 @@ grub_iso9660_iterate_dir (grub_fshelp_node_t dir,
 }
 
 
+
+/* Check whether path table name NAME of NAMELEN bytes is COMP.  */
+static int
+path_table_name_eq (struct grub_iso9660_data *data, grub_uint8_t *name,
+		    grub_size_t namelen, const char *comp, grub_size_t complen)
+{
+  char *conv;
+  int ret;
+
+  /* Plain ISO9660 names are not case-preserving.  */
+  if (!data->joliet)
+    return (namelen == complen
+	    && grub_strncasecmp ((char *) name, comp, complen) == 0);
+
+  conv = grub_iso9660_convert_string (name, namelen >> 1);
+  if (!conv)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return 0;
+    }
+  ret = (grub_strlen (conv) == complen
+	 && grub_memcmp (conv, comp, complen) == 0);
+  grub_free (conv);
+  return ret;
+}
+
+/* Resolve the leading directories of PATH with the path table, without
+   reading any directory on the way.  If ALL is zero the last component
+   is left alone.  On success ROOTNODE is set to the deepest directory
+   found and *REST to the part of PATH below it; otherwise both are left
+   untouched and the caller walks the whole path.  Rock Ridge names and
+   symlinks are not in the path table, so it is not used with them.  */
+static void
+grub_iso9660_lookup_path_table (struct grub_iso9660_data *data,
+				const char *path, int all,
+				struct grub_fshelp_node *rootnode,
+				const char **rest)
+{
+  const char *p, *found_rest = 0;
+  grub_size_t off, cur_off = 0;
+  grub_uint32_t size, cur = 1, n, found_sector = 0;
+  struct grub_iso9660_dir dirent;
+
+  if (data->rockridge)
+    return;
+
+  /* `.' and `..' are left to fshelp.  */
+  for (p = path; *p; p++)
+    if (*p == '.' && (p == path || p[-1] == '/')
+	&& (p[1] == '/' || p[1] == 0
+	    || (p[1] == '.' && (p[2] == '/' || p[2] == 0))))
+      return;
+
+  if (!data->path_table)
+    {
+      size = grub_le_to_cpu32 (data->voldesc.path_table_size);
+      if (size < sizeof (struct grub_iso9660_path)
+	  || size > GRUB_ISO9660_PATH_TABLE_MAX)
+	return;
+      data->path_table = grub_malloc (size);
+      if (!data->path_table)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  return;
+	}
+      if (grub_disk_read (data->disk,
+			  ((grub_disk_addr_t) grub_le_to_cpu32 (data->voldesc.path_table))
+			  << GRUB_ISO9660_LOG2_BLKSZ, 0, size, data->path_table))
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  grub_free (data->path_table);
+	  data->path_table = 0;
+	  return;
+	}
+      data->path_table_size = size;
+    }
+
+  p = path;
+  while (1)
+    {
+      const char *comp, *next;
+      grub_size_t complen;
+      int found = 0;
+
+      while (*p == '/')
+	p++;
+      comp = p;
+      while (*p && *p != '/')
+	p++;
+      complen = p - comp;
+      if (!complen)
+	break;
+      for (next = p; *next == '/'; next++);
+      if (!all && !*next)
+	break;
+
+      /* Entries are sorted by parent number, so the children of the
+	 current directory all come after it.  */
+      for (off = cur_off, n = cur;
+	   off + sizeof (struct grub_iso9660_path) <= data->path_table_size;
+	   n++)
+	{
+	  struct grub_iso9660_path *entry
+	    = (struct grub_iso9660_path *) (data->path_table + off);
+	  grub_size_t entlen = sizeof (*entry) + entry->len + (entry->len & 1);
+	  grub_uint16_t parent = grub_le_to_cpu16 (entry->parentdir);
+
+	  /* Parent numbers are 16-bit, bigger tables are ambiguous.  */
+	  if (n > 0xffff || off + entlen > data->path_table_size)
+	    return;
+	  if (n != cur && parent > cur)
+	    break;
+	  if (n != cur && parent == cur
+	      && path_table_name_eq (data, entry->name, entry->len,
+				     comp, complen))
+	    {
+	      cur = n;
+	      cur_off = off;
+	      found_sector = grub_le_to_cpu32 (entry->first_sector);
+	      found = 1;
+	      break;
+	    }
+	  off += entlen;
+	}
+      if (!found)
+	break;
+      found_rest = p;
+    }
+
+  if (!found_rest)
+    return;
+
+  /* The `.' record at the start of the directory gives its size.  */
+  if (grub_disk_read (data->disk,
+		      ((grub_disk_addr_t) found_sector) << GRUB_ISO9660_LOG2_BLKSZ,
+		      0, sizeof (dirent), &dirent))
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return;
+    }
+  if (dirent.len < sizeof (dirent)
+      || grub_le_to_cpu32 (dirent.first_sector) != found_sector
+      || (dirent.flags & FLAG_TYPE) != FLAG_TYPE_DIR
+      || (dirent.flags & FLAG_MORE_EXTENTS))
+    return;
+
+  rootnode->dirents[0] = dirent;
+  *rest = *found_rest ? found_rest : "/";
+}
+
 
 /* Context for grub_iso9660_dir.  */
 struct grub_iso9660_dir_ctx
@@ -885,6 +1150,8 @@ grub_iso9660_dir (grub_device_t device, const char *path,
   rootnode.have_symlink = 0;
   rootnode.dirents[0] = data->voldesc.rootdir;
 
+  grub_iso9660_lookup_path_table (data, path, 1, &rootnode, &path);
+
   /* Use the fshelp function to traverse the path.  */
   if (grub_fshelp_find_file (path, &rootnode,
 			     &foundnode,
@@ -900,7 +1167,7 @@ grub_iso9660_dir (grub_device_t device, const char *path,
     grub_free (foundnode);
 
  fail:
-  grub_free (data);
+  grub_iso9660_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -928,6 +1195,8 @@ grub_iso9660_open (struct grub_file *file, const char *name)
   rootnode.have_symlink = 0;
   rootnode.dirents[0] = data->voldesc.rootdir;
 
+  grub_iso9660_lookup_path_table (data, name, 0, &rootnode, &name);
+
   /* Use the fshelp function to traverse the path.  */
   if (grub_fshelp_find_file (name, &rootnode,
 			     &foundnode,
@@ -946,7 +1215,7 @@ grub_iso9660_open (struct grub_file *file, const char *name)
  fail:
   grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_iso9660_unmount (data);
 
   return grub_errno;
 }
@@ -978,7 +1247,7 @@ grub_iso9660_close (grub_file_t file)
   struct grub_iso9660_data *data =
     (struct grub_iso9660_data *) file->data;
   grub_free (data->node);
-  grub_free (data);
+  grub_iso9660_unmount (data);
 
   grub_dl_unref (my_mod);
 
@@ -1007,7 +1276,7 @@ grub_iso9660_label (grub_device_t device, char **label)
 	    *ptr-- = 0;
 	}
 
-      grub_free (data);
+      grub_iso9660_unmount (data);
     }
   else
     *label = 0;
@@ -1065,7 +1334,7 @@ grub_iso9660_uuid (grub_device_t device, char **uuid)
 
 	grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_iso9660_unmount (data);
 
   return grub_errno;
 }
@@ -1090,7 +1359,7 @@ grub_iso9660_mtime (grub_device_t device, grub_int32_t *timebuf)
 
   grub_dl_unref (my_mod);
 
-  grub_free (data);
+  grub_iso9660_unmount (data);
 
   return err;
 }
@@ -1841,6 +1841,194 @@ decode_embedded_bp_compressed(const blkptr_t *bp, void *buf)
   return GRUB_ERR_NONE;
 }
 
+/*
+ * Cache of decompressed, checksum-verified blocks.  Every open mounts the
+ * pool again, so the cache is global and keyed by pool GUID together with
+ * the block's DVA, birth txg and checksum.  Metadata (indirect blocks,
+ * dnodes, ZAPs, MOS objects) and file data have separate budgets so that
+ * streaming a large file does not push out the metadata needed to find it.
+ */
+#define ZFS_BLOCK_CACHE_HASH_SIZE	1024
+#define ZFS_BLOCK_CACHE_META_BUDGET	(4 << 20)
+#define ZFS_BLOCK_CACHE_DATA_BUDGET	(8 << 20)
+
+enum zfs_block_class
+  {
+    ZFS_BLOCK_META,
+    ZFS_BLOCK_DATA,
+    ZFS_BLOCK_NCLASSES
+  };
+
+struct zfs_block_key
+{
+  grub_uint64_t guid;
+  grub_uint64_t dva[2];
+  grub_uint64_t birth;
+  grub_uint64_t cksum;
+};
+
+struct zfs_cached_block
+{
+  struct zfs_cached_block *hash_next;
+  struct zfs_cached_block *lru_prev, *lru_next;
+  struct zfs_block_key key;
+  enum zfs_block_class class;
+  grub_size_t size;
+  char data[0];
+};
+
+static struct zfs_cached_block *block_hash[ZFS_BLOCK_CACHE_HASH_SIZE];
+
+/* Most recently used first.  */
+static struct zfs_block_lru
+{
+  struct zfs_cached_block *head, *tail;
+  grub_size_t used;
+  grub_size_t budget;
+} block_lru[ZFS_BLOCK_NCLASSES] =
+  {
+    { NULL, NULL, 0, ZFS_BLOCK_CACHE_META_BUDGET },
+    { NULL, NULL, 0, ZFS_BLOCK_CACHE_DATA_BUDGET }
+  };
+
+static unsigned
+block_hash_index (const struct zfs_block_key *key)
+{
+  grub_uint64_t h = key->guid ^ key->dva[0] ^ (key->dva[1] * 0x9e3779b97f4a7c15ULL)
+    ^ key->birth ^ key->cksum;
+  return (h ^ (h >> 29) ^ (h >> 47)) & (ZFS_BLOCK_CACHE_HASH_SIZE - 1);
+}
+
+static void
+block_lru_unlink (struct zfs_cached_block *b)
+{
+  struct zfs_block_lru *lru = &block_lru[b->class];
+
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    lru->head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    lru->tail = b->lru_prev;
+}
+
+static void
+block_lru_push (struct zfs_cached_block *b)
+{
+  struct zfs_block_lru *lru = &block_lru[b->class];
+
+  b->lru_prev = NULL;
+  b->lru_next = lru->head;
+  if (lru->head)
+    lru->head->lru_prev = b;
+  else
+    lru->tail = b;
+  lru->head = b;
+}
+
+static void
+block_cache_remove (struct zfs_cached_block *b)
+{
+  struct zfs_cached_block **p;
+
+  for (p = &block_hash[block_hash_index (&b->key)]; *p; p = &(*p)->hash_next)
+    if (*p == b)
+      {
+	*p = b->hash_next;
+	break;
+      }
+  block_lru_unlink (b);
+  block_lru[b->class].used -= b->size;
+  grub_free (b);
+}
+
+static void
+block_cache_flush (void)
+{
+  int i;
+
+  for (i = 0; i < ZFS_BLOCK_NCLASSES; i++)
+    while (block_lru[i].tail)
+      block_cache_remove (block_lru[i].tail);
+}
+
+/* Return 1 and fill KEY if the block behind BP may be cached.  */
+static int
+block_cache_key (const blkptr_t *bp, grub_zfs_endian_t endian,
+		 const struct grub_zfs_data *data, struct zfs_block_key *key,
+		 enum zfs_block_class *class)
+{
+  grub_uint64_t prop = grub_zfs_to_cpu64 (bp->blk_prop, endian);
+
+  /* Embedded blocks cost no I/O and decrypted blocks must stay behind the
+     keys of the dataset they were read through.  */
+  if (BP_IS_EMBEDDED (bp) || BP_IS_HOLE (bp) || ((prop >> 60) & 3))
+    return 0;
+
+  key->guid = data->guid;
+  key->dva[0] = bp->blk_dva[0].dva_word[0];
+  key->dva[1] = bp->blk_dva[0].dva_word[1];
+  key->birth = bp->blk_birth;
+  key->cksum = bp->blk_cksum.zc_word[0];
+
+  if (((prop >> 56) & 0x1f) == 0
+      && ((prop >> 48) & 0xff) == DMU_OT_PLAIN_FILE_CONTENTS)
+    *class = ZFS_BLOCK_DATA;
+  else
+    *class = ZFS_BLOCK_META;
+  return 1;
+}
+
+static struct zfs_cached_block *
+block_cache_lookup (const struct zfs_block_key *key)
+{
+  struct zfs_cached_block *b;
+
+  for (b = block_hash[block_hash_index (key)]; b; b = b->hash_next)
+    if (grub_memcmp (&b->key, key, sizeof (*key)) == 0)
+      {
+	block_lru_unlink (b);
+	block_lru_push (b);
+	return b;
+      }
+  return NULL;
+}
+
+static void
+block_cache_insert (const struct zfs_block_key *key,
+		    enum zfs_block_class class,
+		    const void *buf, grub_size_t size)
+{
+  struct zfs_block_lru *lru = &block_lru[class];
+  struct zfs_cached_block *b;
+  unsigned h;
+
+  if (size > lru->budget / 4)
+    return;
+
+  while (lru->used + size > lru->budget && lru->tail)
+    block_cache_remove (lru->tail);
+
+  b = grub_malloc (sizeof (*b) + size);
+  if (!b)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return;
+    }
+  b->key = *key;
+  b->class = class;
+  b->size = size;
+  grub_memcpy (b->data, buf, size);
+
+  h = block_hash_index (key);
+  b->hash_next = block_hash[h];
+  block_hash[h] = b;
+  block_lru_push (b);
+  lru->used += size;
+}
+
 /*
  * Read in a block of data, verify its checksum, decompress if needed,
  * and put the uncompressed data in buf.
@@ -1855,6 +2043,9 @@ zio_read (blkptr_t *bp, grub_zfs_endian_t endian, void **buf,
   grub_err_t err;
   zio_cksum_t zc = bp->blk_cksum;
   grub_uint32_t checksum;
+  struct zfs_block_key key;
+  enum zfs_block_class class;
+  int cacheable;
 
   *buf = NULL;
 
@@ -1883,6 +2074,21 @@ zio_read (blkptr_t *bp, grub_zfs_endian_t endian, void **buf,
   if (size)
     *size = lsize;
 
+  cacheable = block_cache_key (bp, endian, data, &key, &class);
+  if (cacheable)
+    {
+      struct zfs_cached_block *cached = block_cache_lookup (&key);
+
+      if (cached && cached->size == lsize)
+	{
+	  *buf = grub_malloc (lsize);
+	  if (!*buf)
+	    return grub_errno;
+	  grub_memcpy (*buf, cached->data, lsize);
+	  return GRUB_ERR_NONE;
+	}
+    }
+
   if (comp >= ZIO_COMPRESS_FUNCTIONS)
     return grub_error (GRUB_ERR_NOT_IMPLEMENTED_YET,
 		       "compression algorithm %u not supported\n", (unsigned int) comp);
@@ -1995,6 +2201,9 @@ zio_read (blkptr_t *bp, grub_zfs_endian_t endian, void **buf,
 	}
     }
 
+  if (cacheable)
+    block_cache_insert (&key, class, *buf, lsize);
+
   return GRUB_ERR_NONE;
 }
 
@@ -4378,4 +4587,5 @@ GRUB_MOD_INIT (zfs)
 GRUB_MOD_FINI (zfs)
 {
   grub_fs_unregister (&grub_zfs_fs);
+  block_cache_flush ();
 }
@@ -26,6 +26,7 @@
 #include <grub/video.h>
 #include <grub/bitmap.h>
 #include <grub/bitmap_scale.h>
+#include <grub/bitmap_cache.h>
 #include <grub/gfxmenu_view.h>
 #include <grub/menu.h>
 
@@ -41,7 +42,6 @@
 #define ATTACH_MENU_LEFT 0
 #define ATTACH_MENU_RIGHT 1
 
-typedef struct engine_picture_class *picture_class_t;
 typedef struct engine_animation_class *animation_class_t;
 
 enum play_mode
@@ -76,13 +76,6 @@ enum attach_to_menu
   FULL_SCREEN_VARIETY
 };
 
-struct engine_picture_class
-{
-  int n_index;
-  struct grub_video_bitmap *bitmap;
-  struct engine_picture_class *next;
-};
-
 struct engine_animation_class
 {
   struct grub_engine_animation animation;
@@ -92,6 +85,10 @@ struct engine_animation_class
   char *dir_name;
   char *pic_ext;
   char *os_name;
+  /* Image holding all frames in a grid, or 0 to load one file per frame.
+     It is looked up in dir_name, or in the theme directory without one.  */
+  char *sprite_sheet;
+  int sheet_columns;
   int ani_w;
   int ani_h;
   unsigned start_x;
@@ -110,10 +107,23 @@ struct engine_animation_class
   enum collision_detection is_hit;
   enum move_to move_t;
   enum attach_to_menu bind_menu;
-  struct engine_picture_class pic_cache;
+  /* Frames 1 to frame_count (), loaded on first use.  */
+  struct grub_video_bitmap **frames;
+  /* Where the frame was at the previous refresh, and the area the last
+     refresh changed.  */
+  grub_video_rect_t shown;
+  int shown_index;
+  grub_video_rect_t dirty;
   grub_gfxmenu_view_t view;
 };
 
+/* Number of frames; a logo that does not play has one.  */
+static int
+frame_count (animation_class_t vself)
+{
+  return vself->pic_num > 0 ? vself->pic_num : 1;
+}
+
 static grub_err_t
 to_process_bitmap (struct grub_video_bitmap **prs,
 		   struct grub_video_bitmap *raw, animation_class_t vself)
@@ -237,6 +247,30 @@ to_process_bitmap (struct grub_video_bitmap **prs,
   return GRUB_ERR_NONE;
 }
 
+/* Scale and turn RAW for VSELF, and cache the result under PATH and
+   VARIANT.  RAW is left to the caller.  */
+static struct grub_video_bitmap *
+to_cached_frame (animation_class_t vself, const char *path,
+		 const char *variant, struct grub_video_bitmap *raw)
+{
+  struct grub_video_bitmap *processed_bitmap = 0;
+
+  if (to_process_bitmap (&processed_bitmap, raw, vself) != GRUB_ERR_NONE)
+    {
+      grub_video_bitmap_destroy (processed_bitmap);
+      processed_bitmap = 0;
+    }
+  grub_errno = GRUB_ERR_NONE;
+
+  if (processed_bitmap)
+    {
+      grub_video_bitmap_cache_put (path, variant, vself->ani_w, vself->ani_h,
+				   processed_bitmap);
+    }
+
+  return processed_bitmap;
+}
+
 static struct grub_video_bitmap *
 to_loading_picture (animation_class_t vself, const char *dir,
 		    const char *file_name)
@@ -262,28 +296,110 @@ to_loading_picture (animation_class_t vself, const char *dir,
   pstr = grub_stpcpy (pstr, ext);
   *pstr = '\0';
 
+  char variant[sizeof ("animation-") + 2 * 11];
+  struct grub_video_bitmap *processed_bitmap;
+
+  grub_snprintf (variant, sizeof (variant), "animation-%d-%d",
+		 (int) vself->move_t, vself->pic_ratio);
+  processed_bitmap = grub_video_bitmap_cache_get (path, variant,
+						  vself->ani_w, vself->ani_h);
+  if (processed_bitmap)
+    {
+      grub_free (path);
+      return processed_bitmap;
+    }
+
   struct grub_video_bitmap *original_bitmap;
   grub_video_bitmap_load (&original_bitmap, path);
-  grub_free (path);
   grub_errno = GRUB_ERR_NONE;
 
   if (!original_bitmap)
     {
+      grub_free (path);
       return 0;
     }
 
-  struct grub_video_bitmap *processed_bitmap;
+  processed_bitmap = to_cached_frame (vself, path, variant, original_bitmap);
+  grub_video_bitmap_destroy (original_bitmap);
+  grub_free (path);
 
-  to_process_bitmap (&processed_bitmap, original_bitmap, vself);
+  return processed_bitmap;
+}
 
-  grub_video_bitmap_destroy (original_bitmap);
+/* Load all frames of VSELF from the sprite sheet in DIR.  The frames are
+   laid out left to right and top to bottom, sheet_columns to a row.  The
+   sheet is only decoded if some frame is not in the bitmap cache, and only
+   the frames cut from it are cached.  */
+static void
+to_loading_sheet (animation_class_t vself, const char *dir)
+{
+  struct grub_video_bitmap *sheet = 0;
+  char variant[sizeof ("animation-") + 3 * 11];
+  char *path;
+  unsigned columns, rows, fw, fh, bpp, y;
+  int n, count = frame_count (vself);
 
-  if (!processed_bitmap)
+  path = grub_resolve_relative_path (dir, vself->sprite_sheet);
+  if (!path)
     {
-      return 0;
+      return;
     }
 
-  return processed_bitmap;
+  columns = vself->sheet_columns > 0 ? vself->sheet_columns : count;
+  rows = (count + columns - 1) / columns;
+
+  for (n = 0; n < count; n++)
+    {
+      struct grub_video_bitmap *raw;
+
+      if (vself->frames[n])
+	{
+	  continue;
+	}
+
+      grub_snprintf (variant, sizeof (variant), "animation-%d-%d-%d",
+		     (int) vself->move_t, vself->pic_ratio, n + 1);
+      vself->frames[n] = grub_video_bitmap_cache_get (path, variant,
+						      vself->ani_w,
+						      vself->ani_h);
+      if (vself->frames[n])
+	{
+	  continue;
+	}
+
+      if (!sheet && grub_video_bitmap_load (&sheet, path) != GRUB_ERR_NONE)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  break;
+	}
+
+      fw = sheet->mode_info.width / columns;
+      fh = sheet->mode_info.height / rows;
+      bpp = sheet->mode_info.bytes_per_pixel;
+      if (!fw || !fh
+	  || grub_video_bitmap_create (&raw, fw, fh,
+				       sheet->mode_info.blit_format)
+	  != GRUB_ERR_NONE)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  break;
+	}
+
+      for (y = 0; y < fh; y++)
+	{
+	  grub_memcpy ((grub_uint8_t *) raw->data + y * raw->mode_info.pitch,
+		       (grub_uint8_t *) sheet->data
+		       + ((n / columns) * fh + y) * sheet->mode_info.pitch
+		       + (n % columns) * fw * bpp,
+		       fw * bpp);
+	}
+
+      vself->frames[n] = to_cached_frame (vself, path, variant, raw);
+      grub_video_bitmap_destroy (raw);
+    }
+
+  grub_video_bitmap_destroy (sheet);
+  grub_free (path);
 }
 
 static char *
@@ -319,91 +435,112 @@ to_convert_string (int src)
   return tmp1;
 }
 
-static struct grub_video_bitmap *
-get_picture_from_cache (animation_class_t vself)
+/* Whether VSELF has frames to show.  */
+static int
+has_frames (animation_class_t vself)
 {
-  int pic_index = vself->cur_index;
-  picture_class_t pct;
-
-  for (pct = vself->pic_cache.next; pct; pct = pct->next)
-    {
-      if (pct->n_index == pic_index)
-	{
-	  return pct->bitmap;
-	}
-    }
+  return vself->dir_name || vself->sprite_sheet;
+}
 
+/* The directory the frames of VSELF are in.  */
+static char *
+get_frame_dir (animation_class_t vself)
+{
   char *theme_dir = grub_get_dirname (vself->view->theme_path);
   char *tmp1_dir;
   char *tmp2_dir;
   char *os_name = vself->os_name;
-  char *digital_name = to_convert_string (pic_index);
-  if (!digital_name)
+
+  if (vself->dir_name)
     {
+      tmp1_dir = grub_resolve_relative_path (theme_dir, vself->dir_name);
       grub_free (theme_dir);
-      return 0;
+    }
+  else
+    {
+      tmp1_dir = theme_dir;
     }
 
-  struct grub_video_bitmap *ani_bitmap = 0;
+  if (tmp1_dir && (vself->bind_menu != FOLLOW_SINGLE) && os_name)
+    {
+      tmp2_dir = grub_resolve_relative_path (tmp1_dir, os_name);
+      grub_free (tmp1_dir);
+      return tmp2_dir;
+    }
 
-  tmp1_dir = grub_resolve_relative_path (theme_dir, vself->dir_name);
-  grub_free (theme_dir);
+  return tmp1_dir;
+}
 
-  if (tmp1_dir)
+static struct grub_video_bitmap *
+get_picture_from_cache (animation_class_t vself)
+{
+  int pic_index = vself->cur_index;
+  char *frame_dir;
+
+  if (pic_index < 1 || pic_index > frame_count (vself))
     {
-      if ((vself->bind_menu != FOLLOW_SINGLE) && os_name)
-	{
-	  tmp2_dir = grub_resolve_relative_path (tmp1_dir, os_name);
-	  grub_free (tmp1_dir);
+      return 0;
+    }
 
-	  if (tmp2_dir)
-	    {
-	      ani_bitmap = to_loading_picture (vself, tmp2_dir, digital_name);
-	      grub_free (tmp2_dir);
-	    }
-	}
-      else
+  if (!vself->frames)
+    {
+      vself->frames = grub_zalloc (frame_count (vself)
+				   * sizeof (vself->frames[0]));
+      if (!vself->frames)
 	{
-	  ani_bitmap = to_loading_picture (vself, tmp1_dir, digital_name);
-	  grub_free (tmp1_dir);
+	  return 0;
 	}
     }
 
-  grub_free (digital_name);
+  if (vself->frames[pic_index - 1])
+    {
+      return vself->frames[pic_index - 1];
+    }
 
-  if (!ani_bitmap)
+  frame_dir = get_frame_dir (vself);
+  if (!frame_dir)
     {
       return 0;
     }
 
-  pct = grub_malloc (sizeof(*pct));
-  if (!pct)
+  if (vself->sprite_sheet)
     {
-      grub_video_bitmap_destroy (ani_bitmap);
-      return 0;
+      to_loading_sheet (vself, frame_dir);
+    }
+  else
+    {
+      char *digital_name = to_convert_string (pic_index);
+
+      if (digital_name)
+	{
+	  vself->frames[pic_index - 1] = to_loading_picture (vself, frame_dir,
+							     digital_name);
+	  grub_free (digital_name);
+	}
     }
 
-  pct->n_index = pic_index;
-  pct->bitmap = ani_bitmap;
-  pct->next = vself->pic_cache.next;
-  vself->pic_cache.next = pct;
-  return pct->bitmap;
+  grub_free (frame_dir);
+
+  return vself->frames[pic_index - 1];
 }
 
 static void
 animation_clear_cache (animation_class_t vself)
 {
-  picture_class_t cur;
-  picture_class_t next;
+  int n;
+
+  if (!vself->frames)
+    {
+      return;
+    }
 
-  for (cur = vself->pic_cache.next; cur; cur = next)
+  for (n = 0; n < frame_count (vself); n++)
     {
-      next = cur->next;
-      grub_video_bitmap_destroy (cur->bitmap);
-      grub_free (cur);
+      grub_video_bitmap_destroy (vself->frames[n]);
     }
 
-  vself->pic_cache.next = 0;
+  grub_free (vself->frames);
+  vself->frames = 0;
 }
 
 static void
@@ -414,6 +551,7 @@ animation_destroy (void *vself)
   grub_free (self->dir_name);
   grub_free (self->pic_ext);
   grub_free (self->os_name);
+  grub_free (self->sprite_sheet);
   animation_clear_cache (self);
   grub_free (self);
 }
@@ -857,59 +995,84 @@ generate_new_bounds (animation_class_t vself)
   return cur_bounds;
 }
 
-static void
-animation_paint (void *vself, const grub_video_rect_t *region)
+/* Work out the size and starting place of the frames on first use.
+   Returns 0 if the settings make no sense.  */
+static int
+animation_initial (animation_class_t self)
 {
-  animation_class_t self = vself;
-  enum attach_to_menu atm = self->bind_menu;
-  grub_video_rect_t old_save;
-  grub_video_rect_t new_bounds;
+  if (self->ani_w && self->ani_h)
+    {
+      return 1;
+    }
 
-  if (!self->dir_name || !self->cur_index || !self->view->is_animation)
+  if (self->pic_ratio <= 0 || self->move_speed < 0 || !self->bounds.width
+      || !self->bounds.height)
     {
-      return;
+      return 0;
     }
 
-  if (!self->ani_w || !self->ani_h)
+  if (self->bind_menu || self->p_mode)
     {
-      if (self->pic_ratio <= 0 || self->move_speed < 0 || !self->bounds.width
-	  || !self->bounds.height)
-	{
-	  return;
-	}
+      self->move_speed = 0;
+      self->move_t = TO_RIGHT;
+    }
 
-      if (atm || self->p_mode)
-	{
-	  self->move_speed = 0;
-	  self->move_t = TO_RIGHT;
-	}
+  if (!self->move_speed)
+    {
+      stay_initial_parameter (self);
+    }
+  else
+    {
+      move_initial_parameter (self);
+    }
 
-      if (!self->move_speed)
-	{
-	  stay_initial_parameter (self);
-	}
-      else
-	{
-	  move_initial_parameter (self);
-	}
+  return 1;
+}
+
+/* Move the frame, once per tick unless it follows the menu.  */
+static void
+animation_move (animation_class_t self)
+{
+  if (!has_frames (self) || !self->cur_index || !self->view->is_animation)
+    {
+      return;
     }
 
-  if (atm && self->follow_mark)
+  if (!animation_initial (self))
+    {
+      return;
+    }
+
+  if (self->bind_menu && self->follow_mark)
     {
       set_logo_position (self);
     }
-  else
+  else if (self->view->need_refresh)
     {
       animation_check_collision (self);
     }
+}
+
+static void
+animation_paint (void *vself, const grub_video_rect_t *region)
+{
+  animation_class_t self = vself;
+  grub_video_rect_t old_save;
+  grub_video_rect_t new_bounds;
 
-  if (!grub_video_have_common_points (region, &self->bounds))
+  if (!has_frames (self) || !self->cur_index || !self->view
+      || !self->view->is_animation || !self->ani_w || !self->ani_h)
     {
       return;
     }
 
   new_bounds = generate_new_bounds (self);
 
+  if (!grub_video_have_common_points (region, &new_bounds))
+    {
+      return;
+    }
+
   grub_gui_set_viewport (&new_bounds, &old_save);
 
   struct grub_video_bitmap *picture;
@@ -1020,8 +1183,20 @@ animation_set_property (void *vself, const char *name, const char *value)
     }
   else if (grub_strcmp (name, "frame_number") == 0)
     {
+      animation_clear_cache (self);
       self->pic_num = grub_strtol (value, 0, 10);
     }
+  else if (grub_strcmp (name, "sprite_sheet") == 0)
+    {
+      animation_clear_cache (self);
+      grub_free (self->sprite_sheet);
+      self->sprite_sheet = value ? grub_strdup (value) : 0;
+    }
+  else if (grub_strcmp (name, "sprite_columns") == 0)
+    {
+      animation_clear_cache (self);
+      self->sheet_columns = grub_strtol (value, 0, 10);
+    }
   else if (grub_strcmp (name, "move_speed") == 0)
     {
       self->move_speed = grub_strtol (value, 0, 10);
@@ -1118,6 +1293,14 @@ animation_set_property (void *vself, const char *name, const char *value)
   return grub_errno;
 }
 
+static void
+animation_get_dirty_rect (void *vself, grub_video_rect_t *rect)
+{
+  animation_class_t self = vself;
+
+  *rect = self->dirty;
+}
+
 static struct grub_gui_component_ops animation_comp_ops =
   {
       .destroy = animation_destroy,
@@ -1132,6 +1315,31 @@ static struct grub_gui_component_ops animation_comp_ops =
       .set_property = animation_set_property
   };
 
+static void
+add_dirty_rect (animation_class_t vself, const grub_video_rect_t *rect)
+{
+  grub_video_rect_t *d = &vself->dirty;
+  int x2, y2;
+
+  if (!rect->width || !rect->height)
+    {
+      return;
+    }
+
+  if (!d->width || !d->height)
+    {
+      *d = *rect;
+      return;
+    }
+
+  x2 = grub_max (d->x + d->width, rect->x + rect->width);
+  y2 = grub_max (d->y + d->height, rect->y + rect->height);
+  d->x = grub_min (d->x, rect->x);
+  d->y = grub_min (d->y, rect->y);
+  d->width = x2 - d->x;
+  d->height = y2 - d->y;
+}
+
 static void
 get_playback_state (animation_class_t vself)
 {
@@ -1159,6 +1367,9 @@ animation_refresh_info (void *vself, grub_gfxmenu_view_t view)
   animation_class_t self = vself;
   self->view = view;
   int cur_selected = view->selected;
+  grub_video_rect_t shown = { 0, 0, 0, 0 };
+
+  self->dirty = shown;
 
   if (self->bind_menu && (self->is_selected != cur_selected))
     {
@@ -1177,7 +1388,8 @@ animation_refresh_info (void *vself, grub_gfxmenu_view_t view)
     {
       self->cur_index++;
 
-      if (self->cur_index % EXPLOSION_PROOF == 0)
+      /* A sprite sheet is loaded whole, so its frames are kept.  */
+      if (self->cur_index % EXPLOSION_PROOF == 0 && !self->sprite_sheet)
 	{
 	  animation_clear_cache (self);
 	}
@@ -1186,12 +1398,33 @@ animation_refresh_info (void *vself, grub_gfxmenu_view_t view)
 	{
 	  get_playback_state (self);
 
-	  if (self->pic_num > EXPLOSION_PROOF)
+	  if (self->pic_num > EXPLOSION_PROOF && !self->sprite_sheet)
 	    {
 	      animation_clear_cache (self);
 	    }
 	}
     }
+
+  animation_move (self);
+
+  /* Repaint where the frame was and where it is now, if anything changed.  */
+  if (has_frames (self) && self->cur_index && view->is_animation
+      && self->ani_w && self->ani_h)
+    {
+      shown = generate_new_bounds (self);
+    }
+
+  if (shown.x != self->shown.x || shown.y != self->shown.y
+      || shown.width != self->shown.width
+      || shown.height != self->shown.height
+      || self->cur_index != self->shown_index)
+    {
+      add_dirty_rect (self, &self->shown);
+      add_dirty_rect (self, &shown);
+    }
+
+  self->shown = shown;
+  self->shown_index = self->cur_index;
 }
 
 grub_gui_component_t
@@ -1208,6 +1441,8 @@ grub_engine_animation_new (void)
   self->dir_name = 0;
   self->pic_ext = 0;
   self->os_name = 0;
+  self->sprite_sheet = 0;
+  self->sheet_columns = 0;
   self->ani_w = 0;
   self->ani_h = 0;
   self->start_x = 0;
@@ -1228,9 +1463,8 @@ grub_engine_animation_new (void)
   self->bind_menu = NOT_BIND;
   self->animation.component.ops = &animation_comp_ops;
   self->animation.refresh_animation = animation_refresh_info;
-  self->pic_cache.n_index = 0;
-  self->pic_cache.bitmap = 0;
-  self->pic_cache.next = 0;
+  self->animation.get_dirty_rect = animation_get_dirty_rect;
+  self->frames = 0;
 
   return (grub_gui_component_t) self;
 }
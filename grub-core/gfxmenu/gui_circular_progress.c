@@ -25,6 +25,7 @@
 #include <grub/gfxmenu_view.h>
 #include <grub/gfxwidgets.h>
 #include <grub/trig.h>
+#include <grub/bitmap_cache.h>
 
 struct grub_gui_circular_progress
 {
@@ -88,7 +89,7 @@ load_bitmap (const char *dir, const char *file)
 
   /* Load the image.  */
   grub_errno = GRUB_ERR_NONE;
-  grub_video_bitmap_load (&bitmap, abspath);
+  grub_video_bitmap_cache_load (&bitmap, abspath);
   grub_errno = GRUB_ERR_NONE;
 
   grub_free (abspath);
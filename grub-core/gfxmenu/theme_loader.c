@@ -27,6 +27,7 @@
 #include <grub/gui_string_util.h>
 #include <grub/bitmap.h>
 #include <grub/bitmap_scale.h>
+#include <grub/bitmap_cache.h>
 #include <grub/gfxwidgets.h>
 #include <grub/gfxmenu_view.h>
 #include <grub/gui.h>
@@ -169,12 +170,13 @@ theme_set_string (grub_gfxmenu_view_t view,
       path = grub_resolve_relative_path (theme_dir, value);
       if (! path)
         return grub_errno;
-      if (grub_video_bitmap_load (&raw_bitmap, path) != GRUB_ERR_NONE)
+      if (grub_video_bitmap_cache_load (&raw_bitmap, path) != GRUB_ERR_NONE)
         {
           grub_free (path);
           return grub_errno;
         }
-      grub_free(path);
+      grub_free (view->desktop_image_path);
+      view->desktop_image_path = path;
       grub_video_bitmap_destroy (view->raw_desktop_image);
       view->raw_desktop_image = raw_bitmap;
     }
@@ -28,6 +28,7 @@
 #include <grub/gfxterm.h>
 #include <grub/bitmap.h>
 #include <grub/bitmap_scale.h>
+#include <grub/bitmap_cache.h>
 #include <grub/term.h>
 #include <grub/gfxwidgets.h>
 #include <grub/time.h>
@@ -96,6 +97,7 @@ grub_gfxmenu_view_new (const char *theme_path,
   view->message_bg_color = default_fg_color;
   view->raw_desktop_image = 0;
   view->scaled_desktop_image = 0;
+  view->desktop_image_path = 0;
   view->desktop_image_scale_method = GRUB_VIDEO_BITMAP_SELECTION_METHOD_STRETCH;
   view->desktop_image_h_align = GRUB_VIDEO_BITMAP_H_ALIGN_CENTER;
   view->desktop_image_v_align = GRUB_VIDEO_BITMAP_V_ALIGN_CENTER;
@@ -147,6 +149,7 @@ grub_gfxmenu_view_destroy (grub_gfxmenu_view_t view)
     }
   grub_video_bitmap_destroy (view->raw_desktop_image);
   grub_video_bitmap_destroy (view->scaled_desktop_image);
+  grub_free (view->desktop_image_path);
   if (view->terminal_box)
     view->terminal_box->destroy (view->terminal_box);
   grub_free (view->terminal_font_name);
@@ -417,35 +420,61 @@ redraw_menu_visit (grub_gui_component_t component,
       grub_video_set_area_status (GRUB_VIDEO_AREA_ENABLED);
       grub_gfxmenu_view_redraw (view, &bounds);
     }
-    
+}
+
+struct redraw_animation_ctx
+{
+  grub_gfxmenu_view_t view;
+  int painted;
+};
+
+/* Repaint only the area the last refresh of an animation changed.  */
+static void
+redraw_animation_visit (grub_gui_component_t component,
+			void *userdata)
+{
+  struct redraw_animation_ctx *ctx = userdata;
+
   if (component->ops->is_instance (component, "animation"))
     {
-      grub_video_rect_t bounds;
+      engine_animation_t animation = (engine_animation_t) component;
+      grub_video_rect_t dirty;
 
-      component->ops->get_bounds (component, &bounds);
+      animation->get_dirty_rect (animation, &dirty);
+      if (!dirty.width || !dirty.height)
+	return;
       grub_video_set_area_status (GRUB_VIDEO_AREA_ENABLED);
-      grub_gfxmenu_view_redraw (view, &bounds);
+      grub_gfxmenu_view_redraw (ctx->view, &dirty);
+      ctx->painted = 1;
     }
 }
 
+static int
+redraw_animation_components (grub_gfxmenu_view_t view)
+{
+  struct redraw_animation_ctx ctx = { view, 0 };
+
+  grub_gui_iterate_recursively ((grub_gui_component_t) view->canvas,
+				redraw_animation_visit, &ctx);
+  return ctx.painted;
+}
+
 void
 grub_gfxmenu_redraw_menu (grub_gfxmenu_view_t view)
 {
   update_menu_components (view);
-  
-  /* Avoid interference.  */
-  if (view->need_refresh)
-    {
-      refresh_animation_components (view);
-    }
 
   grub_gui_iterate_recursively ((grub_gui_component_t) view->canvas,
                                 redraw_menu_visit, view);
+  /* Animations following the selected entry move after the list.  */
+  refresh_animation_components (view);
+  redraw_animation_components (view);
   grub_video_swap_buffers ();
   if (view->double_repaint)
     {
       grub_gui_iterate_recursively ((grub_gui_component_t) view->canvas,
 				    redraw_menu_visit, view);
+      redraw_animation_components (view);
     }
 }
 
@@ -454,10 +483,17 @@ grub_gfxmenu_set_animation_state (int need_refresh, void *data)
 {
   grub_gfxmenu_view_t view = data;
 
-  /* Frame rate set by the user.  */
+  /* Frame rate set by the user.  Only the frames are repainted, the rest
+     of the menu has not changed.  */
   view->need_refresh = need_refresh;
-  grub_gfxmenu_redraw_menu (view);
+  refresh_animation_components (view);
   view->need_refresh = 0;
+
+  if (!redraw_animation_components (view))
+    return;
+  grub_video_swap_buffers ();
+  if (view->double_repaint)
+    redraw_animation_components (view);
 }
 
 void 
@@ -466,12 +502,7 @@ grub_gfxmenu_set_chosen_entry (int entry, void *data)
   grub_gfxmenu_view_t view = data;
 
   view->selected = entry;
-  
-  /* Avoid interference.  */
-  if (!view->is_animation)
-    {
-      grub_gfxmenu_redraw_menu (view);
-    }
+  grub_gfxmenu_redraw_menu (view);
 }
 
 static int
@@ -667,6 +698,25 @@ init_background (grub_gfxmenu_view_t view)
     return;
 
   struct grub_video_bitmap *scaled_bitmap;
+  char variant[sizeof ("desktop-") + 3 * 11];
+
+  grub_snprintf (variant, sizeof (variant), "desktop-%d-%d-%d",
+                 (int) view->desktop_image_scale_method,
+                 (int) view->desktop_image_v_align,
+                 (int) view->desktop_image_h_align);
+  if (view->desktop_image_path)
+    {
+      scaled_bitmap = grub_video_bitmap_cache_get (view->desktop_image_path,
+                                                   variant,
+                                                   view->screen.width,
+                                                   view->screen.height);
+      if (scaled_bitmap)
+        {
+          view->scaled_desktop_image = scaled_bitmap;
+          return;
+        }
+    }
+
   if (view->desktop_image_scale_method ==
       GRUB_VIDEO_BITMAP_SELECTION_METHOD_STRETCH)
     grub_video_bitmap_create_scaled (&scaled_bitmap,
@@ -686,6 +736,10 @@ init_background (grub_gfxmenu_view_t view)
   if (! scaled_bitmap)
     return;
   view->scaled_desktop_image = scaled_bitmap;
+  if (view->desktop_image_path)
+    grub_video_bitmap_cache_put (view->desktop_image_path, variant,
+                                 view->screen.width, view->screen.height,
+                                 scaled_bitmap);
 
 }
 
@@ -151,6 +151,57 @@ get_card_packet (struct grub_net_card *dev)
   return nb;
 }
 
+/* Receive packets straight into netbuffs, saving the copy out of
+   DEV->rcvbuf, until the card runs dry.  */
+static int
+get_card_packets (struct grub_net_card *dev, struct grub_net_buff **nbs,
+		  int max)
+{
+  grub_efi_simple_network_t *net = dev->efi_net;
+  grub_efi_status_t st;
+  int n = 0;
+
+  while (n < max)
+    {
+      grub_efi_uintn_t bufsize;
+      struct grub_net_buff *nb;
+
+      nb = grub_netbuff_alloc (dev->rcvbufsize + 2);
+      if (!nb)
+	break;
+
+      /* Reserve 2 bytes so that 2 + 14/18 bytes of ethernet header is
+	 divisible by 4. So that IP header is aligned on 4 bytes. */
+      if (grub_netbuff_reserve (nb, 2))
+	{
+	  grub_netbuff_free (nb);
+	  break;
+	}
+      bufsize = nb->end - nb->data;
+      st = efi_call_7 (net->receive, net, NULL, &bufsize,
+		       nb->data, NULL, NULL, NULL);
+      if (st == GRUB_EFI_BUFFER_TOO_SMALL)
+	{
+	  /* Let the single packet path grow the buffer.  */
+	  grub_netbuff_free (nb);
+	  nb = get_card_packet (dev);
+	  if (!nb)
+	    break;
+	  nbs[n++] = nb;
+	  continue;
+	}
+      if (st != GRUB_EFI_SUCCESS || grub_netbuff_put (nb, bufsize))
+	{
+	  grub_netbuff_free (nb);
+	  break;
+	}
+      nbs[n++] = nb;
+    }
+
+  grub_errno = GRUB_ERR_NONE;
+  return n;
+}
+
 static grub_err_t
 open_card (struct grub_net_card *dev)
 {
@@ -226,7 +277,8 @@ static struct grub_net_card_driver efidriver =
     .open = open_card,
     .close = close_card,
     .send = send_card_buffer,
-    .recv = get_card_packet
+    .recv = get_card_packet,
+    .recv_batch = get_card_packets
   };
 
 grub_efi_handle_t
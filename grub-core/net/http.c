@@ -25,6 +25,7 @@
 #include <grub/mm.h>
 #include <grub/dl.h>
 #include <grub/file.h>
+#include <grub/env.h>
 #include <grub/i18n.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
@@ -32,26 +33,102 @@ GRUB_MOD_LICENSE ("GPLv3+");
 enum
   {
     HTTP_PORT = 80,
-    HTTP_MAX_CHUNK_SIZE = 0x80000000
+    HTTP_MAX_CHUNK_SIZE = 0x80000000,
+    /* Ranges requested after a seek start small, so that random access
+       doesn't fetch much it won't use, and double while reading goes
+       on sequentially.  */
+    HTTP_MIN_RANGE = 64 * 1024,
+    HTTP_MAX_RANGE = 1024 * 1024,
+    /* Requests queued on a connection, including the one being
+       answered.  */
+    HTTP_PIPELINE_DEPTH = 2,
+    /* Upper bound for net_http_streams.  */
+    HTTP_MAX_STREAMS = 4,
+    /* Idle connections kept around for the next file.  */
+    HTTP_MAX_IDLE = 4,
+    /* Unwanted response data worth reading to keep a connection.  */
+    HTTP_DRAIN_MAX = 512 * 1024
   };
 
+struct http_conn;
 
-typedef struct http_data
+/* A request sent on a connection.  It stays queued on the connection
+   until its response is complete and on the file until its data has
+   been handed over.  */
+struct http_req
+{
+  struct http_req *conn_next;
+  struct http_req *file_next;
+  struct http_conn *conn;
+  /* NULL once nobody wants the data.  */
+  grub_file_t file;
+  grub_off_t offset;
+  /* 0 if open-ended.  */
+  grub_uint64_t length;
+  /* Data received before the request got to the head of the file.  */
+  grub_net_packets_t packs;
+  int on_conn;
+  int done;
+  int failed;
+};
+
+/* A connection to a server.  Connections outlive files and are reused
+   for the next request to the same server.  */
+struct http_conn
 {
+  struct http_conn *next;
+  grub_net_tcp_socket_t sock;
+  char *server;
+  int port;
+  int dead;
+  int served;
+  /* Responses still expected, oldest first.  */
+  struct http_req *reqs;
+  struct http_req *reqs_last;
+  int nreqs;
+
+  /* State of the response being received.  */
   char *current_line;
   grub_size_t current_line_len;
   int headers_recv;
   int first_line_recv;
-  int size_recv;
-  grub_net_tcp_socket_t sock;
-  char *filename;
-  grub_err_t err;
-  char *errmsg;
+  int code;
+  int keep_alive;
+  int have_length;
+  grub_uint64_t body_rem;
   int chunked;
   grub_size_t chunk_rem;
   int in_chunk_len;
+};
+
+typedef struct http_data
+{
+  char *filename;
+  grub_err_t err;
+  char *errmsg;
+  /* Set once the first response after open or seek has its headers,
+     or has failed.  */
+  int answered;
+  int headers_recv;
+  int failed;
+  /* Outstanding requests in file order.  The first one feeds the
+     packet list of the file.  */
+  struct http_req *reqs;
+  struct http_req *reqs_last;
+  struct http_conn *conns[HTTP_MAX_STREAMS];
+  int nstreams;
+  /* Whether the file is fetched in bounded ranges.  */
+  int ranged;
+  grub_off_t next_off;
+  grub_uint64_t range_size;
 } *http_data_t;
 
+static struct http_conn *idle_conns;
+
+static grub_err_t
+http_receive (grub_net_tcp_socket_t sock, struct grub_net_buff *nb,
+	      void *c);
+
 static grub_off_t
 have_ahead (struct grub_file *file)
 {
@@ -63,132 +140,497 @@ have_ahead (struct grub_file *file)
   return ret;
 }
 
+static int
+http_streams (void)
+{
+  const char *val;
+  unsigned long n;
+
+  val = grub_env_get ("net_http_streams");
+  if (!val)
+    return 1;
+  n = grub_strtoul (val, 0, 0);
+  if (grub_errno)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return 1;
+    }
+  if (n < 1)
+    return 1;
+  if (n > HTTP_MAX_STREAMS)
+    return HTTP_MAX_STREAMS;
+  return n;
+}
+
+static void
+free_packets (grub_net_packets_t *packs)
+{
+  while (packs->first)
+    {
+      grub_netbuff_free (packs->first->nb);
+      grub_net_remove_packet (packs->first);
+    }
+}
+
+/* Free REQ once neither its connection nor its file refer to it.  */
+static void
+http_req_put (struct http_req *req)
+{
+  if (req->on_conn || req->file)
+    return;
+  free_packets (&req->packs);
+  grub_free (req);
+}
+
+/* Let the file know that its head request is complete or failed, and
+   move on to the next one.  */
+static void
+http_advance (grub_file_t file)
+{
+  http_data_t data = file->data;
+  grub_net_t net = file->device->net;
+  struct http_req *req;
+
+  while ((req = data->reqs) && req->done)
+    {
+      /* Data past a failed response would land at the wrong offset.  */
+      if (req->failed)
+	{
+	  data->failed = 1;
+	  data->answered = 1;
+	  break;
+	}
+      data->reqs = req->file_next;
+      if (!data->reqs)
+	data->reqs_last = NULL;
+      req->file = NULL;
+      http_req_put (req);
+
+      req = data->reqs;
+      if (!req)
+	break;
+      while (req->packs.first)
+	{
+	  grub_net_put_packet (&net->packs, req->packs.first->nb);
+	  grub_net_remove_packet (req->packs.first);
+	}
+    }
+
+  if (data->failed
+      || (!data->reqs && (!data->ranged || data->next_off >= file->size)))
+    {
+      net->eof = 1;
+      net->stall = 1;
+      if (file->size == GRUB_FILE_SIZE_UNKNOWN)
+	file->size = have_ahead (file);
+    }
+}
+
+/* The response to the oldest request on CONN is complete.  */
+static void
+http_finish_response (struct http_conn *conn, int failed)
+{
+  struct http_req *req = conn->reqs;
+
+  conn->reqs = req->conn_next;
+  if (!conn->reqs)
+    conn->reqs_last = NULL;
+  conn->nreqs--;
+  conn->served++;
+
+  conn->headers_recv = 0;
+  conn->first_line_recv = 0;
+  conn->have_length = 0;
+  conn->body_rem = 0;
+  conn->chunked = 0;
+  conn->chunk_rem = 0;
+  conn->in_chunk_len = 0;
+  grub_free (conn->current_line);
+  conn->current_line = 0;
+  conn->current_line_len = 0;
+
+  req->on_conn = 0;
+  req->done = 1;
+  req->failed = failed;
+  if (req->file)
+    http_advance (req->file);
+  else
+    http_req_put (req);
+
+  if (!conn->keep_alive && !conn->dead)
+    {
+      grub_net_tcp_close (conn->sock, GRUB_NET_TCP_ABORT);
+      conn->dead = 1;
+    }
+}
+
+/* CONN can't be used any more.  Fail whatever it still owed.  */
+static void
+http_conn_abort (struct http_conn *conn)
+{
+  if (!conn->dead)
+    grub_net_tcp_close (conn->sock, GRUB_NET_TCP_ABORT);
+  conn->dead = 1;
+  while (conn->reqs)
+    http_finish_response (conn, 1);
+}
+
+static void
+http_conn_free (struct http_conn *conn)
+{
+  http_conn_abort (conn);
+  grub_free (conn->server);
+  grub_free (conn);
+}
+
+static void
+http_conn_err (grub_net_tcp_socket_t sock __attribute__ ((unused)),
+	       void *c)
+{
+  http_conn_abort (c);
+}
+
+static void
+http_conn_fin (grub_net_tcp_socket_t sock __attribute__ ((unused)),
+	       void *c)
+{
+  struct http_conn *conn = c;
+
+  /* Without a length the body ends with the connection.  */
+  if (conn->reqs && conn->headers_recv && !conn->have_length
+      && !conn->chunked)
+    http_finish_response (conn, 0);
+  http_conn_abort (conn);
+}
+
+/* Bytes still to be received on CONN, or ~0 if unknown.  */
+static grub_uint64_t
+http_conn_pending (struct http_conn *conn)
+{
+  struct http_req *req;
+  grub_uint64_t ret = 0;
+
+  for (req = conn->reqs; req; req = req->conn_next)
+    {
+      if (req == conn->reqs && conn->headers_recv)
+	{
+	  if (!conn->have_length || conn->chunked)
+	    return ~(grub_uint64_t) 0;
+	  ret += conn->body_rem;
+	}
+      else if (req->length)
+	ret += req->length;
+      else
+	return ~(grub_uint64_t) 0;
+    }
+  return ret;
+}
+
+/* Put CONN in the idle list, or close it if it isn't worth keeping.  */
+static void
+http_conn_release (struct http_conn *conn)
+{
+  struct http_conn *c;
+  int n = 0;
+
+  for (c = idle_conns; c; c = c->next)
+    n++;
+
+  if (conn->dead || n >= HTTP_MAX_IDLE
+      || http_conn_pending (conn) > HTTP_DRAIN_MAX)
+    {
+      http_conn_free (conn);
+      return;
+    }
+  conn->next = idle_conns;
+  idle_conns = conn;
+}
+
+static struct http_conn *
+http_conn_get (grub_file_t file)
+{
+  struct http_conn *conn, **prev;
+  const char *server = file->device->net->server;
+  int port = file->device->net->port;
+
+  for (prev = &idle_conns; (conn = *prev);)
+    {
+      if (conn->dead)
+	{
+	  *prev = conn->next;
+	  http_conn_free (conn);
+	  continue;
+	}
+      if (!conn->nreqs && conn->port == port
+	  && grub_strcmp (conn->server, server) == 0)
+	{
+	  *prev = conn->next;
+	  conn->next = NULL;
+	  grub_dprintf ("http", "reusing connection to %s\n", server);
+	  grub_net_stats.http_reused++;
+	  return conn;
+	}
+      prev = &conn->next;
+    }
+
+  conn = grub_zalloc (sizeof (*conn));
+  if (!conn)
+    return NULL;
+  conn->server = grub_strdup (server);
+  if (!conn->server)
+    {
+      grub_free (conn);
+      return NULL;
+    }
+  conn->port = port;
+  conn->keep_alive = 1;
+
+  grub_dprintf ("http", "opening TCP connection to %s port %d\n",
+		server, port ? port : HTTP_PORT);
+  conn->sock = grub_net_tcp_open (conn->server,
+				  port ? port : HTTP_PORT, http_receive,
+				  http_conn_err, http_conn_fin,
+				  conn);
+  if (!conn->sock)
+    {
+      grub_free (conn->server);
+      grub_free (conn);
+      return NULL;
+    }
+  grub_net_stats.http_connections++;
+  return conn;
+}
+
+static void
+http_set_error (http_data_t data, grub_err_t err, char *msg)
+{
+  if (data->err)
+    {
+      grub_free (msg);
+      return;
+    }
+  data->err = err;
+  data->errmsg = msg;
+  data->answered = 1;
+}
+
 static grub_err_t
-parse_line (grub_file_t file, http_data_t data, char *ptr, grub_size_t len)
+parse_line (struct http_conn *conn, char *ptr, grub_size_t len)
 {
+  struct http_req *req = conn->reqs;
+  grub_file_t file = req->file;
+  http_data_t data = file ? file->data : NULL;
   char *end = ptr + len;
   while (end > ptr && *(end - 1) == '\r')
     end--;
   *end = 0;
   /* Trailing CRLF.  */
-  if (data->in_chunk_len == 1)
+  if (conn->in_chunk_len == 1)
     {
-      data->in_chunk_len = 2;
+      conn->in_chunk_len = 2;
       return GRUB_ERR_NONE;
     }
-  if (data->in_chunk_len == 2)
+  if (conn->in_chunk_len == 2)
     {
-      data->chunk_rem = grub_strtoul (ptr, 0, 16);
-      if (data->chunk_rem > HTTP_MAX_CHUNK_SIZE)
+      conn->chunk_rem = grub_strtoul (ptr, 0, 16);
+      if (conn->chunk_rem > HTTP_MAX_CHUNK_SIZE)
 	  return GRUB_ERR_NET_PACKET_TOO_BIG;
       grub_errno = GRUB_ERR_NONE;
-      if (data->chunk_rem == 0)
-	{
-	  file->device->net->eof = 1;
-	  file->device->net->stall = 1;
-	  if (file->size == GRUB_FILE_SIZE_UNKNOWN)
-	    file->size = have_ahead (file);
-	}
-      data->in_chunk_len = 0;
+      conn->in_chunk_len = 0;
+      if (conn->chunk_rem == 0)
+	http_finish_response (conn, 0);
       return GRUB_ERR_NONE;
     }
   if (ptr == end)
     {
-      data->headers_recv = 1;
-      if (data->chunked)
-	data->in_chunk_len = 2;
+      conn->headers_recv = 1;
+      if (conn->chunked)
+	conn->in_chunk_len = 2;
+      /* The body ends when the server closes the connection.  */
+      else if (!conn->have_length)
+	conn->keep_alive = 0;
+
+      if (data && conn->code == 200 && file->size == GRUB_FILE_SIZE_UNKNOWN
+	  && conn->have_length)
+	file->size = conn->body_rem;
+      /* Without the total size there is no telling where to stop.  */
+      if (data && conn->code == 206 && file->size == GRUB_FILE_SIZE_UNKNOWN)
+	http_set_error (data, GRUB_ERR_NET_UNKNOWN_ERROR,
+			grub_xasprintf (_("HTTP server didn't report the size"
+					  " of `%s'"), data->filename));
+      if (data && req == data->reqs)
+	{
+	  data->headers_recv = 1;
+	  data->answered = 1;
+	}
+      if (conn->have_length && !conn->body_rem)
+	http_finish_response (conn, 0);
       return GRUB_ERR_NONE;
     }
 
-  if (!data->first_line_recv)
+  if (!conn->first_line_recv)
     {
       int code;
+      conn->first_line_recv = 1;
       if (grub_memcmp (ptr, "HTTP/1.1 ", sizeof ("HTTP/1.1 ") - 1) != 0)
 	{
-	  data->errmsg = grub_strdup (_("unsupported HTTP response"));
-	  data->first_line_recv = 1;
+	  if (data)
+	    http_set_error (data, GRUB_ERR_NET_UNKNOWN_ERROR,
+			    grub_strdup (_("unsupported HTTP response")));
+	  conn->keep_alive = 0;
 	  return GRUB_ERR_NONE;
 	}
       ptr += sizeof ("HTTP/1.1 ") - 1;
       code = grub_strtoul (ptr, (const char **)&ptr, 10);
       if (grub_errno)
 	return grub_errno;
+      conn->code = code;
+      if (!data)
+	return GRUB_ERR_NONE;
       switch (code)
 	{
 	case 200:
+	  if (req->offset)
+	    {
+	      http_set_error (data, GRUB_ERR_NET_UNKNOWN_ERROR,
+			      grub_xasprintf (_("HTTP server ignored the range"
+						" requested for `%s'"),
+					      data->filename));
+	      return GRUB_ERR_NONE;
+	    }
+	  /* The whole file comes in this response.  */
+	  req->length = 0;
+	  data->ranged = 0;
+	  break;
 	case 206:
 	  break;
 	case 404:
-	  data->err = GRUB_ERR_FILE_NOT_FOUND;
-	  data->errmsg = grub_xasprintf (_("file `%s' not found"), data->filename);
+	  http_set_error (data, GRUB_ERR_FILE_NOT_FOUND,
+			  grub_xasprintf (_("file `%s' not found"),
+					  data->filename));
 	  return GRUB_ERR_NONE;
 	default:
-	  data->err = GRUB_ERR_NET_UNKNOWN_ERROR;
 	  /* TRANSLATORS: GRUB HTTP code is pretty young. So even perfectly
 	     valid answers like 403 will trigger this very generic message.  */
-	  data->errmsg = grub_xasprintf (_("unsupported HTTP error %d: %s"),
-					 code, ptr);
+	  http_set_error (data, GRUB_ERR_NET_UNKNOWN_ERROR,
+			  grub_xasprintf (_("unsupported HTTP error %d: %s"),
+					  code, ptr));
 	  return GRUB_ERR_NONE;
 	}
-      data->first_line_recv = 1;
       return GRUB_ERR_NONE;
     }
   if (grub_memcmp (ptr, "Content-Length: ", sizeof ("Content-Length: ") - 1)
-      == 0 && !data->size_recv)
+      == 0)
     {
       ptr += sizeof ("Content-Length: ") - 1;
-      file->size = grub_strtoull (ptr, (const char **)&ptr, 10);
-      data->size_recv = 1;
+      conn->body_rem = grub_strtoull (ptr, (const char **)&ptr, 10);
+      conn->have_length = 1;
+      return GRUB_ERR_NONE;
+    }
+  if (grub_memcmp (ptr, "Content-Range: bytes ",
+		   sizeof ("Content-Range: bytes ") - 1) == 0)
+    {
+      /* The total size after the slash, unless it's `*'.  */
+      ptr = grub_strchr (ptr, '/');
+      if (ptr && ptr[1] != '*' && data
+	  && file->size == GRUB_FILE_SIZE_UNKNOWN)
+	{
+	  file->size = grub_strtoull (ptr + 1, 0, 10);
+	  if (grub_errno)
+	    {
+	      grub_errno = GRUB_ERR_NONE;
+	      file->size = GRUB_FILE_SIZE_UNKNOWN;
+	    }
+	}
       return GRUB_ERR_NONE;
     }
   if (grub_memcmp (ptr, "Transfer-Encoding: chunked",
 		   sizeof ("Transfer-Encoding: chunked") - 1) == 0)
     {
-      data->chunked = 1;
+      conn->chunked = 1;
+      /* Trailers aren't parsed, so the end of the body isn't a
+	 reliable place to send the next request.  */
+      conn->keep_alive = 0;
+      return GRUB_ERR_NONE;
+    }
+  if (grub_memcmp (ptr, "Connection: close", sizeof ("Connection: close") - 1)
+      == 0)
+    {
+      conn->keep_alive = 0;
       return GRUB_ERR_NONE;
     }
 
-  return GRUB_ERR_NONE;  
+  return GRUB_ERR_NONE;
 }
 
+/* Hand over a piece of the body of the response being received on
+   CONN.  */
 static void
-http_err (grub_net_tcp_socket_t sock __attribute__ ((unused)),
-	  void *f)
+http_deliver (struct http_conn *conn, struct http_req *req,
+	      struct grub_net_buff *nb)
 {
-  grub_file_t file = f;
-  http_data_t data = file->data;
+  grub_file_t file = req->file;
+  http_data_t data;
+  grub_net_t net;
 
-  if (data->sock)
-    grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
-  data->sock = 0;
-  if (data->current_line)
-    grub_free (data->current_line);
-  data->current_line = 0;
-  file->device->net->eof = 1;
-  file->device->net->stall = 1;
-  if (file->size == GRUB_FILE_SIZE_UNKNOWN)
-    file->size = have_ahead (file);
+  if (!file)
+    {
+      grub_netbuff_free (nb);
+      return;
+    }
+  data = file->data;
+  net = file->device->net;
+  if (data->err)
+    {
+      grub_netbuff_free (nb);
+      return;
+    }
+
+  if (req != data->reqs)
+    {
+      grub_net_put_packet (&req->packs, nb);
+      return;
+    }
+
+  grub_net_put_file_data (net, nb);
+  if (net->packs.count >= 20)
+    net->stall = 1;
+
+  if (net->packs.count >= 100)
+    grub_net_tcp_stall (conn->sock);
 }
 
 static grub_err_t
 http_receive (grub_net_tcp_socket_t sock __attribute__ ((unused)),
 	      struct grub_net_buff *nb,
-	      void *f)
+	      void *c)
 {
-  grub_file_t file = f;
-  http_data_t data = file->data;
+  struct http_conn *conn = c;
   grub_err_t err;
 
-  if (!data->sock)
-    {
-      grub_netbuff_free (nb);
-      return GRUB_ERR_NONE;
-    }
-
   while (1)
     {
       char *ptr = (char *) nb->data;
-      if ((!data->headers_recv || data->in_chunk_len) && data->current_line)
+      grub_size_t avail, part;
+
+      /* A line split across segments may have ended the last response
+	 right at the end of this one.  The connection can still be kept.  */
+      if (nb->data == nb->tail)
+	{
+	  grub_netbuff_free (nb);
+	  return GRUB_ERR_NONE;
+	}
+
+      /* Nothing was asked for, or the connection is being dropped.  */
+      if (conn->dead || !conn->reqs)
+	{
+	  grub_netbuff_free (nb);
+	  if (!conn->dead)
+	    http_conn_abort (conn);
+	  return GRUB_ERR_NONE;
+	}
+
+      if ((!conn->headers_recv || conn->in_chunk_len) && conn->current_line)
 	{
 	  int have_line = 1;
 	  char *t;
@@ -200,126 +642,168 @@ http_receive (grub_net_tcp_socket_t sock __attribute__ ((unused)),
 	      have_line = 0;
 	      ptr = (char *) nb->tail;
 	    }
-	  t = grub_realloc (data->current_line,
-			    data->current_line_len + (ptr - (char *) nb->data));
+	  t = grub_realloc (conn->current_line,
+			    conn->current_line_len + (ptr - (char *) nb->data));
 	  if (!t)
 	    {
 	      grub_netbuff_free (nb);
-	      grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+	      http_conn_abort (conn);
 	      return grub_errno;
 	    }
-	      
-	  data->current_line = t;
-	  grub_memcpy (data->current_line + data->current_line_len,
+
+	  conn->current_line = t;
+	  grub_memcpy (conn->current_line + conn->current_line_len,
 		       nb->data, ptr - (char *) nb->data);
-	  data->current_line_len += ptr - (char *) nb->data;
+	  conn->current_line_len += ptr - (char *) nb->data;
 	  if (!have_line)
 	    {
 	      grub_netbuff_free (nb);
 	      return GRUB_ERR_NONE;
 	    }
-	  err = parse_line (file, data, data->current_line,
-			    data->current_line_len);
-	  grub_free (data->current_line);
-	  data->current_line = 0;
-	  data->current_line_len = 0;
+	  t = conn->current_line;
+	  conn->current_line = 0;
+	  err = parse_line (conn, t, conn->current_line_len);
+	  grub_free (t);
+	  conn->current_line_len = 0;
+	  if (err)
+	    {
+	      http_conn_abort (conn);
+	      grub_netbuff_free (nb);
+	      return err;
+	    }
+	  /* The line may have completed a response.  */
+	  err = grub_netbuff_pull (nb, ptr - (char *) nb->data);
 	  if (err)
 	    {
-	      grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+	      http_conn_abort (conn);
 	      grub_netbuff_free (nb);
 	      return err;
 	    }
+	  continue;
 	}
 
-      while (ptr < (char *) nb->tail && (!data->headers_recv
-					 || data->in_chunk_len))
+      while (ptr < (char *) nb->tail && (!conn->headers_recv
+					 || conn->in_chunk_len))
 	{
 	  char *ptr2;
+	  struct http_req *req = conn->reqs;
+
 	  ptr2 = grub_memchr (ptr, '\n', (char *) nb->tail - ptr);
 	  if (!ptr2)
 	    {
-	      data->current_line = grub_malloc ((char *) nb->tail - ptr);
-	      if (!data->current_line)
+	      conn->current_line = grub_malloc ((char *) nb->tail - ptr);
+	      if (!conn->current_line)
 		{
 		  grub_netbuff_free (nb);
-		  grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+		  http_conn_abort (conn);
 		  return grub_errno;
 		}
-	      data->current_line_len = (char *) nb->tail - ptr;
-	      grub_memcpy (data->current_line, ptr, data->current_line_len);
+	      conn->current_line_len = (char *) nb->tail - ptr;
+	      grub_memcpy (conn->current_line, ptr, conn->current_line_len);
 	      grub_netbuff_free (nb);
 	      return GRUB_ERR_NONE;
 	    }
-	  err = parse_line (file, data, ptr, ptr2 - ptr);
+	  err = parse_line (conn, ptr, ptr2 - ptr);
 	  if (err)
 	    {
-	      grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+	      http_conn_abort (conn);
 	      grub_netbuff_free (nb);
 	      return err;
 	    }
 	  ptr = ptr2 + 1;
+	  /* A response ended: the rest belongs to the next one.  */
+	  if (conn->reqs != req)
+	    break;
 	}
 
       if (((char *) nb->tail - ptr) <= 0)
 	{
 	  grub_netbuff_free (nb);
 	  return GRUB_ERR_NONE;
-	} 
+	}
       err = grub_netbuff_pull (nb, ptr - (char *) nb->data);
       if (err)
 	{
-	  grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+	  http_conn_abort (conn);
 	  grub_netbuff_free (nb);
 	  return err;
 	}
-      if (!(data->chunked && (grub_ssize_t) data->chunk_rem
-	    < nb->tail - nb->data))
-	{
-	  grub_net_put_packet (&file->device->net->packs, nb);
-	  if (file->device->net->packs.count >= 20)
-	    file->device->net->stall = 1;
+      if (conn->dead || !conn->reqs || !conn->headers_recv)
+	continue;
 
-	  if (file->device->net->packs.count >= 100)
-	    grub_net_tcp_stall (data->sock);
+      /* Body data up to the end of the chunk or of the response.  */
+      avail = nb->tail - nb->data;
+      part = avail;
+      if (conn->chunked && conn->chunk_rem < part)
+	part = conn->chunk_rem;
+      else if (!conn->chunked && conn->have_length && conn->body_rem < part)
+	part = conn->body_rem;
 
-	  if (data->chunked)
-	    data->chunk_rem -= nb->tail - nb->data;
-	  return GRUB_ERR_NONE;
+      if (part == avail)
+	{
+	  http_deliver (conn, conn->reqs, nb);
+	  nb = NULL;
 	}
-      if (data->chunk_rem)
+      else if (part)
 	{
 	  struct grub_net_buff *nb2;
-	  nb2 = grub_netbuff_alloc (data->chunk_rem);
+	  nb2 = grub_netbuff_alloc (part);
 	  if (!nb2)
-	    return grub_errno;
-	  err = grub_netbuff_put (nb2, data->chunk_rem);
+	    {
+	      grub_netbuff_free (nb);
+	      http_conn_abort (conn);
+	      return grub_errno;
+	    }
+	  err = grub_netbuff_put (nb2, part);
 	  if (err)
-	    return grub_errno;
-	  grub_memcpy (nb2->data, nb->data, data->chunk_rem);
-	  if (file->device->net->packs.count >= 20)
 	    {
-	      file->device->net->stall = 1;
-	      grub_net_tcp_stall (data->sock);
+	      grub_netbuff_free (nb2);
+	      grub_netbuff_free (nb);
+	      http_conn_abort (conn);
+	      return err;
 	    }
+	  grub_memcpy (nb2->data, nb->data, part);
+	  http_deliver (conn, conn->reqs, nb2);
+	  grub_netbuff_pull (nb, part);
+	}
 
-	  grub_net_put_packet (&file->device->net->packs, nb2);
-	  grub_netbuff_pull (nb, data->chunk_rem);
+      if (conn->chunked)
+	{
+	  conn->chunk_rem -= part;
+	  /* The CRLF after the chunk may come in the next packet.  */
+	  if (!conn->chunk_rem)
+	    conn->in_chunk_len = 1;
 	}
-      data->in_chunk_len = 1;
+      else if (conn->have_length)
+	{
+	  conn->body_rem -= part;
+	  if (!conn->body_rem)
+	    http_finish_response (conn, 0);
+	}
+
+      if (!nb)
+	return GRUB_ERR_NONE;
     }
 }
 
+/* Send a GET for FILE on CONN covering LENGTH bytes from OFFSET, or
+   everything from there if LENGTH is 0.  */
 static grub_err_t
-http_establish (struct grub_file *file, grub_off_t offset, int initial)
+http_send_request (grub_file_t file, struct http_conn *conn,
+		   grub_off_t offset, grub_uint64_t length)
 {
   http_data_t data = file->data;
+  struct http_req *req;
   grub_uint8_t *ptr;
-  int i;
   struct grub_net_buff *nb;
   grub_err_t err;
   char* server = file->device->net->server;
   int port = file->device->net->port;
 
+  req = grub_zalloc (sizeof (*req));
+  if (!req)
+    return grub_errno;
+
   nb = grub_netbuff_alloc (GRUB_NET_TCP_RESERVE_SIZE
 			   + sizeof ("GET ") - 1
 			   + grub_strlen (data->filename)
@@ -328,47 +812,38 @@ http_establish (struct grub_file *file, grub_off_t offset, int initial)
 			   + sizeof ("\r\nUser-Agent: " PACKAGE_STRING
 				     "\r\n") - 1
 			   + sizeof ("Range: bytes=XXXXXXXXXXXXXXXXXXXX"
-				     "-\r\n\r\n"));
+				     "-XXXXXXXXXXXXXXXXXXXX\r\n\r\n"));
   if (!nb)
-    return grub_errno;
+    {
+      grub_free (req);
+      return grub_errno;
+    }
 
   grub_netbuff_reserve (nb, GRUB_NET_TCP_RESERVE_SIZE);
   ptr = nb->tail;
   err = grub_netbuff_put (nb, sizeof ("GET ") - 1);
   if (err)
-    {
-      grub_netbuff_free (nb);
-      return err;
-    }
+    goto fail;
   grub_memcpy (ptr, "GET ", sizeof ("GET ") - 1);
 
   ptr = nb->tail;
 
   err = grub_netbuff_put (nb, grub_strlen (data->filename));
   if (err)
-    {
-      grub_netbuff_free (nb);
-      return err;
-    }
+    goto fail;
   grub_memcpy (ptr, data->filename, grub_strlen (data->filename));
 
   ptr = nb->tail;
   err = grub_netbuff_put (nb, sizeof (" HTTP/1.1\r\nHost: ") - 1);
   if (err)
-    {
-      grub_netbuff_free (nb);
-      return err;
-    }
+    goto fail;
   grub_memcpy (ptr, " HTTP/1.1\r\nHost: ",
 	       sizeof (" HTTP/1.1\r\nHost: ") - 1);
 
   ptr = nb->tail;
   err = grub_netbuff_put (nb, grub_strlen (server));
   if (err)
-    {
-      grub_netbuff_free (nb);
-      return err;
-    }
+    goto fail;
   grub_memcpy (ptr, file->device->net->server,
 	       grub_strlen (file->device->net->server));
 
@@ -386,13 +861,21 @@ http_establish (struct grub_file *file, grub_off_t offset, int initial)
 			  sizeof ("\r\nUser-Agent: " PACKAGE_STRING "\r\n")
 			  - 1);
   if (err)
-    {
-      grub_netbuff_free (nb);
-      return err;
-    }
+    goto fail;
   grub_memcpy (ptr, "\r\nUser-Agent: " PACKAGE_STRING "\r\n",
 	       sizeof ("\r\nUser-Agent: " PACKAGE_STRING "\r\n") - 1);
-  if (!initial)
+  if (data->ranged && length)
+    {
+      ptr = nb->tail;
+      grub_snprintf ((char *) ptr,
+		     sizeof ("Range: bytes=XXXXXXXXXXXXXXXXXXXX"
+			     "-XXXXXXXXXXXXXXXXXXXX\r\n"),
+		     "Range: bytes=%" PRIuGRUB_UINT64_T
+		     "-%" PRIuGRUB_UINT64_T "\r\n",
+		     offset, offset + length - 1);
+      grub_netbuff_put (nb, grub_strlen ((char *) ptr));
+    }
+  else if (offset)
     {
       ptr = nb->tail;
       grub_snprintf ((char *) ptr,
@@ -406,88 +889,273 @@ http_establish (struct grub_file *file, grub_off_t offset, int initial)
   grub_netbuff_put (nb, 2);
   grub_memcpy (ptr, "\r\n", 2);
 
-  grub_dprintf ("http", "opening path %s on host %s TCP port %d\n",
-		data->filename, server, port ? port : HTTP_PORT);
-  data->sock = grub_net_tcp_open (server,
-				  port ? port : HTTP_PORT, http_receive,
-				  http_err, NULL,
-				  file);
-  if (!data->sock)
+  grub_dprintf ("http", "requesting path %s on host %s from %" PRIuGRUB_UINT64_T
+		"%s\n", data->filename, server, offset,
+		length ? " (ranged)" : "");
+
+  err = grub_net_send_tcp_packet (conn->sock, nb, 1);
+  if (err)
     {
-      grub_netbuff_free (nb);
-      return grub_errno;
+      grub_free (req);
+      http_conn_abort (conn);
+      return err;
     }
 
-  //  grub_net_poll_cards (5000);
+  req->conn = conn;
+  req->file = file;
+  req->offset = offset;
+  req->length = data->ranged ? length : 0;
+  req->on_conn = 1;
+  if (conn->reqs_last)
+    conn->reqs_last->conn_next = req;
+  else
+    conn->reqs = req;
+  conn->reqs_last = req;
+  conn->nreqs++;
+  grub_net_stats.http_requests++;
+  if (data->reqs_last)
+    data->reqs_last->file_next = req;
+  else
+    data->reqs = req;
+  data->reqs_last = req;
+  return GRUB_ERR_NONE;
+
+ fail:
+  grub_netbuff_free (nb);
+  grub_free (req);
+  return err;
+}
 
-  err = grub_net_send_tcp_packet (data->sock, nb, 1);
-  if (err)
+/* Keep the connections of FILE busy with the next ranges: an idle
+   connection first, then a new one if streams are left, then a
+   pipelined request behind a busy one.  */
+static void
+http_fill (grub_file_t file)
+{
+  http_data_t data = file->data;
+
+  if (!data->ranged || data->failed || data->err
+      || file->size == GRUB_FILE_SIZE_UNKNOWN)
+    return;
+
+  while (data->next_off < file->size
+	 && file->device->net->packs.count < 20)
     {
-      grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
-      return err;
+      int i, best = -1, empty = -1;
+      grub_uint64_t length;
+      struct http_conn *conn;
+
+      for (i = 0; i < data->nstreams; i++)
+	{
+	  conn = data->conns[i];
+	  if (conn && conn->dead)
+	    {
+	      http_conn_free (conn);
+	      data->conns[i] = conn = NULL;
+	    }
+	  if (!conn)
+	    {
+	      if (empty < 0)
+		empty = i;
+	      continue;
+	    }
+	  if (conn->nreqs < HTTP_PIPELINE_DEPTH
+	      && (best < 0 || conn->nreqs < data->conns[best]->nreqs))
+	    best = i;
+	}
+
+      if (empty >= 0 && (best < 0 || data->conns[best]->nreqs))
+	{
+	  conn = http_conn_get (file);
+	  if (!conn)
+	    {
+	      grub_errno = GRUB_ERR_NONE;
+	      if (best < 0)
+		return;
+	    }
+	  else
+	    {
+	      data->conns[empty] = conn;
+	      best = empty;
+	    }
+	}
+      if (best < 0)
+	return;
+
+      length = data->range_size;
+      if (length > file->size - data->next_off)
+	length = file->size - data->next_off;
+      if (http_send_request (file, data->conns[best], data->next_off, length))
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  return;
+	}
+      data->next_off += length;
+      if (data->range_size < HTTP_MAX_RANGE)
+	data->range_size *= 2;
+    }
+}
+
+/* Orphan the requests of FILE and let go of its connections.  Those
+   with little left to receive are kept, in the file if KEEP or in the
+   idle list otherwise.  */
+static void
+http_drop (grub_file_t file, int keep)
+{
+  http_data_t data = file->data;
+  struct http_req *req, *next;
+  int i;
+
+  for (req = data->reqs; req; req = next)
+    {
+      next = req->file_next;
+      req->file = NULL;
+      req->file_next = NULL;
+      http_req_put (req);
     }
+  data->reqs = data->reqs_last = NULL;
 
-  for (i = 0; !data->headers_recv && i < 100; i++)
+  for (i = 0; i < HTTP_MAX_STREAMS; i++)
     {
-      grub_net_tcp_retransmit ();
-      grub_net_poll_cards (300, &data->headers_recv);
+      struct http_conn *conn = data->conns[i];
+
+      if (!conn)
+	continue;
+      /* http_deliver may have stalled it while the file was full, and
+	 nothing pulls the rest of its data now.  */
+      if (!conn->dead)
+	grub_net_tcp_unstall (conn->sock);
+      if (!keep)
+	{
+	  data->conns[i] = NULL;
+	  http_conn_release (conn);
+	}
+      else if (conn->dead || http_conn_pending (conn) > HTTP_DRAIN_MAX)
+	{
+	  data->conns[i] = NULL;
+	  http_conn_free (conn);
+	}
     }
+}
+
+/* Start fetching FILE at OFFSET and wait for the first answer.  */
+static grub_err_t
+http_start (grub_file_t file, grub_off_t offset)
+{
+  http_data_t data = file->data;
+  grub_net_t net = file->device->net;
+  int attempt, i;
+  grub_uint64_t length = 0;
 
-  if (!data->headers_recv)
+  if (data->ranged)
     {
-      grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
+      if (file->size != GRUB_FILE_SIZE_UNKNOWN && offset >= file->size)
+	{
+	  net->eof = 1;
+	  net->stall = 1;
+	  return GRUB_ERR_NONE;
+	}
+      length = data->range_size;
+      if (file->size != GRUB_FILE_SIZE_UNKNOWN
+	  && length > file->size - offset)
+	length = file->size - offset;
+    }
+
+  for (attempt = 0; ; attempt++)
+    {
+      struct http_conn *conn = data->conns[0];
+      int reused;
+      grub_err_t err;
+
+      if (conn && conn->dead)
+	{
+	  http_conn_free (conn);
+	  data->conns[0] = conn = NULL;
+	}
+      if (!conn)
+	{
+	  conn = http_conn_get (file);
+	  if (!conn)
+	    return grub_errno;
+	  data->conns[0] = conn;
+	}
+      /* The server may have dropped a connection that sat idle, so give
+	 a fresh one a chance before failing.  */
+      reused = (conn->served || conn->nreqs) && !attempt;
+
+      data->answered = 0;
+      data->headers_recv = 0;
+      data->failed = 0;
+      net->eof = 0;
+      net->stall = 0;
+
+      err = http_send_request (file, conn, offset, length);
+      if (err)
+	{
+	  if (reused)
+	    {
+	      grub_errno = GRUB_ERR_NONE;
+	      continue;
+	    }
+	  return err;
+	}
+      data->next_off = offset + length;
+      if (data->range_size < HTTP_MAX_RANGE)
+	data->range_size *= 2;
+
+      for (i = 0; !data->answered && i < 100; i++)
+	{
+	  grub_net_tcp_retransmit ();
+	  grub_net_poll_cards (300, &data->answered);
+	}
+
       if (data->err)
 	{
 	  char *str = data->errmsg;
 	  err = grub_error (data->err, "%s", str);
 	  grub_free (str);
 	  data->errmsg = 0;
-	  return data->err;
+	  return err;
+	}
+      if (data->headers_recv)
+	break;
+      if (data->failed && reused)
+	{
+	  http_drop (file, 1);
+	  continue;
 	}
-      return grub_error (GRUB_ERR_TIMEOUT, N_("time out opening `%s'"), data->filename);
+      return grub_error (GRUB_ERR_TIMEOUT, N_("time out opening `%s'"),
+			 data->filename);
     }
+
+  http_fill (file);
   return GRUB_ERR_NONE;
 }
 
 static grub_err_t
 http_seek (struct grub_file *file, grub_off_t off)
 {
-  struct http_data *old_data, *data;
+  http_data_t data = file->data;
   grub_err_t err;
-  old_data = file->data;
-  /* FIXME: Reuse socket?  */
-  if (old_data->sock)
-    grub_net_tcp_close (old_data->sock, GRUB_NET_TCP_ABORT);
-  old_data->sock = 0;
 
-  while (file->device->net->packs.first)
-    {
-      grub_netbuff_free (file->device->net->packs.first->nb);
-      grub_net_remove_packet (file->device->net->packs.first);
-    }
+  if (!data)
+    return grub_error (GRUB_ERR_BUG, "seek on a failed HTTP file");
+
+  /* Requests still in flight are read and thrown away if that's
+     cheaper than a new connection.  */
+  http_drop (file, 1);
+  free_packets (&file->device->net->packs);
 
   file->device->net->stall = 0;
   file->device->net->eof = 0;
   file->device->net->offset = off;
 
-  data = grub_zalloc (sizeof (*data));
-  if (!data)
-    return grub_errno;
-
-  data->size_recv = 1;
-  data->filename = old_data->filename;
-  if (!data->filename)
-    {
-      grub_free (data);
-      file->data = 0;
-      return grub_errno;
-    }
-  grub_free (old_data);
-
-  file->data = data;
-  err = http_establish (file, off, 0);
+  data->ranged = 1;
+  data->range_size = HTTP_MIN_RANGE;
+  err = http_start (file, off);
   if (err)
     {
+      http_drop (file, 0);
       grub_free (data->filename);
       grub_free (data);
       file->data = 0;
@@ -514,12 +1182,19 @@ http_open (struct grub_file *file, const char *filename)
       return grub_errno;
     }
 
+  /* With several streams the file is fetched in ranges from the start,
+     otherwise as a single response.  */
+  data->nstreams = http_streams ();
+  data->ranged = (data->nstreams > 1);
+  data->range_size = HTTP_MAX_RANGE;
+
   file->not_easily_seekable = 0;
   file->data = data;
 
-  err = http_establish (file, 0, 1);
+  err = http_start (file, 0);
   if (err)
     {
+      http_drop (file, 0);
       grub_free (data->filename);
       grub_free (data);
       return err;
@@ -536,10 +1211,8 @@ http_close (struct grub_file *file)
   if (!data)
     return GRUB_ERR_NONE;
 
-  if (data->sock)
-    grub_net_tcp_close (data->sock, GRUB_NET_TCP_ABORT);
-  if (data->current_line)
-    grub_free (data->current_line);
+  http_drop (file, 0);
+  grub_free (data->errmsg);
   grub_free (data->filename);
   grub_free (data);
   return GRUB_ERR_NONE;
@@ -549,14 +1222,19 @@ static grub_err_t
 http_packets_pulled (struct grub_file *file)
 {
   http_data_t data = file->data;
+  int i;
 
   if (file->device->net->packs.count >= 20)
     return 0;
 
   if (!file->device->net->eof)
     file->device->net->stall = 0;
-  if (data && data->sock)
-    grub_net_tcp_unstall (data->sock);
+  if (!data)
+    return 0;
+  for (i = 0; i < HTTP_MAX_STREAMS; i++)
+    if (data->conns[i] && !data->conns[i]->dead)
+      grub_net_tcp_unstall (data->conns[i]->sock);
+  http_fill (file);
   return 0;
 }
 
@@ -576,5 +1254,11 @@ GRUB_MOD_INIT (http)
 
 GRUB_MOD_FINI (http)
 {
+  while (idle_conns)
+    {
+      struct http_conn *conn = idle_conns;
+      idle_conns = conn->next;
+      http_conn_free (conn);
+    }
   grub_net_app_level_unregister (&grub_http_protocol);
 }
@@ -92,29 +92,75 @@ struct reassemble
 
 static struct reassemble *reassembles;
 
-grub_uint16_t
-grub_net_ip_chksum (void *ipv, grub_size_t len)
+/* Add LEN bytes at DATA to SUM, a partial ones' complement sum as
+   returned by this function.  The sum is kept in host byte order
+   (RFC 1071), so words are added as they are in memory, 32 bits at a
+   time into a 64-bit accumulator that only gets folded at the end.
+   Only the last piece of a packet may have an odd length.  */
+grub_uint32_t
+grub_net_ip_chksum_partial (const void *data, grub_size_t len,
+			    grub_uint32_t sum)
 {
-  grub_uint16_t *ip = (grub_uint16_t *) ipv;
-  grub_uint32_t sum = 0;
-
-  for (; len >= 2; len -= 2)
+  const grub_uint8_t *ptr = data;
+  grub_uint64_t acc = sum;
+
+  for (; len >= 16; len -= 16, ptr += 16)
+    acc += (grub_uint64_t) grub_get_unaligned32 (ptr)
+      + grub_get_unaligned32 (ptr + 4)
+      + grub_get_unaligned32 (ptr + 8)
+      + grub_get_unaligned32 (ptr + 12);
+  for (; len >= 4; len -= 4, ptr += 4)
+    acc += grub_get_unaligned32 (ptr);
+  if (len >= 2)
     {
-      sum += grub_be_to_cpu16 (grub_get_unaligned16 (ip++));
-      if (sum > 0xFFFF)
-	sum -= 0xFFFF;
+      acc += grub_get_unaligned16 (ptr);
+      ptr += 2;
+      len -= 2;
     }
   if (len)
     {
-      sum += *((grub_uint8_t *) ip) << 8;
-      if (sum > 0xFFFF)
-	sum -= 0xFFFF;
+      grub_uint8_t last[2] = { *ptr, 0 };
+      acc += grub_get_unaligned16 (last);
     }
 
-  if (sum >= 0xFFFF)
-    sum -= 0xFFFF;
+  acc = (acc & 0xffffffff) + (acc >> 32);
+  acc = (acc & 0xffffffff) + (acc >> 32);
+  return acc;
+}
+
+/* Turn a partial sum into the value of a checksum field.  */
+grub_uint16_t
+grub_net_ip_chksum_fold (grub_uint32_t sum)
+{
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  /* 0xffff and 0 are the same number, and 0 is what the checksum of
+     data summing to either has always been computed as.  */
+  if (sum == 0xffff)
+    sum = 0;
+  return ~sum;
+}
+
+grub_uint16_t
+grub_net_ip_chksum (void *ipv, grub_size_t len)
+{
+  return grub_net_ip_chksum_fold (grub_net_ip_chksum_partial (ipv, len, 0));
+}
+
+/* Update CHKSUM for LEN bytes of the data it covers changing from OLD to
+   NEW, without summing everything again (RFC 1624).  LEN must be even
+   and the bytes at an even offset.  */
+grub_uint16_t
+grub_net_ip_chksum_update (grub_uint16_t chksum, const void *old,
+			   const void *new, grub_size_t len)
+{
+  const grub_uint8_t *o = old, *n = new;
+  grub_uint32_t sum = (grub_uint16_t) ~chksum;
 
-  return grub_cpu_to_be16 ((~sum) & 0x0000FFFF);
+  for (; len >= 2; len -= 2, o += 2, n += 2)
+    sum += (grub_uint16_t) ~grub_get_unaligned16 (o)
+      + grub_get_unaligned16 (n);
+  return grub_net_ip_chksum_fold (sum);
 }
 
 static int id = 0x2400;
@@ -29,6 +29,7 @@
 #include <grub/net/ethernet.h>
 #include <grub/net/arp.h>
 #include <grub/net/ip.h>
+#include <grub/net/tcp.h>
 #include <grub/loader.h>
 #include <grub/bufio.h>
 #include <grub/kernel.h>
@@ -41,6 +42,7 @@ GRUB_MOD_LICENSE ("GPLv3+");
 char *grub_net_default_server;
 
 struct grub_net_route *grub_net_routes = NULL;
+struct grub_net_stats grub_net_stats;
 struct grub_net_network_level_interface *grub_net_network_level_interfaces = NULL;
 struct grub_net_card *grub_net_cards = NULL;
 struct grub_net_network_level_protocol *grub_net_network_level_protocols = NULL;
@@ -1327,6 +1329,65 @@ grub_cmd_listcards (struct grub_command *cmd __attribute__ ((unused)),
   return GRUB_ERR_NONE;
 }
 
+static void
+set_stats_var (const char *name, grub_uint64_t val)
+{
+  char buf[sizeof ("18446744073709551615")];
+
+  grub_snprintf (buf, sizeof (buf), "%llu", (unsigned long long) val);
+  grub_env_set (name, buf);
+  grub_env_export (name);
+}
+
+static grub_err_t
+grub_cmd_stats (struct grub_command *cmd __attribute__ ((unused)),
+		int argc __attribute__ ((unused)),
+		char **args __attribute__ ((unused)))
+{
+  struct grub_net_card *card;
+  grub_uint64_t rx_bytes = 0, tx_bytes = 0;
+
+  FOR_NET_CARDS(card)
+  {
+    grub_printf ("%s: rx %llu packets %llu bytes, tx %llu packets %llu bytes"
+		 " %llu errors\n", card->name,
+		 (unsigned long long) card->rx_packets,
+		 (unsigned long long) card->rx_bytes,
+		 (unsigned long long) card->tx_packets,
+		 (unsigned long long) card->tx_bytes,
+		 (unsigned long long) card->tx_errors);
+    rx_bytes += card->rx_bytes;
+    tx_bytes += card->tx_bytes;
+  }
+  grub_printf ("poll: %llu calls, %llu ms blocked\n",
+	       (unsigned long long) grub_net_stats.poll_calls,
+	       (unsigned long long) grub_net_stats.poll_ms);
+  grub_printf ("tcp: %llu retransmits, %llu out of order, %llu duplicate ACKs,"
+	       " %llu stalls\n",
+	       (unsigned long long) grub_net_stats.tcp_retransmits,
+	       (unsigned long long) grub_net_stats.tcp_out_of_order,
+	       (unsigned long long) grub_net_stats.tcp_dup_acks,
+	       (unsigned long long) grub_net_stats.tcp_stalls);
+  grub_net_tcp_print_stats ();
+  grub_printf ("tftp: %llu RRQ resends, %llu duplicates, %llu out of order,"
+	       " %llu stalls\n",
+	       (unsigned long long) grub_net_stats.tftp_rrq_resends,
+	       (unsigned long long) grub_net_stats.tftp_duplicates,
+	       (unsigned long long) grub_net_stats.tftp_out_of_order,
+	       (unsigned long long) grub_net_stats.tftp_stalls);
+  grub_printf ("http: %llu connections, %llu reused, %llu requests\n",
+	       (unsigned long long) grub_net_stats.http_connections,
+	       (unsigned long long) grub_net_stats.http_reused,
+	       (unsigned long long) grub_net_stats.http_requests);
+
+  /* A summary for scripts to log.  */
+  set_stats_var ("net_stats_rx_bytes", rx_bytes);
+  set_stats_var ("net_stats_tx_bytes", tx_bytes);
+  set_stats_var ("net_stats_poll_ms", grub_net_stats.poll_ms);
+  set_stats_var ("net_stats_retransmits", grub_net_stats.tcp_retransmits);
+  return GRUB_ERR_NONE;
+}
+
 static grub_err_t
 grub_cmd_listaddrs (struct grub_command *cmd __attribute__ ((unused)),
 		    int argc __attribute__ ((unused)),
@@ -1614,9 +1675,17 @@ grub_net_fs_open (struct grub_file *file_out, const char *name)
   return GRUB_ERR_NONE;
 }
 
+static void
+grub_net_cache_free (struct grub_net_cache *cache);
+
 static grub_err_t
 grub_net_fs_close (grub_file_t file)
 {
+  if (file->device->net->cache)
+    {
+      grub_net_cache_free (file->device->net->cache);
+      file->device->net->cache = NULL;
+    }
   while (file->device->net->packs.first)
     {
       grub_netbuff_free (file->device->net->packs.first->nb);
@@ -1627,6 +1696,30 @@ grub_net_fs_close (grub_file_t file)
   return GRUB_ERR_NONE;
 }
 
+/* Most packets taken from a card in one poll, and from its driver at
+   once.  */
+#define GRUB_NET_RECV_MAX 100
+#define GRUB_NET_RECV_BATCH 16
+
+static int
+receive_batch (struct grub_net_card *card, struct grub_net_buff **nbs,
+	       int max)
+{
+  int n = 0;
+
+  if (card->driver->recv_batch)
+    return card->driver->recv_batch (card, nbs, max);
+
+  while (n < max)
+    {
+      nbs[n] = card->driver->recv (card);
+      if (!nbs[n])
+	break;
+      n++;
+    }
+  return n;
+}
+
 static void
 receive_packets (struct grub_net_card *card, int *stop_condition)
 {
@@ -1645,28 +1738,36 @@ receive_packets (struct grub_net_card *card, int *stop_condition)
 	}
       card->opened = 1;
     }
-  while (received < 100)
+  while (received < GRUB_NET_RECV_MAX)
     {
-      /* Maybe should be better have a fixed number of packets for each card
-	 and just mark them as used and not used.  */ 
-      struct grub_net_buff *nb;
+      struct grub_net_buff *nbs[GRUB_NET_RECV_BATCH];
+      int n, i, max;
 
       if (received > 10 && stop_condition && *stop_condition)
 	break;
 
-      nb = card->driver->recv (card);
-      if (!nb)
+      /* Drain what the card has first, then dispatch it all in one go.  */
+      max = GRUB_NET_RECV_MAX - received;
+      if (max > GRUB_NET_RECV_BATCH)
+	max = GRUB_NET_RECV_BATCH;
+      n = receive_batch (card, nbs, max);
+      for (i = 0; i < n; i++)
 	{
-	  card->last_poll = grub_get_time_ms ();
-	  break;
+	  card->rx_packets++;
+	  card->rx_bytes += nbs[i]->tail - nbs[i]->data;
+	  grub_net_recv_ethernet_packet (nbs[i], card);
+	  if (grub_errno)
+	    {
+	      grub_dprintf ("net", "error receiving: %d: %s\n", grub_errno,
+			    grub_errmsg);
+	      grub_errno = GRUB_ERR_NONE;
+	    }
 	}
-      received++;
-      grub_net_recv_ethernet_packet (nb, card);
-      if (grub_errno)
+      received += n;
+      if (n < max)
 	{
-	  grub_dprintf ("net", "error receiving: %d: %s\n", grub_errno,
-			grub_errmsg);
-	  grub_errno = GRUB_ERR_NONE;
+	  card->last_poll = grub_get_time_ms ();
+	  break;
 	}
     }
   grub_print_error ();
@@ -1721,6 +1822,8 @@ grub_net_poll_cards (unsigned time, int *stop_condition)
     FOR_NET_CARDS (card)
       receive_packets (card, stop_condition);
   grub_net_tcp_retransmit ();
+  grub_net_stats.poll_calls++;
+  grub_net_stats.poll_ms += grub_get_time_ms () - start_time;
 }
 
 static void
@@ -1738,6 +1841,38 @@ grub_net_poll_cards_idle_real (void)
   grub_net_tcp_retransmit ();
 }
 
+/* Smallest read worth receiving into directly.  */
+#define GRUB_NET_DIRECT_MIN 4096
+
+/* Hand over NB, the next data in order of the file on NET.  It is copied
+   straight into the buffer of a waiting read if nothing is queued ahead
+   of it, and queued otherwise.  */
+grub_err_t
+grub_net_put_file_data (grub_net_t net, struct grub_net_buff *nb)
+{
+  if (net->direct_len && !net->packs.first)
+    {
+      grub_size_t amount = nb->tail - nb->data;
+
+      if (amount > net->direct_len)
+	amount = net->direct_len;
+      grub_memcpy (net->direct_buf, nb->data, amount);
+      net->direct_buf += amount;
+      net->direct_len -= amount;
+      net->direct_done += amount;
+      nb->data += amount;
+      /* The read is satisfied, stop polling.  */
+      if (!net->direct_len)
+	net->stall = 1;
+      if (nb->data == nb->tail)
+	{
+	  grub_netbuff_free (nb);
+	  return GRUB_ERR_NONE;
+	}
+    }
+  return grub_net_put_packet (&net->packs, nb);
+}
+
 /*  Read from the packets list*/
 static grub_ssize_t
 grub_net_fs_read_real (grub_file_t file, char *buf, grub_size_t len)
@@ -1788,8 +1923,34 @@ grub_net_fs_read_real (grub_file_t file, char *buf, grub_size_t len)
       if (!net->eof)
 	{
 	  try++;
+	  if (buf && len >= GRUB_NET_DIRECT_MIN)
+	    {
+	      net->direct_buf = ptr;
+	      net->direct_len = len;
+	      net->direct_done = 0;
+	    }
 	  grub_net_poll_cards (GRUB_NET_INTERVAL +
                                (try * GRUB_NET_INTERVAL_ADDITION), &net->stall);
+	  amount = net->direct_done;
+	  net->direct_buf = NULL;
+	  net->direct_len = 0;
+	  net->direct_done = 0;
+	  if (amount)
+	    {
+	      try = 0;
+	      ptr += amount;
+	      len -= amount;
+	      total += amount;
+	      net->offset += amount;
+	      if (grub_file_progress_hook)
+		grub_file_progress_hook (0, 0, amount, file);
+	      if (!len)
+		{
+		  if (net->protocol->packets_pulled)
+		    net->protocol->packets_pulled (file);
+		  return total;
+		}
+	    }
         }
       else
 	return total;
@@ -1850,17 +2011,306 @@ grub_net_seek_real (struct grub_file *file, grub_off_t offset)
   }
 }
 
+/* Network files are read through a cache of aligned blocks, so that
+   filesystems on loopback devices don't fetch the same data again each
+   time they jump between metadata and file contents.  Reads that go on
+   from where the stream is and take at least the rest of a block bypass
+   it.  Each open file has its own blocks, but they share one LRU list
+   and the net_cache_size budget.  */
+#define GRUB_NET_CACHE_BLOCK_SHIFT 16
+#define GRUB_NET_CACHE_BLOCK_SIZE (1 << GRUB_NET_CACHE_BLOCK_SHIFT)
+#define GRUB_NET_CACHE_HASH_SIZE 64
+/* In KiB.  */
+#define GRUB_NET_CACHE_DEFAULT_SIZE (16 * 1024)
+/* Blocks read ahead once reading turns out to be sequential.  */
+#define GRUB_NET_CACHE_READAHEAD_MAX 8
+
+struct grub_net_cache_block
+{
+  struct grub_net_cache_block *lru_next;
+  struct grub_net_cache_block *lru_prev;
+  struct grub_net_cache_block *hash_next;
+  struct grub_net_cache *cache;
+  grub_uint64_t index;
+  /* Less than a block at the end of the file.  */
+  grub_size_t len;
+  char *data;
+};
+
+struct grub_net_cache
+{
+  struct grub_net_cache_block *hash[GRUB_NET_CACHE_HASH_SIZE];
+  /* Block following the last one fetched, where the stream is.  */
+  grub_uint64_t next_index;
+  unsigned readahead;
+};
+
+static struct grub_net_cache_block *net_cache_lru_first;
+static struct grub_net_cache_block *net_cache_lru_last;
+static grub_size_t net_cache_total;
+
+static grub_size_t
+grub_net_cache_budget (void)
+{
+  const char *val;
+  unsigned long kib;
+
+  val = grub_env_get ("net_cache_size");
+  if (!val)
+    return GRUB_NET_CACHE_DEFAULT_SIZE * 1024;
+  kib = grub_strtoul (val, 0, 0);
+  if (grub_errno)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return GRUB_NET_CACHE_DEFAULT_SIZE * 1024;
+    }
+  /* Keep clear of overflow on 32-bit platforms.  */
+  if (kib > (GRUB_ULONG_MAX >> 11))
+    kib = GRUB_ULONG_MAX >> 11;
+  return (grub_size_t) kib * 1024;
+}
+
+static void
+grub_net_cache_lru_unlink (struct grub_net_cache_block *block)
+{
+  if (block->lru_prev)
+    block->lru_prev->lru_next = block->lru_next;
+  else
+    net_cache_lru_first = block->lru_next;
+  if (block->lru_next)
+    block->lru_next->lru_prev = block->lru_prev;
+  else
+    net_cache_lru_last = block->lru_prev;
+}
+
+static void
+grub_net_cache_lru_push (struct grub_net_cache_block *block)
+{
+  block->lru_prev = NULL;
+  block->lru_next = net_cache_lru_first;
+  if (net_cache_lru_first)
+    net_cache_lru_first->lru_prev = block;
+  else
+    net_cache_lru_last = block;
+  net_cache_lru_first = block;
+}
+
+static void
+grub_net_cache_evict (struct grub_net_cache_block *block)
+{
+  struct grub_net_cache_block **p;
+
+  for (p = &block->cache->hash[block->index % GRUB_NET_CACHE_HASH_SIZE];
+       *p; p = &(*p)->hash_next)
+    if (*p == block)
+      {
+	*p = block->hash_next;
+	break;
+      }
+  grub_net_cache_lru_unlink (block);
+  net_cache_total -= GRUB_NET_CACHE_BLOCK_SIZE;
+  grub_free (block->data);
+  grub_free (block);
+}
+
+static struct grub_net_cache_block *
+grub_net_cache_find (struct grub_net_cache *cache, grub_uint64_t index)
+{
+  struct grub_net_cache_block *block;
+
+  for (block = cache->hash[index % GRUB_NET_CACHE_HASH_SIZE]; block;
+       block = block->hash_next)
+    if (block->index == index)
+      return block;
+  return NULL;
+}
+
+static void
+grub_net_cache_free (struct grub_net_cache *cache)
+{
+  int i;
+
+  for (i = 0; i < GRUB_NET_CACHE_HASH_SIZE; i++)
+    while (cache->hash[i])
+      grub_net_cache_evict (cache->hash[i]);
+  grub_free (cache);
+}
+
+/* Fetch block INDEX of FILE into the cache.  */
+static struct grub_net_cache_block *
+grub_net_cache_fill (grub_file_t file, grub_uint64_t index,
+		     grub_size_t budget)
+{
+  struct grub_net_cache *cache = file->device->net->cache;
+  struct grub_net_cache_block *block;
+  grub_off_t start = index << GRUB_NET_CACHE_BLOCK_SHIFT;
+  grub_size_t len = GRUB_NET_CACHE_BLOCK_SIZE;
+  grub_ssize_t got;
+
+  if (file->size != GRUB_FILE_SIZE_UNKNOWN && file->size - start < len)
+    len = file->size - start;
+
+  while (net_cache_lru_last
+	 && net_cache_total + GRUB_NET_CACHE_BLOCK_SIZE > budget)
+    grub_net_cache_evict (net_cache_lru_last);
+
+  block = grub_zalloc (sizeof (*block));
+  if (!block)
+    return NULL;
+  block->data = grub_malloc (GRUB_NET_CACHE_BLOCK_SIZE);
+  if (!block->data)
+    {
+      grub_free (block);
+      return NULL;
+    }
+
+  if (grub_net_seek_real (file, start))
+    got = -1;
+  else
+    got = grub_net_fs_read_real (file, block->data, len);
+  if (got < 0)
+    {
+      grub_free (block->data);
+      grub_free (block);
+      return NULL;
+    }
+  cache->next_index = index + 1;
+
+  block->cache = cache;
+  block->index = index;
+  block->len = got;
+  block->hash_next = cache->hash[index % GRUB_NET_CACHE_HASH_SIZE];
+  cache->hash[index % GRUB_NET_CACHE_HASH_SIZE] = block;
+  grub_net_cache_lru_push (block);
+  net_cache_total += GRUB_NET_CACHE_BLOCK_SIZE;
+  return block;
+}
+
 static grub_ssize_t
 grub_net_fs_read (grub_file_t file, char *buf, grub_size_t len)
 {
-  if (file->offset != file->device->net->offset)
+  grub_net_t net = file->device->net;
+  grub_size_t budget = grub_net_cache_budget ();
+  grub_off_t offset = file->offset;
+  grub_ssize_t total = 0;
+
+  if (!net->cache && budget >= GRUB_NET_CACHE_BLOCK_SIZE)
     {
-      grub_err_t err;
-      err = grub_net_seek_real (file, file->offset);
-      if (err)
-	return err;
+      net->cache = grub_zalloc (sizeof (*net->cache));
+      if (!net->cache)
+	grub_errno = GRUB_ERR_NONE;
+    }
+
+  if (!net->cache || budget < GRUB_NET_CACHE_BLOCK_SIZE)
+    {
+      if (file->offset != net->offset)
+	{
+	  grub_err_t err;
+	  err = grub_net_seek_real (file, file->offset);
+	  if (err)
+	    return err;
+	}
+      return grub_net_fs_read_real (file, buf, len);
     }
-  return grub_net_fs_read_real (file, buf, len);
+
+  while (len)
+    {
+      struct grub_net_cache *cache = net->cache;
+      struct grub_net_cache_block *block;
+      grub_uint64_t index = offset >> GRUB_NET_CACHE_BLOCK_SHIFT;
+      grub_size_t boff = offset & (GRUB_NET_CACHE_BLOCK_SIZE - 1);
+      grub_size_t amount;
+      unsigned i, ahead = 0;
+
+      if (file->size != GRUB_FILE_SIZE_UNKNOWN && offset >= file->size)
+	break;
+
+      block = grub_net_cache_find (cache, index);
+      if (block)
+	{
+	  grub_net_cache_lru_unlink (block);
+	  grub_net_cache_lru_push (block);
+	}
+      else if (offset == net->offset
+	       && boff + len >= GRUB_NET_CACHE_BLOCK_SIZE)
+	{
+	  /* Sequential reading: straight into BUF.  Stop on a block
+	     boundary, so that the stream stays where a fill would start.  */
+	  grub_size_t n = len;
+	  grub_ssize_t got;
+
+	  if (file->size == GRUB_FILE_SIZE_UNKNOWN || offset + len < file->size)
+	    n = ((offset + len) & ~(grub_off_t) (GRUB_NET_CACHE_BLOCK_SIZE - 1))
+	      - offset;
+	  got = grub_net_fs_read_real (file, buf, n);
+	  if (got < 0)
+	    return total ? total : -1;
+	  buf += got;
+	  offset += got;
+	  len -= got;
+	  total += got;
+	  cache->next_index = offset >> GRUB_NET_CACHE_BLOCK_SHIFT;
+	  cache->readahead = 0;
+	  if ((grub_size_t) got < n)
+	    break;
+	  continue;
+	}
+      else
+	{
+	  /* A miss right where the stream stopped means sequential
+	     reading: fetch more at once, while the stream is there.  */
+	  if (index != cache->next_index)
+	    cache->readahead = 0;
+	  else if (cache->readahead < GRUB_NET_CACHE_READAHEAD_MAX)
+	    cache->readahead = cache->readahead ? cache->readahead * 2 : 1;
+	  /* Leave half of the budget to blocks that are read back.  */
+	  ahead = budget / 2 / GRUB_NET_CACHE_BLOCK_SIZE;
+	  ahead = ahead ? ahead - 1 : 0;
+	  if (ahead > cache->readahead)
+	    ahead = cache->readahead;
+
+	  block = grub_net_cache_fill (file, index, budget);
+	  if (!block)
+	    return total ? total : -1;
+	}
+
+      if (boff >= block->len)
+	break;
+      amount = block->len - boff;
+      if (amount > len)
+	amount = len;
+      grub_memcpy (buf, block->data + boff, amount);
+      buf += amount;
+      offset += amount;
+      len -= amount;
+      total += amount;
+
+      if (block->len < GRUB_NET_CACHE_BLOCK_SIZE)
+	break;
+
+      /* BLOCK may be evicted from here on.  */
+      for (i = 1; i <= ahead; i++)
+	{
+	  struct grub_net_cache_block *next;
+
+	  if (file->size != GRUB_FILE_SIZE_UNKNOWN
+	      && ((index + i) << GRUB_NET_CACHE_BLOCK_SHIFT) >= file->size)
+	    break;
+	  if (grub_net_cache_find (cache, index + i))
+	    break;
+	  next = grub_net_cache_fill (file, index + i, budget);
+	  if (!next)
+	    {
+	      /* The data asked for is there already.  */
+	      grub_errno = GRUB_ERR_NONE;
+	      break;
+	    }
+	  if (next->len < GRUB_NET_CACHE_BLOCK_SIZE)
+	    break;
+	}
+    }
+
+  return total;
 }
 
 static struct grub_fs grub_net_fs =
@@ -1886,6 +2336,7 @@ grub_net_fini_hw (int noreturn __attribute__ ((unused)))
 	  card->driver->close (card);
 	card->opened = 0;
       }
+  grub_netbuff_pool_flush ();
   return GRUB_ERR_NONE;
 }
 
@@ -2030,7 +2481,7 @@ static struct grub_preboot *fini_hnd;
 
 static grub_command_t cmd_addaddr, cmd_deladdr, cmd_addroute, cmd_delroute;
 static grub_command_t cmd_lsroutes, cmd_lscards;
-static grub_command_t cmd_lsaddr, cmd_slaac;
+static grub_command_t cmd_lsaddr, cmd_slaac, cmd_stats;
 
 #ifdef GRUB_MACHINE_EFI
 
@@ -2114,6 +2565,8 @@ GRUB_MOD_INIT(net)
 				       "", N_("list network cards"));
   cmd_lsaddr = grub_register_command ("net_ls_addr", grub_cmd_listaddrs,
 				       "", N_("list network addresses"));
+  cmd_stats = grub_register_command ("net_stats", grub_cmd_stats,
+				     "", N_("show network statistics"));
   grub_bootp_init ();
   grub_dns_init ();
 
@@ -2166,6 +2619,7 @@ GRUB_MOD_FINI(net)
   grub_unregister_command (cmd_lscards);
   grub_unregister_command (cmd_lsaddr);
   grub_unregister_command (cmd_slaac);
+  grub_unregister_command (cmd_stats);
   grub_fs_unregister (&grub_net_fs);
   grub_net_open = NULL;
   grub_net_fini_hw (0);
@@ -21,6 +21,14 @@
 #include <grub/mm.h>
 #include <grub/net/netbuff.h>
 
+/* Buffers of the size received frames take are recycled through a free
+   list instead of going back to the heap, since a download allocates
+   and frees one per packet.  The link is kept in the data area.  */
+#define NETBUFF_POOL_MAX 512
+
+static struct grub_net_buff *pool;
+static unsigned pool_count;
+
 grub_err_t
 grub_netbuff_put (struct grub_net_buff *nb, grub_size_t len)
 {
@@ -83,6 +91,14 @@ grub_netbuff_alloc (grub_size_t len)
     len = NETBUFFMINLEN;
 
   len = ALIGN_UP (len, NETBUFF_ALIGN);
+  if (len == NETBUFF_ALIGN && pool)
+    {
+      nb = pool;
+      pool = *(struct grub_net_buff **) nb->head;
+      pool_count--;
+      nb->data = nb->tail = nb->head;
+      return nb;
+    }
 #ifdef GRUB_MACHINE_EMU
   data = grub_malloc (len + sizeof (*nb));
 #else
@@ -122,9 +138,28 @@ grub_netbuff_free (struct grub_net_buff *nb)
 {
   if (!nb)
     return;
+  if (nb->end - nb->head == NETBUFF_ALIGN && pool_count < NETBUFF_POOL_MAX)
+    {
+      *(struct grub_net_buff **) nb->head = pool;
+      pool = nb;
+      pool_count++;
+      return;
+    }
   grub_free (nb->head);
 }
 
+void
+grub_netbuff_pool_flush (void)
+{
+  while (pool)
+    {
+      struct grub_net_buff *nb = pool;
+      pool = *(struct grub_net_buff **) nb->head;
+      grub_free (nb->head);
+    }
+  pool_count = 0;
+}
+
 grub_err_t
 grub_netbuff_clear (struct grub_net_buff *nb)
 {
@@ -21,6 +21,7 @@
 #include <grub/net/tcp.h>
 #include <grub/net/netbuff.h>
 #include <grub/time.h>
+#include <grub/env.h>
 #include <grub/priority_queue.h>
 
 #define TCP_SYN_RETRANSMISSION_TIMEOUT GRUB_NET_INTERVAL
@@ -28,6 +29,25 @@
 #define TCP_RETRANSMISSION_TIMEOUT GRUB_NET_INTERVAL
 #define TCP_RETRANSMISSION_COUNT GRUB_NET_TRIES
 
+/* Receive window, overridable with the net_tcp_window variable.  */
+#define TCP_DEFAULT_WINDOW (4 << 20)
+#define TCP_MIN_WINDOW 2048
+#define TCP_MAX_WINDOW (1 << 30)
+#define TCP_MAX_WINDOW_SHIFT 14
+/* MSS assumed by RFC 1122 when the peer doesn't announce one.  */
+#define TCP_DEFAULT_MSS 536
+/* Out-of-order ranges reported in an ACK.  Without timestamps four fit
+   in the option space.  */
+#define TCP_MAX_SACK_BLOCKS 4
+/* In-order segments received before an ACK is forced.  Fewer are acked
+   on the next poll.  */
+#define TCP_DELAYED_ACK_SEGMENTS 4
+
+/* Sequence number comparisons modulo 2^32.  */
+#define tcp_seq_lt(a, b) ((grub_int32_t) ((a) - (b)) < 0)
+#define tcp_seq_le(a, b) ((grub_int32_t) ((a) - (b)) <= 0)
+#define tcp_seq_gt(a, b) tcp_seq_lt (b, a)
+
 struct unacked
 {
   struct unacked *next;
@@ -47,6 +67,22 @@ enum
     TCP_URG = 0x20,
   };
 
+enum
+  {
+    TCP_OPT_END = 0,
+    TCP_OPT_NOP = 1,
+    TCP_OPT_MSS = 2,
+    TCP_OPT_WINDOW_SCALE = 3,
+    TCP_OPT_SACK_PERMITTED = 4,
+    TCP_OPT_SACK = 5
+  };
+
+struct tcp_sack_block
+{
+  grub_uint32_t start;
+  grub_uint32_t end;
+};
+
 struct grub_net_tcp_socket
 {
   struct grub_net_tcp_socket *next;
@@ -65,7 +101,16 @@ struct grub_net_tcp_socket
   grub_uint32_t my_cur_seq;
   grub_uint32_t their_start_seq;
   grub_uint32_t their_cur_seq;
-  grub_uint16_t my_window;
+  grub_uint32_t my_window;
+  grub_uint8_t my_window_shift;
+  int window_scaling;
+  int sack_ok;
+  grub_uint16_t my_mss;
+  grub_uint16_t their_mss;
+  int ack_pending;
+  int segs_unacked;
+  int n_sack;
+  struct tcp_sack_block sack[TCP_MAX_SACK_BLOCKS];
   struct unacked *unack_first;
   struct unacked *unack_last;
   grub_err_t (*recv_hook) (grub_net_tcp_socket_t sock, struct grub_net_buff *nb,
@@ -78,6 +123,21 @@ struct grub_net_tcp_socket
   struct grub_net_network_level_interface *inf;
   grub_net_packets_t packs;
   grub_priority_queue_t pq;
+  int pq_len;
+
+  /* Counters for net_stats.  */
+  grub_uint64_t bytes_in;
+  grub_uint64_t bytes_out;
+  grub_uint64_t segs_in;
+  grub_uint64_t segs_out;
+  grub_uint64_t retransmits;
+  grub_uint64_t out_of_order;
+  grub_uint64_t dup_acks;
+  grub_uint64_t stalls;
+  grub_uint64_t stall_start;
+  grub_uint64_t stall_ms;
+  /* Smoothed round-trip time in 1/8 ms, 0 until measured.  */
+  grub_uint32_t srtt;
 };
 
 struct grub_net_tcp_listen
@@ -106,17 +166,36 @@ struct tcphdr
   grub_uint16_t urgent;
 } GRUB_PACKED;
 
+struct tcp_mss_opt {
+  grub_uint8_t kind;
+  grub_uint8_t length;
+  grub_uint16_t mss;
+} GRUB_PACKED;
+
 struct tcp_scale_opt {
   grub_uint8_t kind;
   grub_uint8_t length;
   grub_uint8_t scale;
 } GRUB_PACKED;
 
+struct tcp_sack_permitted_opt {
+  grub_uint8_t kind;
+  grub_uint8_t length;
+} GRUB_PACKED;
+
 struct tcp_synhdr {
   struct tcphdr tcphdr;
+  struct tcp_mss_opt mss_opt;
+  grub_uint8_t nop;
   struct tcp_scale_opt scale_opt;
-  grub_uint8_t padding;
-};
+  grub_uint8_t nop2[2];
+  struct tcp_sack_permitted_opt sack_opt;
+} GRUB_PACKED;
+
+struct tcp_sack_opt_block {
+  grub_uint32_t start;
+  grub_uint32_t end;
+} GRUB_PACKED;
 
 struct tcp_pseudohdr
 {
@@ -175,6 +254,193 @@ tcp_socket_register (grub_net_tcp_socket_t sock)
 		  GRUB_AS_LIST (sock));
 }
 
+/* Set up the receive window of SOCK and the scale needed to announce
+   it.  */
+static void
+tcp_init_window (grub_net_tcp_socket_t sock)
+{
+  const char *val;
+  unsigned long window = TCP_DEFAULT_WINDOW;
+
+  val = grub_env_get ("net_tcp_window");
+  if (val)
+    {
+      window = grub_strtoul (val, 0, 0);
+      if (grub_errno)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  window = TCP_DEFAULT_WINDOW;
+	}
+      if (window < TCP_MIN_WINDOW)
+	window = TCP_MIN_WINDOW;
+      if (window > TCP_MAX_WINDOW)
+	window = TCP_MAX_WINDOW;
+    }
+
+  sock->my_window = window;
+  sock->my_window_shift = 0;
+  while ((window >> sock->my_window_shift) > 0xffff
+	 && sock->my_window_shift < TCP_MAX_WINDOW_SHIFT)
+    sock->my_window_shift++;
+}
+
+/* The largest segment we can take without fragmentation on INF.  */
+static grub_uint16_t
+tcp_mss (const struct grub_net_network_level_interface *inf,
+	 const grub_net_network_level_address_t *addr)
+{
+  grub_size_t overhead = sizeof (struct tcphdr);
+
+  if (addr->type == GRUB_NET_NETWORK_LEVEL_PROTOCOL_IPV4)
+    overhead += GRUB_NET_OUR_IPV4_HEADER_SIZE;
+  else
+    overhead += GRUB_NET_OUR_IPV6_HEADER_SIZE;
+
+  if (inf->card->mtu < overhead + TCP_DEFAULT_MSS)
+    return TCP_DEFAULT_MSS;
+  if (inf->card->mtu - overhead > 0xffff)
+    return 0xffff;
+  return inf->card->mtu - overhead;
+}
+
+/* The window field to send on SOCK, big-endian.  */
+static grub_uint16_t
+tcp_window (grub_net_tcp_socket_t sock)
+{
+  grub_uint32_t window = sock->my_window >> sock->my_window_shift;
+
+  if (sock->i_stall)
+    return 0;
+  if (window > 0xffff)
+    window = 0xffff;
+  return grub_cpu_to_be16 (window);
+}
+
+/* Return the option KIND in the header TCPH or NULL.  */
+static grub_uint8_t *
+tcp_find_option (struct tcphdr *tcph, grub_uint8_t kind)
+{
+  grub_uint8_t *ptr = (grub_uint8_t *) (tcph + 1);
+  grub_uint8_t *end = ((grub_uint8_t *) tcph
+		       + (grub_be_to_cpu16 (tcph->flags) >> 12) * 4);
+
+  while (ptr < end && *ptr != TCP_OPT_END)
+    {
+      if (*ptr == TCP_OPT_NOP)
+	{
+	  ptr++;
+	  continue;
+	}
+      if (ptr + 1 >= end || ptr[1] < 2 || ptr + ptr[1] > end)
+	break;
+      if (*ptr == kind)
+	return ptr;
+      ptr += ptr[1];
+    }
+  return NULL;
+}
+
+/* Pick up what the peer offered in its SYN.  */
+static void
+tcp_parse_syn_options (grub_net_tcp_socket_t sock, struct tcphdr *tcph)
+{
+  grub_uint8_t *opt;
+
+  opt = tcp_find_option (tcph, TCP_OPT_MSS);
+  if (opt && opt[1] == sizeof (struct tcp_mss_opt))
+    sock->their_mss = (opt[2] << 8) | opt[3];
+
+  /* Scaling is only in effect if both sides ask for it.  */
+  opt = tcp_find_option (tcph, TCP_OPT_WINDOW_SCALE);
+  sock->window_scaling = (opt && opt[1] == sizeof (struct tcp_scale_opt));
+  if (!sock->window_scaling)
+    sock->my_window_shift = 0;
+
+  opt = tcp_find_option (tcph, TCP_OPT_SACK_PERMITTED);
+  sock->sack_ok = (opt && opt[1] == sizeof (struct tcp_sack_permitted_opt));
+}
+
+/* Fill in the header of a SYN or SYN-ACK sent on SOCK.  */
+static void
+tcp_syn_options (grub_net_tcp_socket_t sock, struct tcp_synhdr *tcph)
+{
+  grub_uint32_t window = sock->my_window;
+
+  grub_memset ((grub_uint8_t *) tcph + sizeof (tcph->tcphdr), TCP_OPT_NOP,
+	       sizeof (*tcph) - sizeof (tcph->tcphdr));
+  tcph->mss_opt.kind = TCP_OPT_MSS;
+  tcph->mss_opt.length = sizeof (tcph->mss_opt);
+  tcph->mss_opt.mss = grub_cpu_to_be16 (sock->my_mss);
+  if (sock->window_scaling)
+    {
+      tcph->scale_opt.kind = TCP_OPT_WINDOW_SCALE;
+      tcph->scale_opt.length = sizeof (tcph->scale_opt);
+      tcph->scale_opt.scale = sock->my_window_shift;
+    }
+  if (sock->sack_ok)
+    {
+      tcph->sack_opt.kind = TCP_OPT_SACK_PERMITTED;
+      tcph->sack_opt.length = sizeof (tcph->sack_opt);
+    }
+
+  /* The window in a SYN is never scaled.  */
+  if (window > 0xffff)
+    window = 0xffff;
+  tcph->tcphdr.window = grub_cpu_to_be16 (window);
+  tcph->tcphdr.urgent = 0;
+}
+
+/* Remember that [START, END) arrived out of order.  The block holding
+   it goes first, as RFC 2018 asks, and the oldest one is dropped when
+   there's no room.  */
+static void
+tcp_sack_add (grub_net_tcp_socket_t sock, grub_uint32_t start,
+	      grub_uint32_t end)
+{
+  struct tcp_sack_block merged = { start, end };
+  int i, j;
+
+  for (i = 0, j = 0; i < sock->n_sack; i++)
+    {
+      struct tcp_sack_block *b = &sock->sack[i];
+
+      if (tcp_seq_le (b->start, merged.end)
+	  && tcp_seq_le (merged.start, b->end))
+	{
+	  if (tcp_seq_lt (b->start, merged.start))
+	    merged.start = b->start;
+	  if (tcp_seq_gt (b->end, merged.end))
+	    merged.end = b->end;
+	  continue;
+	}
+      sock->sack[j++] = *b;
+    }
+
+  if (j == TCP_MAX_SACK_BLOCKS)
+    j--;
+  grub_memmove (&sock->sack[1], &sock->sack[0], j * sizeof (sock->sack[0]));
+  sock->sack[0] = merged;
+  sock->n_sack = j + 1;
+}
+
+/* Drop the parts of the SACK blocks that are now acked cumulatively.  */
+static void
+tcp_sack_trim (grub_net_tcp_socket_t sock)
+{
+  int i, j;
+
+  for (i = 0, j = 0; i < sock->n_sack; i++)
+    {
+      if (tcp_seq_le (sock->sack[i].end, sock->their_cur_seq))
+	continue;
+      sock->sack[j] = sock->sack[i];
+      if (tcp_seq_lt (sock->sack[j].start, sock->their_cur_seq))
+	sock->sack[j].start = sock->their_cur_seq;
+      j++;
+    }
+  sock->n_sack = j;
+}
+
 static void
 error (grub_net_tcp_socket_t sock)
 {
@@ -210,6 +476,14 @@ tcp_send (struct grub_net_buff *nb, grub_net_tcp_socket_t socket)
   if (grub_be_to_cpu16 (tcph->flags) & TCP_FIN)
     size++;
   socket->my_cur_seq += size;
+  socket->segs_out++;
+  socket->bytes_out += size;
+  /* Any segment carrying an ACK makes a pending delayed one redundant.  */
+  if (grub_be_to_cpu16 (tcph->flags) & TCP_ACK)
+    {
+      socket->ack_pending = 0;
+      socket->segs_unacked = 0;
+    }
   tcph->src = grub_cpu_to_be16 (socket->in_port);
   tcph->dst = grub_cpu_to_be16 (socket->out_port);
   tcph->checksum = 0;
@@ -312,8 +586,13 @@ ack_real (grub_net_tcp_socket_t sock, int res)
   struct grub_net_buff *nb_ack;
   struct tcphdr *tcph_ack;
   grub_err_t err;
+  grub_size_t optlen = 0;
 
-  nb_ack = grub_netbuff_alloc (sizeof (*tcph_ack) + 128);
+  /* Report what arrived past the first hole.  */
+  if (!res && sock->sack_ok && sock->n_sack)
+    optlen = 4 + sock->n_sack * sizeof (struct tcp_sack_opt_block);
+
+  nb_ack = grub_netbuff_alloc (sizeof (*tcph_ack) + optlen + 128);
   if (!nb_ack)
     return;
   err = grub_netbuff_reserve (nb_ack, 128);
@@ -325,7 +604,7 @@ ack_real (grub_net_tcp_socket_t sock, int res)
       return;
     }
 
-  err = grub_netbuff_put (nb_ack, sizeof (*tcph_ack));
+  err = grub_netbuff_put (nb_ack, sizeof (*tcph_ack) + optlen);
   if (err)
     {
       grub_netbuff_free (nb_ack);
@@ -334,6 +613,22 @@ ack_real (grub_net_tcp_socket_t sock, int res)
       return;
     }
   tcph_ack = (void *) nb_ack->data;
+  if (optlen)
+    {
+      grub_uint8_t *opt = (grub_uint8_t *) (tcph_ack + 1);
+      struct tcp_sack_opt_block *blocks = (void *) (opt + 4);
+      int i;
+
+      opt[0] = TCP_OPT_NOP;
+      opt[1] = TCP_OPT_NOP;
+      opt[2] = TCP_OPT_SACK;
+      opt[3] = optlen - 2;
+      for (i = 0; i < sock->n_sack; i++)
+	{
+	  blocks[i].start = grub_cpu_to_be32 (sock->sack[i].start);
+	  blocks[i].end = grub_cpu_to_be32 (sock->sack[i].end);
+	}
+    }
   if (res)
     {
       tcph_ack->ack = grub_cpu_to_be32_compile_time (0);
@@ -343,9 +638,8 @@ ack_real (grub_net_tcp_socket_t sock, int res)
   else
     {
       tcph_ack->ack = grub_cpu_to_be32 (sock->their_cur_seq);
-      tcph_ack->flags = grub_cpu_to_be16_compile_time ((5 << 12) | TCP_ACK);
-      tcph_ack->window = !sock->i_stall ? grub_cpu_to_be16 (sock->my_window)
-	: 0;
+      tcph_ack->flags = grub_cpu_to_be16 (((5 + optlen / 4) << 12) | TCP_ACK);
+      tcph_ack->window = tcp_window (sock);
     }
   tcph_ack->urgent = 0;
   tcph_ack->src = grub_cpu_to_be16 (sock->in_port);
@@ -370,6 +664,23 @@ reset (grub_net_tcp_socket_t sock)
   ack_real (sock, 1);
 }
 
+void
+grub_net_tcp_interface_gone (const struct grub_net_network_level_interface *inf)
+{
+  grub_net_tcp_socket_t sock;
+
+  /* The owners are told first, so that whatever they send on the way out
+     is dropped with the rest.  Sockets kept open across files, such as
+     idle HTTP connections, would otherwise be retransmitted through INF
+     after it is freed.  */
+  FOR_TCP_SOCKETS (sock)
+    if (sock->inf == inf)
+      {
+	error (sock);
+	sock->ack_pending = 0;
+      }
+}
+
 void
 grub_net_tcp_retransmit (void)
 {
@@ -380,6 +691,11 @@ grub_net_tcp_retransmit (void)
   FOR_TCP_SOCKETS (sock)
   {
     struct unacked *unack;
+
+    /* Flush the ACKs held back while this poll was receiving.  */
+    if (sock->ack_pending)
+      ack (sock);
+
     for (unack = sock->unack_first; unack; unack = unack->next)
       {
 	struct tcphdr *tcph;
@@ -396,17 +712,27 @@ grub_net_tcp_retransmit (void)
 	  }
 	unack->try_count++;
 	unack->last_try = ctime;
+	sock->retransmits++;
+	grub_net_stats.tcp_retransmits++;
+	grub_dprintf ("tcp", "%d->%d: retransmitting %u, try %d\n",
+		      sock->in_port, sock->out_port,
+		      grub_be_to_cpu32 (((struct tcphdr *) unack->nb->data)
+					->seqnr) - sock->my_start_seq,
+		      unack->try_count);
 	nbd = unack->nb->data;
 	tcph = (struct tcphdr *) nbd;
 
 	if ((tcph->flags & grub_cpu_to_be16_compile_time (TCP_ACK))
 	    && tcph->ack != grub_cpu_to_be32 (sock->their_cur_seq))
 	  {
-	    tcph->checksum = 0;
-	    tcph->checksum = grub_net_ip_transport_checksum (unack->nb,
-							     GRUB_NET_IP_TCP,
-							     &sock->inf->address,
-							     &sock->out_nla);
+	    grub_uint32_t ack = grub_cpu_to_be32 (sock->their_cur_seq);
+
+	    /* Acknowledge what came in since, patching the checksum
+	       rather than summing the whole segment again.  */
+	    tcph->checksum = grub_net_ip_chksum_update (tcph->checksum,
+							&tcph->ack, &ack,
+							sizeof (ack));
+	    tcph->ack = ack;
 	  }
 
 	err = grub_net_send_ip_packet (sock->inf, &(sock->out_nla),
@@ -428,11 +754,10 @@ grub_net_ip_transport_checksum (struct grub_net_buff *nb,
 				const grub_net_network_level_address_t *src,
 				const grub_net_network_level_address_t *dst)
 {
-  grub_uint16_t a, b = 0;
-  grub_uint32_t c;
-  a = ~grub_be_to_cpu16 (grub_net_ip_chksum ((void *) nb->data,
-					     nb->tail - nb->data));
+  grub_uint32_t sum = 0;
 
+  /* The pseudo header goes first, since the data may have an odd
+     length.  */
   switch (dst->type)
     {
     case GRUB_NET_NETWORK_LEVEL_PROTOCOL_IPV4:
@@ -443,7 +768,7 @@ grub_net_ip_transport_checksum (struct grub_net_buff *nb,
 	ph.zero = 0;
 	ph.tcp_length = grub_cpu_to_be16 (nb->tail - nb->data);
 	ph.proto = proto;
-	b = ~grub_be_to_cpu16 (grub_net_ip_chksum ((void *) &ph, sizeof (ph)));
+	sum = grub_net_ip_chksum_partial (&ph, sizeof (ph), 0);
 	break;
       }
     case GRUB_NET_NETWORK_LEVEL_PROTOCOL_IPV6:
@@ -454,20 +779,16 @@ grub_net_ip_transport_checksum (struct grub_net_buff *nb,
 	grub_memset (ph.zero, 0, sizeof (ph.zero));
 	ph.tcp_length = grub_cpu_to_be32 (nb->tail - nb->data);
 	ph.proto = proto;
-	b = ~grub_be_to_cpu16 (grub_net_ip_chksum ((void *) &ph, sizeof (ph)));
+	sum = grub_net_ip_chksum_partial (&ph, sizeof (ph), 0);
 	break;
       }
     case GRUB_NET_NETWORK_LEVEL_PROTOCOL_DHCP_RECV:
-      b = 0;
       break;
     }
-  c = (grub_uint32_t) a + (grub_uint32_t) b;
-  if (c >= 0xffff)
-    c -= 0xffff;
-  return grub_cpu_to_be16 (~c);
+  sum = grub_net_ip_chksum_partial (nb->data, nb->tail - nb->data, sum);
+  return grub_net_ip_chksum_fold (sum);
 }
 
-/* FIXME: overflow. */
 static int
 cmp (const void *a__, const void *b__)
 {
@@ -476,9 +797,9 @@ cmp (const void *a__, const void *b__)
   struct tcphdr *a = (struct tcphdr *) a_->data;
   struct tcphdr *b = (struct tcphdr *) b_->data;
   /* We want the first elements to be on top.  */
-  if (grub_be_to_cpu32 (a->seqnr) < grub_be_to_cpu32 (b->seqnr))
+  if (tcp_seq_lt (grub_be_to_cpu32 (a->seqnr), grub_be_to_cpu32 (b->seqnr)))
     return +1;
-  if (grub_be_to_cpu32 (a->seqnr) > grub_be_to_cpu32 (b->seqnr))
+  if (tcp_seq_gt (grub_be_to_cpu32 (a->seqnr), grub_be_to_cpu32 (b->seqnr)))
     return -1;
   return 0;
 }
@@ -508,7 +829,7 @@ grub_net_tcp_accept (grub_net_tcp_socket_t sock,
 		     void *hook_data)
 {
   struct grub_net_buff *nb_ack;
-  struct tcphdr *tcph;
+  struct tcp_synhdr *tcph;
   grub_err_t err;
   grub_net_network_level_address_t gateway;
   struct grub_net_network_level_interface *inf;
@@ -546,10 +867,11 @@ grub_net_tcp_accept (grub_net_tcp_socket_t sock,
       return err;
     }
   tcph = (void *) nb_ack->data;
-  tcph->ack = grub_cpu_to_be32 (sock->their_cur_seq);
-  tcph->flags = grub_cpu_to_be16_compile_time ((5 << 12) | TCP_SYN | TCP_ACK);
-  tcph->window = grub_cpu_to_be16 (sock->my_window);
-  tcph->urgent = 0;
+  tcph->tcphdr.ack = grub_cpu_to_be32 (sock->their_cur_seq);
+  tcph->tcphdr.flags
+    = grub_cpu_to_be16_compile_time (((sizeof (*tcph) / 4) << 12)
+				     | TCP_SYN | TCP_ACK);
+  tcp_syn_options (sock, tcph);
   sock->established = 1;
   tcp_socket_register (sock);
   err = tcp_send (nb_ack, sock);
@@ -650,18 +972,19 @@ grub_net_tcp_open (char *server,
   grub_memset(tcph, 0, sizeof (*tcph));
   socket->my_start_seq = grub_get_time_ms ();
   socket->my_cur_seq = socket->my_start_seq + 1;
-  socket->my_window = 32768;
+  tcp_init_window (socket);
+  socket->my_mss = tcp_mss (inf, &addr);
+  /* Offer both; the SYN-ACK tells what the peer agreed to.  */
+  socket->window_scaling = 1;
+  socket->sack_ok = 1;
   tcph->tcphdr.seqnr = grub_cpu_to_be32 (socket->my_start_seq);
   tcph->tcphdr.ack = grub_cpu_to_be32_compile_time (0);
-  tcph->tcphdr.flags = grub_cpu_to_be16_compile_time ((6 << 12) | TCP_SYN);
-  tcph->tcphdr.window = grub_cpu_to_be16 (socket->my_window);
-  tcph->tcphdr.urgent = 0;
+  tcph->tcphdr.flags
+    = grub_cpu_to_be16_compile_time (((sizeof (*tcph) / 4) << 12) | TCP_SYN);
+  tcp_syn_options (socket, tcph);
   tcph->tcphdr.src = grub_cpu_to_be16 (socket->in_port);
   tcph->tcphdr.dst = grub_cpu_to_be16 (socket->out_port);
   tcph->tcphdr.checksum = 0;
-  tcph->scale_opt.kind = 3;
-  tcph->scale_opt.length = 3;
-  tcph->scale_opt.scale = 5;
   tcph->tcphdr.checksum = grub_net_ip_transport_checksum (nb, GRUB_NET_IP_TCP,
 							  &socket->inf->address,
 							  &socket->out_nla);
@@ -722,6 +1045,8 @@ grub_net_send_tcp_packet (const grub_net_tcp_socket_t socket,
 	       - sizeof (*tcph));
   else
     fraglen = 1280 - GRUB_NET_OUR_IPV6_HEADER_SIZE;
+  if (socket->their_mss && fraglen > socket->their_mss)
+    fraglen = socket->their_mss;
 
   while (nb->tail - nb->data > fraglen)
     {
@@ -743,8 +1068,7 @@ grub_net_send_tcp_packet (const grub_net_tcp_socket_t socket,
       tcph = (struct tcphdr *) nb2->data;
       tcph->ack = grub_cpu_to_be32 (socket->their_cur_seq);
       tcph->flags = grub_cpu_to_be16_compile_time ((5 << 12) | TCP_ACK);
-      tcph->window = !socket->i_stall ? grub_cpu_to_be16 (socket->my_window)
-	: 0;
+      tcph->window = tcp_window (socket);
       tcph->urgent = 0;
       err = grub_netbuff_put (nb2, fraglen);
       if (err)
@@ -767,7 +1091,7 @@ grub_net_send_tcp_packet (const grub_net_tcp_socket_t socket,
   tcph->ack = grub_cpu_to_be32 (socket->their_cur_seq);
   tcph->flags = (grub_cpu_to_be16_compile_time ((5 << 12) | TCP_ACK)
 		 | (push ? grub_cpu_to_be16_compile_time (TCP_PUSH) : 0));
-  tcph->window = !socket->i_stall ? grub_cpu_to_be16 (socket->my_window) : 0;
+  tcph->window = tcp_window (socket);
   tcph->urgent = 0;
   return tcp_send (nb, socket);
 }
@@ -780,6 +1104,8 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
   struct tcphdr *tcph;
   grub_net_tcp_socket_t sock;
   grub_err_t err;
+  grub_uint32_t seg_start;
+  grub_ssize_t seg_len;
 
   /* Ignore broadcast.  */
   if (!inf)
@@ -831,6 +1157,7 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	  }
 	tcph->checksum = chk;
       }
+    sock->segs_in++;
 
     if ((grub_be_to_cpu16 (tcph->flags) & TCP_SYN)
 	&& (grub_be_to_cpu16 (tcph->flags) & TCP_ACK)
@@ -839,6 +1166,7 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	sock->their_start_seq = grub_be_to_cpu32 (tcph->seqnr);
 	sock->their_cur_seq = sock->their_start_seq + 1;
 	sock->established = 1;
+	tcp_parse_syn_options (sock, tcph);
       }
 
     if (grub_be_to_cpu16 (tcph->flags) & TCP_RST)
@@ -856,6 +1184,8 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
       {
 	struct unacked *unack, *next;
 	grub_uint32_t acked = grub_be_to_cpu32 (tcph->ack);
+	int freed = 0;
+	grub_uint64_t rtt = 0;
 	for (unack = sock->unack_first; unack; unack = next)
 	  {
 	    grub_uint32_t seqnr;
@@ -869,25 +1199,53 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	    if (grub_be_to_cpu16 (unack_tcph->flags) & TCP_FIN)
 	      seqnr++;
 
-	    if (seqnr > acked)
+	    if (tcp_seq_gt (seqnr, acked))
 	      break;
+	    /* Only segments sent once tell the round-trip time.  */
+	    if (unack->try_count == 1 && unack->last_try)
+	      rtt = grub_get_time_ms () - unack->last_try;
+	    freed = 1;
 	    grub_netbuff_free (unack->nb);
 	    grub_free (unack);
 	  }
+	if (sock->unack_first && !freed
+	    && !(grub_be_to_cpu16 (tcph->flags) & (TCP_SYN | TCP_FIN))
+	    && nb->tail - nb->data == (grub_be_to_cpu16 (tcph->flags) >> 12) * 4)
+	  {
+	    sock->dup_acks++;
+	    grub_net_stats.tcp_dup_acks++;
+	  }
+	if (rtt)
+	  {
+	    if (!sock->srtt)
+	      sock->srtt = rtt * 8;
+	    else
+	      sock->srtt += rtt - sock->srtt / 8;
+	  }
 	sock->unack_first = unack;
 	if (!sock->unack_first)
 	  sock->unack_last = NULL;
+
+	/* A SACK means the peer got data past the first unacked segment,
+	   so that one was lost.  Resend it on the next pass rather than
+	   waiting for the timer, but only once.  */
+	if (sock->sack_ok && sock->unack_first
+	    && sock->unack_first->try_count == 1
+	    && tcp_find_option (tcph, TCP_OPT_SACK))
+	  sock->unack_first->last_try = 0;
       }
 
-    if (grub_be_to_cpu32 (tcph->seqnr) < sock->their_cur_seq)
+    seg_start = grub_be_to_cpu32 (tcph->seqnr);
+    seg_len = (nb->tail - nb->data
+	       - (grub_be_to_cpu16 (tcph->flags) >> 12) * sizeof (grub_uint32_t));
+
+    if (tcp_seq_lt (seg_start, sock->their_cur_seq))
       {
 	ack (sock);
 	grub_netbuff_free (nb);
 	return GRUB_ERR_NONE;
       }
-    if (sock->i_reseted && (nb->tail - nb->data
-			    - (grub_be_to_cpu16 (tcph->flags)
-			       >> 12) * sizeof (grub_uint32_t)) > 0)
+    if (sock->i_reseted && seg_len > 0)
       {
 	reset (sock);
       }
@@ -898,11 +1256,13 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	grub_netbuff_free (nb);
 	return err;
       }
+    sock->pq_len++;
 
     {
       struct grub_net_buff **nb_top_p, *nb_top;
       int do_ack = 0;
       int just_closed = 0;
+      int filled_hole = (sock->n_sack != 0);
       while (1)
 	{
 	  nb_top_p = grub_priority_queue_top (sock->pq);
@@ -910,13 +1270,26 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	    return GRUB_ERR_NONE;
 	  nb_top = *nb_top_p;
 	  tcph = (struct tcphdr *) nb_top->data;
-	  if (grub_be_to_cpu32 (tcph->seqnr) >= sock->their_cur_seq)
+	  if (tcp_seq_le (sock->their_cur_seq, grub_be_to_cpu32 (tcph->seqnr)))
 	    break;
 	  grub_netbuff_free (nb_top);
 	  grub_priority_queue_pop (sock->pq);
+	  sock->pq_len--;
 	}
       if (grub_be_to_cpu32 (tcph->seqnr) != sock->their_cur_seq)
 	{
+	  /* Out of order: send a duplicate ACK right away so that the
+	     peer can recover.  */
+	  if (seg_len > 0 && seg_start != sock->their_cur_seq)
+	    {
+	      tcp_sack_add (sock, seg_start, seg_start + seg_len);
+	      sock->out_of_order++;
+	      grub_net_stats.tcp_out_of_order++;
+	      grub_dprintf ("tcp", "%d->%d: got %u while expecting %u\n",
+			    sock->out_port, sock->in_port,
+			    seg_start - sock->their_start_seq,
+			    sock->their_cur_seq - sock->their_start_seq);
+	    }
 	  ack (sock);
 	  return GRUB_ERR_NONE;
 	}
@@ -931,6 +1304,7 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	  if (grub_be_to_cpu32 (tcph->seqnr) != sock->their_cur_seq)
 	    break;
 	  grub_priority_queue_pop (sock->pq);
+	  sock->pq_len--;
 
 	  err = grub_netbuff_pull (nb_top, (grub_be_to_cpu16 (tcph->flags)
 					    >> 12) * sizeof (grub_uint32_t));
@@ -941,6 +1315,7 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	    }
 
 	  sock->their_cur_seq += (nb_top->tail - nb_top->data);
+	  sock->bytes_in += (nb_top->tail - nb_top->data);
 	  if (grub_be_to_cpu16 (tcph->flags) & TCP_FIN)
 	    {
 	      sock->they_closed = 1;
@@ -952,13 +1327,24 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	  if ((nb_top->tail - nb_top->data) > 0)
 	    {
 	      grub_net_put_packet (&sock->packs, nb_top);
+	      sock->segs_unacked++;
 	      do_ack = 1;
 	    }
 	  else
 	    grub_netbuff_free (nb_top);
 	}
+      tcp_sack_trim (sock);
+      /* ACK every few segments and when a FIN arrives or a hole gets
+	 filled.  Otherwise leave it to grub_net_tcp_retransmit at the
+	 end of the poll, so that a burst is acked once.  */
       if (do_ack)
-	ack (sock);
+	{
+	  if (just_closed || filled_hole
+	      || sock->segs_unacked >= TCP_DELAYED_ACK_SEGMENTS)
+	    ack (sock);
+	  else
+	    sock->ack_pending = 1;
+	}
       while (sock->packs.first)
 	{
 	  nb = sock->packs.first->nb;
@@ -995,7 +1381,9 @@ grub_net_recv_tcp_packet (struct grub_net_buff *nb,
 	sock->their_start_seq = grub_be_to_cpu32 (tcph->seqnr);
 	sock->their_cur_seq = sock->their_start_seq + 1;
 	sock->my_cur_seq = sock->my_start_seq = grub_get_time_ms ();
-	sock->my_window = 8192;
+	tcp_init_window (sock);
+	sock->my_mss = tcp_mss (inf, source);
+	tcp_parse_syn_options (sock, tcph);
 
 	sock->pq = grub_priority_queue_new (sizeof (struct grub_net_buff *),
 					    cmp);
@@ -1023,6 +1411,9 @@ grub_net_tcp_stall (grub_net_tcp_socket_t sock)
   if (sock->i_stall)
     return;
   sock->i_stall = 1;
+  sock->stalls++;
+  sock->stall_start = grub_get_time_ms ();
+  grub_net_stats.tcp_stalls++;
   ack (sock);
 }
 
@@ -1032,5 +1423,40 @@ grub_net_tcp_unstall (grub_net_tcp_socket_t sock)
   if (!sock->i_stall)
     return;
   sock->i_stall = 0;
+  sock->stall_ms += grub_get_time_ms () - sock->stall_start;
   ack (sock);
 }
+
+void
+grub_net_tcp_print_stats (void)
+{
+  grub_net_tcp_socket_t sock;
+
+  FOR_TCP_SOCKETS (sock)
+  {
+    char buf[GRUB_NET_MAX_STR_ADDR_LEN];
+    struct unacked *unack;
+    int unacked = 0;
+
+    for (unack = sock->unack_first; unack; unack = unack->next)
+      unacked++;
+    grub_net_addr_to_str (&sock->out_nla, buf);
+    grub_printf ("  %s:%d port %d%s\n", buf, sock->out_port, sock->in_port,
+		 sock->i_closed || sock->they_closed ? " (closed)" : "");
+    grub_printf ("    in %llu bytes %llu segments, out %llu bytes"
+		 " %llu segments\n",
+		 (unsigned long long) sock->bytes_in,
+		 (unsigned long long) sock->segs_in,
+		 (unsigned long long) sock->bytes_out,
+		 (unsigned long long) sock->segs_out);
+    grub_printf ("    rtt %u ms, %llu retransmits, %llu out of order,"
+		 " %llu duplicate ACKs\n", (sock->srtt + 4) / 8,
+		 (unsigned long long) sock->retransmits,
+		 (unsigned long long) sock->out_of_order,
+		 (unsigned long long) sock->dup_acks);
+    grub_printf ("    stalled %llu times for %llu ms, queued %d unacked"
+		 " %d out of order\n",
+		 (unsigned long long) sock->stalls,
+		 (unsigned long long) sock->stall_ms, unacked, sock->pq_len);
+  }
+}
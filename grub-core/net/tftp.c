@@ -25,6 +25,7 @@
 #include <grub/mm.h>
 #include <grub/dl.h>
 #include <grub/file.h>
+#include <grub/env.h>
 #include <grub/priority_queue.h>
 #include <grub/i18n.h>
 
@@ -44,6 +45,14 @@ enum
     TFTP_DEFAULTSIZE_PACKET = 512,
   };
 
+/* Blocks sent per ACK (RFC 7440), overridable with the
+   net_tftp_windowsize variable.  1 is the classic lock-step.  */
+enum
+  {
+    TFTP_DEFAULT_WINDOWSIZE = 16,
+    TFTP_MAX_WINDOWSIZE = 65535
+  };
+
 enum
   {
     TFTP_CODE_EOF = 1,
@@ -103,6 +112,11 @@ typedef struct tftp_data
   grub_uint64_t block;
   grub_uint32_t block_size;
   grub_uint64_t ack_sent;
+  grub_uint32_t window_size;
+  int ack_pending;
+  int gap_acked;
+  int dup_acked;
+  grub_uint16_t last_dup;
   int have_oack;
   struct grub_error_saved save_err;
   grub_net_udp_socket_t sock;
@@ -156,9 +170,33 @@ ack (tftp_data_t data, grub_uint64_t block)
   if (err)
     return err;
   data->ack_sent = block;
+  data->ack_pending = 0;
   return GRUB_ERR_NONE;
 }
 
+static grub_uint32_t
+tftp_window_size (void)
+{
+  const char *val;
+  unsigned long window;
+
+  val = grub_env_get ("net_tftp_windowsize");
+  if (!val)
+    return TFTP_DEFAULT_WINDOWSIZE;
+
+  window = grub_strtoul (val, 0, 0);
+  if (grub_errno)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return TFTP_DEFAULT_WINDOWSIZE;
+    }
+  if (window < 1)
+    return 1;
+  if (window > TFTP_MAX_WINDOWSIZE)
+    return TFTP_MAX_WINDOWSIZE;
+  return window;
+}
+
 static grub_err_t
 tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
 	      struct grub_net_buff *nb,
@@ -181,6 +219,8 @@ tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
     {
     case TFTP_OACK:
       data->block_size = TFTP_DEFAULTSIZE_PACKET;
+      /* Servers without RFC 7440 support leave the option out.  */
+      data->window_size = 1;
       data->have_oack = 1; 
       for (ptr = nb->data + sizeof (tftph->opcode); ptr < nb->tail;)
 	{
@@ -190,10 +230,16 @@ tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
 	  if (grub_memcmp (ptr, "blksize\0", sizeof ("blksize\0") - 1) == 0)
 	    data->block_size = grub_strtoul ((char *) ptr + sizeof ("blksize\0")
 					     - 1, 0, 0);
+	  if (grub_memcmp (ptr, "windowsize\0", sizeof ("windowsize\0") - 1) == 0)
+	    data->window_size = grub_strtoul ((char *) ptr
+					      + sizeof ("windowsize\0") - 1,
+					      0, 0);
 	  while (ptr < nb->tail && *ptr)
 	    ptr++;
 	  ptr++;
 	}
+      if (data->window_size < 1)
+	data->window_size = 1;
       data->block = 0;
       grub_netbuff_free (nb);
       err = ack (data, 0);
@@ -207,6 +253,26 @@ tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
 	  return GRUB_ERR_NONE;
 	}
 
+      /* With a window, an old block means the server missed our last
+	 ACK and is resending the whole window.  ACK once per round
+	 rather than for every block of it.  */
+      if (data->window_size > 1
+	  && cmp_block (grub_be_to_cpu16 (tftph->u.data.block),
+			data->block + 1) < 0)
+	{
+	  grub_uint16_t block = grub_be_to_cpu16 (tftph->u.data.block);
+
+	  grub_net_stats.tftp_duplicates++;
+	  if (!data->dup_acked || cmp_block (block, data->last_dup) <= 0)
+	    {
+	      ack (data, data->block);
+	      data->dup_acked = 1;
+	    }
+	  data->last_dup = block;
+	  grub_netbuff_free (nb);
+	  return GRUB_ERR_NONE;
+	}
+
       err = grub_priority_queue_push (data->pq, &nb);
       if (err)
 	return err;
@@ -222,21 +288,47 @@ tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
 	    tftph = (struct tftphdr *) nb_top->data;
 	    if (cmp_block (grub_be_to_cpu16 (tftph->u.data.block), data->block + 1) >= 0)
 	      break;
-	    ack (data, grub_be_to_cpu16 (tftph->u.data.block));
+	    /* Copies left over from a resent window are just dropped.  */
+	    grub_net_stats.tftp_duplicates++;
+	    if (data->window_size == 1)
+	      ack (data, grub_be_to_cpu16 (tftph->u.data.block));
 	    grub_netbuff_free (nb_top);
 	    grub_priority_queue_pop (data->pq);
 	  }
+	/* A block is missing: ACK the last one received in order so that
+	   the server resends from there without waiting for its
+	   timeout.  */
+	if (data->window_size > 1 && !data->gap_acked
+	    && cmp_block (grub_be_to_cpu16 (tftph->u.data.block),
+			  data->block + 1) > 0)
+	  {
+	    grub_net_stats.tftp_out_of_order++;
+	    grub_dprintf ("tftp", "got block %d while expecting %d\n",
+			  grub_be_to_cpu16 (tftph->u.data.block),
+			  (grub_uint16_t) (data->block + 1));
+	    err = ack (data, data->block);
+	    if (err)
+	      return err;
+	    data->gap_acked = 1;
+	  }
 	while (cmp_block (grub_be_to_cpu16 (tftph->u.data.block), data->block + 1) == 0)
 	  {
 	    unsigned size;
 
 	    grub_priority_queue_pop (data->pq);
+	    data->gap_acked = 0;
+	    data->dup_acked = 0;
 
-	    if (file->device->net->packs.count < 50)
+	    /* Only the last block of a window is acked.  */
+	    if (data->block + 1 - data->ack_sent < data->window_size)
+	      err = 0;
+	    else if (file->device->net->packs.count < 50)
 	      err = ack (data, data->block + 1);
 	    else
 	      {
 		file->device->net->stall = 1;
+		data->ack_pending = 1;
+		grub_net_stats.tftp_stalls++;
 		err = 0;
 	      }
 	    if (err)
@@ -269,7 +361,7 @@ tftp_receive (grub_net_udp_socket_t sock __attribute__ ((unused)),
 	      }
 	    /* If there is data, puts packet in socket list. */
 	    if ((nb_top->tail - nb_top->data) > 0)
-	      grub_net_put_packet (&file->device->net->packs, nb_top);
+	      grub_net_put_file_data (file->device->net, nb_top);
 	    else
 	      grub_netbuff_free (nb_top);
 	  }
@@ -334,6 +426,7 @@ tftp_open (struct grub_file *file, const char *filename)
   grub_uint8_t *nbd;
   grub_net_network_level_address_t addr;
   int port = file->device->net->port;
+  grub_uint32_t window_size;
 
   data = grub_zalloc (sizeof (*data));
   if (!data)
@@ -383,6 +476,18 @@ tftp_open (struct grub_file *file, const char *filename)
   grub_strcpy (rrq, "0");
   rrqlen += grub_strlen ("0") + 1;
   rrq += grub_strlen ("0") + 1;
+
+  window_size = tftp_window_size ();
+  if (window_size > 1)
+    {
+      grub_strcpy (rrq, "windowsize");
+      rrqlen += grub_strlen ("windowsize") + 1;
+      rrq += grub_strlen ("windowsize") + 1;
+
+      grub_snprintf (rrq, sizeof ("65535"), "%u", window_size);
+      rrqlen += grub_strlen (rrq) + 1;
+      rrq += grub_strlen (rrq) + 1;
+    }
   hdrlen = sizeof (tftph->opcode) + rrqlen;
 
   err = grub_netbuff_unput (&nb, nb.tail - (nb.data + hdrlen));
@@ -432,6 +537,8 @@ tftp_open (struct grub_file *file, const char *filename)
   for (i = 0; i < GRUB_NET_TRIES; i++)
     {
       nb.data = nbd;
+      if (i)
+	grub_net_stats.tftp_rrq_resends++;
       err = grub_net_send_udp_packet (data->sock, &nb);
       if (err)
 	{
@@ -510,7 +617,8 @@ tftp_packets_pulled (struct grub_file *file)
 
   if (!file->device->net->eof)
     file->device->net->stall = 0;
-  if (data->ack_sent >= data->block)
+  /* Send the window ACK held back while the queue was full.  */
+  if (!data->ack_pending || data->ack_sent >= data->block)
     return 0;
   return ack (data, data->block);
 }
@@ -844,8 +844,9 @@ run_menu (grub_menu_t menu, int nested, int *auto_boot)
   else
     clear_timeout ();
 
-  /* Initialize the animation engine.  */
-  s1_time = grub_get_time_ms ();
+  /* Initialize the animation engine.  S1_TIME is when the next frame is
+     due.  */
+  s1_time = grub_get_time_ms () + frame_speed;
 
   if (!animation_open && egn_refresh)
     {
@@ -899,10 +900,14 @@ run_menu (grub_menu_t menu, int nested, int *auto_boot)
 
       grub_uint64_t cur_time = grub_get_time_ms ();
 
-      /* Refresh the animation.  */
-      if (animation_open && (cur_time - s1_time >= frame_speed))
+      /* Refresh the animation.  Frames keep to their deadlines, and the
+	 ones missed while drawing or handling keys are dropped rather than
+	 drawn back to back.  */
+      if (animation_open && cur_time >= s1_time)
 	{
-	  s1_time = cur_time;
+	  s1_time += frame_speed;
+	  if (s1_time <= cur_time)
+	    s1_time = cur_time + frame_speed;
 	  menu_set_animation_state (egn_refresh);
 	}
 
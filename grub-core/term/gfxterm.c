@@ -45,6 +45,13 @@ struct grub_dirty_region
   int bottom_right_y;
 };
 
+/* Columns START to END (exclusive) of a row of text.  */
+struct grub_text_span
+{
+  unsigned int start;
+  unsigned int end;
+};
+
 struct grub_colored_char
 {
   /* An Unicode codepoint.  */
@@ -93,8 +100,22 @@ struct grub_virtual_screen
   grub_video_color_t bg_color_display;
 
   /* Text buffer for virtual screen.  Contains (columns * rows) number
-     of entries.  */
+     of entries.  Its rows form a ring with FIRST_ROW at the top, so
+     that scrolling does not have to move them.  */
   struct grub_colored_char *text_buffer;
+  unsigned int first_row;
+
+  /* The rows of the text layer form the same ring, with LAYER_FIRST_ROW
+     shown at the top.  It lags TOTAL_SCROLL rows behind FIRST_ROW until
+     real_scroll catches up.  */
+  unsigned int layer_first_row;
+
+  /* Characters of each row of the ring which have changed and have yet
+     to be painted on the text layer.  */
+  struct grub_text_span *pending;
+
+  /* Whether the cursor has to be drawn on the next refresh.  */
+  int cursor_pending;
 
   int total_scroll;
 
@@ -192,6 +213,7 @@ grub_virtual_screen_free (void)
 	grub_unicode_destroy_glyph (&virtual_screen.text_buffer[i].code);
       grub_free (virtual_screen.text_buffer);
     }
+  grub_free (virtual_screen.pending);
 
   /* Reset virtual screen data.  */
   grub_memset (&virtual_screen, 0, sizeof (virtual_screen));
@@ -226,7 +248,10 @@ grub_virtual_screen_setup (unsigned int x, unsigned int y,
   virtual_screen.cursor_x = 0;
   virtual_screen.cursor_y = 0;
   virtual_screen.cursor_state = 1;
+  virtual_screen.cursor_pending = 0;
   virtual_screen.total_scroll = 0;
+  virtual_screen.first_row = 0;
+  virtual_screen.layer_first_row = 0;
 
   /* Calculate size of text buffer.  */
   virtual_screen.columns = virtual_screen.width / virtual_screen.normal_char_width;
@@ -240,6 +265,11 @@ grub_virtual_screen_setup (unsigned int x, unsigned int y,
   if (grub_errno != GRUB_ERR_NONE)
     return grub_errno;
 
+  virtual_screen.pending = grub_zalloc (virtual_screen.rows
+					* sizeof (*virtual_screen.pending));
+  if (grub_errno != GRUB_ERR_NONE)
+    return grub_errno;
+
   /* Create new render target for text layer.  */
   grub_video_create_render_target (&text_layer,
                                    virtual_screen.width,
@@ -421,6 +451,65 @@ grub_gfxterm_term_fini (struct grub_term_output *term __attribute__ ((unused)))
   return GRUB_ERR_NONE;
 }
 
+/* Row of the ring in the text buffer and the text layer holding row CY of
+   the text.  */
+static inline unsigned int
+ring_row (unsigned int cy)
+{
+  return (virtual_screen.first_row + cy) % virtual_screen.rows;
+}
+
+static inline struct grub_colored_char *
+text_row (unsigned int cy)
+{
+  return virtual_screen.text_buffer + ring_row (cy) * virtual_screen.columns;
+}
+
+/* Blit the text layer to X, Y in the window.  Since its rows form a
+   ring, this can take up to three blits: up to the end of the ring, from
+   its start, and the part below the last full row.  */
+static void
+blit_text_layer (enum grub_video_blit_operators oper, int x, int y,
+		 unsigned int width, unsigned int height)
+{
+  int ring = virtual_screen.rows * virtual_screen.normal_char_height;
+  int top = virtual_screen.layer_first_row * virtual_screen.normal_char_height;
+  int sy = y - virtual_screen.offset_y;
+  int end = sy + (int) height;
+  int to, src;
+
+  /* Nothing of the text layer is above its offset.  */
+  if (sy < 0)
+    sy = 0;
+
+  while (sy < end)
+    {
+      if (top == 0 || sy >= ring)
+	{
+	  to = end;
+	  src = sy;
+	}
+      else if (sy < ring - top)
+	{
+	  to = ring - top;
+	  src = sy + top;
+	}
+      else
+	{
+	  to = ring;
+	  src = sy + top - ring;
+	}
+      if (to > end)
+	to = end;
+
+      grub_video_blit_render_target (text_layer, oper,
+				     x, sy + virtual_screen.offset_y,
+				     x - virtual_screen.offset_x, src,
+				     width, to - sy);
+      sy = to;
+    }
+}
+
 static void
 redraw_screen_rect (unsigned int x, unsigned int y,
                     unsigned int width, unsigned int height)
@@ -494,16 +583,10 @@ redraw_screen_rect (unsigned int x, unsigned int y,
 
   if (grub_gfxterm_background.blend_text_bg)
     /* Render text layer as blended.  */
-    grub_video_blit_render_target (text_layer, GRUB_VIDEO_BLIT_BLEND, x, y,
-                                   x - virtual_screen.offset_x,
-                                   y - virtual_screen.offset_y,
-                                   width, height);
+    blit_text_layer (GRUB_VIDEO_BLIT_BLEND, x, y, width, height);
   else
     /* Render text layer as replaced (to get texts background color).  */
-    grub_video_blit_render_target (text_layer, GRUB_VIDEO_BLIT_REPLACE, x, y,
-                                   x - virtual_screen.offset_x,
-                                   y - virtual_screen.offset_y,
-                                   width, height);
+    blit_text_layer (GRUB_VIDEO_BLIT_REPLACE, x, y, width, height);
 
   /* Restore saved viewport.  */
   grub_video_set_viewport (saved_view.x, saved_view.y,
@@ -603,66 +686,128 @@ dirty_region_redraw (void)
   redraw_screen_rect (x, y, width, height);
 }
 
-static inline void
-paint_char (unsigned cx, unsigned cy)
+/* Paint columns START to END of row CY of the text on the text layer.
+   The background of each run of characters in the same colour is filled
+   at once, and then the glyphs are drawn over it.  */
+static void
+paint_chars (unsigned int cy, unsigned int start, unsigned int end)
 {
-  struct grub_colored_char *p;
+  struct grub_colored_char *row;
   struct grub_font_glyph *glyph;
-  grub_video_color_t color;
-  grub_video_color_t bgcolor;
-  unsigned int x;
+  unsigned int char_width = virtual_screen.normal_char_width;
+  unsigned int height = virtual_screen.normal_char_height;
   unsigned int y;
+  unsigned int right;
+  unsigned int i, run, cells;
   int ascent;
-  unsigned int height;
-  unsigned int width;
 
-  if (cy + virtual_screen.total_scroll >= virtual_screen.rows)
+  row = text_row (cy);
+
+  /* The rest of a wide character is painted along with its start.  */
+  while (start < end && !row[start].code.base)
+    start++;
+  if (start >= end)
     return;
 
-  /* Find out active character.  */
-  p = (virtual_screen.text_buffer
-       + cx + (cy * virtual_screen.columns));
+  y = ring_row (cy) * height;
+  ascent = grub_font_get_ascent (virtual_screen.font);
+  right = end * char_width;
 
-  if (!p->code.base)
-    return;
+  grub_video_set_active_render_target (text_layer);
 
-  /* Get glyph for character.  */
-  glyph = grub_font_construct_glyph (virtual_screen.font, &p->code);
-  if (!glyph)
+  for (i = start; i < end; i = run)
     {
-      grub_errno = GRUB_ERR_NONE;
-      return;
+      for (run = i + 1; run < end; run++)
+	if (row[run].code.base && row[run].bg_color != row[i].bg_color)
+	  break;
+      grub_video_fill_rect (row[i].bg_color, i * char_width, y,
+			    (run - i) * char_width, height);
     }
-  ascent = grub_font_get_ascent (virtual_screen.font);
 
-  width = virtual_screen.normal_char_width * calculate_character_width(glyph);
-  height = virtual_screen.normal_char_height;
-
-  color = p->fg_color;
-  bgcolor = p->bg_color;
+  for (i = start; i < end; i++)
+    {
+      /* Blanks are only background.  */
+      if (!row[i].code.base
+	  || (row[i].code.base == ' ' && !row[i].code.ncomb
+	      && !row[i].code.attributes))
+	continue;
 
-  x = cx * virtual_screen.normal_char_width;
-  y = (cy + virtual_screen.total_scroll) * virtual_screen.normal_char_height;
+      glyph = grub_font_construct_glyph (virtual_screen.font, &row[i].code);
+      if (!glyph)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  continue;
+	}
+      grub_font_draw_glyph (glyph, row[i].fg_color, i * char_width,
+			    y + ascent);
+      cells = calculate_character_width (glyph);
+      if (right < (i + cells) * char_width)
+	right = (i + cells) * char_width;
+    }
 
-  /* Render glyph to text layer.  */
-  grub_video_set_active_render_target (text_layer);
-  grub_video_fill_rect (bgcolor, x, y, width, height);
-  grub_font_draw_glyph (glyph, color, x, y + ascent);
   grub_video_set_active_render_target (render_target);
 
-  /* Mark character to be drawn.  */
-  dirty_region_add (virtual_screen.offset_x + x, virtual_screen.offset_y + y,
-                    width, height);
+  /* Mark characters to be drawn.  */
+  dirty_region_add (virtual_screen.offset_x + start * char_width,
+		    virtual_screen.offset_y
+		    + (cy + virtual_screen.total_scroll) * height,
+		    right - start * char_width, height);
 }
 
-static inline void
-write_char (void)
+/* Have COUNT characters from CX, CY painted on the next refresh.  */
+static void
+mark_chars (unsigned int cx, unsigned int cy, unsigned int count)
 {
-  paint_char (virtual_screen.cursor_x, virtual_screen.cursor_y);
+  struct grub_text_span *span;
+  unsigned int end;
+
+  end = cx + count;
+  if (end > virtual_screen.columns)
+    end = virtual_screen.columns;
+  if (cx >= end)
+    return;
+
+  span = &virtual_screen.pending[ring_row (cy)];
+  if (span->start >= span->end)
+    {
+      span->start = cx;
+      span->end = end;
+      return;
+    }
+  if (span->start > cx)
+    span->start = cx;
+  if (span->end < end)
+    span->end = end;
 }
 
+/* Paint the characters which changed since the last refresh.  Rows which
+   real_scroll is about to bring in are left to it.  */
+static void
+paint_pending (void)
+{
+  struct grub_text_span *span;
+  unsigned int cy;
+
+  for (cy = 0; cy + virtual_screen.total_scroll < virtual_screen.rows; cy++)
+    {
+      span = &virtual_screen.pending[ring_row (cy)];
+      if (span->start < span->end)
+	paint_chars (cy, span->start, span->end);
+      span->start = span->end = 0;
+    }
+}
+
+/* Remove the cursor, by painting the character under it again.  */
 static inline void
-draw_cursor (int show)
+erase_cursor (void)
+{
+  if (virtual_screen.cursor_state)
+    mark_chars (virtual_screen.cursor_x, virtual_screen.cursor_y, 1);
+  virtual_screen.cursor_pending = 0;
+}
+
+static void
+draw_cursor (void)
 {
   unsigned int x;
   unsigned int y;
@@ -670,10 +815,10 @@ draw_cursor (int show)
   unsigned int height;
   unsigned int ascent;
   grub_video_color_t color;
-  
-  write_char ();
 
-  if (!show)
+  virtual_screen.cursor_pending = 0;
+
+  if (!virtual_screen.cursor_state)
     return;
 
   if (virtual_screen.cursor_y + virtual_screen.total_scroll
@@ -689,17 +834,19 @@ draw_cursor (int show)
   x = virtual_screen.cursor_x * virtual_screen.normal_char_width;
   width = virtual_screen.normal_char_width;
   color = virtual_screen.fg_color;
-  y = ((virtual_screen.cursor_y + virtual_screen.total_scroll)
-       * virtual_screen.normal_char_height
-       + ascent);
+  y = ring_row (virtual_screen.cursor_y) * virtual_screen.normal_char_height
+    + ascent;
   height = 2;
-  
+
   /* Render cursor to text layer.  */
   grub_video_set_active_render_target (text_layer);
   grub_video_fill_rect (color, x, y, width, height);
   grub_video_set_active_render_target (render_target);
-  
+
   /* Mark cursor to be redrawn.  */
+  y = ((virtual_screen.cursor_y + virtual_screen.total_scroll)
+       * virtual_screen.normal_char_height
+       + ascent);
   dirty_region_add (virtual_screen.offset_x + x,
 		    virtual_screen.offset_y + y,
 		    width, height);
@@ -708,7 +855,7 @@ draw_cursor (int show)
 static void
 real_scroll (void)
 {
-  unsigned int i, j, was_scroll;
+  unsigned int i, was_scroll;
   grub_video_color_t color;
 
   if (!virtual_screen.total_scroll)
@@ -717,12 +864,6 @@ real_scroll (void)
   /* If we have bitmap, re-draw screen, otherwise scroll physical screen too.  */
   if (grub_gfxterm_background.bitmap)
     {
-      /* Scroll physical screen.  */
-      grub_video_set_active_render_target (text_layer);
-      color = virtual_screen.bg_color;
-      grub_video_scroll (color, 0, -virtual_screen.normal_char_height
-			 * virtual_screen.total_scroll);
-
       /* Mark virtual screen to be redrawn.  */
       dirty_region_add_virtualscreen ();
     }
@@ -730,9 +871,6 @@ real_scroll (void)
     {
       grub_video_rect_t saved_view;
 
-      /* Remove cursor.  */
-      draw_cursor (0);
-
       grub_video_set_active_render_target (render_target);
 
       i = window.double_repaint ? 2 : 1;
@@ -773,56 +911,53 @@ real_scroll (void)
 	    grub_video_swap_buffers ();
 	}
       dirty_region_reset ();
-
-      /* Scroll physical screen.  */
-      grub_video_set_active_render_target (text_layer);
-      color = virtual_screen.bg_color;
-      grub_video_scroll (color, 0, -virtual_screen.normal_char_height
-			 * virtual_screen.total_scroll);
-
-      grub_video_set_active_render_target (render_target);
-
     }
 
+  /* Scrolling the text layer only moves the start of its ring.  */
+  virtual_screen.layer_first_row = virtual_screen.first_row;
+
   was_scroll = virtual_screen.total_scroll;
   virtual_screen.total_scroll = 0;
 
   if (was_scroll > virtual_screen.rows)
     was_scroll = virtual_screen.rows;
 
-  /* Draw shadow part.  */
+  /* Clear the rows which came in at the bottom and draw shadow part.  */
+  color = virtual_screen.bg_color;
   for (i = virtual_screen.rows - was_scroll;
        i < virtual_screen.rows; i++)
-    for (j = 0; j < virtual_screen.columns; j++)
-      paint_char (j, i);
+    {
+      grub_video_set_active_render_target (text_layer);
+      grub_video_fill_rect (color, 0,
+			    ring_row (i) * virtual_screen.normal_char_height,
+			    virtual_screen.width,
+			    virtual_screen.normal_char_height);
+      grub_video_set_active_render_target (render_target);
+
+      virtual_screen.pending[ring_row (i)].start = 0;
+      virtual_screen.pending[ring_row (i)].end = 0;
+      paint_chars (i, 0, virtual_screen.columns);
+    }
 
   /* Draw cursor if visible.  */
   if (virtual_screen.cursor_state)
-    draw_cursor (1);
+    virtual_screen.cursor_pending = 1;
 }
 
 static void
 scroll_up (void)
 {
+  struct grub_colored_char *row;
   unsigned int i;
 
-  /* Clear first line in text buffer.  */
+  /* Clear first line in text buffer and make it the last one.  */
+  row = text_row (0);
   for (i = 0; i < virtual_screen.columns; i++)
-    grub_unicode_destroy_glyph (&virtual_screen.text_buffer[i].code);
-  
-  /* Scroll text buffer with one line to up.  */
-  grub_memmove (virtual_screen.text_buffer,
-                virtual_screen.text_buffer + virtual_screen.columns,
-                sizeof (*virtual_screen.text_buffer)
-                * virtual_screen.columns
-                * (virtual_screen.rows - 1));
-
-  /* Clear last line in text buffer.  */
-  for (i = virtual_screen.columns * (virtual_screen.rows - 1);
-       i < virtual_screen.columns * virtual_screen.rows;
-       i++)
-    clear_char (&(virtual_screen.text_buffer[i]));
+    clear_char (&row[i]);
+  virtual_screen.pending[ring_row (0)].start = 0;
+  virtual_screen.pending[ring_row (0)].end = 0;
 
+  virtual_screen.first_row = ring_row (1);
   virtual_screen.total_scroll++;
 }
 
@@ -838,8 +973,7 @@ grub_gfxterm_putchar (struct grub_term_output *term,
     return;
 
   /* Erase current cursor, if any.  */
-  if (virtual_screen.cursor_state)
-    draw_cursor (0);
+  erase_cursor ();
 
   if (c->base == '\b' || c->base == '\n' || c->base == '\r')
     {
@@ -881,9 +1015,7 @@ grub_gfxterm_putchar (struct grub_term_output *term,
 	}
 
       /* Find position on virtual screen, and fill information.  */
-      p = (virtual_screen.text_buffer +
-           virtual_screen.cursor_x +
-           virtual_screen.cursor_y * virtual_screen.columns);
+      p = text_row (virtual_screen.cursor_y) + virtual_screen.cursor_x;
       grub_unicode_destroy_glyph (&p->code);
       grub_unicode_set_glyph (&p->code, c);
       grub_errno = GRUB_ERR_NONE;
@@ -895,17 +1027,17 @@ grub_gfxterm_putchar (struct grub_term_output *term,
         {
           unsigned i;
 
-          for (i = 1; i < char_width && p + i < 
-		 virtual_screen.text_buffer + virtual_screen.columns
-		 * virtual_screen.rows; i++)
+          for (i = 1; i < char_width
+		 && virtual_screen.cursor_x + i < virtual_screen.columns; i++)
 	      {
 		grub_unicode_destroy_glyph (&p[i].code);
 		p[i].code.base = 0;
 	      }
         }
 
-      /* Draw glyph.  */
-      write_char ();
+      /* Draw glyph on the next refresh.  */
+      mark_chars (virtual_screen.cursor_x, virtual_screen.cursor_y,
+		  char_width);
 
       /* Make sure we scroll screen when needed and wrap line correctly.  */
       virtual_screen.cursor_x += char_width;
@@ -921,10 +1053,8 @@ grub_gfxterm_putchar (struct grub_term_output *term,
     }
 
   /* Redraw cursor if it should be visible.  */
-  /* Note: This will redraw the character as well, which means that the
-     above call to write_char is redundant when the cursor is showing.  */
   if (virtual_screen.cursor_state)
-    draw_cursor (1);
+    virtual_screen.cursor_pending = 1;
 }
 
 /* Use ASCII characters to determine normal character width.  */
@@ -1001,15 +1131,14 @@ grub_gfxterm_gotoxy (struct grub_term_output *term __attribute__ ((unused)),
     pos.y = virtual_screen.rows - 1;
 
   /* Erase current cursor, if any.  */
-  if (virtual_screen.cursor_state)
-    draw_cursor (0);
+  erase_cursor ();
 
   virtual_screen.cursor_x = pos.x;
   virtual_screen.cursor_y = pos.y;
 
   /* Draw cursor if visible.  */
   if (virtual_screen.cursor_state)
-    draw_cursor (1);
+    virtual_screen.cursor_pending = 1;
 }
 
 static void
@@ -1019,7 +1148,12 @@ grub_virtual_screen_cls (struct grub_term_output *term __attribute__ ((unused)))
 
   for (i = 0; i < virtual_screen.columns * virtual_screen.rows; i++)
     clear_char (&(virtual_screen.text_buffer[i]));
+  grub_memset (virtual_screen.pending, 0,
+	       virtual_screen.rows * sizeof (*virtual_screen.pending));
 
+  virtual_screen.first_row = 0;
+  virtual_screen.total_scroll = 0;
+  virtual_screen.cursor_pending = 0;
   virtual_screen.cursor_x = virtual_screen.cursor_y = 0;
 }
 
@@ -1037,6 +1171,7 @@ grub_gfxterm_cls (struct grub_term_output *term)
   grub_video_fill_rect (color, 0, 0,
                         virtual_screen.width, virtual_screen.height);
   grub_video_set_active_render_target (render_target);
+  virtual_screen.layer_first_row = 0;
 
   /* Mark virtual screen to be redrawn.  */
   dirty_region_add_virtualscreen ();
@@ -1077,9 +1212,9 @@ grub_gfxterm_setcursor (struct grub_term_output *term __attribute__ ((unused)),
   if (virtual_screen.cursor_state != on)
     {
       if (virtual_screen.cursor_state)
-	draw_cursor (0);
+	erase_cursor ();
       else
-	draw_cursor (1);
+	virtual_screen.cursor_pending = 1;
 
       virtual_screen.cursor_state = on;
     }
@@ -1088,7 +1223,10 @@ grub_gfxterm_setcursor (struct grub_term_output *term __attribute__ ((unused)),
 static void
 grub_gfxterm_refresh (struct grub_term_output *term __attribute__ ((unused)))
 {
+  paint_pending ();
   real_scroll ();
+  if (virtual_screen.cursor_pending)
+    draw_cursor ();
 
   /* Redraw only changed regions.  */
   dirty_region_redraw ();
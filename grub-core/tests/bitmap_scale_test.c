@@ -0,0 +1,259 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026 Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/test.h>
+#include <grub/dl.h>
+#include <grub/misc.h>
+#include <grub/time.h>
+#include <grub/video.h>
+#include <grub/bitmap.h>
+#include <grub/bitmap_scale.h>
+
+GRUB_MOD_LICENSE ("GPLv3+");
+
+static grub_uint32_t seed = 443;
+
+static grub_uint8_t
+next_byte (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static struct grub_video_bitmap *
+make_bitmap (unsigned width, unsigned height,
+	     enum grub_video_blit_format format, int solid)
+{
+  struct grub_video_bitmap *bitmap;
+  grub_uint8_t *data;
+  grub_size_t i, size;
+  grub_uint8_t c[4];
+
+  if (grub_video_bitmap_create (&bitmap, width, height, format))
+    return 0;
+  data = bitmap->data;
+  size = (grub_size_t) bitmap->mode_info.pitch * height;
+  for (i = 0; i < sizeof (c); i++)
+    c[i] = next_byte ();
+  for (i = 0; i < size; i++)
+    data[i] = solid ? c[i % bitmap->mode_info.bytes_per_pixel] : next_byte ();
+  return bitmap;
+}
+
+/* Average of the source area under destination pixel (X, Y), computed
+   exactly.  Along each dimension destination pixel I covers
+   [I * SN, (I + 1) * SN) and source pixel S covers [S * DN, (S + 1) * DN).  */
+static grub_uint8_t
+reference_area (struct grub_video_bitmap *src, unsigned dw, unsigned dh,
+		unsigned x, unsigned y, unsigned comp)
+{
+  unsigned sw = src->mode_info.width, sh = src->mode_info.height;
+  unsigned bpp = src->mode_info.bytes_per_pixel;
+  grub_uint8_t *data = src->data;
+  grub_uint64_t sum = 0, total = (grub_uint64_t) sw * sh;
+  unsigned sx, sy;
+
+  for (sy = y * sh / dh; sy * dh < (y + 1) * sh; sy++)
+    {
+      unsigned oy = grub_min ((sy + 1) * dh, (y + 1) * sh)
+	- grub_max (sy * dh, y * sh);
+
+      for (sx = x * sw / dw; sx * dw < (x + 1) * sw; sx++)
+	{
+	  unsigned ox = grub_min ((sx + 1) * dw, (x + 1) * sw)
+	    - grub_max (sx * dw, x * sw);
+
+	  sum += (grub_uint64_t) ox * oy
+	    * data[sy * src->mode_info.pitch + sx * bpp + comp];
+	}
+    }
+  return grub_divmod64 (2 * sum + total, 2 * total, 0);
+}
+
+static const struct
+{
+  unsigned sw, sh, dw, dh;
+} sizes[] =
+  {
+    { 64, 48, 64, 48 },
+    { 64, 48, 32, 24 },
+    { 100, 77, 33, 19 },
+    { 512, 512, 32, 32 },
+    { 37, 23, 101, 89 },
+    { 1, 1, 5, 7 },
+    { 5, 7, 1, 1 },
+    { 300, 200, 7, 300 },
+    { 17, 3, 3, 17 }
+  };
+
+static const enum grub_video_bitmap_scale_method methods[] =
+  {
+    GRUB_VIDEO_BITMAP_SCALE_METHOD_NEAREST,
+    GRUB_VIDEO_BITMAP_SCALE_METHOD_BILINEAR,
+    GRUB_VIDEO_BITMAP_SCALE_METHOD_AREA,
+    GRUB_VIDEO_BITMAP_SCALE_METHOD_BEST
+  };
+
+static const enum grub_video_blit_format formats[] =
+  {
+    GRUB_VIDEO_BLIT_FORMAT_RGBA_8888,
+    GRUB_VIDEO_BLIT_FORMAT_RGB_888
+  };
+
+static void
+bitmap_scale_test (void)
+{
+  struct grub_video_bitmap *src, *dst;
+  unsigned i, f, m, x, y, c, bpp;
+  grub_uint8_t *s, *d;
+  int ok;
+
+  for (i = 0; i < ARRAY_SIZE (sizes); i++)
+    for (f = 0; f < ARRAY_SIZE (formats); f++)
+      {
+	/* Each pixel of a solid bitmap stays exactly the same.  */
+	src = make_bitmap (sizes[i].sw, sizes[i].sh, formats[f], 1);
+	grub_test_assert (src != 0, "couldn't create the bitmap");
+	if (! src)
+	  return;
+	bpp = src->mode_info.bytes_per_pixel;
+	s = src->data;
+	for (m = 0; m < ARRAY_SIZE (methods); m++)
+	  {
+	    grub_test_assert (grub_video_bitmap_create_scaled
+			      (&dst, sizes[i].dw, sizes[i].dh, src, methods[m])
+			      == GRUB_ERR_NONE,
+			      "couldn't scale %ux%u to %ux%u",
+			      sizes[i].sw, sizes[i].sh,
+			      sizes[i].dw, sizes[i].dh);
+	    if (! dst)
+	      continue;
+	    d = dst->data;
+	    ok = 1;
+	    for (y = 0; y < sizes[i].dh; y++)
+	      for (x = 0; x < sizes[i].dw * bpp; x++)
+		if (d[y * dst->mode_info.pitch + x] != s[x % bpp])
+		  ok = 0;
+	    grub_test_assert (ok, "solid %ux%u scaled to %ux%u with method %d"
+			      " changed", sizes[i].sw, sizes[i].sh,
+			      sizes[i].dw, sizes[i].dh, (int) methods[m]);
+	    grub_video_bitmap_destroy (dst);
+	  }
+	grub_video_bitmap_destroy (src);
+
+	/* Averaging is within one of the exact result.  */
+	src = make_bitmap (sizes[i].sw, sizes[i].sh, formats[f], 0);
+	if (! src)
+	  return;
+	grub_video_bitmap_create_scaled (&dst, sizes[i].dw, sizes[i].dh, src,
+					 GRUB_VIDEO_BITMAP_SCALE_METHOD_AREA);
+	if (dst)
+	  {
+	    int diff = 0;
+
+	    d = dst->data;
+	    for (y = 0; y < sizes[i].dh; y++)
+	      for (x = 0; x < sizes[i].dw; x++)
+		for (c = 0; c < bpp; c++)
+		  {
+		    int r = reference_area (src, sizes[i].dw, sizes[i].dh,
+					    x, y, c);
+		    int v = d[y * dst->mode_info.pitch + x * bpp + c];
+
+		    if (v - r > diff || r - v > diff)
+		      diff = v > r ? v - r : r - v;
+		  }
+	    grub_test_assert (diff <= 1,
+			      "averaging %ux%u to %ux%u is off by %d",
+			      sizes[i].sw, sizes[i].sh,
+			      sizes[i].dw, sizes[i].dh, diff);
+	    grub_video_bitmap_destroy (dst);
+	  }
+	grub_video_bitmap_destroy (src);
+      }
+
+  /* Halving averages each 2x2 block, rounding to nearest.  */
+  src = make_bitmap (64, 64, GRUB_VIDEO_BLIT_FORMAT_RGBA_8888, 0);
+  if (! src)
+    return;
+  grub_video_bitmap_create_scaled (&dst, 32, 32, src,
+				   GRUB_VIDEO_BITMAP_SCALE_METHOD_BEST);
+  if (dst)
+    {
+      s = src->data;
+      d = dst->data;
+      ok = 1;
+      for (y = 0; y < 32; y++)
+	for (x = 0; x < 32 * 4; x++)
+	  {
+	    unsigned p = 2 * y * 256 + (x / 4) * 8 + x % 4;
+	    unsigned sum = s[p] + s[p + 4] + s[p + 256] + s[p + 260];
+
+	    if (d[y * 128 + x] != (sum + 2) / 4)
+	      ok = 0;
+	  }
+      grub_test_assert (ok, "halving isn't averaging 2x2 blocks");
+      grub_video_bitmap_destroy (dst);
+    }
+  grub_video_bitmap_destroy (src);
+}
+
+#ifdef GRUB_TEST_BENCHMARK
+static void
+benchmark (unsigned sw, unsigned sh, unsigned dw, unsigned dh)
+{
+  struct grub_video_bitmap *src, *dst;
+  grub_uint64_t start;
+  unsigned m, n;
+
+  src = make_bitmap (sw, sh, GRUB_VIDEO_BLIT_FORMAT_RGBA_8888, 0);
+  if (! src)
+    return;
+  for (m = 0; m < ARRAY_SIZE (methods); m++)
+    {
+      start = grub_get_time_ms ();
+      for (n = 0; n < 10; n++)
+	{
+	  grub_video_bitmap_create_scaled (&dst, dw, dh, src, methods[m]);
+	  grub_video_bitmap_destroy (dst);
+	}
+      grub_printf ("bitmap_scale: 10 x %ux%u to %ux%u with method %d"
+		   " in %lld ms\n", sw, sh, dw, dh, (int) methods[m],
+		   (long long) (grub_get_time_ms () - start));
+    }
+  grub_video_bitmap_destroy (src);
+}
+
+/* The same checks, then timings of common scalings.  Built as the
+   bitmap_scale_bench module, which all_functional_test doesn't load.  */
+static void
+bitmap_scale_bench (void)
+{
+  bitmap_scale_test ();
+
+  benchmark (3840, 2160, 1920, 1080);
+  benchmark (1920, 1080, 1024, 768);
+  benchmark (800, 600, 1920, 1080);
+  benchmark (512, 512, 32, 32);
+}
+
+GRUB_FUNCTIONAL_TEST (bitmap_scale_bench, bitmap_scale_bench);
+#else
+/* Register bitmap_scale_test method as a functional test.  */
+GRUB_FUNCTIONAL_TEST (bitmap_scale_test, bitmap_scale_test);
+#endif
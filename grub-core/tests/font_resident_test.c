@@ -0,0 +1,85 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026 Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/test.h>
+#include <grub/dl.h>
+#include <grub/misc.h>
+#include <grub/font.h>
+
+GRUB_MOD_LICENSE ("GPLv3+");
+
+static int
+same_glyph (struct grub_font_glyph *a, struct grub_font_glyph *b)
+{
+  if (!a || !b)
+    return a == b;
+  return (a->width == b->width && a->height == b->height
+	  && a->offset_x == b->offset_x && a->offset_y == b->offset_y
+	  && a->device_width == b->device_width
+	  && grub_memcmp (a->bitmap, b->bitmap,
+			  (a->width * a->height + 7) / 8) == 0);
+}
+
+/* Glyphs of NAME read one by one and all at once must be the same.  Fonts
+   made with grub-mkfont --aligned are used in place, others are copied.  */
+static grub_font_t
+check_font (const char *name)
+{
+  grub_font_t lazy, resident;
+  grub_uint32_t code;
+  int ok = 1;
+
+  lazy = grub_font_load (name);
+  resident = grub_font_load_resident (name);
+  if (!lazy || !resident)
+    {
+      grub_test_assert (0, "%s font not loaded: %s", name, grub_errmsg);
+      return 0;
+    }
+
+  for (code = 0; code < 0x10000; code++)
+    if (!same_glyph (grub_font_get_glyph (lazy, code),
+		     grub_font_get_glyph (resident, code)))
+      ok = 0;
+  grub_test_assert (ok, "resident %s font glyphs differ", name);
+  return resident;
+}
+
+static void
+font_resident_test (void)
+{
+  grub_font_t unicode, aligned;
+  grub_uint32_t code;
+  int ok = 1;
+
+  unicode = check_font ("unicode");
+  aligned = check_font ("aligned");
+  if (!unicode || !aligned)
+    return;
+
+  /* The aligned font is a subset of the same source, named "Aligned
+     Regular 16" so that tests asking for FONT_NAME still get unicode.  */
+  for (code = 0; code < 0x500; code++)
+    if (!same_glyph (grub_font_get_glyph (unicode, code),
+		     grub_font_get_glyph (aligned, code)))
+      ok = 0;
+  grub_test_assert (ok, "aligned font glyphs differ from unicode ones");
+}
+
+/* Register font_resident_test method as a functional test.  */
+GRUB_FUNCTIONAL_TEST (font_resident_test, font_resident_test);
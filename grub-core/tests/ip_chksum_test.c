@@ -0,0 +1,166 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026 Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/test.h>
+#include <grub/dl.h>
+#include <grub/misc.h>
+#include <grub/time.h>
+#include <grub/net/ip.h>
+
+GRUB_MOD_LICENSE ("GPLv3+");
+
+static grub_uint8_t buf[2048];
+
+/* One big-endian word at a time, as RFC 1071 describes it.  */
+static grub_uint16_t
+reference (const grub_uint8_t *data, grub_size_t len)
+{
+  grub_uint32_t sum = 0;
+  grub_size_t i;
+
+  for (i = 0; i + 1 < len; i += 2)
+    {
+      sum += (data[i] << 8) | data[i + 1];
+      if (sum > 0xffff)
+	sum -= 0xffff;
+    }
+  if (i < len)
+    {
+      sum += data[i] << 8;
+      if (sum > 0xffff)
+	sum -= 0xffff;
+    }
+  if (sum >= 0xffff)
+    sum -= 0xffff;
+  return grub_cpu_to_be16 (~sum & 0xffff);
+}
+
+static grub_uint32_t seed = 404;
+
+static grub_uint8_t
+next_byte (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static void
+fill (grub_uint8_t *data, grub_size_t len)
+{
+  grub_size_t i;
+  int kind = next_byte () % 8;
+
+  for (i = 0; i < len; i++)
+    data[i] = kind == 0 ? 0 : kind == 1 ? 0xff : next_byte ();
+}
+
+static void
+ip_chksum_test (void)
+{
+  grub_size_t len, off, i;
+  grub_uint16_t c;
+  unsigned n;
+
+  /* Every length and alignment up to a couple of words past the
+     unrolled loop, then sizes around the usual MTUs.  */
+  for (len = 0; len < 80; len++)
+    for (off = 0; off < 8; off++)
+      {
+	fill (buf + off, len);
+	grub_test_assert (grub_net_ip_chksum (buf + off, len)
+			  == reference (buf + off, len),
+			  "checksum of %d bytes at offset %d differs",
+			  (int) len, (int) off);
+      }
+  for (n = 0; n < 1000; n++)
+    {
+      len = 1400 + next_byte () % 160;
+      off = next_byte () % 8;
+      fill (buf + off, len);
+      grub_test_assert (grub_net_ip_chksum (buf + off, len)
+			== reference (buf + off, len),
+			"checksum of %d bytes at offset %d differs",
+			(int) len, (int) off);
+    }
+
+  /* Summing in pieces, of which only the last is odd.  */
+  for (n = 0; n < 1000; n++)
+    {
+      grub_size_t split;
+      grub_uint32_t sum;
+
+      len = next_byte () * 6 + 2;
+      split = (next_byte () % (len / 2)) * 2;
+      fill (buf, len);
+      sum = grub_net_ip_chksum_partial (buf, split, 0);
+      sum = grub_net_ip_chksum_partial (buf + split, len - split, sum);
+      grub_test_assert (grub_net_ip_chksum_fold (sum) == reference (buf, len),
+			"checksum of %d bytes split at %d differs",
+			(int) len, (int) split);
+    }
+
+  /* Patching a checksum must give what summing again does.  */
+  for (n = 0; n < 1000; n++)
+    {
+      grub_uint8_t repl[4];
+
+      len = 20 + next_byte () * 4;
+      off = (next_byte () % (len / 2 - 2)) * 2;
+      fill (buf, len);
+      for (i = 0; i < sizeof (repl); i++)
+	repl[i] = next_byte ();
+      c = grub_net_ip_chksum (buf, len);
+      c = grub_net_ip_chksum_update (c, buf + off, repl, sizeof (repl));
+      grub_memcpy (buf + off, repl, sizeof (repl));
+      grub_test_assert (c == reference (buf, len),
+			"updated checksum of %d bytes at %d differs",
+			(int) len, (int) off);
+    }
+}
+
+#ifdef GRUB_TEST_BENCHMARK
+/* The same checks, then timings against the reference.  Built as the
+   ip_chksum_bench module, which all_functional_test doesn't load.  */
+static void
+ip_chksum_bench (void)
+{
+  grub_uint64_t start;
+  volatile grub_uint16_t c;
+  unsigned n;
+
+  ip_chksum_test ();
+
+  fill (buf, 1500);
+  start = grub_get_time_ms ();
+  for (n = 0; n < 100000; n++)
+    c = grub_net_ip_chksum (buf, 1500);
+  grub_printf ("ip_chksum: 100000 x 1500 bytes in %lld ms\n",
+	       (long long) (grub_get_time_ms () - start));
+  start = grub_get_time_ms ();
+  for (n = 0; n < 100000; n++)
+    c = reference (buf, 1500);
+  grub_printf ("ip_chksum: reference took %lld ms\n",
+	       (long long) (grub_get_time_ms () - start));
+  (void) c;
+}
+
+GRUB_FUNCTIONAL_TEST (ip_chksum_bench, ip_chksum_bench);
+#else
+/* Register example_test method as a functional test.  */
+GRUB_FUNCTIONAL_TEST (ip_chksum_test, ip_chksum_test);
+#endif
@@ -79,6 +79,9 @@ grub_functional_all_tests (grub_extcmd_context_t ctxt __attribute__ ((unused)),
   grub_dl_load ("cmp_test");
   grub_dl_load ("mul_test");
   grub_dl_load ("shift_test");
+  grub_dl_load ("ip_chksum_test");
+  grub_dl_load ("bitmap_scale_test");
+  grub_dl_load ("font_resident_test");
 
   FOR_LIST_ELEMENTS (test, grub_test_list)
     ok = !grub_test_run (test) && ok;
@@ -23,11 +23,137 @@
 #include <grub/video_fb.h>
 #include <grub/command.h>
 #include <grub/font.h>
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/bitmap.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
 #define FONT_NAME "Unknown Regular 16"
 
+#define BLEND_WIDTH 64
+#define BLEND_HEIGHT 48
+
+/* Component K of pixel (X, Y) of the test bitmaps.  */
+static grub_uint8_t
+blend_pattern (unsigned x, unsigned y, unsigned k)
+{
+  return (x * 37 + y * 101 + k * 59) ^ (x * y * (k + 1));
+}
+
+static struct grub_video_bitmap *
+blend_bitmap (enum grub_video_blit_format format)
+{
+  struct grub_video_bitmap *bitmap;
+  grub_uint8_t *p;
+  unsigned x, y, k, bpp;
+
+  if (grub_video_bitmap_create (&bitmap, BLEND_WIDTH, BLEND_HEIGHT, format))
+    return 0;
+  bpp = bitmap->mode_info.bytes_per_pixel;
+  for (y = 0; y < BLEND_HEIGHT; y++)
+    for (x = 0; x < BLEND_WIDTH; x++)
+      {
+	p = (grub_uint8_t *) bitmap->data + y * bitmap->mode_info.pitch
+	  + x * bpp;
+	for (k = 0; k < bpp; k++)
+	  p[k] = blend_pattern (x, y, k);
+	/* Make sure the shortcuts for transparent and opaque pixels are
+	   taken too.  */
+	if (bpp == 4 && x % 5 == 0)
+	  p[3] = (y & 1) ? 0xff : 0;
+      }
+  return bitmap;
+}
+
+/* The same as alpha_dilute in fbblit.c.  */
+static grub_uint8_t
+blend_reference (grub_uint8_t bg, grub_uint8_t fg, grub_uint8_t alpha)
+{
+  return (fg * alpha + bg * (255 - alpha)) / 255;
+}
+
+/* Blending an RGBA bitmap into MODE must give, byte for byte, what
+   blending each component on its own does.  */
+static void
+blend_check (struct grub_video_mode_info *mode)
+{
+  struct grub_video_bitmap *bg = 0, *fg = 0;
+  grub_uint8_t *b = 0, *f = 0, *r;
+  grub_size_t size = (grub_size_t) mode->pitch * BLEND_HEIGHT;
+  unsigned bpp = mode->bytes_per_pixel;
+  unsigned x, y, k;
+  int ok = 1;
+
+  if (grub_video_capture_start (mode, grub_video_fbstd_colors,
+				mode->number_of_colors))
+    {
+      grub_test_assert (0, "can't start capture: %s", grub_errmsg);
+      grub_print_error ();
+      return;
+    }
+
+  bg = blend_bitmap (GRUB_VIDEO_BLIT_FORMAT_RGB_888);
+  fg = blend_bitmap (GRUB_VIDEO_BLIT_FORMAT_RGBA_8888);
+  b = grub_malloc (size);
+  f = grub_malloc (size);
+  if (! bg || ! fg || ! b || ! f)
+    goto fail;
+
+  /* The background, and the foreground converted without blending.  */
+  r = grub_video_capture_get_framebuffer ();
+  grub_video_blit_bitmap (fg, GRUB_VIDEO_BLIT_REPLACE, 0, 0, 0, 0,
+			  BLEND_WIDTH, BLEND_HEIGHT);
+  grub_memcpy (f, r, size);
+  grub_video_blit_bitmap (bg, GRUB_VIDEO_BLIT_REPLACE, 0, 0, 0, 0,
+			  BLEND_WIDTH, BLEND_HEIGHT);
+  grub_memcpy (b, r, size);
+
+  grub_video_blit_bitmap (fg, GRUB_VIDEO_BLIT_BLEND, 0, 0, 0, 0,
+			  BLEND_WIDTH, BLEND_HEIGHT);
+
+  for (y = 0; y < BLEND_HEIGHT; y++)
+    for (x = 0; x < BLEND_WIDTH; x++)
+      {
+	grub_size_t p = y * mode->pitch + x * bpp;
+	grub_uint8_t a = ((grub_uint8_t *) fg->data)[y * fg->mode_info.pitch
+						     + x * 4 + 3];
+
+	if (bpp == 4)
+	  {
+	    grub_uint32_t bw = *(grub_uint32_t *) (b + p);
+	    grub_uint32_t fw = *(grub_uint32_t *) (f + p);
+	    grub_uint32_t rw = *(grub_uint32_t *) (r + p);
+
+	    for (k = 0; k < 32; k += 8)
+	      {
+		grub_uint8_t expected;
+
+		if (k == mode->reserved_field_pos)
+		  expected = a ? a : bw >> k;
+		else
+		  expected = blend_reference (bw >> k, fw >> k, a);
+		if (((rw >> k) & 0xff) != expected)
+		  ok = 0;
+	      }
+	  }
+	else
+	  for (k = 0; k < bpp; k++)
+	    if (r[p + k] != blend_reference (b[p + k], f[p + k], a))
+	      ok = 0;
+      }
+  grub_test_assert (ok, "blending into %dx%dx%d mode with red at %d differs",
+		    mode->width, mode->height, mode->bpp,
+		    mode->red_field_pos);
+
+ fail:
+  grub_free (b);
+  grub_free (f);
+  grub_video_bitmap_destroy (bg);
+  grub_video_bitmap_destroy (fg);
+  grub_video_capture_end ();
+}
+
 /* Functional test main method.  */
 static void
 videotest_checksum (void)
@@ -50,10 +176,18 @@ videotest_checksum (void)
   for (i = 0; i < ARRAY_SIZE (grub_test_video_modes); i++)
     {
       grub_err_t err;
+      enum grub_video_blit_format format;
 #if defined (GRUB_MACHINE_MIPS_QEMU_MIPS) || defined (GRUB_MACHINE_IEEE1275)
       if (grub_test_video_modes[i].width > 1024)
 	continue;
 #endif
+      format = grub_video_get_blit_format (&grub_test_video_modes[i]);
+      if (format == GRUB_VIDEO_BLIT_FORMAT_RGBA_8888
+	  || format == GRUB_VIDEO_BLIT_FORMAT_BGRA_8888
+	  || format == GRUB_VIDEO_BLIT_FORMAT_RGB_888
+	  || format == GRUB_VIDEO_BLIT_FORMAT_BGR_888)
+	blend_check (&grub_test_video_modes[i]);
+
       err = grub_video_capture_start (&grub_test_video_modes[i],
 				      grub_video_fbstd_colors,
 				      grub_test_video_modes[i].number_of_colors);
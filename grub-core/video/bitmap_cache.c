@@ -0,0 +1,971 @@
+/* bitmap_cache.c - Cache of decoded and scaled bitmaps.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/bitmap.h>
+#include <grub/bitmap_scale.h>
+#include <grub/bitmap_cache.h>
+#include <grub/types.h>
+#include <grub/dl.h>
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+#include <grub/disk.h>
+#include <grub/partition.h>
+#include <grub/env.h>
+#include <grub/list.h>
+#include <grub/extcmd.h>
+#include <grub/i18n.h>
+
+GRUB_MOD_LICENSE ("GPLv3+");
+
+/* Default limit of the memory used by cached bitmaps.  */
+#define BITMAP_CACHE_DEFAULT_LIMIT	(32 << 20)
+
+/* Cache file layout: the file magic, then entries each made of a struct
+   bitmap_cache_file_entry, the file name, the variant and the pixels.
+   An entry magic of 0 ends the list.  All numbers are little endian.  */
+#define BITMAP_CACHE_FILE_MAGIC		"GRUBBMC1"
+#define BITMAP_CACHE_ENTRY_MAGIC	0x45434d42
+
+#define BITMAP_CACHE_IO_SIZE		65536
+
+struct bitmap_cache_file_entry
+{
+  grub_uint32_t magic;
+  grub_uint32_t name_len;
+  grub_uint32_t variant_len;
+  grub_uint32_t width;
+  grub_uint32_t height;
+  grub_uint32_t mtimeset;
+  grub_int32_t mtime;
+  grub_uint64_t file_size;
+  grub_uint32_t bitmap_width;
+  grub_uint32_t bitmap_height;
+  grub_uint32_t blit_format;
+  grub_uint32_t data_len;
+  grub_uint32_t checksum;
+} GRUB_PACKED;
+
+/* What identifies the contents of a file.  */
+struct bitmap_cache_stat
+{
+  grub_uint64_t size;
+  grub_int32_t mtime;
+  int mtimeset;
+};
+
+struct bitmap_cache_entry
+{
+  struct bitmap_cache_entry *next;
+  struct bitmap_cache_entry **prev;
+
+  char *filename;
+  char *variant;
+  unsigned int width;
+  unsigned int height;
+  struct bitmap_cache_stat stat;
+  /* Whether STAT was found this session rather than read from a saved
+     cache.  Files do not change under GRUB, so they are looked at once.  */
+  int checked;
+
+  struct grub_video_bitmap *bitmap;
+  grub_size_t size;
+};
+
+/* Most recently used first.  */
+static struct bitmap_cache_entry *bitmap_cache;
+static grub_size_t bitmap_cache_size;
+static grub_size_t bitmap_cache_limit = BITMAP_CACHE_DEFAULT_LIMIT;
+static unsigned long bitmap_cache_hits, bitmap_cache_misses;
+
+/* Return the name FILENAME is known by in the cache.  Names without a
+   device refer to $root, which can change.  */
+static char *
+bitmap_cache_name (const char *filename)
+{
+  const char *root;
+
+  if (filename[0] == '(')
+    return grub_strdup (filename);
+
+  root = grub_env_get ("root");
+  if (! root)
+    return grub_strdup (filename);
+
+  return grub_xasprintf ("(%s)%s", root, filename);
+}
+
+/* Context for bitmap_cache_stat_file.  */
+struct bitmap_cache_stat_ctx
+{
+  const char *basename;
+  struct bitmap_cache_stat *stat;
+};
+
+/* Helper for bitmap_cache_stat_file.  */
+static int
+bitmap_cache_stat_hook (const char *name, const struct grub_dirhook_info *info,
+			void *data)
+{
+  struct bitmap_cache_stat_ctx *ctx = data;
+
+  if ((info->case_insensitive ? grub_strcasecmp (name, ctx->basename)
+       : grub_strcmp (name, ctx->basename)) != 0)
+    return 0;
+
+  ctx->stat->mtimeset = info->mtimeset;
+  ctx->stat->mtime = info->mtime;
+  return 1;
+}
+
+/* Find the size and the modification time of FILENAME.  */
+static grub_err_t
+bitmap_cache_stat_file (const char *filename, struct bitmap_cache_stat *stat)
+{
+  grub_file_t file;
+  const char *path;
+  char *dir, *slash;
+
+  file = grub_file_open (filename, GRUB_FILE_TYPE_GET_SIZE
+			 | GRUB_FILE_TYPE_NO_DECOMPRESS);
+  if (! file)
+    return grub_errno;
+
+  stat->size = grub_file_size (file);
+  stat->mtimeset = 0;
+  stat->mtime = 0;
+
+  path = grub_strchr (filename, ')');
+  path = path ? path + 1 : filename;
+  dir = grub_strdup (path);
+  slash = dir ? grub_strrchr (dir, '/') : 0;
+  if (file->fs && file->fs->fs_dir && slash)
+    {
+      struct bitmap_cache_stat_ctx ctx = {
+	.basename = path + (slash - dir) + 1,
+	.stat = stat
+      };
+
+      slash[1] = '\0';
+      file->fs->fs_dir (file->device, dir, bitmap_cache_stat_hook, &ctx);
+      /* A missing modification time only weakens the check.  */
+      grub_errno = GRUB_ERR_NONE;
+    }
+  grub_free (dir);
+  grub_file_close (file);
+
+  return grub_errno;
+}
+
+/* Find what identifies NAME, the name FILENAME is known by in the cache,
+   looking at the file only if no entry for it was checked before.  */
+static grub_err_t
+bitmap_cache_stat_name (const char *filename, const char *name,
+			struct bitmap_cache_stat *stat)
+{
+  struct bitmap_cache_entry *entry;
+
+  FOR_LIST_ELEMENTS (entry, bitmap_cache)
+    if (entry->checked && grub_strcmp (entry->filename, name) == 0)
+      {
+	*stat = entry->stat;
+	return GRUB_ERR_NONE;
+      }
+
+  return bitmap_cache_stat_file (filename, stat);
+}
+
+static struct grub_video_bitmap *
+bitmap_cache_copy (struct grub_video_bitmap *src, grub_size_t size)
+{
+  struct grub_video_bitmap *dst;
+
+  dst = grub_malloc (sizeof (*dst));
+  if (! dst)
+    return 0;
+
+  dst->mode_info = src->mode_info;
+  dst->data = grub_malloc (size);
+  if (! dst->data)
+    {
+      grub_free (dst);
+      return 0;
+    }
+  grub_memcpy (dst->data, src->data, size);
+
+  return dst;
+}
+
+static void
+bitmap_cache_free (struct bitmap_cache_entry *entry)
+{
+  grub_list_remove (GRUB_AS_LIST (entry));
+  bitmap_cache_size -= entry->size;
+  grub_video_bitmap_destroy (entry->bitmap);
+  grub_free (entry->filename);
+  grub_free (entry->variant);
+  grub_free (entry);
+}
+
+static void
+bitmap_cache_clear (void)
+{
+  while (bitmap_cache)
+    bitmap_cache_free (bitmap_cache);
+}
+
+/* Drop the least recently used entries until the cache fits in its
+   limit.  */
+static void
+bitmap_cache_trim (void)
+{
+  struct bitmap_cache_entry *last;
+
+  while (bitmap_cache_size > bitmap_cache_limit)
+    {
+      for (last = bitmap_cache; last->next; last = last->next);
+      bitmap_cache_free (last);
+    }
+}
+
+static struct bitmap_cache_entry *
+bitmap_cache_find (const char *name, const char *variant,
+		   unsigned int width, unsigned int height)
+{
+  struct bitmap_cache_entry *entry;
+
+  FOR_LIST_ELEMENTS (entry, bitmap_cache)
+    if (entry->width == width && entry->height == height
+	&& grub_strcmp (entry->filename, name) == 0
+	&& grub_strcmp (entry->variant, variant) == 0)
+      return entry;
+
+  return 0;
+}
+
+/* Add ENTRY as the most recently used bitmap.  With LAST, add it as the
+   least recently used one instead, unless that needs room or the same
+   bitmap is already cached.  Takes ownership of ENTRY.  */
+static void
+bitmap_cache_insert (struct bitmap_cache_entry *entry, int last)
+{
+  struct bitmap_cache_entry *old;
+
+  old = bitmap_cache_find (entry->filename, entry->variant,
+			   entry->width, entry->height);
+  if (old && ! last)
+    bitmap_cache_free (old);
+
+  if (entry->size > bitmap_cache_limit
+      || (last && (old || bitmap_cache_size + entry->size
+		   > bitmap_cache_limit)))
+    {
+      grub_video_bitmap_destroy (entry->bitmap);
+      grub_free (entry->filename);
+      grub_free (entry->variant);
+      grub_free (entry);
+      return;
+    }
+
+  if (last)
+    {
+      struct bitmap_cache_entry **p;
+
+      for (p = &bitmap_cache; *p; p = &(*p)->next);
+      entry->next = 0;
+      entry->prev = p;
+      *p = entry;
+    }
+  else
+    grub_list_push (GRUB_AS_LIST_P (&bitmap_cache), GRUB_AS_LIST (entry));
+
+  bitmap_cache_size += entry->size;
+  bitmap_cache_trim ();
+}
+
+struct grub_video_bitmap *
+grub_video_bitmap_cache_get (const char *filename, const char *variant,
+			     unsigned int width, unsigned int height)
+{
+  struct bitmap_cache_entry *entry, *other;
+  struct bitmap_cache_stat stat;
+  struct grub_video_bitmap *bitmap = 0;
+  char *name;
+
+  name = bitmap_cache_name (filename);
+  if (! name)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return 0;
+    }
+
+  entry = bitmap_cache_find (name, variant, width, height);
+  if (! entry)
+    {
+      grub_free (name);
+      bitmap_cache_misses++;
+      return 0;
+    }
+
+  /* The file may have changed since the cache was saved.  */
+  if (! entry->checked)
+    {
+      if (bitmap_cache_stat_name (filename, name, &stat) != GRUB_ERR_NONE
+	  || stat.size != entry->stat.size
+	  || stat.mtimeset != entry->stat.mtimeset
+	  || stat.mtime != entry->stat.mtime)
+	{
+	  grub_errno = GRUB_ERR_NONE;
+	  grub_dprintf ("bitmap_cache", "%s changed\n", entry->filename);
+	  bitmap_cache_free (entry);
+	  grub_free (name);
+	  bitmap_cache_misses++;
+	  return 0;
+	}
+
+      /* Other bitmaps made from the same file are just as good.  */
+      FOR_LIST_ELEMENTS (other, bitmap_cache)
+	if (grub_strcmp (other->filename, name) == 0
+	    && other->stat.size == stat.size
+	    && other->stat.mtimeset == stat.mtimeset
+	    && other->stat.mtime == stat.mtime)
+	  other->checked = 1;
+    }
+  grub_free (name);
+
+  bitmap = bitmap_cache_copy (entry->bitmap, entry->size);
+  if (! bitmap)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return 0;
+    }
+
+  grub_list_remove (GRUB_AS_LIST (entry));
+  grub_list_push (GRUB_AS_LIST_P (&bitmap_cache), GRUB_AS_LIST (entry));
+  bitmap_cache_hits++;
+
+  return bitmap;
+}
+
+/* Number of bytes of pixels in BITMAP, or 0 if it cannot be cached.  */
+static grub_size_t
+bitmap_cache_data_size (struct grub_video_bitmap *bitmap)
+{
+  struct grub_video_mode_info *mode_info = &bitmap->mode_info;
+
+  if (mode_info->height == 0
+      || mode_info->pitch > GRUB_SIZE_MAX / mode_info->height)
+    return 0;
+
+  return (grub_size_t) mode_info->pitch * mode_info->height;
+}
+
+void
+grub_video_bitmap_cache_put (const char *filename, const char *variant,
+			     unsigned int width, unsigned int height,
+			     struct grub_video_bitmap *bitmap)
+{
+  struct bitmap_cache_entry *entry;
+  grub_size_t size;
+
+  if (! bitmap)
+    return;
+
+  size = bitmap_cache_data_size (bitmap);
+  if (size == 0 || size > bitmap_cache_limit)
+    return;
+
+  entry = grub_zalloc (sizeof (*entry));
+  if (! entry)
+    goto fail;
+
+  entry->filename = bitmap_cache_name (filename);
+  if (! entry->filename
+      || bitmap_cache_stat_name (filename, entry->filename, &entry->stat)
+	 != GRUB_ERR_NONE)
+    goto fail;
+  entry->checked = 1;
+
+  entry->variant = grub_strdup (variant);
+  entry->bitmap = bitmap_cache_copy (bitmap, size);
+  if (! entry->variant || ! entry->bitmap)
+    goto fail;
+  entry->width = width;
+  entry->height = height;
+  entry->size = size;
+
+  bitmap_cache_insert (entry, 0);
+  return;
+
+ fail:
+  if (entry)
+    {
+      grub_video_bitmap_destroy (entry->bitmap);
+      grub_free (entry->filename);
+      grub_free (entry->variant);
+      grub_free (entry);
+    }
+  grub_errno = GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_video_bitmap_cache_load (struct grub_video_bitmap **bitmap,
+			      const char *filename)
+{
+  if (! bitmap)
+    return grub_error (GRUB_ERR_BUG, "invalid argument");
+
+  *bitmap = grub_video_bitmap_cache_get (filename, "", 0, 0);
+  if (*bitmap)
+    return GRUB_ERR_NONE;
+
+  if (grub_video_bitmap_load (bitmap, filename) != GRUB_ERR_NONE)
+    return grub_errno;
+
+  grub_video_bitmap_cache_put (filename, "", 0, 0, *bitmap);
+  return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_video_bitmap_cache_load_scaled (struct grub_video_bitmap **bitmap,
+				     const char *filename,
+				     unsigned int width, unsigned int height,
+				     enum grub_video_bitmap_scale_method
+				     scale_method)
+{
+  struct grub_video_bitmap *raw;
+  char variant[sizeof ("scale-") + 10];
+
+  if (! bitmap)
+    return grub_error (GRUB_ERR_BUG, "invalid argument");
+
+  grub_snprintf (variant, sizeof (variant), "scale-%d", (int) scale_method);
+  *bitmap = grub_video_bitmap_cache_get (filename, variant, width, height);
+  if (*bitmap)
+    return GRUB_ERR_NONE;
+
+  if (grub_video_bitmap_load (&raw, filename) != GRUB_ERR_NONE)
+    return grub_errno;
+
+  grub_video_bitmap_create_scaled (bitmap, width, height, raw, scale_method);
+  grub_video_bitmap_destroy (raw);
+  if (! *bitmap)
+    return grub_errno;
+
+  grub_video_bitmap_cache_put (filename, variant, width, height, *bitmap);
+  return GRUB_ERR_NONE;
+}
+
+static grub_uint32_t
+bitmap_cache_checksum (const grub_uint8_t *data, grub_size_t len)
+{
+  grub_uint32_t a = 1, b = 0;
+  grub_size_t i;
+
+  /* Adler-32 with the modulo reduction deferred as far as it can be.  */
+  while (len)
+    {
+      grub_size_t n = len < 5552 ? len : 5552;
+
+      for (i = 0; i < n; i++)
+	{
+	  a += data[i];
+	  b += a;
+	}
+      a %= 65521;
+      b %= 65521;
+      data += n;
+      len -= n;
+    }
+
+  return (b << 16) | a;
+}
+
+static grub_err_t
+bitmap_cache_read_file (const char *filename)
+{
+  grub_file_t file;
+  char magic[sizeof (BITMAP_CACHE_FILE_MAGIC) - 1] = { 0 };
+  unsigned count = 0;
+
+  file = grub_file_open (filename, GRUB_FILE_TYPE_BITMAP_CACHE
+			 | GRUB_FILE_TYPE_NO_DECOMPRESS);
+  if (! file)
+    return grub_errno;
+
+  if (grub_file_read (file, magic, sizeof (magic))
+      != (grub_ssize_t) sizeof (magic)
+      || grub_memcmp (magic, BITMAP_CACHE_FILE_MAGIC, sizeof (magic)) != 0)
+    {
+      grub_file_close (file);
+      /* A freshly created file is all zeros.  */
+      if (grub_errno == GRUB_ERR_NONE && magic[0] == 0)
+	return GRUB_ERR_NONE;
+      if (grub_errno == GRUB_ERR_NONE)
+	grub_error (GRUB_ERR_BAD_FILE_TYPE, N_("invalid bitmap cache file"));
+      return grub_errno;
+    }
+
+  while (1)
+    {
+      struct bitmap_cache_file_entry hdr;
+      struct bitmap_cache_entry *entry;
+      grub_uint32_t name_len, variant_len, data_len;
+      enum grub_video_blit_format format;
+
+      if (grub_file_read (file, &hdr, sizeof (hdr))
+	  != (grub_ssize_t) sizeof (hdr)
+	  || grub_le_to_cpu32 (hdr.magic) != BITMAP_CACHE_ENTRY_MAGIC)
+	break;
+
+      name_len = grub_le_to_cpu32 (hdr.name_len);
+      variant_len = grub_le_to_cpu32 (hdr.variant_len);
+      data_len = grub_le_to_cpu32 (hdr.data_len);
+      format = grub_le_to_cpu32 (hdr.blit_format);
+      if (name_len == 0 || name_len > 4096 || variant_len > 4096)
+	break;
+
+      entry = grub_zalloc (sizeof (*entry));
+      if (! entry)
+	break;
+      entry->filename = grub_malloc (name_len + 1);
+      entry->variant = grub_malloc (variant_len + 1);
+      if (! entry->filename || ! entry->variant
+	  || grub_file_read (file, entry->filename, name_len)
+	     != (grub_ssize_t) name_len
+	  || grub_file_read (file, entry->variant, variant_len)
+	     != (grub_ssize_t) variant_len
+	  || grub_video_bitmap_create (&entry->bitmap,
+				       grub_le_to_cpu32 (hdr.bitmap_width),
+				       grub_le_to_cpu32 (hdr.bitmap_height),
+				       format) != GRUB_ERR_NONE
+	  || bitmap_cache_data_size (entry->bitmap) != data_len
+	  || grub_file_read (file, entry->bitmap->data, data_len)
+	     != (grub_ssize_t) data_len
+	  || bitmap_cache_checksum (entry->bitmap->data, data_len)
+	     != grub_le_to_cpu32 (hdr.checksum))
+	{
+	  grub_video_bitmap_destroy (entry->bitmap);
+	  grub_free (entry->filename);
+	  grub_free (entry->variant);
+	  grub_free (entry);
+	  break;
+	}
+      entry->filename[name_len] = '\0';
+      entry->variant[variant_len] = '\0';
+      entry->width = grub_le_to_cpu32 (hdr.width);
+      entry->height = grub_le_to_cpu32 (hdr.height);
+      entry->stat.size = grub_le_to_cpu64 (hdr.file_size);
+      entry->stat.mtimeset = !! grub_le_to_cpu32 (hdr.mtimeset);
+      entry->stat.mtime = grub_le_to_cpu32 (hdr.mtime);
+      entry->size = data_len;
+
+      /* The file is saved most recently used first.  */
+      bitmap_cache_insert (entry, 1);
+      count++;
+    }
+
+  grub_dprintf ("bitmap_cache", "read %u bitmaps from %s\n", count, filename);
+
+  grub_file_close (file);
+  /* Whatever follows a damaged entry is lost, but what was read is
+     good.  */
+  grub_errno = GRUB_ERR_NONE;
+  return GRUB_ERR_NONE;
+}
+
+/* The cache file is overwritten in place, as the sectors it occupies.  */
+struct bitmap_cache_block
+{
+  grub_disk_addr_t sector;
+  unsigned offset;
+  unsigned length;
+  struct bitmap_cache_block *next;
+};
+
+struct bitmap_cache_writer
+{
+  struct bitmap_cache_block *head, *tail;
+  grub_disk_t disk;
+  grub_disk_addr_t part_start;
+  /* Offset in the file of BUF, and the file size.  */
+  grub_off_t pos;
+  grub_off_t size;
+  grub_uint8_t *buf;
+  grub_size_t fill;
+};
+
+/* Store the sectors of the cache file.  */
+static void
+bitmap_cache_read_hook (grub_disk_addr_t sector, unsigned offset,
+			unsigned length, void *data)
+{
+  struct bitmap_cache_writer *w = data;
+  struct bitmap_cache_block *block;
+
+  block = grub_malloc (sizeof (*block));
+  if (! block)
+    return;
+
+  block->sector = sector;
+  block->offset = offset;
+  block->length = length;
+  block->next = 0;
+  if (w->tail)
+    w->tail->next = block;
+  else
+    w->head = block;
+  w->tail = block;
+}
+
+/* Make sure the sectors found hold the file as it is, as the file is
+   written there directly.  The same checks as for the environment block
+   in loadenv.  */
+static grub_err_t
+bitmap_cache_check_blocks (struct bitmap_cache_writer *w, grub_file_t file)
+{
+  struct bitmap_cache_block *p, *q;
+  grub_off_t total = 0;
+  grub_uint8_t *diskbuf = 0, *filebuf = 0;
+  grub_size_t buf_len = 0;
+
+  for (p = w->head; p; p = p->next)
+    {
+      /* Check if any pair of blocks overlap.  */
+      for (q = p->next; q; q = q->next)
+	{
+	  grub_disk_addr_t s1, s2;
+	  grub_disk_addr_t e1, e2;
+
+	  s1 = p->sector;
+	  e1 = s1 + ((p->offset + p->length + GRUB_DISK_SECTOR_SIZE - 1)
+		     >> GRUB_DISK_SECTOR_BITS);
+
+	  s2 = q->sector;
+	  e2 = s2 + ((q->offset + q->length + GRUB_DISK_SECTOR_SIZE - 1)
+		     >> GRUB_DISK_SECTOR_BITS);
+
+	  if (s1 < e2 && s2 < e1)
+	    return grub_error (GRUB_ERR_BAD_FS, "malformed file");
+	}
+
+      total += p->length;
+    }
+
+  if (total != w->size)
+    {
+      /* Maybe sparse, unallocated sectors. No way in GRUB.  */
+      return grub_error (GRUB_ERR_BAD_FILE_TYPE, "sparse file not allowed");
+    }
+
+  /* Re-read all sectors by the blocklist, and compare them with the data
+     read through the file system, which may not store it verbatim.  */
+  grub_file_seek (file, 0);
+  for (p = w->head; p; p = p->next)
+    {
+      if (p->length > buf_len)
+	{
+	  grub_free (diskbuf);
+	  grub_free (filebuf);
+	  buf_len = 2 * p->length;
+	  diskbuf = grub_malloc (buf_len);
+	  filebuf = grub_malloc (buf_len);
+	  if (! diskbuf || ! filebuf)
+	    break;
+	}
+
+      if (grub_disk_read (w->disk, p->sector - w->part_start,
+			  p->offset, p->length, diskbuf)
+	  || grub_file_read (file, filebuf, p->length)
+	     != (grub_ssize_t) p->length)
+	break;
+
+      if (grub_memcmp (diskbuf, filebuf, p->length) != 0)
+	{
+	  grub_error (GRUB_ERR_FILE_READ_ERROR, "invalid blocklist");
+	  break;
+	}
+    }
+
+  grub_free (diskbuf);
+  grub_free (filebuf);
+  if (p && grub_errno == GRUB_ERR_NONE)
+    grub_error (GRUB_ERR_FILE_READ_ERROR, N_("premature end of file %s"),
+		file->name);
+  return grub_errno;
+}
+
+static grub_err_t
+bitmap_cache_flush (struct bitmap_cache_writer *w)
+{
+  struct bitmap_cache_block *p;
+  grub_off_t start = 0;
+  grub_size_t done = 0;
+
+  for (p = w->head; p && done < w->fill; start += p->length, p = p->next)
+    {
+      grub_off_t from, n;
+
+      if (start + p->length <= w->pos + done)
+	continue;
+
+      from = w->pos + done - start;
+      n = p->length - from;
+      if (n > w->fill - done)
+	n = w->fill - done;
+
+      if (grub_disk_write (w->disk, p->sector - w->part_start,
+			   p->offset + from, n, w->buf + done))
+	return grub_errno;
+      done += n;
+    }
+
+  w->pos += w->fill;
+  w->fill = 0;
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+bitmap_cache_write (struct bitmap_cache_writer *w, const void *data,
+		    grub_size_t len)
+{
+  const grub_uint8_t *ptr = data;
+
+  while (len)
+    {
+      grub_size_t n = BITMAP_CACHE_IO_SIZE - w->fill;
+
+      if (n > len)
+	n = len;
+      grub_memcpy (w->buf + w->fill, ptr, n);
+      w->fill += n;
+      ptr += n;
+      len -= n;
+      if (w->fill == BITMAP_CACHE_IO_SIZE && bitmap_cache_flush (w))
+	return grub_errno;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+bitmap_cache_write_file (const char *filename)
+{
+  struct bitmap_cache_writer w;
+  struct bitmap_cache_entry *entry;
+  struct bitmap_cache_block *p;
+  grub_file_t file;
+  grub_uint32_t end = 0;
+  unsigned count = 0;
+
+  grub_memset (&w, 0, sizeof (w));
+
+  file = grub_file_open (filename, GRUB_FILE_TYPE_BITMAP_CACHE
+			 | GRUB_FILE_TYPE_NO_DECOMPRESS
+			 | GRUB_FILE_TYPE_SKIP_SIGNATURE);
+  if (! file)
+    return grub_errno;
+
+  if (! file->device->disk)
+    {
+      grub_file_close (file);
+      return grub_error (GRUB_ERR_BAD_DEVICE, "disk device required");
+    }
+
+  w.buf = grub_malloc (BITMAP_CACHE_IO_SIZE);
+  if (! w.buf)
+    goto fail;
+
+  /* Read the whole file to find where it is.  */
+  file->read_hook = bitmap_cache_read_hook;
+  file->read_hook_data = &w;
+  while (grub_file_read (file, w.buf, BITMAP_CACHE_IO_SIZE) > 0);
+  file->read_hook = 0;
+  if (grub_errno)
+    goto fail;
+
+  w.size = grub_file_size (file);
+  w.disk = file->device->disk;
+  w.part_start = grub_partition_get_start (w.disk->partition);
+  if (bitmap_cache_check_blocks (&w, file))
+    goto fail;
+
+  if (w.size < sizeof (BITMAP_CACHE_FILE_MAGIC) - 1 + sizeof (end))
+    {
+      grub_error (GRUB_ERR_OUT_OF_RANGE, N_("bitmap cache file too small"));
+      goto fail;
+    }
+  if (bitmap_cache_write (&w, BITMAP_CACHE_FILE_MAGIC,
+			  sizeof (BITMAP_CACHE_FILE_MAGIC) - 1))
+    goto fail;
+
+  FOR_LIST_ELEMENTS (entry, bitmap_cache)
+    {
+      struct bitmap_cache_file_entry hdr;
+      grub_size_t name_len, variant_len;
+      struct grub_video_mode_info *mode_info = &entry->bitmap->mode_info;
+
+      name_len = grub_strlen (entry->filename);
+      variant_len = grub_strlen (entry->variant);
+
+      /* Only what grub_video_bitmap_create can make again is saved, and
+	 only as long as there is room for the end marker.  */
+      if (mode_info->pitch != mode_info->width * mode_info->bytes_per_pixel
+	  || (mode_info->blit_format != GRUB_VIDEO_BLIT_FORMAT_RGBA_8888
+	      && mode_info->blit_format != GRUB_VIDEO_BLIT_FORMAT_RGB_888
+	      && mode_info->blit_format != GRUB_VIDEO_BLIT_FORMAT_INDEXCOLOR)
+	  || w.pos + w.fill + sizeof (hdr) + name_len + variant_len
+	     + entry->size + sizeof (end) > w.size)
+	continue;
+
+      hdr.magic = grub_cpu_to_le32_compile_time (BITMAP_CACHE_ENTRY_MAGIC);
+      hdr.name_len = grub_cpu_to_le32 (name_len);
+      hdr.variant_len = grub_cpu_to_le32 (variant_len);
+      hdr.width = grub_cpu_to_le32 (entry->width);
+      hdr.height = grub_cpu_to_le32 (entry->height);
+      hdr.mtimeset = grub_cpu_to_le32 (entry->stat.mtimeset);
+      hdr.mtime = grub_cpu_to_le32 (entry->stat.mtime);
+      hdr.file_size = grub_cpu_to_le64 (entry->stat.size);
+      hdr.bitmap_width = grub_cpu_to_le32 (mode_info->width);
+      hdr.bitmap_height = grub_cpu_to_le32 (mode_info->height);
+      hdr.blit_format = grub_cpu_to_le32 (mode_info->blit_format);
+      hdr.data_len = grub_cpu_to_le32 (entry->size);
+      hdr.checksum = grub_cpu_to_le32 (bitmap_cache_checksum (entry->bitmap->data,
+							      entry->size));
+
+      if (bitmap_cache_write (&w, &hdr, sizeof (hdr))
+	  || bitmap_cache_write (&w, entry->filename, name_len)
+	  || bitmap_cache_write (&w, entry->variant, variant_len)
+	  || bitmap_cache_write (&w, entry->bitmap->data, entry->size))
+	goto fail;
+      count++;
+    }
+
+  if (bitmap_cache_write (&w, &end, sizeof (end)))
+    goto fail;
+  bitmap_cache_flush (&w);
+
+  grub_dprintf ("bitmap_cache", "wrote %u bitmaps to %s\n", count, filename);
+
+ fail:
+  while (w.head)
+    {
+      p = w.head->next;
+      grub_free (w.head);
+      w.head = p;
+    }
+  grub_free (w.buf);
+  grub_file_close (file);
+  return grub_errno;
+}
+
+static const struct grub_arg_option options[] =
+  {
+    {"clear", 'c', 0, N_("Drop all cached bitmaps."), 0, 0},
+    {"load", 'l', 0, N_("Add the bitmaps saved in FILE."), N_("FILE"),
+     ARG_TYPE_PATHNAME},
+    {"save", 's', 0, N_("Save the cached bitmaps to FILE, which must exist."),
+     N_("FILE"), ARG_TYPE_PATHNAME},
+    {"limit", 'm', 0, N_("Use up to SIZE KiB of memory."), N_("SIZE"),
+     ARG_TYPE_INT},
+    {0, 0, 0, 0, 0, 0}
+  };
+
+enum
+  {
+    OPTION_CLEAR,
+    OPTION_LOAD,
+    OPTION_SAVE,
+    OPTION_LIMIT
+  };
+
+static grub_err_t
+grub_cmd_bitmap_cache (grub_extcmd_context_t ctxt,
+		       int argc __attribute__ ((unused)),
+		       char **args __attribute__ ((unused)))
+{
+  struct grub_arg_list *state = ctxt->state;
+  struct bitmap_cache_entry *entry;
+  unsigned count = 0;
+
+  if (state[OPTION_CLEAR].set)
+    bitmap_cache_clear ();
+
+  if (state[OPTION_LIMIT].set)
+    {
+      const char *end;
+      unsigned long limit;
+
+      limit = grub_strtoul (state[OPTION_LIMIT].arg, &end, 0);
+      if (grub_errno)
+	return grub_errno;
+      if (*end != '\0' || limit > GRUB_SIZE_MAX >> 10)
+	return grub_error (GRUB_ERR_BAD_ARGUMENT,
+			   N_("invalid cache size `%s'"),
+			   state[OPTION_LIMIT].arg);
+      bitmap_cache_limit = (grub_size_t) limit << 10;
+      if (bitmap_cache)
+	bitmap_cache_trim ();
+    }
+
+  if (state[OPTION_LOAD].set
+      && bitmap_cache_read_file (state[OPTION_LOAD].arg))
+    return grub_errno;
+
+  if (state[OPTION_SAVE].set)
+    return bitmap_cache_write_file (state[OPTION_SAVE].arg);
+
+  if (state[OPTION_CLEAR].set || state[OPTION_LIMIT].set
+      || state[OPTION_LOAD].set)
+    return GRUB_ERR_NONE;
+
+  FOR_LIST_ELEMENTS (entry, bitmap_cache)
+    {
+      grub_printf ("%s %s %ux%u: %ux%u, %" PRIuGRUB_SIZE " KiB\n",
+		   entry->filename, entry->variant[0] ? entry->variant : "-",
+		   entry->width, entry->height,
+		   entry->bitmap->mode_info.width,
+		   entry->bitmap->mode_info.height,
+		   (entry->size + 1023) >> 10);
+      count++;
+    }
+  grub_printf ("%u bitmaps, %" PRIuGRUB_SIZE " KiB of %" PRIuGRUB_SIZE
+	       " KiB, %lu hits, %lu misses\n", count,
+	       (bitmap_cache_size + 1023) >> 10, bitmap_cache_limit >> 10,
+	       bitmap_cache_hits, bitmap_cache_misses);
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_extcmd_t cmd;
+
+GRUB_MOD_INIT (bitmap_cache)
+{
+  cmd = grub_register_extcmd ("bitmap_cache", grub_cmd_bitmap_cache, 0,
+			      N_("[-c] [-m SIZE] [-l FILE] [-s FILE]"),
+			      N_("Show or manage the cache of decoded images."),
+			      options);
+}
+
+GRUB_MOD_FINI (bitmap_cache)
+{
+  grub_unregister_extcmd (cmd);
+  bitmap_cache_clear ();
+}
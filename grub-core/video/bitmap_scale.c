@@ -30,8 +30,9 @@ GRUB_MOD_LICENSE ("GPLv3+");
 /* Prototypes for module-local functions.  */
 static grub_err_t scale_nn (struct grub_video_bitmap *dst,
                             struct grub_video_bitmap *src);
-static grub_err_t scale_bilinear (struct grub_video_bitmap *dst,
-                                  struct grub_video_bitmap *src);
+static grub_err_t scale_separable (struct grub_video_bitmap *dst,
+                                   struct grub_video_bitmap *src,
+                                   int area_x, int area_y);
 
 static grub_err_t
 grub_video_bitmap_scale (struct grub_video_bitmap *dst,
@@ -44,8 +45,15 @@ grub_video_bitmap_scale (struct grub_video_bitmap *dst,
     case GRUB_VIDEO_BITMAP_SCALE_METHOD_NEAREST:
       return scale_nn (dst, src);
     case GRUB_VIDEO_BITMAP_SCALE_METHOD_BEST:
+      /* Bilinear interpolation blurs and then aliases as the image gets
+         smaller, so average along the dimensions that shrink.  */
+      return scale_separable (dst, src,
+                              dst->mode_info.width < src->mode_info.width,
+                              dst->mode_info.height < src->mode_info.height);
     case GRUB_VIDEO_BITMAP_SCALE_METHOD_BILINEAR:
-      return scale_bilinear (dst, src);
+      return scale_separable (dst, src, 0, 0);
+    case GRUB_VIDEO_BITMAP_SCALE_METHOD_AREA:
+      return scale_separable (dst, src, 1, 1);
     default:
       return grub_error (GRUB_ERR_BUG, "Invalid scale_method value");
     }
@@ -344,18 +352,219 @@ scale_nn (struct grub_video_bitmap *dst, struct grub_video_bitmap *src)
   return GRUB_ERR_NONE;
 }
 
-/* Bilinear interpolation image scaling algorithm.
+/* Weights are fixed-point numbers with this many fractional bits.  Those
+   of the vertical pass only have 8, so that the weighted sum of a
+   component fits in half a word and two can be computed at once.  */
+#define FILTER_BITS_X	14
+#define FILTER_BITS_Y	8
+/* Turning horizontally weighted sums of 8.8 fixed-point components into
+   8 bits.  */
+#define FILTER_SHIFT	(FILTER_BITS_X + 8)
+#define FILTER_ROUND	(1 << (FILTER_SHIFT - 1))
+
+/* How each destination pixel along one dimension is made of source
+   pixels: COUNT[i] pixels starting at FIRST[i], weighted by the COUNT[i]
+   values at WEIGHTS + i * TAPS which add up to one.  */
+struct scale_filter
+{
+  unsigned *first;
+  unsigned *count;
+  grub_uint16_t *weights;
+  unsigned taps;
+};
+
+static void
+free_filter (struct scale_filter *filter)
+{
+  grub_free (filter->first);
+  filter->first = 0;
+}
+
+/* Compute the filter scaling SN source pixels to DN destination pixels,
+   either by linear interpolation between the two source pixels nearest to
+   the centre of each destination pixel or, if AREA is set, by averaging
+   the source pixels it covers weighted by how much of them it covers.
+   Weights have BITS fractional bits.  */
+static grub_err_t
+make_filter (struct scale_filter *filter, unsigned sn, unsigned dn, int area,
+             unsigned bits)
+{
+  unsigned one = 1 << bits;
+  grub_uint16_t *w;
+  grub_size_t n;
+  unsigned i;
+
+  /* A destination pixel covers SN / DN source pixels, which is rounded
+     up and takes in one more unless the pixels line up.  */
+  filter->taps = sn / dn + (sn % dn != 0) + (sn % dn != 0);
+  if (! area || filter->taps < 2)
+    filter->taps = 2;
+  if (filter->taps > (GRUB_SIZE_MAX / dn - 2 * sizeof (unsigned))
+      / sizeof (grub_uint16_t))
+    return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+  n = (grub_size_t) dn * (2 * sizeof (unsigned)
+                          + filter->taps * sizeof (grub_uint16_t));
+  filter->first = grub_zalloc (n);
+  if (! filter->first)
+    return grub_errno;
+  filter->count = filter->first + dn;
+  filter->weights = (grub_uint16_t *) (filter->count + dn);
+
+  for (i = 0, w = filter->weights; i < dn; i++, w += filter->taps)
+    if (area)
+      {
+        /* Measured in 1/DN of a source pixel, destination pixel I covers
+           [LO, LO + SN) and source pixel S covers [S * DN, (S + 1) * DN).
+           Rounding the running total rather than each weight keeps the
+           sum exact.  */
+        grub_uint64_t lo = (grub_uint64_t) i * sn;
+        grub_uint64_t s, end;
+        unsigned k, prev = 0, cur;
+
+        filter->first[i] = grub_divmod64 (lo, dn, 0);
+        for (k = 0, s = filter->first[i]; k < filter->taps; k++, s++)
+          {
+            end = (s + 1) * dn;
+            if (end > lo + sn)
+              end = lo + sn;
+            cur = grub_divmod64 (((end - lo) << bits) + sn / 2, sn, 0);
+            w[k] = cur - prev;
+            prev = cur;
+            if (end == lo + sn)
+              break;
+          }
+        filter->count[i] = k + 1;
+      }
+    else
+      {
+        /* The centre of destination pixel I is at
+           ((2 * I + 1) * SN / DN - 1) / 2 in source pixels.  */
+        grub_uint64_t pos = (grub_uint64_t) (2 * i + 1) * sn;
+        grub_uint64_t rem = 0;
+        unsigned frac = 0;
+
+        if (pos > dn)
+          {
+            pos = grub_divmod64 (pos - dn, 2 * dn, &rem);
+            frac = grub_divmod64 ((rem << bits) + dn, 2 * dn, 0);
+            if (frac == one)
+              {
+                pos++;
+                frac = 0;
+              }
+          }
+        else
+          pos = 0;
+        if (pos >= sn - 1)
+          {
+            pos = sn - 1;
+            frac = 0;
+          }
+        filter->first[i] = pos;
+        filter->count[i] = frac ? 2 : 1;
+        w[0] = one - frac;
+        w[1] = frac;
+      }
+  return GRUB_ERR_NONE;
+}
+
+/* Filter ROW of 8.8 fixed-point components horizontally into the DW
+   pixels at DPTR, rounding back to 8 bits.  */
+static void
+filter_row (grub_uint8_t *dptr, const grub_uint16_t *row,
+            const struct scale_filter *filter, unsigned dw,
+            unsigned bytes_per_pixel)
+{
+  const unsigned *first = filter->first;
+  const unsigned *count = filter->count;
+  const grub_uint16_t *w = filter->weights;
+  unsigned taps = filter->taps;
+  unsigned dx, k;
+
+  if (bytes_per_pixel == 4 && taps == 2)
+    /* All four components of a pixel at once, from two source pixels.
+       Those past the edge of the row have no weight.  */
+    for (dx = 0; dx < dw; dx++, w += 2, dptr += 4)
+      {
+        const grub_uint16_t *p = row + first[dx] * 4;
+        grub_uint32_t w0 = w[0], w1 = w[1];
+
+        dptr[0] = (w0 * p[0] + w1 * p[4] + FILTER_ROUND) >> FILTER_SHIFT;
+        dptr[1] = (w0 * p[1] + w1 * p[5] + FILTER_ROUND) >> FILTER_SHIFT;
+        dptr[2] = (w0 * p[2] + w1 * p[6] + FILTER_ROUND) >> FILTER_SHIFT;
+        dptr[3] = (w0 * p[3] + w1 * p[7] + FILTER_ROUND) >> FILTER_SHIFT;
+      }
+  else if (bytes_per_pixel == 4)
+    for (dx = 0; dx < dw; dx++, w += taps, dptr += 4)
+      {
+        const grub_uint16_t *p = row + first[dx] * 4;
+        grub_uint32_t c0, c1, c2, c3;
+
+        c0 = c1 = c2 = c3 = FILTER_ROUND;
+        for (k = 0; k < count[dx]; k++, p += 4)
+          {
+            grub_uint32_t wk = w[k];
+
+            c0 += wk * p[0];
+            c1 += wk * p[1];
+            c2 += wk * p[2];
+            c3 += wk * p[3];
+          }
+        dptr[0] = c0 >> FILTER_SHIFT;
+        dptr[1] = c1 >> FILTER_SHIFT;
+        dptr[2] = c2 >> FILTER_SHIFT;
+        dptr[3] = c3 >> FILTER_SHIFT;
+      }
+  else if (bytes_per_pixel == 3)
+    for (dx = 0; dx < dw; dx++, w += taps, dptr += 3)
+      {
+        const grub_uint16_t *p = row + first[dx] * 3;
+        grub_uint32_t c0, c1, c2;
+
+        c0 = c1 = c2 = FILTER_ROUND;
+        for (k = 0; k < count[dx]; k++, p += 3)
+          {
+            grub_uint32_t wk = w[k];
+
+            c0 += wk * p[0];
+            c1 += wk * p[1];
+            c2 += wk * p[2];
+          }
+        dptr[0] = c0 >> FILTER_SHIFT;
+        dptr[1] = c1 >> FILTER_SHIFT;
+        dptr[2] = c2 >> FILTER_SHIFT;
+      }
+  else
+    for (dx = 0; dx < dw; dx++, w += taps)
+      {
+        const grub_uint16_t *p = row + first[dx] * bytes_per_pixel;
+        unsigned comp;
+
+        for (comp = 0; comp < bytes_per_pixel; comp++, dptr++)
+          {
+            grub_uint32_t c = FILTER_ROUND;
+
+            for (k = 0; k < count[dx]; k++)
+              c += (grub_uint32_t) w[k] * p[k * bytes_per_pixel + comp];
+            *dptr = c >> FILTER_SHIFT;
+          }
+      }
+}
+
+/* Separable image scaling.
 
    Copy the bitmap SRC to the bitmap DST, scaling the bitmap to fit the
-   dimensions of DST.  This function uses the bilinear interpolation algorithm
-   to interpolate the pixels.
+   dimensions of DST.  Each destination row is first filtered vertically
+   from the source rows it depends on into a row of 8.8 fixed-point
+   components as wide as the source, which is then filtered horizontally.
+   AREA_X and AREA_Y select averaging rather than bilinear interpolation
+   for each dimension.
 
    Supports only direct color modes which have components separated
-   into bytes (e.g., RGBA 8:8:8:8 or BGR 8:8:8 true color).
-   But because of this simplifying assumption, the implementation is
-   greatly simplified.  */
+   into bytes (e.g., RGBA 8:8:8:8 or BGR 8:8:8 true color).  */
 static grub_err_t
-scale_bilinear (struct grub_video_bitmap *dst, struct grub_video_bitmap *src)
+scale_separable (struct grub_video_bitmap *dst, struct grub_video_bitmap *src,
+                 int area_x, int area_y)
 {
   grub_err_t err = verify_bitmaps(dst, src);
   if (err != GRUB_ERR_NONE)
@@ -370,84 +579,67 @@ scale_bilinear (struct grub_video_bitmap *dst, struct grub_video_bitmap *src)
   int dstride = dst->mode_info.pitch;
   int sstride = src->mode_info.pitch;
   /* bytes_per_pixel is the same for both src and dst. */
-  int bytes_per_pixel = dst->mode_info.bytes_per_pixel;
-  unsigned dy, syf, sy, ystep, yfrac, yover;
-  unsigned sxf, sx, xstep, xfrac, xover;
-  grub_uint8_t *dptr, *dline_end, *sline;
-
-  xstep = (sw << 8) / dw;
-  xover = (sw << 8) % dw;
-  ystep = (sh << 8) / dh;
-  yover = (sh << 8) % dh;
+  unsigned bytes_per_pixel = dst->mode_info.bytes_per_pixel;
+  unsigned len = sw * bytes_per_pixel;
+  struct scale_filter xf = { 0 }, yf = { 0 };
+  grub_uint16_t *row = 0;
+  unsigned dy, j, k;
+
+  err = make_filter (&xf, sw, dw, area_x, FILTER_BITS_X);
+  if (err == GRUB_ERR_NONE)
+    err = make_filter (&yf, sh, dh, area_y, FILTER_BITS_Y);
+  if (err != GRUB_ERR_NONE)
+    goto fail;
+  /* With a pixel to spare for filter_row.  */
+  row = grub_zalloc ((len + bytes_per_pixel) * sizeof (row[0]));
+  if (! row)
+    {
+      err = grub_errno;
+      goto fail;
+    }
 
-  for (dy = 0, syf = 0, yfrac = 0; dy < dh; dy++, syf += ystep, yfrac += yover)
+  for (dy = 0; dy < dh; dy++)
     {
-      if (yfrac >= dh)
-	{
-	  yfrac -= dh;
-	  syf++;
-	}
-      sy = syf >> 8;
-      dptr = ddata + dy * dstride;
-      dline_end = dptr + dw * bytes_per_pixel;
-      sline = sdata + sy * sstride;
-      for (sxf = 0, xfrac = 0; dptr < dline_end; sxf += xstep, xfrac += xover, dptr += bytes_per_pixel)
+      const grub_uint16_t *w = yf.weights + dy * yf.taps;
+      const grub_uint8_t *s0 = sdata + yf.first[dy] * sstride;
+      unsigned count = yf.count[dy];
+
+      /* Vertical pass.  Components are filtered independently, so this
+         runs straight along the source rows whatever the pixel size, and
+         takes four at a time, two to a word.  */
+      for (j = 0; j + 4 <= len; j += 4)
         {
-          grub_uint8_t *sptr;
-          int comp;
-
-	  if (xfrac >= dw)
-	    {
-	      xfrac -= dw;
-	      sxf++;
-	    }
+          const grub_uint8_t *s = s0 + j;
+          grub_uint32_t lo = 0, hi = 0;
 
-          /* Get the address of the pixels in src and dst. */
-	  sx = sxf >> 8;
-	  sptr = sline + sx * bytes_per_pixel;
-
-          /* If we have enough space to do so, use bilinear interpolation.
-             Otherwise, fall back to nearest neighbor for this pixel. */
-          if (sx < sw - 1 && sy < sh - 1)
+          for (k = 0; k < count; k++, s += sstride)
             {
-              /* Do bilinear interpolation. */
-
-              /* Fixed-point .8 numbers representing the fraction of the
-                 distance in the x (u) and y (v) direction within the
-                 box of 4 pixels in the source. */
-              unsigned u = sxf & 0xff;
-              unsigned v = syf & 0xff;
-
-              for (comp = 0; comp < bytes_per_pixel; comp++)
-                {
-                  /* Get the component's values for the
-                     four source corner pixels. */
-                  unsigned f00 = sptr[comp];
-                  unsigned f10 = sptr[comp + bytes_per_pixel];
-                  unsigned f01 = sptr[comp + sstride];
-                  unsigned f11 = sptr[comp + sstride + bytes_per_pixel];
-
-                  /* Count coeffecients. */
-                  unsigned c00 = (256 - u) * (256 - v);
-                  unsigned c10 = u * (256 - v);
-                  unsigned c01 = (256 - u) * v;
-                  unsigned c11 = u * v;
-
-                  /* Interpolate. */
-                  unsigned fxy = c00 * f00 + c01 * f01 + c10 * f10 + c11 * f11;
-                  fxy = fxy >> 16;
-
-                  dptr[comp] = fxy;
-                }
-            }
-          else
-            {
-              /* Fall back to nearest neighbor interpolation. */
-              /* Copy the pixel color value. */
-              for (comp = 0; comp < bytes_per_pixel; comp++)
-                dptr[comp] = sptr[comp];
+              grub_uint32_t v = grub_le_to_cpu32 (grub_get_unaligned32 (s));
+
+              lo += (v & 0x00ff00ff) * w[k];
+              hi += ((v >> 8) & 0x00ff00ff) * w[k];
             }
+          row[j] = lo;
+          row[j + 1] = hi;
+          row[j + 2] = lo >> 16;
+          row[j + 3] = hi >> 16;
         }
+      for (; j < len; j++)
+        {
+          const grub_uint8_t *s = s0 + j;
+          grub_uint32_t c = 0;
+
+          for (k = 0; k < count; k++, s += sstride)
+            c += *s * w[k];
+          row[j] = c;
+        }
+
+      filter_row (ddata + dy * dstride, row, &xf, dw, bytes_per_pixel);
     }
-  return GRUB_ERR_NONE;
+
+ fail:
+  grub_free (row);
+  free_filter (&yf);
+  free_filter (&xf);
+  return err;
 }
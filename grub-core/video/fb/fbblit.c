@@ -34,6 +34,14 @@
 #include <grub/types.h>
 #include <grub/video.h>
 
+/* Exchange the components in the lowest and the third byte of a 32-bit
+   pixel, which turns RGBX8888 into BGRX8888 and back.  */
+static inline grub_uint32_t
+swap_red_blue (grub_uint32_t color)
+{
+  return (color & 0xFF00FF00) | ((color >> 16) & 0xFF) | ((color & 0xFF) << 16);
+}
+
 /* Generic replacing blitter (slow).  Works for every supported format.  */
 static void
 grub_video_fbblit_replace (struct grub_video_fbblit_info *dst,
@@ -769,8 +777,8 @@ grub_video_fbblit_replace_BGRX8888_RGBX8888 (struct grub_video_fbblit_info *dst,
 {
   int i;
   int j;
-  grub_uint8_t *srcptr;
-  grub_uint8_t *dstptr;
+  grub_uint32_t *srcptr;
+  grub_uint32_t *dstptr;
   unsigned int srcrowskip;
   unsigned int dstrowskip;
 
@@ -785,30 +793,10 @@ grub_video_fbblit_replace_BGRX8888_RGBX8888 (struct grub_video_fbblit_info *dst,
   for (j = 0; j < height; j++)
     {
       for (i = 0; i < width; i++)
-        {
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-          grub_uint8_t a = *srcptr++;
-#endif
-          grub_uint8_t r = *srcptr++;
-          grub_uint8_t g = *srcptr++;
-          grub_uint8_t b = *srcptr++;
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
-          grub_uint8_t a = *srcptr++;
-#endif
-
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-          *dstptr++ = a;
-#endif
-          *dstptr++ = b;
-          *dstptr++ = g;
-          *dstptr++ = r;
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
-          *dstptr++ = a;
-#endif
-        }
+        *dstptr++ = swap_red_blue (*srcptr++);
 
-      srcptr += srcrowskip;
-      dstptr += dstrowskip;
+      GRUB_VIDEO_FB_ADVANCE_POINTER (srcptr, srcrowskip);
+      GRUB_VIDEO_FB_ADVANCE_POINTER (dstptr, dstrowskip);
     }
 }
 
@@ -823,7 +811,7 @@ grub_video_fbblit_replace_BGRX8888_RGB888 (struct grub_video_fbblit_info *dst,
   int i;
   int j;
   grub_uint8_t *srcptr;
-  grub_uint8_t *dstptr;
+  grub_uint32_t *dstptr;
   unsigned int srcrowskip;
   unsigned int dstrowskip;
 
@@ -839,27 +827,20 @@ grub_video_fbblit_replace_BGRX8888_RGB888 (struct grub_video_fbblit_info *dst,
     {
       for (i = 0; i < width; i++)
         {
-          grub_uint8_t r = *srcptr++;
-          grub_uint8_t g = *srcptr++;
-          grub_uint8_t b = *srcptr++;
-
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-          /* Set alpha component as opaque.  */
-          *dstptr++ = 255;
-#endif
+          grub_uint32_t r = *srcptr++;
+          grub_uint32_t g = *srcptr++;
+          grub_uint32_t b = *srcptr++;
 
-          *dstptr++ = b;
-          *dstptr++ = g;
-          *dstptr++ = r;
-
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
           /* Set alpha component as opaque.  */
-          *dstptr++ = 255;
+#ifdef GRUB_CPU_WORDS_BIGENDIAN
+          *dstptr++ = 0xFF000000 | (b << 16) | (g << 8) | r;
+#else
+          *dstptr++ = 0xFF000000 | (r << 16) | (g << 8) | b;
 #endif
         }
 
       srcptr += srcrowskip;
-      dstptr += dstrowskip;
+      GRUB_VIDEO_FB_ADVANCE_POINTER (dstptr, dstrowskip);
     }
 }
 
@@ -1159,6 +1140,28 @@ alpha_dilute (grub_uint8_t bg, grub_uint8_t fg, grub_uint8_t alpha)
   return h;
 }
 
+/* Like alpha_dilute, for two components at once held in the low bytes of
+   the 16-bit halves of BG and FG.  Neither half of the sum overflows, and
+   for S below 65535 dividing by 255 is (S + 1 + (S >> 8)) >> 8.  */
+static inline grub_uint32_t
+alpha_dilute_pair (grub_uint32_t bg, grub_uint32_t fg, grub_uint32_t alpha)
+{
+  grub_uint32_t s;
+
+  s = fg * alpha + bg * (255 ^ alpha);
+  return ((s + 0x00010001 + ((s >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+}
+
+/* Blend the 32-bit pixel FG over BG, which has the same layout, with
+   alpha_dilute and make ALPHA the alpha of the result.  */
+static inline grub_uint32_t
+alpha_blend (grub_uint32_t bg, grub_uint32_t fg, grub_uint32_t alpha)
+{
+  return alpha_dilute_pair (bg & 0x00FF00FF, fg & 0x00FF00FF, alpha)
+    | (alpha_dilute_pair ((bg >> 8) & 0xFF, (fg >> 8) & 0xFF, alpha) << 8)
+    | (alpha << 24);
+}
+
 /* Generic blending blitter.  Works for every supported format.  */
 static void
 grub_video_fbblit_blend (struct grub_video_fbblit_info *dst,
@@ -1242,55 +1245,27 @@ grub_video_fbblit_blend_BGRA8888_RGBA8888 (struct grub_video_fbblit_info *dst,
 
   for (j = 0; j < height; j++)
     {
-      for (i = 0; i < width; i++)
+      for (i = 0; i < width; i++, dstptr++)
         {
           grub_uint32_t color;
-          unsigned int sr;
-          unsigned int sg;
-          unsigned int sb;
           unsigned int a;
-          unsigned int dr;
-          unsigned int dg;
-          unsigned int db;
 
           color = *srcptr++;
 
           a = color >> 24;
 
+          /* Skip transparent source pixels.  */
           if (a == 0)
-            {
-              /* Skip transparent source pixels.  */
-              dstptr++;
-              continue;
-            }
+            continue;
 
-          sr = (color >> 0) & 0xFF;
-          sg = (color >> 8) & 0xFF;
-          sb = (color >> 16) & 0xFF;
+          color = swap_red_blue (color);
 
           if (a == 255)
-            {
-              /* Opaque pixel shortcut.  */
-              dr = sr;
-              dg = sg;
-              db = sb;
-            }
+            /* Opaque pixel shortcut.  */
+            *dstptr = color;
           else
-            {
-              /* General pixel color blending.  */
-              color = *dstptr;
-
-              dr = (color >> 16) & 0xFF;
-              dr = alpha_dilute (dr, sr, a);
-              dg = (color >> 8) & 0xFF;
-              dg = alpha_dilute (dg, sg, a);
-              db = (color >> 0) & 0xFF;
-              db = alpha_dilute (db, sb, a);
-            }
-
-          color = (a << 24) | (dr << 16) | (dg << 8) | db;
-
-          *dstptr++ = color;
+            /* General pixel color blending.  */
+            *dstptr = alpha_blend (*dstptr, color, a);
         }
 
       GRUB_VIDEO_FB_ADVANCE_POINTER (srcptr, srcrowskip);
@@ -1359,8 +1334,6 @@ grub_video_fbblit_blend_BGR888_RGBA8888 (struct grub_video_fbblit_info *dst,
           else
             {
               /* General pixel color blending.  */
-              color = *dstptr;
-
 #ifndef GRUB_CPU_WORDS_BIGENDIAN
               db = dstptr[0];
               dg = dstptr[1];
@@ -1371,9 +1344,10 @@ grub_video_fbblit_blend_BGR888_RGBA8888 (struct grub_video_fbblit_info *dst,
               db = dstptr[2];
 #endif
 
-              db = alpha_dilute (db, sb, a);
-              dg = alpha_dilute (dg, sg, a);
-              dr = alpha_dilute (dr, sr, a);
+              color = alpha_blend ((db << 16) | (dg << 8) | dr, color, a);
+              dr = color & 0xFF;
+              dg = (color >> 8) & 0xFF;
+              db = (color >> 16) & 0xFF;
             }
 
 #ifndef GRUB_CPU_WORDS_BIGENDIAN
@@ -1405,13 +1379,7 @@ grub_video_fbblit_blend_RGBA8888_RGBA8888 (struct grub_video_fbblit_info *dst,
   int j;
   grub_uint32_t *srcptr;
   grub_uint32_t *dstptr;
-  unsigned int sr;
-  unsigned int sg;
-  unsigned int sb;
   unsigned int a;
-  unsigned int dr;
-  unsigned int dg;
-  unsigned int db;
   grub_size_t srcrowskip;
   grub_size_t dstrowskip;
 
@@ -1441,23 +1409,8 @@ grub_video_fbblit_blend_RGBA8888_RGBA8888 (struct grub_video_fbblit_info *dst,
               continue;
             }
 
-          sr = (color >> 0) & 0xFF;
-          sg = (color >> 8) & 0xFF;
-          sb = (color >> 16) & 0xFF;
-
-          color = *dstptr;
-
-          dr = (color >> 0) & 0xFF;
-          dg = (color >> 8) & 0xFF;
-          db = (color >> 16) & 0xFF;
-
-          dr = alpha_dilute (dr, sr, a);
-          dg = alpha_dilute (dg, sg, a);
-          db = alpha_dilute (db, sb, a);
-
-          color = (a << 24) | (db << 16) | (dg << 8) | dr;
-
-          *dstptr++ = color;
+          *dstptr = alpha_blend (*dstptr, color, a);
+          dstptr++;
         }
       GRUB_VIDEO_FB_ADVANCE_POINTER (srcptr, srcrowskip);
       GRUB_VIDEO_FB_ADVANCE_POINTER (dstptr, dstrowskip);
@@ -1536,9 +1489,10 @@ grub_video_fbblit_blend_RGB888_RGBA8888 (struct grub_video_fbblit_info *dst,
           dr = dstptr[2];
 #endif
 
-          dr = alpha_dilute (dr, sr, a);
-          dg = alpha_dilute (dg, sg, a);
-          db = alpha_dilute (db, sb, a);
+          color = alpha_blend ((db << 16) | (dg << 8) | dr, color, a);
+          dr = color & 0xFF;
+          dg = (color >> 8) & 0xFF;
+          db = (color >> 16) & 0xFF;
 
 #ifndef GRUB_CPU_WORDS_BIGENDIAN
           *dstptr++ = dr;
@@ -31,10 +31,20 @@ GRUB_MOD_LICENSE ("GPLv3+");
 typedef grub_err_t (*grub_video_fb_doublebuf_update_screen_t) (void);
 typedef volatile void *framebuf_t;
 
+/* Damaged parts of the back buffer which have yet to be copied to the
+   screen, kept as a short list of rectangles.  */
+#define DIRTY_MAX_RECTS 16
+
+struct dirty_rect
+{
+  int x1, y1;
+  int x2, y2;
+};
+
 struct dirty
 {
-  int first_line;
-  int last_line;
+  unsigned int count;
+  struct dirty_rect rects[DIRTY_MAX_RECTS];
 };
 
 static struct
@@ -829,15 +839,111 @@ grub_video_fb_unmap_color_int (struct grub_video_fbblit_info * source,
     }
 }
 
+static inline grub_uint64_t
+dirty_area (const struct dirty_rect *r)
+{
+  return (grub_uint64_t) (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static inline void
+dirty_union (struct dirty_rect *u, const struct dirty_rect *a,
+	     const struct dirty_rect *b)
+{
+  u->x1 = grub_min (a->x1, b->x1);
+  u->y1 = grub_min (a->y1, b->y1);
+  u->x2 = grub_max (a->x2, b->x2);
+  u->y2 = grub_max (a->y2, b->y2);
+}
+
+/* Add R to the list D.  R is merged with any rectangle whose union with
+   it is no bigger than both of them together, so overlapping and
+   adjacent damage is copied once.  When the list is full R is merged
+   with the rectangle it makes grow least.  */
 static void
-dirty (int y, int height)
+dirty_add (struct dirty *d, struct dirty_rect r)
 {
+  struct dirty_rect u;
+  unsigned int i, best;
+  grub_uint64_t cost, best_cost = 0;
+
+  if (r.x1 >= r.x2 || r.y1 >= r.y2)
+    return;
+
+ again:
+  best = d->count;
+  for (i = 0; i < d->count; i++)
+    {
+      dirty_union (&u, &d->rects[i], &r);
+      if (dirty_area (&u) <= dirty_area (&d->rects[i]) + dirty_area (&r))
+	{
+	  r = u;
+	  d->rects[i] = d->rects[--d->count];
+	  goto again;
+	}
+      cost = dirty_area (&u) - dirty_area (&d->rects[i]);
+      if (best == d->count || cost < best_cost)
+	{
+	  best = i;
+	  best_cost = cost;
+	}
+    }
+
+  if (d->count == DIRTY_MAX_RECTS)
+    {
+      dirty_union (&r, &d->rects[best], &r);
+      d->rects[best] = d->rects[--d->count];
+      goto again;
+    }
+
+  d->rects[d->count++] = r;
+}
+
+/* Copy the rectangles in D from the back buffer to PAGE.  */
+static void
+dirty_copy (volatile void *page, const struct dirty *d)
+{
+  struct grub_video_mode_info *mode_info = &framebuffer.back_target->mode_info;
+  grub_size_t pitch = mode_info->pitch;
+  grub_size_t offset, start, end;
+  unsigned int i;
+  int y;
+
+  for (i = 0; i < d->count; i++)
+    {
+      const struct dirty_rect *r = &d->rects[i];
+
+      offset = r->y1 * pitch;
+      if (r->x1 == 0 && r->x2 == (int) mode_info->width)
+	{
+	  /* Whole lines are contiguous.  */
+	  grub_memcpy ((char *) page + offset,
+		       (char *) framebuffer.back_target->data + offset,
+		       pitch * (r->y2 - r->y1));
+	  continue;
+	}
+
+      /* Round to whole bytes for modes with less than 8 bits per pixel.  */
+      start = ((grub_size_t) r->x1 * mode_info->bpp) / 8;
+      end = ((grub_size_t) r->x2 * mode_info->bpp + 7) / 8;
+      for (y = r->y1; y < r->y2; y++, offset += pitch)
+	grub_memcpy ((char *) page + offset + start,
+		     (char *) framebuffer.back_target->data + offset + start,
+		     end - start);
+    }
+}
+
+static void
+dirty (int x, int y, int width, int height)
+{
+  struct dirty_rect r;
+
   if (framebuffer.render_target != framebuffer.back_target)
     return;
-  if (framebuffer.current_dirty.first_line > y)
-    framebuffer.current_dirty.first_line = y;
-  if (framebuffer.current_dirty.last_line < y + height)
-    framebuffer.current_dirty.last_line = y + height;
+  r.x1 = x;
+  r.y1 = y;
+  r.x2 = x + width;
+  r.y2 = y + height;
+  dirty_add (&framebuffer.current_dirty, r);
 }
 
 grub_err_t
@@ -895,7 +1001,7 @@ grub_video_fb_fill_rect (grub_video_color_t color, int x, int y,
   x += area_x;
   y += area_y;
 
-  dirty (y, height);
+  dirty (x, y, width, height);
 
   /* Use fbblit_info to encapsulate rendering.  */
   target.mode_info = &framebuffer.render_target->mode_info;
@@ -1008,7 +1114,7 @@ grub_video_fb_blit_source (struct grub_video_fbblit_info *source,
   target.data = framebuffer.render_target->data;
 
   /* Do actual blitting.  */
-  dirty (y, height);
+  dirty (x, y, width, height);
   grub_video_fb_dispatch_blit (&target, source, oper, x, y, width, height,
                                offset_x, offset_y);
 
@@ -1060,7 +1166,9 @@ grub_video_fb_scroll (grub_video_color_t color, int dx, int dy)
   width = framebuffer.render_target->viewport.width - grub_abs (dx);
   height = framebuffer.render_target->viewport.height - grub_abs (dy);
 
-  dirty (framebuffer.render_target->viewport.y,
+  dirty (framebuffer.render_target->viewport.x,
+	 framebuffer.render_target->viewport.y,
+	 framebuffer.render_target->viewport.width,
 	 framebuffer.render_target->viewport.height);
 
   if (dx < 0)
@@ -1415,20 +1523,8 @@ grub_video_fb_get_active_render_target (struct grub_video_fbrender_target **targ
 static grub_err_t
 doublebuf_blit_update_screen (void)
 {
-  if (framebuffer.current_dirty.first_line
-      <= framebuffer.current_dirty.last_line)
-    grub_memcpy ((char *) framebuffer.pages[0]
-		 + framebuffer.current_dirty.first_line
-		 * framebuffer.back_target->mode_info.pitch,
-		 (char *) framebuffer.back_target->data
-		 + framebuffer.current_dirty.first_line
-		 * framebuffer.back_target->mode_info.pitch,
-		 framebuffer.back_target->mode_info.pitch
-		 * (framebuffer.current_dirty.last_line
-		    - framebuffer.current_dirty.first_line));
-  framebuffer.current_dirty.first_line
-    = framebuffer.back_target->mode_info.height;
-  framebuffer.current_dirty.last_line = 0;
+  dirty_copy (framebuffer.pages[0], &framebuffer.current_dirty);
+  framebuffer.current_dirty.count = 0;
 
   return GRUB_ERR_NONE;
 }
@@ -1461,8 +1557,7 @@ grub_video_fb_doublebuf_blit_init (struct grub_video_fbrender_target **back,
   framebuffer.pages[0] = framebuf;
   framebuffer.displayed_page = 0;
   framebuffer.render_page = 0;
-  framebuffer.current_dirty.first_line = mode_info.height;
-  framebuffer.current_dirty.last_line = 0;
+  framebuffer.current_dirty.count = 0;
 
   return GRUB_ERR_NONE;
 }
@@ -1472,26 +1567,18 @@ doublebuf_pageflipping_update_screen (void)
 {
   int new_displayed_page;
   grub_err_t err;
-  int first_line, last_line;
-
-  first_line = framebuffer.current_dirty.first_line;
-  last_line = framebuffer.current_dirty.last_line;
-  if (first_line > framebuffer.previous_dirty.first_line)
-    first_line = framebuffer.previous_dirty.first_line;
-  if (last_line < framebuffer.previous_dirty.last_line)
-    last_line = framebuffer.previous_dirty.last_line;
-
-  if (first_line <= last_line)
-    grub_memcpy ((char *) framebuffer.pages[framebuffer.render_page]
-		 + first_line * framebuffer.back_target->mode_info.pitch,
-		 (char *) framebuffer.back_target->data
-		 + first_line * framebuffer.back_target->mode_info.pitch,
-		 framebuffer.back_target->mode_info.pitch
-		 * (last_line - first_line));
+  struct dirty both;
+  unsigned int i;
+
+  /* The page being drawn on last got what was damaged before the previous
+     flip, so it also needs what was damaged since.  */
+  both = framebuffer.current_dirty;
+  for (i = 0; i < framebuffer.previous_dirty.count; i++)
+    dirty_add (&both, framebuffer.previous_dirty.rects[i]);
+
+  dirty_copy (framebuffer.pages[framebuffer.render_page], &both);
   framebuffer.previous_dirty = framebuffer.current_dirty;
-  framebuffer.current_dirty.first_line
-    = framebuffer.back_target->mode_info.height;
-  framebuffer.current_dirty.last_line = 0;
+  framebuffer.current_dirty.count = 0;
 
   /* Swap the page numbers in the framebuffer struct.  */
   new_displayed_page = framebuffer.render_page;
@@ -1544,12 +1631,8 @@ doublebuf_pageflipping_init (struct grub_video_mode_info *mode_info,
   framebuffer.pages[0] = page0_ptr;
   framebuffer.pages[1] = page1_ptr;
 
-  framebuffer.current_dirty.first_line
-    = framebuffer.back_target->mode_info.height;
-  framebuffer.current_dirty.last_line = 0;
-  framebuffer.previous_dirty.first_line
-    = framebuffer.back_target->mode_info.height;
-  framebuffer.previous_dirty.last_line = 0;
+  framebuffer.current_dirty.count = 0;
+  framebuffer.previous_dirty.count = 0;
 
   /* Set the framebuffer memory data pointer and display the right page.  */
   err = set_page_in (framebuffer.displayed_page);
@@ -1635,9 +1718,7 @@ grub_video_fb_setup (unsigned int mode_type, unsigned int mode_mask,
   framebuffer.displayed_page = 0;
   framebuffer.render_page = 0;
   framebuffer.set_page = 0;
-  framebuffer.current_dirty.first_line
-    = framebuffer.back_target->mode_info.height;
-  framebuffer.current_dirty.last_line = 0;
+  framebuffer.current_dirty.count = 0;
 
   mode_info->mode_type &= ~GRUB_VIDEO_MODE_TYPE_DOUBLE_BUFFERED;
 
@@ -22,7 +22,7 @@
 #include <grub/dl.h>
 #include <grub/mm.h>
 #include <grub/misc.h>
-#include <grub/bufio.h>
+#include <grub/file.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
@@ -33,6 +33,8 @@ GRUB_MOD_LICENSE ("GPLv3+");
 enum
   {
     JPEG_MARKER_SOF0 = 0xc0,
+    JPEG_MARKER_SOF1 = 0xc1,
+    JPEG_MARKER_SOF2 = 0xc2,
     JPEG_MARKER_DHT  = 0xc4,
     JPEG_MARKER_SOI  = 0xd8,
     JPEG_MARKER_EOI  = 0xd9,
@@ -52,8 +54,30 @@ enum
 #define SHIFT_BITS		8
 #define CONST(x)		((int) ((x) * (1L << SHIFT_BITS) + 0.5))
 
+/* Precision of the color conversion tables.  */
+#define COLOR_SHIFT_BITS	16
+#define COLOR_CONST(x)		((int) ((x) * (1L << COLOR_SHIFT_BITS) + 0.5))
+
+/* Extra precision kept between the two IDCT passes.  */
+#define PASS1_BITS		2
+
+/* Fraction bits of the scaled quantization tables.  */
+#define QUANT_BITS		12
+
+#define DEQUANT(c, q)	(((c) * (q) + (1 << (QUANT_BITS - PASS1_BITS - 1))) \
+				 >> (QUANT_BITS - PASS1_BITS))
+
+/* Scale a result of the IDCT row pass down to a sample.  */
+#define JPEG_DESCALE(x)		jpeg_range_limit[((x) >> (PASS1_BITS + 3)) & 1023]
+
 #define JPEG_UNIT_SIZE		8
 
+/* Codes up to this long are decoded with a single table lookup.  */
+#define JPEG_HUFF_FAST_BITS	9
+
+/* Size of the file input buffer.  */
+#define JPEG_INBUF_SIZE		8192
+
 static const grub_uint8_t jpeg_zigzag_order[64] = {
   0, 1, 8, 16, 9, 2, 3, 10,
   17, 24, 32, 25, 18, 11, 4, 5,
@@ -65,48 +89,157 @@ static const grub_uint8_t jpeg_zigzag_order[64] = {
   53, 60, 61, 54, 47, 55, 62, 63
 };
 
-typedef int jpeg_data_unit_t[64];
+/* Scale factors of the AAN IDCT, cos (k * pi / 16) * sqrt (2) for row and
+   column multiplied together, in units of 2^-14.  They are folded into
+   the quantization tables.  */
+static const grub_uint16_t jpeg_aan_scales[64] = {
+  16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+  22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+  21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+  19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+  16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+  12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+   8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+   4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+};
+
+typedef grub_int16_t jpeg_data_unit_t[64];
+
+struct huff_table
+{
+  /* Indexed by the next JPEG_HUFF_FAST_BITS input bits.  Each entry holds
+     the code length above the symbol, or 0 if the code is longer.  */
+  grub_uint16_t fast[1 << JPEG_HUFF_FAST_BITS];
+  /* Canonical decoding of the longer codes.  */
+  int maxcode[17];
+  int firstcode[17];
+  int firstsym[17];
+  grub_uint8_t values[256];
+};
+
+struct grub_jpeg_component
+{
+  int id;
+  /* Sampling factors.  */
+  int h, v;
+  int qt;
+  int dc_table, ac_table;
+  int dc_value;
+
+  /* Quantization table in natural order, with the IDCT scale factors
+     applied.  Fixed when the first scan of the component starts.  */
+  int quan_mul[64];
+  int quan_set;
+
+  /* Blocks coded in a scan of this component alone.  */
+  unsigned bw, bh;
+  /* Blocks per row, counting the padding of partial MCUs.  */
+  unsigned stride;
+
+  /* Coefficients of all blocks when the image has several scans.  */
+  grub_int16_t *coefs;
+
+  /* Samples of one row of MCUs.  */
+  grub_uint8_t *pixels;
+  unsigned pitch;
+};
 
 struct grub_jpeg_data
 {
   grub_file_t file;
   struct grub_video_bitmap **bitmap;
-  grub_uint8_t *bitmap_ptr;
+
+  grub_uint8_t inbuf[JPEG_INBUF_SIZE];
+  grub_uint8_t *in_ptr, *in_end;
 
   unsigned image_width;
   unsigned image_height;
+  int progressive;
 
-  grub_uint8_t *huff_value[4];
-  int huff_offset[4][16];
-  int huff_maxval[4][16];
+  /* DC tables 0-3, then AC tables 0-3.  */
+  struct huff_table huff[8];
 
-  grub_uint8_t quan_table[2][64];
-  int comp_index[3][3];
+  grub_uint16_t quan_table[4][64];
 
-  jpeg_data_unit_t ydu[4];
-  jpeg_data_unit_t crdu;
-  jpeg_data_unit_t cbdu;
+  struct grub_jpeg_component comp[3];
+  int color_components;
 
   unsigned log_vs, log_hs;
-  int dri;
-  unsigned r1;
+  unsigned mcu_cols, mcu_rows;
 
-  int dc_value[3];
+  /* Whether all coefficients are kept until the end of the image rather
+     than turned into pixels MCU row by MCU row.  */
+  int coef_mode;
+  int scans;
 
-  int color_components;
+  /* The current scan.  */
+  struct grub_jpeg_component *scan_comp[3];
+  int scan_count;
+  int ss, se, ah, al;
+  unsigned eob_run;
+
+  int dri;
 
-  int bit_mask, bit_save;
+  /* Entropy coded data not consumed yet, most significant bit first.  */
+  grub_uint32_t bit_buf;
+  int bit_count;
+  /* Marker found in the entropy coded data, or 0.  */
+  int marker;
 };
 
-static grub_uint8_t
-grub_jpeg_get_byte (struct grub_jpeg_data *data)
+/* Color conversion, scaled by 2^COLOR_SHIFT_BITS for the green ones.  */
+static int jpeg_cr_r[256];
+static int jpeg_cb_b[256];
+static int jpeg_cr_g[256];
+static int jpeg_cb_g[256];
+
+/* Clamping of samples to 0-255, indexed modulo 1024 so that negative values
+   map to 0.  */
+static grub_uint8_t jpeg_range_limit[1024];
+
+static int
+grub_jpeg_fill (struct grub_jpeg_data *data)
 {
-  grub_uint8_t r;
+  grub_ssize_t n;
 
-  r = 0;
-  grub_file_read (data->file, &r, 1);
+  n = grub_file_read (data->file, data->inbuf, sizeof (data->inbuf));
+  if (n <= 0)
+    {
+      data->in_ptr = data->in_end = data->inbuf;
+      if (!grub_errno)
+	grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: unexpected end of file");
+      return 0;
+    }
+  data->in_ptr = data->inbuf;
+  data->in_end = data->inbuf + n;
+  return 1;
+}
 
-  return r;
+/* Offset in the file of the next byte to be read.  */
+static grub_off_t
+grub_jpeg_offset (struct grub_jpeg_data *data)
+{
+  return data->file->offset - (data->in_end - data->in_ptr);
+}
+
+static void
+grub_jpeg_skip (struct grub_jpeg_data *data, grub_off_t len)
+{
+  if (len <= (grub_off_t) (data->in_end - data->in_ptr))
+    {
+      data->in_ptr += len;
+      return;
+    }
+  grub_file_seek (data->file, grub_jpeg_offset (data) + len);
+  data->in_ptr = data->in_end = data->inbuf;
+}
+
+static grub_uint8_t
+grub_jpeg_get_byte (struct grub_jpeg_data *data)
+{
+  if (data->in_ptr == data->in_end && !grub_jpeg_fill (data))
+    return 0;
+  return *data->in_ptr++;
 }
 
 static grub_uint16_t
@@ -114,124 +247,192 @@ grub_jpeg_get_word (struct grub_jpeg_data *data)
 {
   grub_uint16_t r;
 
-  r = 0;
-  grub_file_read (data->file, &r, sizeof (grub_uint16_t));
+  r = grub_jpeg_get_byte (data) << 8;
+  r |= grub_jpeg_get_byte (data);
 
-  return grub_be_to_cpu16 (r);
+  return r;
 }
 
-static int
-grub_jpeg_get_bit (struct grub_jpeg_data *data)
+/* Make sure that at least 25 bits are buffered.  Stuffed zero bytes are
+   dropped; at a marker the data ends and zeros are supplied instead.  */
+static void
+grub_jpeg_fill_bits (struct grub_jpeg_data *data)
 {
-  int ret;
-
-  if (data->bit_mask == 0)
+  while (data->bit_count <= 24)
     {
-      data->bit_save = grub_jpeg_get_byte (data);
-      if (data->bit_save == JPEG_ESC_CHAR)
+      grub_uint32_t b = 0;
+
+      if (!data->marker)
 	{
-	  if (grub_jpeg_get_byte (data) != 0)
+	  if (data->in_ptr < data->in_end && *data->in_ptr != JPEG_ESC_CHAR)
+	    b = *data->in_ptr++;
+	  else
 	    {
-	      grub_error (GRUB_ERR_BAD_FILE_TYPE,
-			  "jpeg: invalid 0xFF in data stream");
-	      return 0;
+	      b = grub_jpeg_get_byte (data);
+	      if (b == JPEG_ESC_CHAR)
+		{
+		  int c;
+
+		  do
+		    c = grub_jpeg_get_byte (data);
+		  while (c == JPEG_ESC_CHAR);
+		  if (c != 0)
+		    {
+		      data->marker = c;
+		      b = 0;
+		    }
+		}
 	    }
 	}
-      data->bit_mask = 0x80;
+
+      data->bit_buf |= b << (24 - data->bit_count);
+      data->bit_count += 8;
     }
+}
+
+static inline int
+grub_jpeg_get_bits (struct grub_jpeg_data *data, int num)
+{
+  int ret;
 
-  ret = ((data->bit_save & data->bit_mask) != 0);
-  data->bit_mask >>= 1;
+  if (num == 0)
+    return 0;
+
+  if (data->bit_count < num)
+    grub_jpeg_fill_bits (data);
+
+  ret = data->bit_buf >> (32 - num);
+  data->bit_buf <<= num;
+  data->bit_count -= num;
   return ret;
 }
 
+static inline int
+grub_jpeg_get_bit (struct grub_jpeg_data *data)
+{
+  return grub_jpeg_get_bits (data, 1);
+}
+
 static int
 grub_jpeg_get_number (struct grub_jpeg_data *data, int num)
 {
-  int value, i, msb;
+  int value;
 
   if (num == 0)
     return 0;
 
-  msb = value = grub_jpeg_get_bit (data);
-  for (i = 1; i < num; i++)
-    value = (value << 1) + (grub_jpeg_get_bit (data) != 0);
-  if (!msb)
+  value = grub_jpeg_get_bits (data, num);
+  if (value < (1 << (num - 1)))
     value += 1 - (1 << num);
 
   return value;
 }
 
 static int
-grub_jpeg_get_huff_code (struct grub_jpeg_data *data, int id)
+grub_jpeg_get_huff_code (struct grub_jpeg_data *data, struct huff_table *ht)
 {
-  int code;
-  unsigned i;
+  int entry, len;
+
+  if (data->bit_count < 16)
+    grub_jpeg_fill_bits (data);
 
-  code = 0;
-  for (i = 0; i < ARRAY_SIZE (data->huff_maxval[id]); i++)
+  entry = ht->fast[data->bit_buf >> (32 - JPEG_HUFF_FAST_BITS)];
+  if (entry)
     {
-      code <<= 1;
-      if (grub_jpeg_get_bit (data))
-	code++;
-      if (code < data->huff_maxval[id][i])
-	return data->huff_value[id][code + data->huff_offset[id][i]];
+      data->bit_buf <<= entry >> 8;
+      data->bit_count -= entry >> 8;
+      return entry & 0xff;
     }
+
+  for (len = JPEG_HUFF_FAST_BITS + 1; len <= 16; len++)
+    {
+      int code = data->bit_buf >> (32 - len);
+
+      if (code < ht->maxcode[len])
+	{
+	  data->bit_buf <<= len;
+	  data->bit_count -= len;
+	  return ht->values[ht->firstsym[len] + code - ht->firstcode[len]];
+	}
+    }
+
   grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: huffman decode fails");
   return 0;
 }
 
+static grub_err_t
+grub_jpeg_build_huff_table (struct huff_table *ht, const grub_uint8_t *count)
+{
+  int code = 0, sym = 0, len;
+
+  grub_memset (ht->fast, 0, sizeof (ht->fast));
+  for (len = 1; len <= 16; len++)
+    {
+      int i;
+
+      ht->firstcode[len] = code;
+      ht->firstsym[len] = sym;
+      if (code + count[len - 1] > (1 << len))
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "jpeg: invalid huffman table");
+      for (i = 0; i < count[len - 1]; i++, code++, sym++)
+	if (len <= JPEG_HUFF_FAST_BITS)
+	  {
+	    int j, n = 1 << (JPEG_HUFF_FAST_BITS - len);
+
+	    for (j = 0; j < n; j++)
+	      ht->fast[(code << (JPEG_HUFF_FAST_BITS - len)) + j]
+		= (len << 8) | ht->values[sym];
+	  }
+      ht->maxcode[len] = code;
+      code <<= 1;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
 static grub_err_t
 grub_jpeg_decode_huff_table (struct grub_jpeg_data *data)
 {
-  int id, ac, n, base, ofs;
+  int id, ac, n;
   grub_uint32_t next_marker;
   grub_uint8_t count[16];
   unsigned i;
 
-  next_marker = data->file->offset;
+  next_marker = grub_jpeg_offset (data);
   next_marker += grub_jpeg_get_word (data);
 
-  while (data->file->offset + sizeof (count) + 1 <= next_marker)
+  while (grub_jpeg_offset (data) + sizeof (count) + 1 <= next_marker
+	 && !grub_errno)
     {
+      struct huff_table *ht;
+
       id = grub_jpeg_get_byte (data);
       ac = (id >> 4) & 1;
       id &= 0xF;
-      if (id > 1)
+      if (id > 3)
 	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 			   "jpeg: too many huffman tables");
 
-      if (grub_file_read (data->file, &count, sizeof (count)) !=
-	  sizeof (count))
-	return grub_errno;
-
       n = 0;
-      for (i = 0; i < ARRAY_SIZE (count); i++)
-	n += count[i];
-
-      id += ac * 2;
-      data->huff_value[id] = grub_malloc (n);
-      if (grub_errno)
-	return grub_errno;
-
-      if (grub_file_read (data->file, data->huff_value[id], n) != n)
-	return grub_errno;
-
-      base = 0;
-      ofs = 0;
       for (i = 0; i < ARRAY_SIZE (count); i++)
 	{
-	  base += count[i];
-	  ofs += count[i];
+	  count[i] = grub_jpeg_get_byte (data);
+	  n += count[i];
+	}
+      if (n > 256)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "jpeg: invalid huffman table");
 
-	  data->huff_maxval[id][i] = base;
-	  data->huff_offset[id][i] = ofs - base;
+      ht = &data->huff[ac * 4 + id];
+      for (i = 0; i < (unsigned) n; i++)
+	ht->values[i] = grub_jpeg_get_byte (data);
 
-	  base <<= 1;
-	}
+      if (grub_jpeg_build_huff_table (ht, count))
+	return grub_errno;
     }
 
-  if (data->file->offset != next_marker)
+  if (grub_jpeg_offset (data) != next_marker)
     grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: extra byte in huffman table");
 
   return grub_errno;
@@ -240,32 +441,33 @@ grub_jpeg_decode_huff_table (struct grub_jpeg_data *data)
 static grub_err_t
 grub_jpeg_decode_quan_table (struct grub_jpeg_data *data)
 {
-  int id;
+  int id, precision;
   grub_uint32_t next_marker;
 
-  next_marker = data->file->offset;
+  next_marker = grub_jpeg_offset (data);
   next_marker += grub_jpeg_get_word (data);
 
-  while (data->file->offset + sizeof (data->quan_table[id]) + 1
-	 <= next_marker)
+  while (grub_jpeg_offset (data) + 64 + 1 <= next_marker && !grub_errno)
     {
+      unsigned i;
+
       id = grub_jpeg_get_byte (data);
-      if (id >= 0x10)		/* Upper 4-bit is precision.  */
+      precision = id >> 4;	/* Upper 4-bit is precision.  */
+      id &= 0xF;
+      if (precision > 1)
 	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
-			   "jpeg: only 8-bit precision is supported");
+			   "jpeg: invalid quantization table precision");
 
-      if (id > 1)
+      if (id > 3)
 	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 			   "jpeg: too many quantization tables");
 
-      if (grub_file_read (data->file, &data->quan_table[id],
-			  sizeof (data->quan_table[id]))
-	  != sizeof (data->quan_table[id]))
-	return grub_errno;
-
+      for (i = 0; i < 64; i++)
+	data->quan_table[id][jpeg_zigzag_order[i]]
+	  = precision ? grub_jpeg_get_word (data) : grub_jpeg_get_byte (data);
     }
 
-  if (data->file->offset != next_marker)
+  if (grub_jpeg_offset (data) != next_marker)
     grub_error (GRUB_ERR_BAD_FILE_TYPE,
 		"jpeg: extra byte in quantization table");
 
@@ -277,8 +479,12 @@ grub_jpeg_decode_sof (struct grub_jpeg_data *data)
 {
   int i, cc;
   grub_uint32_t next_marker;
+  unsigned mcu_w, mcu_h;
+
+  if (data->color_components)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: too many frames");
 
-  next_marker = data->file->offset;
+  next_marker = grub_jpeg_offset (data);
   next_marker += grub_jpeg_get_word (data);
 
   if (grub_jpeg_get_byte (data) != 8)
@@ -295,36 +501,58 @@ grub_jpeg_decode_sof (struct grub_jpeg_data *data)
   if (cc != 1 && cc != 3)
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 		       "jpeg: component count must be 1 or 3");
-  data->color_components = cc;
 
   for (i = 0; i < cc; i++)
     {
-      int id, ss;
-
-      id = grub_jpeg_get_byte (data) - 1;
-      if ((id < 0) || (id >= 3))
-	return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: invalid index");
+      struct grub_jpeg_component *c = &data->comp[i];
+      int ss;
 
+      c->id = grub_jpeg_get_byte (data);
       ss = grub_jpeg_get_byte (data);	/* Sampling factor.  */
-      if (!id)
+      c->h = ss >> 4;
+      c->v = ss & 0xF;
+      if (!i)
 	{
-	  grub_uint8_t vs, hs;
-	  vs = ss & 0xF;	/* Vertical sampling.  */
-	  hs = ss >> 4;	/* Horizontal sampling.  */
-	  if ((vs > 2) || (hs > 2) || (vs == 0) || (hs == 0))
+	  if ((c->v > 2) || (c->h > 2) || (c->v == 0) || (c->h == 0))
 	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 			       "jpeg: sampling method not supported");
-	  data->log_vs = (vs == 2);
-	  data->log_hs = (hs == 2);
 	}
       else if (ss != JPEG_SAMPLING_1x1)
 	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 			   "jpeg: sampling method not supported");
-      data->comp_index[id][0] = grub_jpeg_get_byte (data);
+      c->qt = grub_jpeg_get_byte (data);
+      if (c->qt > 3)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "jpeg: invalid quantization table");
     }
 
-  if (data->file->offset != next_marker)
-    grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: extra byte in sof");
+  if (grub_jpeg_offset (data) != next_marker)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: extra byte in sof");
+
+  /* The only scan of a grayscale image has one block per MCU whatever the
+     sampling factors say.  */
+  if (cc == 1)
+    data->comp[0].h = data->comp[0].v = 1;
+
+  data->color_components = cc;
+  data->log_hs = (data->comp[0].h == 2);
+  data->log_vs = (data->comp[0].v == 2);
+
+  mcu_w = 8 << data->log_hs;
+  mcu_h = 8 << data->log_vs;
+  data->mcu_cols = (data->image_width + mcu_w - 1) / mcu_w;
+  data->mcu_rows = (data->image_height + mcu_h - 1) / mcu_h;
+
+  for (i = 0; i < cc; i++)
+    {
+      struct grub_jpeg_component *c = &data->comp[i];
+
+      c->stride = data->mcu_cols * c->h;
+      c->bw = ((data->image_width * c->h + mcu_w / 8 - 1) / (mcu_w / 8)
+	       + 7) / 8;
+      c->bh = ((data->image_height * c->v + mcu_h / 8 - 1) / (mcu_h / 8)
+	       + 7) / 8;
+    }
 
   return grub_errno;
 }
@@ -341,343 +569,634 @@ grub_jpeg_decode_dri (struct grub_jpeg_data *data)
   return grub_errno;
 }
 
+/* Dequantize the coefficients DU with the scaled table QUAN, transform
+   them with the AAN IDCT and store the samples at OUT.  */
 static void
-grub_jpeg_idct_transform (jpeg_data_unit_t du)
+grub_jpeg_idct_transform (const grub_int16_t *du, const int *quan,
+			  grub_uint8_t *out, unsigned pitch)
 {
-  int *pd;
+  int ws[64];
+  int *wp;
   int i;
   int t0, t1, t2, t3, t4, t5, t6, t7;
-  int v0, v1, v2, v3, v4;
+  int t10, t11, t12, t13;
+  int z5, z10, z11, z12, z13;
 
-  pd = du;
-  for (i = 0; i < JPEG_UNIT_SIZE; i++, pd++)
+  /* Columns, with PASS1_BITS of extra precision from the table.  */
+  for (i = 0, wp = ws; i < JPEG_UNIT_SIZE; i++, du++, quan++, wp++)
     {
-      if ((pd[JPEG_UNIT_SIZE * 1] | pd[JPEG_UNIT_SIZE * 2] |
-	   pd[JPEG_UNIT_SIZE * 3] | pd[JPEG_UNIT_SIZE * 4] |
-	   pd[JPEG_UNIT_SIZE * 5] | pd[JPEG_UNIT_SIZE * 6] |
-	   pd[JPEG_UNIT_SIZE * 7]) == 0)
+      if ((du[JPEG_UNIT_SIZE * 1] | du[JPEG_UNIT_SIZE * 2] |
+	   du[JPEG_UNIT_SIZE * 3] | du[JPEG_UNIT_SIZE * 4] |
+	   du[JPEG_UNIT_SIZE * 5] | du[JPEG_UNIT_SIZE * 6] |
+	   du[JPEG_UNIT_SIZE * 7]) == 0)
 	{
-	  pd[JPEG_UNIT_SIZE * 0] <<= SHIFT_BITS;
-
-	  pd[JPEG_UNIT_SIZE * 1] = pd[JPEG_UNIT_SIZE * 2]
-	    = pd[JPEG_UNIT_SIZE * 3] = pd[JPEG_UNIT_SIZE * 4]
-	    = pd[JPEG_UNIT_SIZE * 5] = pd[JPEG_UNIT_SIZE * 6]
-	    = pd[JPEG_UNIT_SIZE * 7] = pd[JPEG_UNIT_SIZE * 0];
+	  int dc = DEQUANT (du[0], quan[0]);
 
+	  wp[JPEG_UNIT_SIZE * 0] = wp[JPEG_UNIT_SIZE * 1]
+	    = wp[JPEG_UNIT_SIZE * 2] = wp[JPEG_UNIT_SIZE * 3]
+	    = wp[JPEG_UNIT_SIZE * 4] = wp[JPEG_UNIT_SIZE * 5]
+	    = wp[JPEG_UNIT_SIZE * 6] = wp[JPEG_UNIT_SIZE * 7] = dc;
 	  continue;
 	}
 
-      t0 = pd[JPEG_UNIT_SIZE * 0];
-      t1 = pd[JPEG_UNIT_SIZE * 2];
-      t2 = pd[JPEG_UNIT_SIZE * 4];
-      t3 = pd[JPEG_UNIT_SIZE * 6];
+      /* Even part.  */
+      t0 = DEQUANT (du[JPEG_UNIT_SIZE * 0], quan[JPEG_UNIT_SIZE * 0]);
+      t1 = DEQUANT (du[JPEG_UNIT_SIZE * 2], quan[JPEG_UNIT_SIZE * 2]);
+      t2 = DEQUANT (du[JPEG_UNIT_SIZE * 4], quan[JPEG_UNIT_SIZE * 4]);
+      t3 = DEQUANT (du[JPEG_UNIT_SIZE * 6], quan[JPEG_UNIT_SIZE * 6]);
+
+      t10 = t0 + t2;
+      t11 = t0 - t2;
+      t13 = t1 + t3;
+      t12 = (((t1 - t3) * CONST (1.414213562)) >> SHIFT_BITS) - t13;
+
+      t0 = t10 + t13;
+      t3 = t10 - t13;
+      t1 = t11 + t12;
+      t2 = t11 - t12;
+
+      /* Odd part.  */
+      t4 = DEQUANT (du[JPEG_UNIT_SIZE * 1], quan[JPEG_UNIT_SIZE * 1]);
+      t5 = DEQUANT (du[JPEG_UNIT_SIZE * 3], quan[JPEG_UNIT_SIZE * 3]);
+      t6 = DEQUANT (du[JPEG_UNIT_SIZE * 5], quan[JPEG_UNIT_SIZE * 5]);
+      t7 = DEQUANT (du[JPEG_UNIT_SIZE * 7], quan[JPEG_UNIT_SIZE * 7]);
+
+      z13 = t6 + t5;
+      z10 = t6 - t5;
+      z11 = t4 + t7;
+      z12 = t4 - t7;
+
+      t7 = z11 + z13;
+      t11 = ((z11 - z13) * CONST (1.414213562)) >> SHIFT_BITS;
+      z5 = ((z10 + z12) * CONST (1.847759065)) >> SHIFT_BITS;
+      t10 = ((z12 * CONST (1.082392200)) >> SHIFT_BITS) - z5;
+      t12 = ((z10 * -CONST (2.613125930)) >> SHIFT_BITS) + z5;
+
+      t6 = t12 - t7;
+      t5 = t11 - t6;
+      t4 = t10 + t5;
+
+      wp[JPEG_UNIT_SIZE * 0] = t0 + t7;
+      wp[JPEG_UNIT_SIZE * 7] = t0 - t7;
+      wp[JPEG_UNIT_SIZE * 1] = t1 + t6;
+      wp[JPEG_UNIT_SIZE * 6] = t1 - t6;
+      wp[JPEG_UNIT_SIZE * 2] = t2 + t5;
+      wp[JPEG_UNIT_SIZE * 5] = t2 - t5;
+      wp[JPEG_UNIT_SIZE * 4] = t3 + t4;
+      wp[JPEG_UNIT_SIZE * 3] = t3 - t4;
+    }
 
-      v4 = (t1 + t3) * CONST (0.541196100);
+  /* Rows.  The DC term reaches every output, so the level shift and the
+     rounding of the final descaling are added to it.  */
+  for (i = 0, wp = ws; i < JPEG_UNIT_SIZE;
+       i++, wp += JPEG_UNIT_SIZE, out += pitch)
+    {
+      wp[0] += (128 << (PASS1_BITS + 3)) + (1 << (PASS1_BITS + 2));
 
-      v0 = ((t0 + t2) << SHIFT_BITS);
-      v1 = ((t0 - t2) << SHIFT_BITS);
-      v2 = v4 - t3 * CONST (1.847759065);
-      v3 = v4 + t1 * CONST (0.765366865);
+      if ((wp[1] | wp[2] | wp[3] | wp[4] | wp[5] | wp[6] | wp[7]) == 0)
+	{
+	  grub_memset (out, JPEG_DESCALE (wp[0]), JPEG_UNIT_SIZE);
+	  continue;
+	}
 
-      t0 = v0 + v3;
-      t3 = v0 - v3;
-      t1 = v1 + v2;
-      t2 = v1 - v2;
+      t10 = wp[0] + wp[4];
+      t11 = wp[0] - wp[4];
+      t13 = wp[2] + wp[6];
+      t12 = (((wp[2] - wp[6]) * CONST (1.414213562)) >> SHIFT_BITS) - t13;
+
+      t0 = t10 + t13;
+      t3 = t10 - t13;
+      t1 = t11 + t12;
+      t2 = t11 - t12;
+
+      z13 = wp[5] + wp[3];
+      z10 = wp[5] - wp[3];
+      z11 = wp[1] + wp[7];
+      z12 = wp[1] - wp[7];
+
+      t7 = z11 + z13;
+      t11 = ((z11 - z13) * CONST (1.414213562)) >> SHIFT_BITS;
+      z5 = ((z10 + z12) * CONST (1.847759065)) >> SHIFT_BITS;
+      t10 = ((z12 * CONST (1.082392200)) >> SHIFT_BITS) - z5;
+      t12 = ((z10 * -CONST (2.613125930)) >> SHIFT_BITS) + z5;
+
+      t6 = t12 - t7;
+      t5 = t11 - t6;
+      t4 = t10 + t5;
+
+      out[0] = JPEG_DESCALE (t0 + t7);
+      out[7] = JPEG_DESCALE (t0 - t7);
+      out[1] = JPEG_DESCALE (t1 + t6);
+      out[6] = JPEG_DESCALE (t1 - t6);
+      out[2] = JPEG_DESCALE (t2 + t5);
+      out[5] = JPEG_DESCALE (t2 - t5);
+      out[4] = JPEG_DESCALE (t3 + t4);
+      out[3] = JPEG_DESCALE (t3 - t4);
+    }
+}
 
-      t4 = pd[JPEG_UNIT_SIZE * 7];
-      t5 = pd[JPEG_UNIT_SIZE * 5];
-      t6 = pd[JPEG_UNIT_SIZE * 3];
-      t7 = pd[JPEG_UNIT_SIZE * 1];
+/* Decode a block of a sequential scan.  */
+static void
+grub_jpeg_decode_du (struct grub_jpeg_data *data,
+		     struct grub_jpeg_component *c, grub_int16_t *du)
+{
+  unsigned pos;
 
-      v0 = t4 + t7;
-      v1 = t5 + t6;
-      v2 = t4 + t6;
-      v3 = t5 + t7;
+  c->dc_value +=
+    grub_jpeg_get_number (data,
+			  grub_jpeg_get_huff_code (data,
+						   &data->huff[c->dc_table])
+			  & 0xF);
+  du[0] = c->dc_value;
 
-      v4 = (v2 + v3) * CONST (1.175875602);
+  pos = 1;
+  while (pos < 64)
+    {
+      int num, val;
+
+      num = grub_jpeg_get_huff_code (data, &data->huff[4 + c->ac_table]);
+      if (!(num & 0xF))
+	{
+	  if (num != 0xF0)
+	    break;
+	  pos += 16;
+	  continue;
+	}
+
+      val = grub_jpeg_get_number (data, num & 0xF);
+      pos += num >> 4;
+      if (pos >= 64)
+	break;
+      du[jpeg_zigzag_order[pos]] = val;
+      pos++;
+    }
+}
 
-      v0 *= CONST (0.899976223);
-      v1 *= CONST (2.562915447);
-      v2 = v2 * CONST (1.961570560) - v4;
-      v3 = v3 * CONST (0.390180644) - v4;
+/* Decode a block of a progressive scan.  */
+static void
+grub_jpeg_decode_du_progressive (struct grub_jpeg_data *data,
+				 struct grub_jpeg_component *c,
+				 grub_int16_t *du)
+{
+  struct huff_table *ac = &data->huff[4 + c->ac_table];
+  int k;
 
-      t4 = t4 * CONST (0.298631336) - v0 - v2;
-      t5 = t5 * CONST (2.053119869) - v1 - v3;
-      t6 = t6 * CONST (3.072711026) - v1 - v2;
-      t7 = t7 * CONST (1.501321110) - v0 - v3;
+  if (data->ss == 0)
+    {
+      if (data->ah == 0)
+	{
+	  int t = grub_jpeg_get_huff_code (data, &data->huff[c->dc_table]);
 
-      pd[JPEG_UNIT_SIZE * 0] = t0 + t7;
-      pd[JPEG_UNIT_SIZE * 7] = t0 - t7;
-      pd[JPEG_UNIT_SIZE * 1] = t1 + t6;
-      pd[JPEG_UNIT_SIZE * 6] = t1 - t6;
-      pd[JPEG_UNIT_SIZE * 2] = t2 + t5;
-      pd[JPEG_UNIT_SIZE * 5] = t2 - t5;
-      pd[JPEG_UNIT_SIZE * 3] = t3 + t4;
-      pd[JPEG_UNIT_SIZE * 4] = t3 - t4;
+	  c->dc_value += grub_jpeg_get_number (data, t & 0xF);
+	  du[0] = c->dc_value * (1 << data->al);
+	}
+      else if (grub_jpeg_get_bit (data))
+	du[0] |= 1 << data->al;
+      return;
     }
 
-  pd = du;
-  for (i = 0; i < JPEG_UNIT_SIZE; i++, pd += JPEG_UNIT_SIZE)
+  if (data->ah == 0)
     {
-      if ((pd[1] | pd[2] | pd[3] | pd[4] | pd[5] | pd[6] | pd[7]) == 0)
+      /* First pass over these coefficients.  */
+      if (data->eob_run)
 	{
-	  pd[0] >>= (SHIFT_BITS + 3);
-	  pd[1] = pd[2] = pd[3] = pd[4] = pd[5] = pd[6] = pd[7] = pd[0];
-	  continue;
+	  data->eob_run--;
+	  return;
 	}
 
-      v4 = (pd[2] + pd[6]) * CONST (0.541196100);
+      for (k = data->ss; k <= data->se; )
+	{
+	  int rs, r, s;
 
-      v0 = (pd[0] + pd[4]) << SHIFT_BITS;
-      v1 = (pd[0] - pd[4]) << SHIFT_BITS;
-      v2 = v4 - pd[6] * CONST (1.847759065);
-      v3 = v4 + pd[2] * CONST (0.765366865);
+	  rs = grub_jpeg_get_huff_code (data, ac);
+	  r = rs >> 4;
+	  s = rs & 0xF;
+	  if (s == 0)
+	    {
+	      if (r < 15)
+		{
+		  data->eob_run = (1 << r) - 1 + grub_jpeg_get_bits (data, r);
+		  break;
+		}
+	      k += 16;
+	      continue;
+	    }
+	  k += r;
+	  if (k > 63)
+	    {
+	      grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: invalid run length");
+	      return;
+	    }
+	  du[jpeg_zigzag_order[k++]] = grub_jpeg_get_number (data, s)
+	    * (1 << data->al);
+	}
+      return;
+    }
 
-      t0 = v0 + v3;
-      t3 = v0 - v3;
-      t1 = v1 + v2;
-      t2 = v1 - v2;
+  /* Refinement: a bit more of each coefficient already seen, and new
+     coefficients of magnitude 1.  */
+  {
+    int bit = 1 << data->al;
 
-      t4 = pd[7];
-      t5 = pd[5];
-      t6 = pd[3];
-      t7 = pd[1];
+    k = data->ss;
+    if (data->eob_run == 0)
+      while (k <= data->se)
+	{
+	  int rs, r, s = 0;
 
-      v0 = t4 + t7;
-      v1 = t5 + t6;
-      v2 = t4 + t6;
-      v3 = t5 + t7;
+	  rs = grub_jpeg_get_huff_code (data, ac);
+	  r = rs >> 4;
+	  if (rs & 0xF)
+	    {
+	      if ((rs & 0xF) != 1)
+		{
+		  grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			      "jpeg: invalid refinement");
+		  return;
+		}
+	      s = grub_jpeg_get_bit (data) ? bit : -bit;
+	    }
+	  else if (r < 15)
+	    {
+	      data->eob_run = (1 << r) + grub_jpeg_get_bits (data, r);
+	      break;
+	    }
+
+	  /* Skip R zero coefficients, refining the others on the way, and
+	     put the new one after them.  */
+	  for (; k <= data->se; k++)
+	    {
+	      grub_int16_t *p = &du[jpeg_zigzag_order[k]];
 
-      v4 = (v2 + v3) * CONST (1.175875602);
+	      if (*p)
+		{
+		  if (grub_jpeg_get_bit (data) && !(*p & bit))
+		    *p += (*p > 0) ? bit : -bit;
+		}
+	      else if (r-- == 0)
+		{
+		  *p = s;
+		  k++;
+		  break;
+		}
+	    }
+	}
 
-      v0 *= CONST (0.899976223);
-      v1 *= CONST (2.562915447);
-      v2 = v2 * CONST (1.961570560) - v4;
-      v3 = v3 * CONST (0.390180644) - v4;
+    if (data->eob_run)
+      {
+	for (; k <= data->se; k++)
+	  {
+	    grub_int16_t *p = &du[jpeg_zigzag_order[k]];
 
-      t4 = t4 * CONST (0.298631336) - v0 - v2;
-      t5 = t5 * CONST (2.053119869) - v1 - v3;
-      t6 = t6 * CONST (3.072711026) - v1 - v2;
-      t7 = t7 * CONST (1.501321110) - v0 - v3;
+	    if (*p && grub_jpeg_get_bit (data) && !(*p & bit))
+	      *p += (*p > 0) ? bit : -bit;
+	  }
+	data->eob_run--;
+      }
+  }
+}
 
-      pd[0] = (t0 + t7) >> (SHIFT_BITS * 2 + 3);
-      pd[7] = (t0 - t7) >> (SHIFT_BITS * 2 + 3);
-      pd[1] = (t1 + t6) >> (SHIFT_BITS * 2 + 3);
-      pd[6] = (t1 - t6) >> (SHIFT_BITS * 2 + 3);
-      pd[2] = (t2 + t5) >> (SHIFT_BITS * 2 + 3);
-      pd[5] = (t2 - t5) >> (SHIFT_BITS * 2 + 3);
-      pd[3] = (t3 + t4) >> (SHIFT_BITS * 2 + 3);
-      pd[4] = (t3 - t4) >> (SHIFT_BITS * 2 + 3);
-    }
+/* Convert one line of samples.  Chroma lines are subsampled horizontally
+   by 2^LOG_HS.  */
+static void
+grub_jpeg_ycrcb_to_rgb (const grub_uint8_t *yy, const grub_uint8_t *cr,
+			const grub_uint8_t *cb, unsigned log_hs,
+			unsigned width, grub_uint8_t *rgb)
+{
+  unsigned i;
 
-  for (i = 0; i < JPEG_UNIT_SIZE * JPEG_UNIT_SIZE; i++)
+  for (i = 0; i < width; i++, rgb += 3)
     {
-      du[i] += 128;
+      int y = yy[i];
+      int r = cr[i >> log_hs];
+      int b = cb[i >> log_hs];
+      int dd;
+
+      /* Red  */
+      dd = y + jpeg_cr_r[r];
+      if ((unsigned) dd > 255)
+	dd = dd < 0 ? 0 : 255;
+#ifdef GRUB_CPU_WORDS_BIGENDIAN
+      rgb[2] = dd;
+#else
+      rgb[0] = dd;
+#endif
+
+      /* Green  */
+      dd = y + ((jpeg_cb_g[b] + jpeg_cr_g[r]) >> COLOR_SHIFT_BITS);
+      if ((unsigned) dd > 255)
+	dd = dd < 0 ? 0 : 255;
+      rgb[1] = dd;
 
-      if (du[i] < 0)
-	du[i] = 0;
-      if (du[i] > 255)
-	du[i] = 255;
+      /* Blue  */
+      dd = y + jpeg_cb_b[b];
+      if ((unsigned) dd > 255)
+	dd = dd < 0 ? 0 : 255;
+#ifdef GRUB_CPU_WORDS_BIGENDIAN
+      rgb[0] = dd;
+#else
+      rgb[2] = dd;
+#endif
     }
 }
 
+/* Convert the samples of MCU row ROW into the bitmap.  */
 static void
-grub_jpeg_decode_du (struct grub_jpeg_data *data, int id, jpeg_data_unit_t du)
+grub_jpeg_output_row (struct grub_jpeg_data *data, unsigned row)
 {
-  int h1, h2, qt;
-  unsigned pos;
+  struct grub_jpeg_component *c = data->comp;
+  unsigned r, nr, width = data->image_width;
+  grub_uint8_t *out;
 
-  grub_memset (du, 0, sizeof (jpeg_data_unit_t));
+  r = row << (3 + data->log_vs);
+  nr = data->image_height - r;
+  if (nr > (8U << data->log_vs))
+    nr = 8U << data->log_vs;
+  out = (*data->bitmap)->data + r * width * 3;
 
-  qt = data->comp_index[id][0];
-  h1 = data->comp_index[id][1];
-  h2 = data->comp_index[id][2];
+  for (r = 0; r < nr; r++, out += width * 3)
+    {
+      const grub_uint8_t *yy = c[0].pixels + r * c[0].pitch;
 
-  data->dc_value[id] +=
-    grub_jpeg_get_number (data, grub_jpeg_get_huff_code (data, h1));
+      if (data->color_components >= 3)
+	{
+	  unsigned cr = (r >> data->log_vs) * c[2].pitch;
+	  unsigned cb = (r >> data->log_vs) * c[1].pitch;
 
-  du[0] = data->dc_value[id] * (int) data->quan_table[qt][0];
-  pos = 1;
-  while (pos < ARRAY_SIZE (data->quan_table[qt]))
-    {
-      int num, val;
+	  grub_jpeg_ycrcb_to_rgb (yy, c[2].pixels + cr, c[1].pixels + cb,
+				  data->log_hs, width, out);
+	}
+      else
+	{
+	  unsigned i;
 
-      num = grub_jpeg_get_huff_code (data, h2);
-      if (!num)
-	break;
+	  for (i = 0; i < width; i++)
+	    {
+	      out[3 * i] = yy[i];
+	      out[3 * i + 1] = yy[i];
+	      out[3 * i + 2] = yy[i];
+	    }
+	}
+    }
+}
 
-      val = grub_jpeg_get_number (data, num & 0xF);
-      num >>= 4;
-      pos += num;
-      du[jpeg_zigzag_order[pos]] = val * (int) data->quan_table[qt][pos];
-      pos++;
+/* Expect a restart marker and start over.  */
+static grub_err_t
+grub_jpeg_restart (struct grub_jpeg_data *data)
+{
+  int i;
+
+  data->bit_buf = 0;
+  data->bit_count = 0;
+  if (!data->marker)
+    {
+      if (grub_jpeg_get_byte (data) != JPEG_ESC_CHAR)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "jpeg: restart marker expected");
+      do
+	data->marker = grub_jpeg_get_byte (data);
+      while (data->marker == JPEG_ESC_CHAR);
     }
+  if (data->marker < JPEG_MARKER_RST0 || data->marker > JPEG_MARKER_RST7)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+		       "jpeg: restart marker expected");
+  data->marker = 0;
+
+  for (i = 0; i < data->color_components; i++)
+    data->comp[i].dc_value = 0;
+  data->eob_run = 0;
 
-  grub_jpeg_idct_transform (du);
+  return grub_errno;
 }
 
 static void
-grub_jpeg_ycrcb_to_rgb (int yy, int cr, int cb, grub_uint8_t * rgb)
+grub_jpeg_decode_block (struct grub_jpeg_data *data,
+			struct grub_jpeg_component *c,
+			unsigned bx, unsigned by)
 {
-  int dd;
-
-  cr -= 128;
-  cb -= 128;
-
-  /* Red  */
-  dd = yy + ((cr * CONST (1.402)) >> SHIFT_BITS);
-  if (dd < 0)
-    dd = 0;
-  if (dd > 255)
-    dd = 255;
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-  rgb[2] = dd;
-#else
-  *(rgb++) = dd;
-#endif
+  if (data->coef_mode)
+    {
+      grub_int16_t *du = c->coefs + ((grub_size_t) by * c->stride + bx) * 64;
 
-  /* Green  */
-  dd = yy - ((cb * CONST (0.34414) + cr * CONST (0.71414)) >> SHIFT_BITS);
-  if (dd < 0)
-    dd = 0;
-  if (dd > 255)
-    dd = 255;
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-  rgb[1] = dd;
-#else
-  *(rgb++) = dd;
-#endif
+      if (data->progressive)
+	grub_jpeg_decode_du_progressive (data, c, du);
+      else
+	grub_jpeg_decode_du (data, c, du);
+    }
+  else
+    {
+      jpeg_data_unit_t du;
 
-  /* Blue  */
-  dd = yy + ((cb * CONST (1.772)) >> SHIFT_BITS);
-  if (dd < 0)
-    dd = 0;
-  if (dd > 255)
-    dd = 255;
-#ifdef GRUB_CPU_WORDS_BIGENDIAN
-  rgb[0] = dd;
-  rgb += 3;
-#else
-  *(rgb++) = dd;
-#endif
+      grub_memset (du, 0, sizeof (du));
+      grub_jpeg_decode_du (data, c, du);
+      grub_jpeg_idct_transform (du, c->quan_mul,
+				c->pixels + (by % c->v) * 8 * c->pitch
+				+ bx * 8, c->pitch);
+    }
 }
 
 static grub_err_t
-grub_jpeg_decode_sos (struct grub_jpeg_data *data)
+grub_jpeg_decode_data (struct grub_jpeg_data *data)
 {
-  int i, cc;
-  grub_uint32_t data_offset;
+  unsigned nx, ny, x, y;
+  int i, todo = data->dri;
 
-  data_offset = data->file->offset;
-  data_offset += grub_jpeg_get_word (data);
-
-  cc = grub_jpeg_get_byte (data);
+  for (i = 0; i < data->color_components; i++)
+    data->comp[i].dc_value = 0;
+  data->eob_run = 0;
+  data->bit_buf = 0;
+  data->bit_count = 0;
 
-  if (cc != 3 && cc != 1)
-    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
-		       "jpeg: component count must be 1 or 3");
-  data->color_components = cc;
+  if (data->scan_count == 1)
+    {
+      nx = data->scan_comp[0]->bw;
+      ny = data->scan_comp[0]->bh;
+    }
+  else
+    {
+      nx = data->mcu_cols;
+      ny = data->mcu_rows;
+    }
 
-  for (i = 0; i < cc; i++)
+  for (y = 0; y < ny; y++)
     {
-      int id, ht;
+      for (x = 0; x < nx; x++)
+	{
+	  if (data->dri && !todo--)
+	    {
+	      if (grub_jpeg_restart (data))
+		return grub_errno;
+	      todo = data->dri - 1;
+	    }
 
-      id = grub_jpeg_get_byte (data) - 1;
-      if ((id < 0) || (id >= 3))
-	return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: invalid index");
+	  if (data->scan_count == 1)
+	    grub_jpeg_decode_block (data, data->scan_comp[0], x, y);
+	  else
+	    for (i = 0; i < data->scan_count; i++)
+	      {
+		struct grub_jpeg_component *c = data->scan_comp[i];
+		int r2, c2;
+
+		for (r2 = 0; r2 < c->v; r2++)
+		  for (c2 = 0; c2 < c->h; c2++)
+		    grub_jpeg_decode_block (data, c, x * c->h + c2,
+					    y * c->v + r2);
+	      }
+
+	  if (grub_errno)
+	    return grub_errno;
+	}
 
-      ht = grub_jpeg_get_byte (data);
-      data->comp_index[id][1] = (ht >> 4);
-      data->comp_index[id][2] = (ht & 0xF) + 2;
+      if (!data->coef_mode)
+	grub_jpeg_output_row (data, y);
     }
 
-  grub_jpeg_get_byte (data);	/* Skip 3 unused bytes.  */
-  grub_jpeg_get_word (data);
+  return grub_errno;
+}
 
-  if (data->file->offset != data_offset)
-    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: extra byte in sos");
+/* Turn the coefficients collected over all scans into the image.  */
+static grub_err_t
+grub_jpeg_output_coefs (struct grub_jpeg_data *data)
+{
+  unsigned row;
+
+  for (row = 0; row < data->mcu_rows; row++)
+    {
+      int i;
+
+      for (i = 0; i < data->color_components; i++)
+	{
+	  struct grub_jpeg_component *c = &data->comp[i];
+	  unsigned r2, bx;
+
+	  for (r2 = 0; r2 < (unsigned) c->v; r2++)
+	    for (bx = 0; bx < c->stride; bx++)
+	      grub_jpeg_idct_transform (c->coefs
+					+ (((grub_size_t) row * c->v + r2)
+					   * c->stride + bx) * 64,
+					c->quan_mul,
+					c->pixels + r2 * 8 * c->pitch
+					+ bx * 8, c->pitch);
+	}
+      grub_jpeg_output_row (data, row);
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Set up the bitmap and the buffers when the first scan starts.  */
+static grub_err_t
+grub_jpeg_alloc (struct grub_jpeg_data *data)
+{
+  int i;
 
   if (grub_video_bitmap_create (data->bitmap, data->image_width,
 				data->image_height,
 				GRUB_VIDEO_BLIT_FORMAT_RGB_888))
     return grub_errno;
 
-  data->bitmap_ptr = (*data->bitmap)->data;
+  for (i = 0; i < data->color_components; i++)
+    {
+      struct grub_jpeg_component *c = &data->comp[i];
+
+      c->pitch = c->stride * 8;
+      c->pixels = grub_malloc (c->pitch * c->v * 8);
+      if (!c->pixels)
+	return grub_errno;
+
+      if (data->coef_mode)
+	{
+	  grub_uint64_t size;
+
+	  size = (grub_uint64_t) c->stride * data->mcu_rows * c->v
+	    * 64 * sizeof (grub_int16_t);
+	  if (size > GRUB_SIZE_MAX)
+	    return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+	  c->coefs = grub_zalloc (size);
+	  if (!c->coefs)
+	    return grub_errno;
+	}
+    }
+
   return GRUB_ERR_NONE;
 }
 
 static grub_err_t
-grub_jpeg_decode_data (struct grub_jpeg_data *data)
+grub_jpeg_decode_sos (struct grub_jpeg_data *data)
 {
-  unsigned c1, vb, hb, nr1, nc1;
-  int rst = data->dri;
+  int i, cc;
+  grub_uint32_t data_offset;
 
-  vb = 8 << data->log_vs;
-  hb = 8 << data->log_hs;
-  nr1 = (data->image_height + vb - 1) >> (3 + data->log_vs);
-  nc1 = (data->image_width + hb - 1)  >> (3 + data->log_hs);
+  data_offset = grub_jpeg_offset (data);
+  data_offset += grub_jpeg_get_word (data);
 
-  for (; data->r1 < nr1 && (!data->dri || rst);
-       data->r1++, data->bitmap_ptr += (vb * data->image_width - hb * nc1) * 3)
-    for (c1 = 0;  c1 < nc1 && (!data->dri || rst);
-	c1++, rst--, data->bitmap_ptr += hb * 3)
-      {
-	unsigned r2, c2, nr2, nc2;
-	grub_uint8_t *ptr2;
+  if (!data->color_components)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: scan before frame");
 
-	for (r2 = 0; r2 < (1U << data->log_vs); r2++)
-	  for (c2 = 0; c2 < (1U << data->log_hs); c2++)
-	    grub_jpeg_decode_du (data, 0, data->ydu[r2 * 2 + c2]);
+  cc = grub_jpeg_get_byte (data);
 
-	if (data->color_components >= 3)
-	  {
-	    grub_jpeg_decode_du (data, 1, data->cbdu);
-	    grub_jpeg_decode_du (data, 2, data->crdu);
-	  }
+  if (cc < 1 || cc > data->color_components)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+		       "jpeg: component count must be 1 or 3");
+  data->scan_count = cc;
 
-	if (grub_errno)
-	  return grub_errno;
+  for (i = 0; i < cc; i++)
+    {
+      struct grub_jpeg_component *c = NULL;
+      int id, ht, j;
 
-	nr2 = (data->r1 == nr1 - 1) ? (data->image_height - data->r1 * vb) : vb;
-	nc2 = (c1 == nc1 - 1) ? (data->image_width - c1 * hb) : hb;
+      id = grub_jpeg_get_byte (data);
+      for (j = 0; j < data->color_components; j++)
+	if (data->comp[j].id == id)
+	  c = &data->comp[j];
+      if (!c)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: invalid index");
 
-	ptr2 = data->bitmap_ptr;
-	for (r2 = 0; r2 < nr2; r2++, ptr2 += (data->image_width - nc2) * 3)
-	  for (c2 = 0; c2 < nc2; c2++, ptr2 += 3)
-	    {
-	      unsigned i0;
-	      int yy;
+      ht = grub_jpeg_get_byte (data);
+      c->dc_table = (ht >> 4);
+      c->ac_table = (ht & 0xF);
+      if (c->dc_table > 3 || c->ac_table > 3)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "jpeg: invalid huffman table");
+      data->scan_comp[i] = c;
 
-	      i0 = (r2 >> data->log_vs) * 8 + (c2 >> data->log_hs);
-	      yy = data->ydu[(r2 / 8) * 2 + (c2 / 8)][(r2 % 8) * 8 + (c2 % 8)];
+      if (!c->quan_set)
+	{
+	  for (j = 0; j < 64; j++)
+	    c->quan_mul[j] = ((grub_uint32_t) data->quan_table[c->qt][j]
+			      * jpeg_aan_scales[j]
+			      + (1 << (13 - QUANT_BITS)))
+	      >> (14 - QUANT_BITS);
+	  c->quan_set = 1;
+	}
+    }
 
-	      if (data->color_components >= 3)
-		{
-		  int cr, cb;
-		  cr = data->crdu[i0];
-		  cb = data->cbdu[i0];
-		  grub_jpeg_ycrcb_to_rgb (yy, cr, cb, ptr2);
-		}
-	      else
-		{
-		  ptr2[0] = yy;
-		  ptr2[1] = yy;
-		  ptr2[2] = yy;
-		}
-	    }
-      }
+  data->ss = grub_jpeg_get_byte (data);
+  data->se = grub_jpeg_get_byte (data);
+  data->al = grub_jpeg_get_byte (data);
+  data->ah = data->al >> 4;
+  data->al &= 0xF;
 
-  return grub_errno;
-}
+  if (grub_jpeg_offset (data) != data_offset)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: extra byte in sos");
 
-static void
-grub_jpeg_reset (struct grub_jpeg_data *data)
-{
-  data->bit_mask = 0x0;
+  if (data->progressive
+      && (data->se > 63 || data->al > 13
+	  || (data->ss == 0 && data->se != 0)
+	  || (data->ss != 0 && (cc != 1 || data->se < data->ss))))
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: invalid progressive scan");
 
-  data->dc_value[0] = 0;
-  data->dc_value[1] = 0;
-  data->dc_value[2] = 0;
+  if (data->scans++ == 0)
+    {
+      data->coef_mode = data->progressive || cc != data->color_components;
+      return grub_jpeg_alloc (data);
+    }
+
+  /* A sequential image in a single scan is converted as it is decoded.  */
+  if (!data->coef_mode)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "jpeg: unexpected scan");
+
+  return GRUB_ERR_NONE;
 }
 
 static grub_uint8_t
@@ -685,6 +1204,14 @@ grub_jpeg_get_marker (struct grub_jpeg_data *data)
 {
   grub_uint8_t r;
 
+  /* Found while reading entropy coded data.  */
+  if (data->marker)
+    {
+      r = data->marker;
+      data->marker = 0;
+      return r;
+    }
+
   r = grub_jpeg_get_byte (data);
 
   if (r != JPEG_ESC_CHAR)
@@ -693,7 +1220,11 @@ grub_jpeg_get_marker (struct grub_jpeg_data *data)
       return 0;
     }
 
-  return grub_jpeg_get_byte (data);
+  do
+    r = grub_jpeg_get_byte (data);
+  while (r == JPEG_ESC_CHAR);
+
+  return r;
 }
 
 static grub_err_t
@@ -720,7 +1251,11 @@ grub_jpeg_decode_jpeg (struct grub_jpeg_data *data)
 	case JPEG_MARKER_DQT:	/* Define Quantization Table.  */
 	  grub_jpeg_decode_quan_table (data);
 	  break;
+	case JPEG_MARKER_SOF2:	/* Start Of Frame 2, progressive.  */
+	  data->progressive = 1;
+	  /* FALLTHROUGH */
 	case JPEG_MARKER_SOF0:	/* Start Of Frame 0.  */
+	case JPEG_MARKER_SOF1:	/* Start Of Frame 1, extended sequential.  */
 	  grub_jpeg_decode_sof (data);
 	  break;
 	case JPEG_MARKER_DRI:	/* Define Restart Interval.  */
@@ -729,19 +1264,14 @@ grub_jpeg_decode_jpeg (struct grub_jpeg_data *data)
 	case JPEG_MARKER_SOS:	/* Start Of Scan.  */
 	  if (grub_jpeg_decode_sos (data))
 	    break;
-	  /* FALLTHROUGH */
-	case JPEG_MARKER_RST0:	/* Restart.  */
-	case JPEG_MARKER_RST1:
-	case JPEG_MARKER_RST2:
-	case JPEG_MARKER_RST3:
-	case JPEG_MARKER_RST4:
-	case JPEG_MARKER_RST5:
-	case JPEG_MARKER_RST6:
-	case JPEG_MARKER_RST7:
 	  grub_jpeg_decode_data (data);
-	  grub_jpeg_reset (data);
 	  break;
 	case JPEG_MARKER_EOI:	/* End Of Image.  */
+	  if (!data->scans)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "jpeg: no image data");
+	  if (data->coef_mode)
+	    grub_jpeg_output_coefs (data);
 	  return grub_errno;
 	default:		/* Skip unrecognized marker.  */
 	  {
@@ -750,7 +1280,10 @@ grub_jpeg_decode_jpeg (struct grub_jpeg_data *data)
 	    sz = grub_jpeg_get_word (data);
 	    if (grub_errno)
 	      return (grub_errno);
-	    grub_file_seek (data->file, data->file->offset + sz - 2);
+	    if (sz < 2)
+	      return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+				 "jpeg: invalid segment size");
+	    grub_jpeg_skip (data, sz - 2);
 	  }
 	}
     }
@@ -765,7 +1298,8 @@ grub_video_reader_jpeg (struct grub_video_bitmap **bitmap,
   grub_file_t file;
   struct grub_jpeg_data *data;
 
-  file = grub_buffile_open (filename, GRUB_FILE_TYPE_PIXMAP, 0);
+  /* The reader does its own buffering.  */
+  file = grub_file_open (filename, GRUB_FILE_TYPE_PIXMAP);
   if (!file)
     return grub_errno;
 
@@ -776,10 +1310,14 @@ grub_video_reader_jpeg (struct grub_video_bitmap **bitmap,
 
       data->file = file;
       data->bitmap = bitmap;
+      data->in_ptr = data->in_end = data->inbuf;
       grub_jpeg_decode_jpeg (data);
 
-      for (i = 0; i < 4; i++)
-	grub_free (data->huff_value[i]);
+      for (i = 0; i < 3; i++)
+	{
+	  grub_free (data->comp[i].coefs);
+	  grub_free (data->comp[i].pixels);
+	}
 
       grub_free (data);
     }
@@ -808,6 +1346,23 @@ static struct grub_video_bitmap_reader jpeg_reader = {
 
 GRUB_MOD_INIT (jpeg)
 {
+  int i;
+
+  for (i = 0; i < 256; i++)
+    {
+      int x = i - 128;
+
+      jpeg_cr_r[i] = (COLOR_CONST (1.402) * x
+		      + (1 << (COLOR_SHIFT_BITS - 1))) >> COLOR_SHIFT_BITS;
+      jpeg_cb_b[i] = (COLOR_CONST (1.772) * x
+		      + (1 << (COLOR_SHIFT_BITS - 1))) >> COLOR_SHIFT_BITS;
+      jpeg_cr_g[i] = -COLOR_CONST (0.71414) * x;
+      jpeg_cb_g[i] = -COLOR_CONST (0.34414) * x + (1 << (COLOR_SHIFT_BITS - 1));
+    }
+
+  for (i = 0; i < 1024; i++)
+    jpeg_range_limit[i] = (i < 256) ? i : (i < 512) ? 255 : 0;
+
   grub_video_bitmap_reader_register (&jpg_reader);
   grub_video_bitmap_reader_register (&jpeg_reader);
 }
@@ -22,7 +22,7 @@
 #include <grub/dl.h>
 #include <grub/mm.h>
 #include <grub/misc.h>
-#include <grub/bufio.h>
+#include <grub/file.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
@@ -75,10 +75,23 @@ enum
 
 #define DEFLATE_HUFF_LEN	16
 
+/* Codes up to this long are decoded with a single table lookup.  */
+#define HUFF_FAST_BITS		9
+#define HUFF_FAST_SIZE		(1 << HUFF_FAST_BITS)
+
+/* Size of the file input buffer.  */
+#define PNG_INBUF_SIZE		8192
+
 struct huff_table
 {
-  int *values, *maxval, *offset;
-  int num_values, max_length;
+  /* Indexed by the next HUFF_FAST_BITS input bits.  Each entry holds the
+     code length above the symbol, or 0 if the code is longer.  */
+  grub_uint16_t fast[HUFF_FAST_SIZE];
+  /* Canonical decoding of the longer codes.  */
+  grub_uint32_t maxcode[DEFLATE_HUFF_LEN];
+  grub_uint16_t firstcode[DEFLATE_HUFF_LEN];
+  grub_uint16_t firstsym[DEFLATE_HUFF_LEN];
+  grub_uint16_t values[DEFLATE_HLIT_MAX];
 };
 
 struct grub_png_data
@@ -86,25 +99,22 @@ struct grub_png_data
   grub_file_t file;
   struct grub_video_bitmap **bitmap;
 
-  int bit_count, bit_save;
+  grub_uint8_t inbuf[PNG_INBUF_SIZE];
+  grub_uint8_t *in_ptr, *in_end;
+
+  /* Compressed input not consumed yet, least significant bit first.  */
+  grub_uint32_t bit_buf;
+  int bit_count;
 
   grub_uint32_t next_offset;
 
   unsigned image_width, image_height;
   int bpp, is_16bit;
-  int raw_bytes, is_gray, is_alpha, is_palette;
+  int is_gray, is_alpha, is_palette;
   int row_bytes, color_bits;
-  grub_uint8_t *image_data;
-
-  int inside_idat, idat_remain;
-
-  int code_values[DEFLATE_HLIT_MAX];
-  int code_maxval[DEFLATE_HUFF_LEN];
-  int code_offset[DEFLATE_HUFF_LEN];
 
-  int dist_values[DEFLATE_HDIST_MAX];
-  int dist_maxval[DEFLATE_HUFF_LEN];
-  int dist_offset[DEFLATE_HUFF_LEN];
+  grub_uint32_t idat_remain;
+  int idat_done;
 
   grub_uint8_t palette[256][3];
 
@@ -113,38 +123,102 @@ struct grub_png_data
 
   grub_uint8_t slide[WSIZE];
   int wp;
+  /* Start of the output in SLIDE not yet passed on to the rows.  */
+  int flush_pos;
+
+  /* The row being received and the one before, unfiltered.  When the
+     bitmap has the same layout as the data, both point into it.  */
+  grub_uint8_t *cur_row, *prev_row;
+  grub_uint8_t *row_buf;
+  grub_uint8_t *out_row;
+  int out_bytes, direct;
+  unsigned cur_line;
+
+  int cur_column, cur_filter;
+};
 
-  grub_uint8_t *cur_rgb;
+static int
+grub_png_fill (struct grub_png_data *data)
+{
+  grub_ssize_t n;
 
-  int cur_column, cur_filter, first_line;
-};
+  n = grub_file_read (data->file, data->inbuf, sizeof (data->inbuf));
+  if (n <= 0)
+    {
+      data->in_ptr = data->in_end = data->inbuf;
+      if (!grub_errno)
+	grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: unexpected end of file");
+      return 0;
+    }
+  data->in_ptr = data->inbuf;
+  data->in_end = data->inbuf + n;
+  return 1;
+}
+
+/* Offset in the file of the next byte to be read.  */
+static grub_off_t
+grub_png_offset (struct grub_png_data *data)
+{
+  return data->file->offset - (data->in_end - data->in_ptr);
+}
+
+static void
+grub_png_skip (struct grub_png_data *data, grub_off_t len)
+{
+  if (len <= (grub_off_t) (data->in_end - data->in_ptr))
+    {
+      data->in_ptr += len;
+      return;
+    }
+  grub_file_seek (data->file, grub_png_offset (data) + len);
+  data->in_ptr = data->in_end = data->inbuf;
+}
+
+static grub_uint8_t
+grub_png_get_byte (struct grub_png_data *data)
+{
+  if (data->in_ptr == data->in_end && !grub_png_fill (data))
+    return 0;
+  return *data->in_ptr++;
+}
 
 static grub_uint32_t
 grub_png_get_dword (struct grub_png_data *data)
 {
   grub_uint32_t r;
 
-  r = 0;
-  grub_file_read (data->file, &r, sizeof (grub_uint32_t));
+  if (data->in_end - data->in_ptr >= 4)
+    {
+      r = grub_be_to_cpu32 (grub_get_unaligned32 (data->in_ptr));
+      data->in_ptr += 4;
+      return r;
+    }
 
-  return grub_be_to_cpu32 (r);
+  r = (grub_uint32_t) grub_png_get_byte (data) << 24;
+  r |= grub_png_get_byte (data) << 16;
+  r |= grub_png_get_byte (data) << 8;
+  r |= grub_png_get_byte (data);
+  return r;
 }
 
+/* Next byte of the zlib stream, which goes on over the following IDAT
+   chunks.  */
 static grub_uint8_t
-grub_png_get_byte (struct grub_png_data *data)
+grub_png_get_idat_byte (struct grub_png_data *data)
 {
-  grub_uint8_t r;
-
-  if ((data->inside_idat) && (data->idat_remain == 0))
+  if (data->idat_remain == 0)
     {
       grub_uint32_t len, type;
 
       do
 	{
+	  if (grub_errno)
+	    return 0;
+
           /* Skip crc checksum.  */
 	  grub_png_get_dword (data);
 
-          if (data->file->offset != data->next_offset)
+          if (grub_png_offset (data) != data->next_offset)
             {
               grub_error (GRUB_ERR_BAD_FILE_TYPE,
                           "png: chunk size error");
@@ -160,56 +234,50 @@ grub_png_get_byte (struct grub_png_data *data)
 	      return 0;
 	    }
 
-          data->next_offset = data->file->offset + len + 4;
+          data->next_offset = grub_png_offset (data) + len + 4;
 	}
       while (len == 0);
       data->idat_remain = len;
     }
 
-  r = 0;
-  grub_file_read (data->file, &r, 1);
-
-  if (data->inside_idat)
-    data->idat_remain--;
-
-  return r;
+  data->idat_remain--;
+  return grub_png_get_byte (data);
 }
 
-static int
-grub_png_get_bits (struct grub_png_data *data, int num)
+/* Make sure that at least 25 bits are buffered.  This never reads more
+   than 4 bytes ahead, so it doesn't go past the adler checksum at the end
+   of the stream.  */
+static inline void
+grub_png_fill_bits (struct grub_png_data *data)
 {
-  int code, shift;
-
-  if (data->bit_count == 0)
-    {
-      data->bit_save = grub_png_get_byte (data);
-      data->bit_count = 8;
-    }
-
-  code = 0;
-  shift = 0;
-  while (grub_errno == 0)
+  while (data->bit_count <= 24)
     {
-      int n;
-
-      n = data->bit_count;
-      if (n > num)
-	n = num;
+      grub_uint8_t b;
 
-      code += (int) (data->bit_save & ((1 << n) - 1)) << shift;
-      num -= n;
-      if (!num)
+      if (data->idat_remain && data->in_ptr < data->in_end)
 	{
-	  data->bit_count -= n;
-	  data->bit_save >>= n;
-	  break;
+	  data->idat_remain--;
+	  b = *data->in_ptr++;
 	}
+      else
+	b = grub_png_get_idat_byte (data);
 
-      shift += n;
-
-      data->bit_save = grub_png_get_byte (data);
-      data->bit_count = 8;
+      data->bit_buf |= (grub_uint32_t) b << data->bit_count;
+      data->bit_count += 8;
     }
+}
+
+static inline int
+grub_png_get_bits (struct grub_png_data *data, int num)
+{
+  int code;
+
+  if (data->bit_count < num)
+    grub_png_fill_bits (data);
+
+  code = data->bit_buf & ((1U << num) - 1);
+  data->bit_buf >>= num;
+  data->bit_count -= num;
 
   return code;
 }
@@ -223,11 +291,10 @@ grub_png_decode_image_palette (struct grub_png_data *data,
   if (len == 0)
     return GRUB_ERR_NONE;
 
-  for (i = 0; 3 * i < len && i < 256; i++)
+  for (i = 0; 3 * i + 3 <= len && i < 256; i++)
     for (j = 0; j < 3; j++)
       data->palette[i][j] = grub_png_get_byte (data);
-  for (i *= 3; i < len; i++)
-    grub_png_get_byte (data);
+  grub_png_skip (data, len - 3 * i);
 
   grub_png_get_dword (data);
 
@@ -244,7 +311,8 @@ grub_png_decode_image_header (struct grub_png_data *data)
   data->image_width = grub_png_get_dword (data);
   data->image_height = grub_png_get_dword (data);
 
-  if ((!data->image_height) || (!data->image_width))
+  if ((!data->image_height) || (!data->image_width)
+      || data->image_width > GRUB_INT_MAX / 16)
     return grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: invalid image size");
 
   color_bits = grub_png_get_byte (data);
@@ -263,7 +331,10 @@ grub_png_decode_image_header (struct grub_png_data *data)
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 		       "png: color type not supported");
   if (color_type & PNG_COLOR_MASK_ALPHA)
-    blt = GRUB_VIDEO_BLIT_FORMAT_RGBA_8888;
+    {
+      data->is_alpha = 1;
+      blt = GRUB_VIDEO_BLIT_FORMAT_RGBA_8888;
+    }
   else
     blt = GRUB_VIDEO_BLIT_FORMAT_RGB_888;
   if (data->is_palette)
@@ -276,9 +347,10 @@ grub_png_decode_image_header (struct grub_png_data *data)
       data->bpp = 1;
     }
 
+  /* Only gray and palette images may have fewer bits per sample.  */
   if ((color_bits != 8) && (color_bits != 16)
-      && (color_bits != 4
-	  || !(data->is_gray || data->is_palette)))
+      && ((color_bits != 1 && color_bits != 2 && color_bits != 4)
+	  || !(data->is_gray || data->is_palette) || data->is_alpha))
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
                        "png: bit depth must be 8 or 16");
 
@@ -295,31 +367,31 @@ grub_png_decode_image_header (struct grub_png_data *data)
 
   data->color_bits = color_bits;
   data->row_bytes = data->image_width * data->bpp;
-  if (data->color_bits <= 4)
+  if (data->color_bits < 8)
     data->row_bytes = (data->image_width * data->color_bits + 7) / 8;
 
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
-  if (data->is_16bit || data->is_gray || data->is_palette)
-#endif
-    {
-      data->image_data = grub_malloc (data->image_height * data->row_bytes);
-      if (grub_errno)
-        return grub_errno;
+  /* Room for two rows, the first one doubling as the blank row above the
+     image.  */
+  data->row_buf = grub_zalloc (2 * data->row_bytes);
+  if (!data->row_buf)
+    return grub_errno;
+
+  data->out_row = (*data->bitmap)->data;
+  data->out_bytes = data->is_alpha ? 4 : 3;
+  data->prev_row = data->row_buf;
 
-      data->cur_rgb = data->image_data;
-    }
 #ifndef GRUB_CPU_WORDS_BIGENDIAN
-  else
+  if (!(data->is_16bit || data->is_gray || data->is_palette))
     {
-      data->image_data = 0;
-      data->cur_rgb = (*data->bitmap)->data;
+      data->direct = 1;
+      data->cur_row = data->out_row;
     }
+  else
 #endif
-
-  data->raw_bytes = data->image_height * (data->row_bytes + 1);
+    data->cur_row = data->row_buf + data->row_bytes;
 
   data->cur_column = 0;
-  data->first_line = 1;
+  data->cur_line = 0;
 
   if (grub_png_get_byte (data) != PNG_COMPRESSION_BASE)
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
@@ -347,14 +419,14 @@ static const grub_uint8_t bitorder[] = {
 /* Copy lengths for literal codes 257..285.  */
 static const int cplens[] = {
   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
-  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
 };
 
 /* Extra bits for literal codes 257..285.  */
 static const grub_uint8_t cplext[] = {
   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
-  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 99, 99
-};				/* 99==invalid  */
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
 
 /* Copy offsets for distance codes 0..29.  */
 static const int cpdist[] = {
@@ -370,109 +442,136 @@ static const grub_uint8_t cpdext[] = {
   12, 12, 13, 13
 };
 
-static void
-grub_png_init_huff_table (struct huff_table *ht, int cur_maxlen,
-			  int *cur_values, int *cur_maxval, int *cur_offset)
+/* The lowest BITS bits of V in reverse order.  */
+static inline unsigned
+grub_png_bitrev (unsigned v, int bits)
 {
-  ht->values = cur_values;
-  ht->maxval = cur_maxval;
-  ht->offset = cur_offset;
-  ht->num_values = 0;
-  ht->max_length = cur_maxlen;
-  grub_memset (cur_maxval, 0, sizeof (int) * cur_maxlen);
+  v = ((v & 0xaaaa) >> 1) | ((v & 0x5555) << 1);
+  v = ((v & 0xcccc) >> 2) | ((v & 0x3333) << 2);
+  v = ((v & 0xf0f0) >> 4) | ((v & 0x0f0f) << 4);
+  v = ((v & 0xff00) >> 8) | ((v & 0x00ff) << 8);
+  return v >> (16 - bits);
 }
 
-static void
-grub_png_insert_huff_item (struct huff_table *ht, int code, int len)
+/* Set up HT for the canonical code given by the code lengths LENS of
+   NUM symbols.  */
+static grub_err_t
+grub_png_build_huff_table (struct huff_table *ht, const grub_uint8_t *lens,
+			   int num)
 {
-  int i, n;
+  int count[DEFLATE_HUFF_LEN], next_code[DEFLATE_HUFF_LEN];
+  int code, sym, i;
 
-  if (len == 0)
-    return;
+  grub_memset (count, 0, sizeof (count));
+  grub_memset (ht->fast, 0, sizeof (ht->fast));
 
-  if (len > ht->max_length)
+  for (i = 0; i < num; i++)
+    count[lens[i]]++;
+  count[0] = 0;
+
+  code = 0;
+  sym = 0;
+  for (i = 1; i < DEFLATE_HUFF_LEN; i++)
     {
-      grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: invalid code length");
-      return;
+      next_code[i] = code;
+      ht->firstcode[i] = code;
+      ht->firstsym[i] = sym;
+      code += count[i];
+      if (count[i] && code > (1 << i))
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: invalid code lengths");
+      ht->maxcode[i] = code << (16 - i);
+      code <<= 1;
+      sym += count[i];
     }
 
-  n = 0;
-  for (i = len; i < ht->max_length; i++)
-    n += ht->maxval[i];
+  for (i = 0; i < num; i++)
+    {
+      int len = lens[i];
 
-  for (i = 0; i < n; i++)
-    ht->values[ht->num_values - i] = ht->values[ht->num_values - i - 1];
+      if (len == 0)
+	continue;
 
-  ht->values[ht->num_values - n] = code;
-  ht->num_values++;
-  ht->maxval[len - 1]++;
+      ht->values[next_code[len] - ht->firstcode[len] + ht->firstsym[len]] = i;
+      if (len <= HUFF_FAST_BITS)
+	{
+	  unsigned j;
+
+	  for (j = grub_png_bitrev (next_code[len], len); j < HUFF_FAST_SIZE;
+	       j += 1 << len)
+	    ht->fast[j] = (len << 9) | i;
+	}
+      next_code[len]++;
+    }
+
+  return GRUB_ERR_NONE;
 }
 
-static void
-grub_png_build_huff_table (struct huff_table *ht)
+static int
+grub_png_get_huff_code_slow (struct grub_png_data *data,
+			     struct huff_table *ht)
 {
-  int base, ofs, i;
-
-  base = 0;
-  ofs = 0;
-  for (i = 0; i < ht->max_length; i++)
-    {
-      base += ht->maxval[i];
-      ofs += ht->maxval[i];
+  unsigned k;
+  int len;
 
-      ht->maxval[i] = base;
-      ht->offset[i] = ofs - base;
+  k = grub_png_bitrev (data->bit_buf & 0xffff, 16);
+  for (len = HUFF_FAST_BITS + 1; len < DEFLATE_HUFF_LEN; len++)
+    if (k < ht->maxcode[len])
+      break;
 
-      base <<= 1;
+  if (len == DEFLATE_HUFF_LEN)
+    {
+      grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: invalid huffman code");
+      return 0;
     }
+
+  data->bit_buf >>= len;
+  data->bit_count -= len;
+  return ht->values[(k >> (16 - len)) - ht->firstcode[len]
+		    + ht->firstsym[len]];
 }
 
-static int
+static inline int
 grub_png_get_huff_code (struct grub_png_data *data, struct huff_table *ht)
 {
-  int code, i;
+  int entry;
 
-  code = 0;
-  for (i = 0; i < ht->max_length; i++)
+  if (data->bit_count < DEFLATE_HUFF_LEN)
+    grub_png_fill_bits (data);
+
+  entry = ht->fast[data->bit_buf & (HUFF_FAST_SIZE - 1)];
+  if (entry)
     {
-      code = (code << 1) + grub_png_get_bits (data, 1);
-      if (code < ht->maxval[i])
-	return ht->values[code + ht->offset[i]];
+      data->bit_buf >>= entry >> 9;
+      data->bit_count -= entry >> 9;
+      return entry & 0x1ff;
     }
-  return 0;
+  return grub_png_get_huff_code_slow (data, ht);
 }
 
 static grub_err_t
 grub_png_init_fixed_block (struct grub_png_data *data)
 {
+  grub_uint8_t lens[DEFLATE_HLIT_MAX];
   int i;
 
-  grub_png_init_huff_table (&data->code_table, DEFLATE_HUFF_LEN,
-			    data->code_values, data->code_maxval,
-			    data->code_offset);
-
   for (i = 0; i < 144; i++)
-    grub_png_insert_huff_item (&data->code_table, i, 8);
+    lens[i] = 8;
 
   for (; i < 256; i++)
-    grub_png_insert_huff_item (&data->code_table, i, 9);
+    lens[i] = 9;
 
   for (; i < 280; i++)
-    grub_png_insert_huff_item (&data->code_table, i, 7);
+    lens[i] = 7;
 
   for (; i < DEFLATE_HLIT_MAX; i++)
-    grub_png_insert_huff_item (&data->code_table, i, 8);
-
-  grub_png_build_huff_table (&data->code_table);
+    lens[i] = 8;
 
-  grub_png_init_huff_table (&data->dist_table, DEFLATE_HUFF_LEN,
-			    data->dist_values, data->dist_maxval,
-			    data->dist_offset);
+  grub_png_build_huff_table (&data->code_table, lens, DEFLATE_HLIT_MAX);
 
   for (i = 0; i < DEFLATE_HDIST_MAX; i++)
-    grub_png_insert_huff_item (&data->dist_table, i, 5);
+    lens[i] = 5;
 
-  grub_png_build_huff_table (&data->dist_table);
+  grub_png_build_huff_table (&data->dist_table, lens, DEFLATE_HDIST_MAX);
 
   return grub_errno;
 }
@@ -480,12 +579,9 @@ grub_png_init_fixed_block (struct grub_png_data *data)
 static grub_err_t
 grub_png_init_dynamic_block (struct grub_png_data *data)
 {
-  int nl, nd, nb, i, prev;
+  int nl, nd, nb, i;
   struct huff_table cl;
-  int cl_values[sizeof (bitorder)];
-  int cl_maxval[8];
-  int cl_offset[8];
-  grub_uint8_t lens[DEFLATE_HCLEN_MAX];
+  grub_uint8_t lens[DEFLATE_HLIT_MAX + DEFLATE_HDIST_MAX];
 
   nl = DEFLATE_HLIT_BASE + grub_png_get_bits (data, 5);
   nd = DEFLATE_HDIST_BASE + grub_png_get_bits (data, 5);
@@ -495,186 +591,347 @@ grub_png_init_dynamic_block (struct grub_png_data *data)
       (nb > DEFLATE_HCLEN_MAX))
     return grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: too much data");
 
-  grub_png_init_huff_table (&cl, 8, cl_values, cl_maxval, cl_offset);
-
   for (i = 0; i < nb; i++)
     lens[bitorder[i]] = grub_png_get_bits (data, 3);
 
   for (; i < DEFLATE_HCLEN_MAX; i++)
     lens[bitorder[i]] = 0;
 
-  for (i = 0; i < DEFLATE_HCLEN_MAX; i++)
-    grub_png_insert_huff_item (&cl, i, lens[i]);
-
-  grub_png_build_huff_table (&cl);
-
-  grub_png_init_huff_table (&data->code_table, DEFLATE_HUFF_LEN,
-			    data->code_values, data->code_maxval,
-			    data->code_offset);
-
-  grub_png_init_huff_table (&data->dist_table, DEFLATE_HUFF_LEN,
-			    data->dist_values, data->dist_maxval,
-			    data->dist_offset);
+  if (grub_png_build_huff_table (&cl, lens, DEFLATE_HCLEN_MAX))
+    return grub_errno;
 
-  prev = 0;
-  for (i = 0; i < nl + nd; i++)
+  i = 0;
+  while (i < nl + nd)
     {
-      int n, code;
-      struct huff_table *ht;
+      int n, c, val;
 
       if (grub_errno)
 	return grub_errno;
 
-      if (i < nl)
-	{
-	  ht = &data->code_table;
-	  code = i;
-	}
-      else
-	{
-	  ht = &data->dist_table;
-	  code = i - nl;
-	}
-
       n = grub_png_get_huff_code (data, &cl);
       if (n < 16)
 	{
-	  grub_png_insert_huff_item (ht, code, n);
-	  prev = n;
+	  lens[i++] = n;
+	  continue;
 	}
-      else if (n == 16)
-	{
-	  int c;
 
+      if (n == 16)
+	{
+	  if (i == 0)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "png: invalid code lengths");
 	  c = 3 + grub_png_get_bits (data, 2);
-	  while (c > 0)
-	    {
-	      grub_png_insert_huff_item (ht, code++, prev);
-	      i++;
-	      c--;
-	    }
-	  i--;
+	  val = lens[i - 1];
 	}
       else if (n == 17)
-	i += 3 + grub_png_get_bits (data, 3) - 1;
+	{
+	  c = 3 + grub_png_get_bits (data, 3);
+	  val = 0;
+	}
       else
-	i += 11 + grub_png_get_bits (data, 7) - 1;
-    }
+	{
+	  c = 11 + grub_png_get_bits (data, 7);
+	  val = 0;
+	}
 
-  grub_png_build_huff_table (&data->code_table);
-  grub_png_build_huff_table (&data->dist_table);
+      if (i + c > nl + nd)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   "png: invalid code lengths");
+      grub_memset (lens + i, val, c);
+      i += c;
+    }
 
-  return grub_errno;
+  if (grub_png_build_huff_table (&data->code_table, lens, nl))
+    return grub_errno;
+  return grub_png_build_huff_table (&data->dist_table, lens + nl, nd);
 }
 
-static grub_err_t
-grub_png_output_byte (struct grub_png_data *data, grub_uint8_t n)
+/* Undo the filter of the row just received.  */
+static void
+grub_png_unfilter_row (struct grub_png_data *data)
 {
-  if (--data->raw_bytes < 0)
-    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "image size overflown");
+  grub_uint8_t *cur = data->cur_row;
+  const grub_uint8_t *up = data->prev_row;
+  int bpp = data->bpp;
+  int n = data->row_bytes;
+  int i;
 
-  if (data->cur_column == 0)
+  switch (data->cur_filter)
     {
-      if (n >= PNG_FILTER_VALUE_LAST)
-	return grub_error (GRUB_ERR_BAD_FILE_TYPE, "invalid filter value");
+    case PNG_FILTER_VALUE_SUB:
+      for (i = bpp; i < n; i++)
+	cur[i] += cur[i - bpp];
+      break;
+
+    case PNG_FILTER_VALUE_UP:
+      for (i = 0; i < n; i++)
+	cur[i] += up[i];
+      break;
+
+    case PNG_FILTER_VALUE_AVG:
+      for (i = 0; i < bpp; i++)
+	cur[i] += up[i] >> 1;
+      for (; i < n; i++)
+	cur[i] += ((int) cur[i - bpp] + (int) up[i]) >> 1;
+      break;
+
+    case PNG_FILTER_VALUE_PAETH:
+      for (i = 0; i < bpp; i++)
+	cur[i] += up[i];
+      for (; i < n; i++)
+	{
+	  int a, b, c, pa, pb, pc;
+
+	  a = cur[i - bpp];
+	  b = up[i];
+	  c = up[i - bpp];
+
+	  pa = b - c;
+	  pb = a - c;
+	  pc = pa + pb;
+
+	  if (pa < 0)
+	    pa = -pa;
+
+	  if (pb < 0)
+	    pb = -pb;
 
-      data->cur_filter = n;
+	  if (pc < 0)
+	    pc = -pc;
+
+	  cur[i] += ((pa <= pb) && (pa <= pc)) ? a : (pb <= pc) ? b : c;
+	}
+      break;
     }
-  else
-    *data->cur_rgb++ = n;
+}
 
-  data->cur_column++;
-  if (data->cur_column == data->row_bytes + 1)
+#ifndef GRUB_CPU_WORDS_BIGENDIAN
+#define R4 0
+#define G4 1
+#define B4 2
+#define A4 3
+#define R3 0
+#define G3 1
+#define B3 2
+#else
+#define R4 3
+#define G4 2
+#define B4 1
+#define A4 0
+#define R3 2
+#define G3 1
+#define B3 0
+#endif
+
+/* Convert the row just unfiltered into the bitmap.  16-bit samples are
+   cut to their upper, first, byte.  */
+static void
+grub_png_convert_row (struct grub_png_data *data)
+{
+  const grub_uint8_t *s = data->cur_row;
+  grub_uint8_t *d = data->out_row;
+  unsigned i, w = data->image_width;
+  int step = data->is_16bit ? 2 : 1;
+
+  if (data->color_bits < 8)
     {
-      grub_uint8_t *blank_line = NULL;
-      grub_uint8_t *cur = data->cur_rgb - data->row_bytes;
-      grub_uint8_t *left = cur;
-      grub_uint8_t *up;
+      /* Gray levels are scaled by 0xff / ((1 << color_bits) - 1).  */
+      static const grub_uint8_t multipliers[5] = { 0, 0xff, 0x55, 0, 0x11 };
+      int mask = (1 << data->color_bits) - 1;
+      int shift = 8 - data->color_bits;
 
-      if (data->first_line)
+      for (i = 0; i < w; i++, d += 3)
 	{
-	  blank_line = grub_zalloc (data->row_bytes);
-	  if (blank_line == NULL)
-	    return grub_errno;
+	  grub_uint8_t col = (*s >> shift) & mask;
 
-	  up = blank_line;
+	  if (data->is_gray)
+	    {
+	      col *= multipliers[data->color_bits];
+	      d[R3] = col;
+	      d[G3] = col;
+	      d[B3] = col;
+	    }
+	  else
+	    {
+	      d[R3] = data->palette[col][0];
+	      d[G3] = data->palette[col][1];
+	      d[B3] = data->palette[col][2];
+	    }
+	  shift -= data->color_bits;
+	  if (shift < 0)
+	    {
+	      s++;
+	      shift += 8;
+	    }
 	}
-      else
-	up = cur - data->row_bytes;
+      return;
+    }
 
-      switch (data->cur_filter)
+  if (data->is_palette)
+    {
+      for (i = 0; i < w; i++, d += 3, s++)
 	{
-	case PNG_FILTER_VALUE_SUB:
-	  {
-	    int i;
+	  d[R3] = data->palette[s[0]][0];
+	  d[G3] = data->palette[s[0]][1];
+	  d[B3] = data->palette[s[0]][2];
+	}
+      return;
+    }
 
-	    cur += data->bpp;
-	    for (i = data->bpp; i < data->row_bytes; i++, cur++, left++)
-	      *cur += *left;
+  if (data->is_gray && data->is_alpha)
+    for (i = 0; i < w; i++, d += 4, s += 2 * step)
+      {
+	d[R4] = s[0];
+	d[G4] = s[0];
+	d[B4] = s[0];
+	d[A4] = s[step];
+      }
+  else if (data->is_gray)
+    for (i = 0; i < w; i++, d += 3, s += step)
+      {
+	d[R3] = s[0];
+	d[G3] = s[0];
+	d[B3] = s[0];
+      }
+  else if (data->is_alpha)
+    for (i = 0; i < w; i++, d += 4, s += 4 * step)
+      {
+	d[R4] = s[0];
+	d[G4] = s[step];
+	d[B4] = s[2 * step];
+	d[A4] = s[3 * step];
+      }
+  else
+    for (i = 0; i < w; i++, d += 3, s += 3 * step)
+      {
+	d[R3] = s[0];
+	d[G3] = s[step];
+	d[B3] = s[2 * step];
+      }
+}
 
-	    break;
-	  }
-	case PNG_FILTER_VALUE_UP:
-	  {
-	    int i;
+/* Pass LEN bytes of decompressed data on to the rows.  */
+static grub_err_t
+grub_png_output_bytes (struct grub_png_data *data, const grub_uint8_t *p,
+		       int len)
+{
+  while (len > 0)
+    {
+      int n;
 
-	    for (i = 0; i < data->row_bytes; i++, cur++, up++)
-	      *cur += *up;
+      if (data->cur_column == 0)
+	{
+	  if (data->cur_line >= data->image_height)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "image size overflown");
 
-	    break;
-	  }
-	case PNG_FILTER_VALUE_AVG:
-	  {
-	    int i;
+	  if (*p >= PNG_FILTER_VALUE_LAST)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "invalid filter value");
 
-	    for (i = 0; i < data->bpp; i++, cur++, up++)
-	      *cur += *up >> 1;
+	  data->cur_filter = *p++;
+	  len--;
+	  data->cur_column = 1;
+	  continue;
+	}
 
-	    for (; i < data->row_bytes; i++, cur++, up++, left++)
-	      *cur += ((int) *up + (int) *left) >> 1;
+      n = data->row_bytes + 1 - data->cur_column;
+      if (n > len)
+	n = len;
+      grub_memcpy (data->cur_row + data->cur_column - 1, p, n);
+      p += n;
+      len -= n;
+      data->cur_column += n;
+      if (data->cur_column <= data->row_bytes)
+	break;
 
-	    break;
-	  }
-	case PNG_FILTER_VALUE_PAETH:
-	  {
-	    int i;
-	    grub_uint8_t *upper_left = up;
+      /* The row is complete.  */
+      grub_png_unfilter_row (data);
+      if (data->direct)
+	{
+	  data->prev_row = data->cur_row;
+	  data->cur_row += data->row_bytes;
+	}
+      else
+	{
+	  grub_uint8_t *t;
 
-	    for (i = 0; i < data->bpp; i++, cur++, up++)
-	      *cur += *up;
+	  grub_png_convert_row (data);
+	  data->out_row += data->image_width * data->out_bytes;
+	  t = data->prev_row;
+	  data->prev_row = data->cur_row;
+	  data->cur_row = t;
+	}
+      data->cur_line++;
+      data->cur_column = 0;
+    }
 
-	    for (; i < data->row_bytes; i++, cur++, up++, left++, upper_left++)
-	      {
-		int a, b, c, pa, pb, pc;
+  return GRUB_ERR_NONE;
+}
 
-                a = *left;
-                b = *up;
-                c = *upper_left;
+/* Pass the output added to the window since the last time on.  */
+static void
+grub_png_flush (struct grub_png_data *data)
+{
+  if (data->wp != data->flush_pos && !grub_errno)
+    grub_png_output_bytes (data, data->slide + data->flush_pos,
+			   data->wp - data->flush_pos);
+  if (data->wp == WSIZE)
+    data->wp = 0;
+  data->flush_pos = data->wp;
+}
 
-                pa = b - c;
-                pb = a - c;
-                pc = pa + pb;
+static grub_err_t
+grub_png_read_stored_block (struct grub_png_data *data)
+{
+  int len, nlen;
 
-                if (pa < 0)
-                  pa = -pa;
+  /* Stored data starts at a byte boundary.  */
+  grub_png_get_bits (data, data->bit_count & 7);
+  len = grub_png_get_bits (data, 16);
+  nlen = grub_png_get_bits (data, 16);
+  if (len != (~nlen & 0xffff))
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, "png: invalid stored block");
 
-                if (pb < 0)
-                  pb = -pb;
+  while (len > 0 && grub_errno == 0)
+    {
+      int n = WSIZE - data->wp;
 
-                if (pc < 0)
-                  pc = -pc;
+      if (n > len)
+	n = len;
+      len -= n;
 
-                *cur += ((pa <= pb) && (pa <= pc)) ? a : (pb <= pc) ? b : c;
-	      }
-	  }
+      /* Take the bytes already in the bit buffer first.  */
+      while (n > 0 && data->bit_count)
+	{
+	  data->slide[data->wp++] = grub_png_get_bits (data, 8);
+	  n--;
 	}
 
-      grub_free (blank_line);
+      while (n > 0 && grub_errno == 0)
+	{
+	  grub_size_t amount = data->in_end - data->in_ptr;
 
-      data->cur_column = 0;
-      data->first_line = 0;
+	  if (amount > data->idat_remain)
+	    amount = data->idat_remain;
+	  if (amount > (grub_size_t) n)
+	    amount = n;
+	  if (amount == 0)
+	    {
+	      data->slide[data->wp++] = grub_png_get_idat_byte (data);
+	      n--;
+	      continue;
+	    }
+	  grub_memcpy (data->slide + data->wp, data->in_ptr, amount);
+	  data->in_ptr += amount;
+	  data->idat_remain -= amount;
+	  data->wp += amount;
+	  n -= amount;
+	}
+
+      if (data->wp == WSIZE)
+	grub_png_flush (data);
     }
 
+  grub_png_flush (data);
   return grub_errno;
 }
 
@@ -688,12 +945,9 @@ grub_png_read_dynamic_block (struct grub_png_data *data)
       n = grub_png_get_huff_code (data, &data->code_table);
       if (n < 256)
 	{
-	  data->slide[data->wp] = n;
-	  grub_png_output_byte (data, n);
-
-	  data->wp++;
-	  if (data->wp >= WSIZE)
-	    data->wp = 0;
+	  data->slide[data->wp++] = n;
+	  if (data->wp == WSIZE)
+	    grub_png_flush (data);
 	}
       else if (n == 256)
 	break;
@@ -702,37 +956,47 @@ grub_png_read_dynamic_block (struct grub_png_data *data)
 	  int len, dist, pos;
 
 	  n -= 257;
+	  if (n >= (int) ARRAY_SIZE (cplens))
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "png: invalid length code");
 	  len = cplens[n];
 	  if (cplext[n])
 	    len += grub_png_get_bits (data, cplext[n]);
 
 	  n = grub_png_get_huff_code (data, &data->dist_table);
+	  if (n >= (int) ARRAY_SIZE (cpdist))
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "png: invalid distance code");
 	  dist = cpdist[n];
 	  if (cpdext[n])
 	    dist += grub_png_get_bits (data, cpdext[n]);
 
-	  pos = data->wp - dist;
-	  if (pos < 0)
-	    pos += WSIZE;
+	  pos = (data->wp - dist) & (WSIZE - 1);
 
-	  while (len > 0)
+	  /* Byte by byte, as the copy may overlap what it produces.  */
+	  if (pos + len <= WSIZE && data->wp + len < WSIZE)
 	    {
-	      data->slide[data->wp] = data->slide[pos];
-	      grub_png_output_byte (data, data->slide[data->wp]);
-
-	      data->wp++;
-	      if (data->wp >= WSIZE)
-		data->wp = 0;
+	      grub_uint8_t *d = data->slide + data->wp;
+	      const grub_uint8_t *s = data->slide + pos;
 
-	      pos++;
-	      if (pos >= WSIZE)
-		pos = 0;
+	      data->wp += len;
+	      while (len--)
+		*d++ = *s++;
+	      continue;
+	    }
 
+	  while (len > 0)
+	    {
+	      data->slide[data->wp++] = data->slide[pos++];
+	      pos &= WSIZE - 1;
+	      if (data->wp == WSIZE)
+		grub_png_flush (data);
 	      len--;
 	    }
 	}
     }
 
+  grub_png_flush (data);
   return grub_errno;
 }
 
@@ -742,8 +1006,8 @@ grub_png_decode_image_data (struct grub_png_data *data)
   grub_uint8_t cmf, flg;
   int final;
 
-  cmf = grub_png_get_byte (data);
-  flg = grub_png_get_byte (data);
+  cmf = grub_png_get_bits (data, 8);
+  flg = grub_png_get_bits (data, 8);
 
   if ((cmf & 0xF) != Z_DEFLATED)
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
@@ -763,31 +1027,17 @@ grub_png_decode_image_data (struct grub_png_data *data)
       switch (block_type)
 	{
 	case INFLATE_STORED:
-	  {
-	    grub_uint16_t i, len;
-
-	    data->bit_count = 0;
-	    len = grub_png_get_byte (data);
-	    len += ((grub_uint16_t) grub_png_get_byte (data)) << 8;
-
-            /* Skip NLEN field.  */
-	    grub_png_get_byte (data);
-	    grub_png_get_byte (data);
-
-	    for (i = 0; i < len; i++)
-	      grub_png_output_byte (data, grub_png_get_byte (data));
-
-	    break;
-	  }
+	  grub_png_read_stored_block (data);
+	  break;
 
 	case INFLATE_FIXED:
-          grub_png_init_fixed_block (data);
-	  grub_png_read_dynamic_block (data);
+          if (grub_png_init_fixed_block (data) == GRUB_ERR_NONE)
+	    grub_png_read_dynamic_block (data);
 	  break;
 
 	case INFLATE_DYNAMIC:
-	  grub_png_init_dynamic_block (data);
-	  grub_png_read_dynamic_block (data);
+	  if (grub_png_init_dynamic_block (data) == GRUB_ERR_NONE)
+	    grub_png_read_dynamic_block (data);
 	  break;
 
 	default:
@@ -797,11 +1047,23 @@ grub_png_decode_image_data (struct grub_png_data *data)
     }
   while ((!final) && (grub_errno == 0));
 
-  /* Skip adler checksum.  */
-  grub_png_get_dword (data);
+  if (grub_errno)
+    return grub_errno;
 
-  /* Skip crc checksum.  */
-  grub_png_get_dword (data);
+  /* Skip adler checksum, part of which may be buffered already.  */
+  grub_png_get_bits (data, data->bit_count & 7);
+  while (data->bit_count < 32)
+    {
+      grub_png_get_idat_byte (data);
+      data->bit_count += 8;
+    }
+  data->bit_count = 0;
+  data->bit_buf = 0;
+
+  /* Skip whatever is left of the chunk and its crc checksum.  */
+  grub_png_skip (data, (grub_off_t) data->idat_remain + 4);
+  data->idat_remain = 0;
+  data->idat_done = 1;
 
   return grub_errno;
 }
@@ -809,215 +1071,15 @@ grub_png_decode_image_data (struct grub_png_data *data)
 static const grub_uint8_t png_magic[8] =
   { 0x89, 0x50, 0x4e, 0x47, 0xd, 0xa, 0x1a, 0x0a };
 
-static void
-grub_png_convert_image (struct grub_png_data *data)
-{
-  unsigned i;
-  grub_uint8_t *d1, *d2;
-
-  d1 = (*data->bitmap)->data;
-  d2 = data->image_data + data->is_16bit;
-
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
-#define R4 3
-#define G4 2
-#define B4 1
-#define A4 0
-#define R3 2
-#define G3 1
-#define B3 0
-#else
-#define R4 0
-#define G4 1
-#define B4 2
-#define A4 3
-#define R3 0
-#define G3 1
-#define B3 2
-#endif
-
-  if (data->color_bits <= 4)
-    {
-      grub_uint8_t palette[16][3];
-      grub_uint8_t *d1c, *d2c;
-      int shift;
-      int mask = (1 << data->color_bits) - 1;
-      unsigned j;
-      if (data->is_gray)
-	{
-	  /* Generic formula is
-	     (0xff * i) / ((1U << data->color_bits) - 1)
-	     but for allowed bit depth of 1, 2 and for it's
-	     equivalent to
-	     (0xff / ((1U << data->color_bits) - 1)) * i
-	     Precompute the multipliers to avoid division.
-	  */
-
-	  const grub_uint8_t multipliers[5] = { 0xff, 0xff, 0x55, 0x24, 0x11 };
-	  for (i = 0; i < (1U << data->color_bits); i++)
-	    {
-	      grub_uint8_t col = multipliers[data->color_bits] * i;
-	      palette[i][0] = col;
-	      palette[i][1] = col;
-	      palette[i][2] = col;
-	    }
-	}
-      else
-	grub_memcpy (palette, data->palette, 3 << data->color_bits);
-      d1c = d1;
-      d2c = d2;
-      for (j = 0; j < data->image_height; j++, d1c += data->image_width * 3,
-	   d2c += data->row_bytes)
-	{
-	  d1 = d1c;
-	  d2 = d2c;
-	  shift = 8 - data->color_bits;
-	  for (i = 0; i < data->image_width; i++, d1 += 3)
-	    {
-	      grub_uint8_t col = (d2[0] >> shift) & mask;
-	      d1[R3] = data->palette[col][2];
-	      d1[G3] = data->palette[col][1];
-	      d1[B3] = data->palette[col][0];
-	      shift -= data->color_bits;
-	      if (shift < 0)
-		{
-		  d2++;
-		  shift += 8;
-		}
-	    }
-	}
-      return;
-    }
-
-  if (data->is_palette)
-    {
-      for (i = 0; i < (data->image_width * data->image_height);
-	   i++, d1 += 3, d2++)
-	{
-	  d1[R3] = data->palette[d2[0]][2];
-	  d1[G3] = data->palette[d2[0]][1];
-	  d1[B3] = data->palette[d2[0]][0];
-	}
-      return;
-    }
-  
-  if (data->is_gray)
-    {
-      switch (data->bpp)
-	{
-	case 4:
-	  /* 16-bit gray with alpha.  */
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 4, d2 += 4)
-	    {
-	      d1[R4] = d2[3];
-	      d1[G4] = d2[3];
-	      d1[B4] = d2[3];
-	      d1[A4] = d2[1];
-	    }
-	  break;
-	case 2:
-	  if (data->is_16bit)
-	    /* 16-bit gray without alpha.  */
-	    {
-	      for (i = 0; i < (data->image_width * data->image_height);
-		   i++, d1 += 4, d2 += 2)
-		{
-		  d1[R3] = d2[1];
-		  d1[G3] = d2[1];
-		  d1[B3] = d2[1];
-		}
-	    }
-	  else
-	    /* 8-bit gray with alpha.  */
-	    {
-	      for (i = 0; i < (data->image_width * data->image_height);
-		   i++, d1 += 4, d2 += 2)
-		{
-		  d1[R4] = d2[1];
-		  d1[G4] = d2[1];
-		  d1[B4] = d2[1];
-		  d1[A4] = d2[0];
-		}
-	    }
-	  break;
-	  /* 8-bit gray without alpha.  */
-	case 1:
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 3, d2++)
-	    {
-	      d1[R3] = d2[0];
-	      d1[G3] = d2[0];
-	      d1[B3] = d2[0];
-	    }
-	  break;
-	}
-      return;
-    }
-
-    {
-  /* Only copy the upper 8 bit.  */
-#ifndef GRUB_CPU_WORDS_BIGENDIAN
-      for (i = 0; i < (data->image_width * data->image_height * data->bpp >> 1);
-	   i++, d1++, d2 += 2)
-	*d1 = *d2;
-#else
-      switch (data->bpp)
-	{
-	  /* 16-bit with alpha.  */
-	case 8:
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 4, d2+=8)
-	    {
-	      d1[0] = d2[7];
-	      d1[1] = d2[5];
-	      d1[2] = d2[3];
-	      d1[3] = d2[1];
-	    }
-	  break;
-	  /* 16-bit without alpha.  */
-	case 6:
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 3, d2+=6)
-	    {
-	      d1[0] = d2[5];
-	      d1[1] = d2[3];
-	      d1[2] = d2[1];
-	    }
-	  break;
-	case 4:
-	  /* 8-bit with alpha.  */
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 4, d2 += 4)
-	    {
-	      d1[0] = d2[3];
-	      d1[1] = d2[2];
-	      d1[2] = d2[1];
-	      d1[3] = d2[0];
-	    }
-	  break;
-	  /* 8-bit without alpha.  */
-	case 3:
-	  for (i = 0; i < (data->image_width * data->image_height);
-	       i++, d1 += 3, d2 += 3)
-	    {
-	      d1[0] = d2[2];
-	      d1[1] = d2[1];
-	      d1[2] = d2[0];
-	    }
-	  break;
-	}
-#endif
-    }
-
-}
-
 static grub_err_t
 grub_png_decode_png (struct grub_png_data *data)
 {
   grub_uint8_t magic[8];
+  unsigned i;
 
-  if (grub_file_read (data->file, &magic[0], 8) != 8)
+  for (i = 0; i < sizeof (magic); i++)
+    magic[i] = grub_png_get_byte (data);
+  if (grub_errno)
     return grub_errno;
 
   if (grub_memcmp (magic, png_magic, sizeof (png_magic)))
@@ -1029,11 +1091,14 @@ grub_png_decode_png (struct grub_png_data *data)
 
       len = grub_png_get_dword (data);
       type = grub_png_get_dword (data);
-      data->next_offset = data->file->offset + len + 4;
+      data->next_offset = grub_png_offset (data) + len + 4;
 
       switch (type)
 	{
 	case PNG_CHUNK_IHDR:
+	  if (data->row_buf)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "png: duplicate image header");
 	  grub_png_decode_image_header (data);
 	  break;
 
@@ -1042,29 +1107,32 @@ grub_png_decode_png (struct grub_png_data *data)
 	  break;
 
 	case PNG_CHUNK_IDAT:
-	  data->inside_idat = 1;
+	  if (!data->row_buf)
+	    return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			       "png: missing image header");
+	  if (data->idat_done)
+	    {
+	      grub_png_skip (data, (grub_off_t) len + 4);
+	      break;
+	    }
 	  data->idat_remain = len;
 	  data->bit_count = 0;
+	  data->bit_buf = 0;
 
 	  grub_png_decode_image_data (data);
-
-	  data->inside_idat = 0;
 	  break;
 
 	case PNG_CHUNK_IEND:
-          if (data->image_data)
-            grub_png_convert_image (data);
-
 	  return grub_errno;
 
 	default:
-	  grub_file_seek (data->file, data->file->offset + len + 4);
+	  grub_png_skip (data, (grub_off_t) len + 4);
 	}
 
       if (grub_errno)
         break;
 
-      if (data->file->offset != data->next_offset)
+      if (grub_png_offset (data) != data->next_offset)
         return grub_error (GRUB_ERR_BAD_FILE_TYPE,
                            "png: chunk size error");
     }
@@ -1079,7 +1147,8 @@ grub_video_reader_png (struct grub_video_bitmap **bitmap,
   grub_file_t file;
   struct grub_png_data *data;
 
-  file = grub_buffile_open (filename, GRUB_FILE_TYPE_PIXMAP, 0);
+  /* The reader does its own buffering.  */
+  file = grub_file_open (filename, GRUB_FILE_TYPE_PIXMAP);
   if (!file)
     return grub_errno;
 
@@ -1088,10 +1157,11 @@ grub_video_reader_png (struct grub_video_bitmap **bitmap,
     {
       data->file = file;
       data->bitmap = bitmap;
+      data->in_ptr = data->in_end = data->inbuf;
 
       grub_png_decode_png (data);
 
-      grub_free (data->image_data);
+      grub_free (data->row_buf);
       grub_free (data);
     }
 
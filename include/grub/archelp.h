@@ -47,6 +47,18 @@ struct grub_archelp_ops
 
   void
   (*rewind) (struct grub_archelp_data *data);
+
+  /* Optional.  Drivers which can report and restore the position of a
+     header and the disk they read from get a name index, built on the
+     first access and shared between later opens of the same archive.  */
+  grub_off_t
+  (*tell) (struct grub_archelp_data *data);
+
+  void
+  (*seek) (struct grub_archelp_data *data, grub_off_t hofs);
+
+  grub_disk_t
+  (*get_disk) (struct grub_archelp_data *data);
 };
 
 grub_err_t
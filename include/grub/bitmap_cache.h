@@ -0,0 +1,65 @@
+/* bitmap_cache.h - Cache of decoded and scaled bitmaps.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRUB_BITMAP_CACHE_HEADER
+#define GRUB_BITMAP_CACHE_HEADER	1
+
+#include <grub/err.h>
+#include <grub/types.h>
+#include <grub/bitmap.h>
+#include <grub/bitmap_scale.h>
+
+/* Cached bitmaps are identified by the file they were made from, its size
+   and modification time, a VARIANT string naming the processing applied
+   after decoding ("" for none) and the requested WIDTH and HEIGHT (0 when
+   they do not apply).  Bitmaps returned by the functions below are copies
+   owned by the caller.  */
+
+/* Return a copy of the cached bitmap, or 0 if there is none.  */
+struct grub_video_bitmap *
+EXPORT_FUNC (grub_video_bitmap_cache_get) (const char *filename,
+					   const char *variant,
+					   unsigned int width,
+					   unsigned int height);
+
+/* Store a copy of BITMAP.  Failures are not reported, the bitmap is just
+   not cached.  */
+void
+EXPORT_FUNC (grub_video_bitmap_cache_put) (const char *filename,
+					   const char *variant,
+					   unsigned int width,
+					   unsigned int height,
+					   struct grub_video_bitmap *bitmap);
+
+/* Like grub_video_bitmap_load, going through the cache.  */
+grub_err_t
+EXPORT_FUNC (grub_video_bitmap_cache_load) (struct grub_video_bitmap **bitmap,
+					    const char *filename);
+
+/* Load FILENAME scaled to WIDTH x HEIGHT, going through the cache.  Only
+   the scaled bitmap is kept.  */
+grub_err_t
+EXPORT_FUNC (grub_video_bitmap_cache_load_scaled)
+				     (struct grub_video_bitmap **bitmap,
+				      const char *filename,
+				      unsigned int width, unsigned int height,
+				      enum grub_video_bitmap_scale_method
+				      scale_method);
+
+#endif /* ! GRUB_BITMAP_CACHE_HEADER */
@@ -113,6 +113,8 @@ enum grub_file_type
     GRUB_FILE_TYPE_KEYBOARD_LAYOUT,
     /* Picture file.  */
     GRUB_FILE_TYPE_PIXMAP,
+    /* Saved cache of decoded pictures.  */
+    GRUB_FILE_TYPE_BITMAP_CACHE,
     /* *.lst shipped by GRUB.  */
     GRUB_FILE_TYPE_GRUB_MODULE_LIST,
     /* config file.  */
@@ -45,6 +45,8 @@ struct grub_font
   grub_uint32_t num_chars;
   struct char_index_entry *char_index;
   grub_uint16_t *bmp_idx;
+  /* All glyphs, for fonts loaded as resident.  */
+  grub_uint8_t *glyph_data;
 };
 
 /* Font type used to access font functions.  */
@@ -101,6 +103,9 @@ void grub_font_loader_init (void);
    Returns: 0 upon success; nonzero upon failure.  */
 grub_font_t EXPORT_FUNC(grub_font_load) (const char *filename);
 
+/* Like grub_font_load, but read all glyphs into memory at once.  */
+grub_font_t EXPORT_FUNC(grub_font_load_resident) (const char *filename);
+
 /* Get the font that has the specified name.  Font names are in the form
    "Family Name Bold Italic 14", where Bold and Italic are optional.
    If no font matches the name specified, the most recently loaded font
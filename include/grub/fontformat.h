@@ -34,5 +34,13 @@
 #define FONT_FORMAT_SECTION_NAMES_FAMILY "FAMI"
 #define FONT_FORMAT_SECTION_NAMES_SLAN "SLAN"
 
+/* Size of the header of a character definition in the DATA section.  */
+#define FONT_FORMAT_GLYPH_HEADER_SIZE 10
+
+/* With grub-mkfont --aligned, each character definition in the DATA section
+   is preceded by at least this many bytes of padding and starts at a
+   multiple of it from the start of the section contents.  */
+#define FONT_FORMAT_GLYPH_ALIGN 8
+
 #endif /* ! GRUB_FONT_FORMAT_HEADER */
 
@@ -101,6 +101,7 @@ struct grub_gfxmenu_view
   grub_video_rgba_color_t message_bg_color;
   struct grub_video_bitmap *raw_desktop_image;
   struct grub_video_bitmap *scaled_desktop_image;
+  char *desktop_image_path;
   grub_video_bitmap_selection_method_t desktop_image_scale_method;
   grub_video_bitmap_h_align_t desktop_image_h_align;
   grub_video_bitmap_v_align_t desktop_image_v_align;
@@ -206,6 +206,8 @@ struct grub_engine_animation
 {
   struct grub_gui_component component;
   void (*refresh_animation) (void *self, grub_gfxmenu_view_t view);
+  /* Get the area changed by the last refresh.  */
+  void (*get_dirty_rect) (void *self, grub_video_rect_t *rect);
 };
 
 /* Interfaces to concrete component classes.  */
@@ -75,6 +75,14 @@ struct grub_hfsplus_compress_index
   grub_uint32_t size;
 };
 
+/* One extent of a file, with its position in the file.  */
+struct grub_hfsplus_extent_map
+{
+  grub_uint64_t fileblock;
+  grub_uint32_t start;
+  grub_uint32_t count;
+};
+
 struct grub_hfsplus_file
 {
   struct grub_hfsplus_data *data;
@@ -90,6 +98,10 @@ struct grub_hfsplus_file
   struct grub_hfsplus_compress_index *compress_index;
   grub_uint32_t cbuf_block;
   grub_uint32_t compress_index_size;
+  /* All extents of the fork being read, including those from the extent
+     overflow tree.  Only built for the opened file.  */
+  struct grub_hfsplus_extent_map *extmap;
+  grub_uint32_t extmap_count;
 };
 
 struct grub_hfsplus_btree
@@ -101,6 +113,18 @@ struct grub_hfsplus_btree
   struct grub_hfsplus_file file;
 };
 
+#define GRUB_HFSPLUS_NODE_CACHE_SIZE 32
+
+/* A B-tree node kept in memory.  */
+struct grub_hfsplus_node_cache
+{
+  struct grub_hfsplus_btree *btree;
+  grub_uint64_t node;
+  grub_uint64_t last_used;
+  grub_size_t size;
+  char *buf;
+};
+
 /* Information about a "mounted" HFS+ filesystem.  */
 struct grub_hfsplus_data
 {
@@ -120,6 +144,9 @@ struct grub_hfsplus_data
      filesystem (one inside a plain HFS wrapper).  */
   grub_disk_addr_t embedded_offset;
   int case_sensitive;
+
+  struct grub_hfsplus_node_cache node_cache[GRUB_HFSPLUS_NODE_CACHE_SIZE];
+  grub_uint64_t node_cache_tick;
 };
 
 /* Internal representation of a catalog key.  */
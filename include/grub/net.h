@@ -82,6 +82,10 @@ struct grub_net_card_driver
   grub_err_t (*send) (struct grub_net_card *dev,
 		      struct grub_net_buff *buf);
   struct grub_net_buff * (*recv) (struct grub_net_card *dev);
+  /* Optional.  Receive up to MAX packets into NBS and return how many.
+     Fewer than MAX means that the card has nothing more for now.  */
+  int (*recv_batch) (struct grub_net_card *dev, struct grub_net_buff **nbs,
+		     int max);
 };
 
 typedef struct grub_net_packet
@@ -135,6 +139,12 @@ struct grub_net_card
   grub_size_t rcvbufsize;
   grub_size_t txbufsize;
   int txbusy;
+  /* Counters for net_stats.  */
+  grub_uint64_t rx_packets;
+  grub_uint64_t rx_bytes;
+  grub_uint64_t tx_packets;
+  grub_uint64_t tx_bytes;
+  grub_uint64_t tx_errors;
   union
   {
 #ifdef GRUB_MACHINE_EFI
@@ -224,8 +234,8 @@ grub_net_put_packet (grub_net_packets_t *pkts, struct grub_net_buff *nb)
   if (pkts->first)
     {
       pkts->last->next = n;
-      pkts->last = n;
       n->prev = pkts->last;
+      pkts->last = n;
     }
   else
     pkts->first = pkts->last = n;
@@ -280,6 +290,12 @@ typedef struct grub_net
   grub_fs_t fs;
   int eof;
   int stall;
+  struct grub_net_cache *cache;
+  /* Buffer of a read waiting for data, which is copied there as it
+     arrives rather than queued.  */
+  char *direct_buf;
+  grub_size_t direct_len;
+  grub_size_t direct_done;
 } *grub_net_t;
 
 extern grub_net_t (*EXPORT_VAR (grub_net_open)) (const char *name);
@@ -618,15 +634,43 @@ grub_env_set_net_property (const char *intername, const char *suffix,
 void
 grub_net_poll_cards (unsigned time, int *stop_condition);
 
+/* Totals shown by net_stats, kept by the protocols as they go.  */
+struct grub_net_stats
+{
+  grub_uint64_t poll_calls;
+  grub_uint64_t poll_ms;
+  grub_uint64_t tcp_retransmits;
+  grub_uint64_t tcp_out_of_order;
+  grub_uint64_t tcp_dup_acks;
+  grub_uint64_t tcp_stalls;
+  grub_uint64_t tftp_rrq_resends;
+  grub_uint64_t tftp_duplicates;
+  grub_uint64_t tftp_out_of_order;
+  grub_uint64_t tftp_stalls;
+  grub_uint64_t http_connections;
+  grub_uint64_t http_reused;
+  grub_uint64_t http_requests;
+};
+
+extern struct grub_net_stats grub_net_stats;
+
+grub_err_t
+grub_net_put_file_data (grub_net_t net, struct grub_net_buff *nb);
+
 void grub_bootp_init (void);
 void grub_bootp_fini (void);
 
 void grub_dns_init (void);
 void grub_dns_fini (void);
 
+/* Fail the TCP connections going through INTER, which is going away.  */
+void
+grub_net_tcp_interface_gone (const struct grub_net_network_level_interface *inter);
+
 static inline void
 grub_net_network_level_interface_unregister (struct grub_net_network_level_interface *inter)
 {
+  grub_net_tcp_interface_gone (inter);
   inter->card->num_ifaces--;
   *inter->prev = inter->next;
   if (inter->next)
@@ -43,6 +43,11 @@ grub_net_ipv6_get_id (const grub_net_link_level_address_t *addr)
 }
 
 grub_uint16_t grub_net_ip_chksum(void *ipv, grub_size_t len);
+grub_uint32_t grub_net_ip_chksum_partial (const void *data, grub_size_t len,
+					  grub_uint32_t sum);
+grub_uint16_t grub_net_ip_chksum_fold (grub_uint32_t sum);
+grub_uint16_t grub_net_ip_chksum_update (grub_uint16_t chksum, const void *old,
+					 const void *new, grub_size_t len);
 
 grub_err_t
 grub_net_recv_ip_packets (struct grub_net_buff *nb,
@@ -90,7 +90,8 @@ enum
     GRUB_FONT_FLAG_BOLD	= 1,
     GRUB_FONT_FLAG_NOBITMAP = 2,
     GRUB_FONT_FLAG_NOHINTING = 4,
-    GRUB_FONT_FLAG_FORCEHINT = 8
+    GRUB_FONT_FLAG_FORCEHINT = 8,
+    GRUB_FONT_FLAG_ALIGN = 16
   };
 
 struct grub_font_info
@@ -788,7 +789,7 @@ write_font_pf2 (struct grub_font_info *font_info, char *output_file)
   FILE *file;
   grub_uint32_t leng;
   char style_name[20], *font_name, *ptr;
-  int offset;
+  int offset, data_start;
   struct grub_glyph_info *cur;
 
   file = grub_util_fopen (output_file, "wb");
@@ -889,19 +890,25 @@ write_font_pf2 (struct grub_font_info *font_info, char *output_file)
 			 file, output_file);
   grub_util_write_image ((char *) &leng, 4, file, output_file);
   offset += 8 + font_info->num_glyphs * 9 + 8;
+  data_start = offset;
 
   for (cur = font_info->glyphs_sorted;
        cur < font_info->glyphs_sorted + font_info->num_glyphs; cur++)
     {
       grub_uint32_t data32;
       grub_uint8_t data8;
+      /* Leave room for GRUB to make a glyph in place.  */
+      if (font_info->flags & GRUB_FONT_FLAG_ALIGN)
+	offset = data_start + ALIGN_UP (offset - data_start
+					+ FONT_FORMAT_GLYPH_ALIGN,
+					FONT_FORMAT_GLYPH_ALIGN);
       data32 = grub_cpu_to_be32 (cur->char_code);
       grub_util_write_image ((char *) &data32, 4, file, output_file);
       data8 = 0;
       grub_util_write_image ((char *) &data8, 1, file, output_file);
       data32 = grub_cpu_to_be32 (offset);
       grub_util_write_image ((char *) &data32, 4, file, output_file);
-      offset += 10 + cur->bitmap_size;
+      offset += FONT_FORMAT_GLYPH_HEADER_SIZE + cur->bitmap_size;
     }
 
   leng = 0xffffffff;
@@ -910,10 +917,21 @@ write_font_pf2 (struct grub_font_info *font_info, char *output_file)
 			 file, output_file);
   grub_util_write_image ((char *) &leng, 4, file, output_file);
 
+  offset = data_start;
   for (cur = font_info->glyphs_sorted;
        cur < font_info->glyphs_sorted + font_info->num_glyphs; cur++)
     {
       grub_uint16_t data;
+      if (font_info->flags & GRUB_FONT_FLAG_ALIGN)
+	{
+	  static const char padding[2 * FONT_FORMAT_GLYPH_ALIGN];
+	  int len;
+
+	  len = ALIGN_UP (offset - data_start + FONT_FORMAT_GLYPH_ALIGN,
+			  FONT_FORMAT_GLYPH_ALIGN) - (offset - data_start);
+	  grub_util_write_image (padding, len, file, output_file);
+	  offset += len;
+	}
       data = grub_cpu_to_be16 (cur->width);
       grub_util_write_image ((char *) &data, 2, file, output_file);
       data = grub_cpu_to_be16 (cur->height);
@@ -926,6 +944,7 @@ write_font_pf2 (struct grub_font_info *font_info, char *output_file)
       grub_util_write_image ((char *) &data, 2, file, output_file);
       grub_util_write_image ((char *) &cur->bitmap[0], cur->bitmap_size,
 			     file, output_file);
+      offset += FONT_FORMAT_GLYPH_HEADER_SIZE + cur->bitmap_size;
     }
 
   fclose (file);
@@ -959,6 +978,9 @@ static struct argp_option options[] = {
       pre-rendered bitmap is available.
     */
    N_("ignore bitmap strikes when loading"), 0},
+  {"aligned",  0x102, 0, 0,
+   N_("pad glyph data so that GRUB can use it in place "
+      "when loading the whole font"), 0},
   {"verbose",  'v', 0, 0, N_("print verbose messages."), 0},
   { 0, 0, 0, 0, 0, 0 }
 };
@@ -1025,6 +1047,10 @@ argp_parser (int key, char *arg, struct my_argp_state *state)
       arguments->font_info.flags |= GRUB_FONT_FLAG_NOHINTING;
       break;
 
+    case 0x102:
+      arguments->font_info.flags |= GRUB_FONT_FLAG_ALIGN;
+      break;
+
     case 'a':
       arguments->font_info.flags |= GRUB_FONT_FLAG_FORCEHINT;
       break;